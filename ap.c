@@ -17,15 +17,52 @@
 #include <linux/uaccess.h>
 #include <linux/workqueue.h>
 #include <linux/device.h>
+#include <linux/vmalloc.h>
+#include <linux/sizes.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "svc_msg.h"
 #include "greybus_manifest.h"
 #include "greybus.h"
 
-struct ap_msg {
-	u8 *data;
-	size_t size;
+/*
+ * Incoming SVC messages are copied into a ring of preallocated
+ * memory, one per host device, so nothing needs to be allocated in
+ * the (interrupt context) receive path.  Each message is stored in a
+ * record, 8-byte aligned, which is processed in place by the ring's
+ * work.  A record that won't fit before the end of the ring is put
+ * at the start, with a wrap marker left in its place.  Messages that
+ * don't fit at all are dropped and counted.
+ */
+#define SVC_RING_SIZE		SZ_128K
+#define SVC_RING_ALIGN		8
+#define SVC_RING_WRAP		U32_MAX
+
+static unsigned int svc_ring_size = SVC_RING_SIZE;
+module_param(svc_ring_size, uint, 0644);
+MODULE_PARM_DESC(svc_ring_size, "Size in bytes of new host devices' SVC message rings");
+
+struct svc_ring_rec {
+	u32	size;		/* of data, or SVC_RING_WRAP */
+	u32	pad;
+	u8	data[0];
+};
+
+struct gb_svc_ring {
 	struct greybus_host_device *hd;
-	struct work_struct event;
+	spinlock_t lock;	/* head, tail, used, dead, statistics */
+	u8 *buffer;
+	size_t size;
+	size_t head;		/* where the next record goes */
+	size_t tail;		/* the oldest record */
+	size_t used;		/* bytes in records and wrap padding */
+	bool dead;
+	struct work_struct work;
+	struct dentry *debugfs_dentry;
+
+	unsigned long events;
+	unsigned long dropped;
+	size_t used_max;
 };
 
 static struct workqueue_struct *ap_workqueue;
@@ -251,13 +288,18 @@ static void svc_suspend(struct svc_function_suspend *suspend,
 	dev_err(hd->parent, "Got an suspend message???\n");
 }
 
-static struct svc_msg *convert_ap_message(struct ap_msg *ap_msg)
+static struct svc_msg *convert_ap_message(struct greybus_host_device *hd,
+					  u8 *data, size_t size)
 {
 	struct svc_msg *svc_msg;
 	struct svc_msg_header *header;
-	struct greybus_host_device *hd = ap_msg->hd;
 
-	svc_msg = (struct svc_msg *)ap_msg->data;
+	if (size < sizeof(*header)) {
+		dev_err(hd->parent, "short svc message (%zu bytes)\n", size);
+		return NULL;
+	}
+
+	svc_msg = (struct svc_msg *)data;
 	header = &svc_msg->header;
 
 	/* Validate the message type */
@@ -276,18 +318,14 @@ static struct svc_msg *convert_ap_message(struct ap_msg *ap_msg)
 	return svc_msg;
 }
 
-static void ap_process_event(struct work_struct *work)
+static void ap_process_msg(struct greybus_host_device *hd, u8 *data,
+			   size_t size)
 {
 	struct svc_msg *svc_msg;
-	struct greybus_host_device *hd;
-	struct ap_msg *ap_msg;
 	int payload_length;
 
-	ap_msg = container_of(work, struct ap_msg, event);
-	hd = ap_msg->hd;
-
 	/* Turn the "raw" data into a real message */
-	svc_msg = convert_ap_message(ap_msg);
+	svc_msg = convert_ap_message(hd, data, size);
 	if (!svc_msg)
 		return;
 
@@ -317,45 +355,179 @@ static void ap_process_event(struct work_struct *work)
 		dev_err(hd->parent, "received invalid SVC function ID %d\n",
 			svc_msg->header.function_id);
 	}
+}
 
-	/* clean the message up */
-	kfree(ap_msg->data);
-	kfree(ap_msg);
+static size_t svc_ring_rec_size(size_t size)
+{
+	return ALIGN(sizeof(struct svc_ring_rec) + size, SVC_RING_ALIGN);
 }
 
-int greybus_svc_in(struct greybus_host_device *hd, u8 *data, int size)
+/*
+ * Process the records in a host device's ring, oldest first.  The
+ * producer never touches the space of a record until its work here
+ * is done, so records are processed without holding the lock.
+ */
+static void svc_ring_work(struct work_struct *work)
 {
-	struct ap_msg *ap_msg;
+	struct gb_svc_ring *ring = container_of(work, struct gb_svc_ring, work);
+	struct svc_ring_rec *rec;
+	size_t rec_size;
+
+	while (true) {
+		spin_lock_irq(&ring->lock);
+		if (!ring->used) {
+			spin_unlock_irq(&ring->lock);
+			break;
+		}
+		rec = (struct svc_ring_rec *)(ring->buffer + ring->tail);
+		if (rec->size == SVC_RING_WRAP) {
+			ring->used -= ring->size - ring->tail;
+			ring->tail = 0;
+			spin_unlock_irq(&ring->lock);
+			continue;
+		}
+		spin_unlock_irq(&ring->lock);
+
+		ap_process_msg(ring->hd, rec->data, rec->size);
+		rec_size = svc_ring_rec_size(rec->size);
+
+		spin_lock_irq(&ring->lock);
+		ring->tail += rec_size;
+		if (ring->tail == ring->size)
+			ring->tail = 0;
+		ring->used -= rec_size;
+		if (!ring->used)
+			ring->head = ring->tail = 0;
+		spin_unlock_irq(&ring->lock);
+	}
+}
 
-	/*
-	 * Totally naive copy the message into a new structure that we slowly
-	 * create and add it to the list.  Let's get this working, the odds of
-	 * this being any "slow path" for AP messages is really low at this
-	 * point in time, but you never know, so this comment is here to point
-	 * out that maybe we should use a slab allocator, or even just not copy
-	 * the data, but use it directly and force the urbs to be "new" each
-	 * time.
-	 */
+int greybus_svc_in(struct greybus_host_device *hd, u8 *data, int size)
+{
+	struct gb_svc_ring *ring = hd->svc_ring;
+	struct svc_ring_rec *rec;
+	size_t rec_size = svc_ring_rec_size(size);
+	unsigned long flags;
+	size_t pad = 0;
 
 	/* Note - this can, and will, be called in interrupt context. */
-	ap_msg = kmalloc(sizeof(*ap_msg), GFP_ATOMIC);
-	if (!ap_msg)
+	spin_lock_irqsave(&ring->lock, flags);
+	if (ring->dead) {
+		spin_unlock_irqrestore(&ring->lock, flags);
+		return -ESHUTDOWN;
+	}
+
+	if (rec_size > ring->size - ring->head)
+		pad = ring->size - ring->head;
+	if (ring->used + pad + rec_size > ring->size) {
+		ring->dropped++;
+		spin_unlock_irqrestore(&ring->lock, flags);
+		dev_err_ratelimited(hd->parent,
+				    "svc ring full, %d byte message dropped\n",
+				    size);
+		return -ENOSPC;
+	}
+
+	if (pad) {
+		rec = (struct svc_ring_rec *)(ring->buffer + ring->head);
+		rec->size = SVC_RING_WRAP;
+		ring->head = 0;
+	}
+	rec = (struct svc_ring_rec *)(ring->buffer + ring->head);
+	rec->size = size;
+	memcpy(rec->data, data, size);
+
+	ring->head += rec_size;
+	if (ring->head == ring->size)
+		ring->head = 0;
+	ring->used += pad + rec_size;
+	ring->used_max = max(ring->used_max, ring->used);
+	ring->events++;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	queue_work(ap_workqueue, &ring->work);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(greybus_svc_in);
+
+static int svc_ring_show(struct seq_file *s, void *unused)
+{
+	struct gb_svc_ring *ring = s->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	seq_printf(s, "size: %zu\n", ring->size);
+	seq_printf(s, "used: %zu\n", ring->used);
+	seq_printf(s, "used_max: %zu\n", ring->used_max);
+	seq_printf(s, "events: %lu\n", ring->events);
+	seq_printf(s, "dropped: %lu\n", ring->dropped);
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return 0;
+}
+
+static int svc_ring_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, svc_ring_show, inode->i_private);
+}
+
+static const struct file_operations svc_ring_fops = {
+	.open		= svc_ring_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Set up a new host device's SVC message ring */
+int gb_ap_hd_init(struct greybus_host_device *hd)
+{
+	struct gb_svc_ring *ring;
+	size_t size = ALIGN(svc_ring_size, SVC_RING_ALIGN);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
 		return -ENOMEM;
-	ap_msg->data = kmalloc(size, GFP_ATOMIC);
-	if (!ap_msg->data) {
-		kfree(ap_msg);
+
+	/* Room for at least one maximal SVC message */
+	size = max_t(size_t, size, svc_ring_rec_size(sizeof(struct svc_msg) +
+						     SZ_64K));
+	ring->buffer = vmalloc(size);
+	if (!ring->buffer) {
+		kfree(ring);
 		return -ENOMEM;
 	}
-	memcpy(ap_msg->data, data, size);
-	ap_msg->size = size;
-	ap_msg->hd = hd;
 
-	INIT_WORK(&ap_msg->event, ap_process_event);
-	queue_work(ap_workqueue, &ap_msg->event);
+	ring->hd = hd;
+	ring->size = size;
+	spin_lock_init(&ring->lock);
+	INIT_WORK(&ring->work, svc_ring_work);
+	ring->debugfs_dentry = debugfs_create_file("svc_ring", S_IRUGO,
+						   hd->debugfs_dentry, ring,
+						   &svc_ring_fops);
+	hd->svc_ring = ring;
 
 	return 0;
 }
-EXPORT_SYMBOL_GPL(greybus_svc_in);
+
+/*
+ * Stop accepting SVC messages for a host device that is going away,
+ * and wait for those already received to be processed.
+ */
+void gb_ap_hd_exit(struct greybus_host_device *hd)
+{
+	struct gb_svc_ring *ring = hd->svc_ring;
+
+	spin_lock_irq(&ring->lock);
+	ring->dead = true;
+	spin_unlock_irq(&ring->lock);
+	flush_work(&ring->work);
+
+	debugfs_remove(ring->debugfs_dentry);
+	hd->svc_ring = NULL;
+	vfree(ring->buffer);
+	kfree(ring);
+}
 
 int gb_ap_init(void)
 {
@@ -10,19 +10,48 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/power_supply.h>
 #include "greybus.h"
 
+static unsigned int snapshot_ms = 1000;
+module_param(snapshot_ms, uint, 0644);
+MODULE_PARM_DESC(snapshot_ms,
+		 "How long battery properties are reused for before being read again (msecs)");
+
+/* The battery properties that change; power_supply values */
+struct gb_battery_snapshot {
+	int status;		/* POWER_SUPPLY_STATUS_* */
+	int capacity;
+	int temperature;
+	int voltage;
+};
+
 struct gb_battery {
 	struct power_supply bat;
-	// FIXME
-	// we will want to keep the battery stats in here as we will be getting
-	// updates from the SVC "on the fly" so we don't have to always go ask
-	// the battery for some information.  Hopefully...
 	struct gb_connection *connection;
 	u8 version_major;
 	u8 version_minor;
 
+	int technology;		/* POWER_SUPPLY_TECHNOLOGY_* */
+	u32 max_voltage;
+
+	/*
+	 * Property reads are answered from a snapshot no older than
+	 * snapshot_ms.  A module that sends updates itself is trusted
+	 * to send one whenever something changes, so then the snapshot
+	 * never goes stale.  The lock is never held across an operation
+	 * (the request handler takes it); refresh_lock is.
+	 */
+	struct mutex refresh_lock;
+	spinlock_t lock;
+	struct gb_battery_snapshot snapshot;
+	unsigned long snapshot_time;	/* jiffies */
+	bool snapshot_valid;
+	bool updates;			/* module sends UPDATE requests */
+	bool registered;
 };
 #define to_gb_battery(x) container_of(x, struct gb_battery, bat)
 
@@ -30,6 +59,9 @@ struct gb_battery {
 #define	GB_BATTERY_VERSION_MAJOR		0x00
 #define	GB_BATTERY_VERSION_MINOR		0x01
 
+/* Modules reporting this minor version or later handle GET_ALL */
+#define	GB_BATTERY_VERSION_MINOR_ALL		0x02
+
 /* Greybus battery request types */
 #define	GB_BATTERY_TYPE_INVALID			0x00
 #define	GB_BATTERY_TYPE_PROTOCOL_VERSION	0x01
@@ -42,6 +74,8 @@ struct gb_battery {
 #define	GB_BATTERY_TYPE_CURRENT			0x08
 #define GB_BATTERY_TYPE_CAPACITY		0x09	// TODO - POWER_SUPPLY_PROP_CURRENT_MAX
 #define GB_BATTERY_TYPE_SHUTDOWN_TEMP		0x0a	// TODO - POWER_SUPPLY_PROP_TEMP_ALERT_MAX
+#define	GB_BATTERY_TYPE_GET_ALL			0x0b
+#define	GB_BATTERY_TYPE_UPDATE			0x0c	/* Unsolicited data */
 
 /* Should match up with battery types in linux/power_supply.h */
 #define GB_BATTERY_TECH_UNKNOWN			0x0000
@@ -83,156 +117,218 @@ struct gb_battery_voltage_response {
 	__le32	voltage;
 };
 
+/*
+ * Everything that changes, as answered to GET_ALL and sent by the
+ * module in an UPDATE request.  (Update response has no payload.)
+ */
+struct gb_battery_properties {
+	__le16	battery_status;
+	__le32	capacity __packed;
+	__le32	temperature __packed;
+	__le32	voltage __packed;
+};
+
 /* Define get_version() routine */
 define_get_version(gb_battery, BATTERY);
 
-static int get_tech(struct gb_battery *gb)
+/*
+ * Map greybus values to power_supply values.  Hopefully these are
+ * "identical" which should allow gcc to optimize the code away to
+ * nothing.
+ */
+static int battery_tech_map(u32 technology)
 {
-	struct gb_battery_technology_response tech_response;
-	u32 technology;
-	int retval;
-
-	retval = gb_operation_sync(gb->connection, GB_BATTERY_TYPE_TECHNOLOGY,
-				   NULL, 0,
-				   &tech_response, sizeof(tech_response));
-	if (retval)
-		return retval;
-
-	/*
-	 * Map greybus values to power_supply values.  Hopefully these are
-	 * "identical" which should allow gcc to optimize the code away to
-	 * nothing.
-	 */
-	technology = le32_to_cpu(tech_response.technology);
 	switch (technology) {
 	case GB_BATTERY_TECH_NiMH:
-		technology = POWER_SUPPLY_TECHNOLOGY_NiMH;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_NiMH;
 	case GB_BATTERY_TECH_LION:
-		technology = POWER_SUPPLY_TECHNOLOGY_LION;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_LION;
 	case GB_BATTERY_TECH_LIPO:
-		technology = POWER_SUPPLY_TECHNOLOGY_LIPO;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_LIPO;
 	case GB_BATTERY_TECH_LiFe:
-		technology = POWER_SUPPLY_TECHNOLOGY_LiFe;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_LiFe;
 	case GB_BATTERY_TECH_NiCd:
-		technology = POWER_SUPPLY_TECHNOLOGY_NiCd;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_NiCd;
 	case GB_BATTERY_TECH_LiMn:
-		technology = POWER_SUPPLY_TECHNOLOGY_LiMn;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_LiMn;
 	case GB_BATTERY_TECH_UNKNOWN:
 	default:
-		technology = POWER_SUPPLY_TECHNOLOGY_UNKNOWN;
-		break;
+		return POWER_SUPPLY_TECHNOLOGY_UNKNOWN;
 	}
-	return technology;
 }
 
-static int get_status(struct gb_battery *gb)
+/*
+ * The technology and design voltage of a battery don't change, so
+ * they are fetched (together, in one batch) when the connection is
+ * set up rather than every time they're asked for.  Either one the
+ * module fails to report is left unknown (or zero).
+ */
+static void get_design(struct gb_battery *gb)
 {
-	struct gb_battery_status_response status_response;
-	u16 battery_status;
-	int retval;
-
-	retval = gb_operation_sync(gb->connection, GB_BATTERY_TYPE_STATUS,
-				   NULL, 0,
-				   &status_response, sizeof(status_response));
-	if (retval)
-		return retval;
+	struct gb_battery_technology_response tech_response;
+	struct gb_battery_max_voltage_response volt_response;
+	struct gb_operation_batch_entry batch[] = {
+		{
+			.type		= GB_BATTERY_TYPE_TECHNOLOGY,
+			.response	= &tech_response,
+			.response_size	= sizeof(tech_response),
+		},
+		{
+			.type		= GB_BATTERY_TYPE_MAX_VOLTAGE,
+			.response	= &volt_response,
+			.response_size	= sizeof(volt_response),
+		},
+	};
+
+	gb_operation_batch(gb->connection, batch, ARRAY_SIZE(batch));
+
+	if (!batch[0].result)
+		gb->technology =
+			battery_tech_map(le32_to_cpu(tech_response.technology));
+	else
+		gb->technology = POWER_SUPPLY_TECHNOLOGY_UNKNOWN;
+
+	if (!batch[1].result)
+		gb->max_voltage = le32_to_cpu(volt_response.max_voltage);
+	else
+		gb->max_voltage = 0;
+}
 
-	/*
-	 * Map greybus values to power_supply values.  Hopefully these are
-	 * "identical" which should allow gcc to optimize the code away to
-	 * nothing.
-	 */
-	battery_status = le16_to_cpu(status_response.battery_status);
+/*
+ * Map greybus values to power_supply values.  Hopefully these are
+ * "identical" which should allow gcc to optimize the code away to
+ * nothing.
+ */
+static int battery_status_map(u16 battery_status)
+{
 	switch (battery_status) {
 	case GB_BATTERY_STATUS_CHARGING:
-		battery_status = POWER_SUPPLY_STATUS_CHARGING;
-		break;
+		return POWER_SUPPLY_STATUS_CHARGING;
 	case GB_BATTERY_STATUS_DISCHARGING:
-		battery_status = POWER_SUPPLY_STATUS_DISCHARGING;
-		break;
+		return POWER_SUPPLY_STATUS_DISCHARGING;
 	case GB_BATTERY_STATUS_NOT_CHARGING:
-		battery_status = POWER_SUPPLY_STATUS_NOT_CHARGING;
-		break;
+		return POWER_SUPPLY_STATUS_NOT_CHARGING;
 	case GB_BATTERY_STATUS_FULL:
-		battery_status = POWER_SUPPLY_STATUS_FULL;
-		break;
+		return POWER_SUPPLY_STATUS_FULL;
 	case GB_BATTERY_STATUS_UNKNOWN:
 	default:
-		battery_status = POWER_SUPPLY_STATUS_UNKNOWN;
-		break;
+		return POWER_SUPPLY_STATUS_UNKNOWN;
 	}
-	return battery_status;
 }
 
-static int get_max_voltage(struct gb_battery *gb)
+static void snapshot_update(struct gb_battery *gb,
+			    struct gb_battery_properties *props)
 {
-	struct gb_battery_max_voltage_response volt_response;
-	u32 max_voltage;
-	int retval;
-
-	retval = gb_operation_sync(gb->connection, GB_BATTERY_TYPE_MAX_VOLTAGE,
-				   NULL, 0,
-				   &volt_response, sizeof(volt_response));
-	if (retval)
-		return retval;
-
-	max_voltage = le32_to_cpu(volt_response.max_voltage);
-	return max_voltage;
+	struct gb_battery_snapshot *snapshot = &gb->snapshot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->lock, flags);
+	snapshot->status = battery_status_map(le16_to_cpu(props->battery_status));
+	snapshot->capacity = le32_to_cpu(props->capacity);
+	snapshot->temperature = le32_to_cpu(props->temperature);
+	snapshot->voltage = le32_to_cpu(props->voltage);
+	gb->snapshot_time = jiffies;
+	gb->snapshot_valid = true;
+	spin_unlock_irqrestore(&gb->lock, flags);
 }
 
-static int get_percent_capacity(struct gb_battery *gb)
+/*
+ * Read everything that changes in one go: a single GET_ALL request
+ * if the module knows it, otherwise a batch of the individual ones.
+ */
+static int snapshot_refresh(struct gb_battery *gb)
 {
+	struct gb_battery_status_response status_response;
 	struct gb_battery_capacity_response capacity_response;
-	u32 capacity;
+	struct gb_battery_temperature_response temp_response;
+	struct gb_battery_voltage_response voltage_response;
+	struct gb_operation_batch_entry batch[] = {
+		{
+			.type		= GB_BATTERY_TYPE_STATUS,
+			.response	= &status_response,
+			.response_size	= sizeof(status_response),
+		},
+		{
+			.type		= GB_BATTERY_TYPE_PERCENT_CAPACITY,
+			.response	= &capacity_response,
+			.response_size	= sizeof(capacity_response),
+		},
+		{
+			.type		= GB_BATTERY_TYPE_TEMPERATURE,
+			.response	= &temp_response,
+			.response_size	= sizeof(temp_response),
+		},
+		{
+			.type		= GB_BATTERY_TYPE_VOLTAGE,
+			.response	= &voltage_response,
+			.response_size	= sizeof(voltage_response),
+		},
+	};
+	struct gb_battery_properties props;
 	int retval;
 
-	retval = gb_operation_sync(gb->connection,
-				   GB_BATTERY_TYPE_PERCENT_CAPACITY,
-				   NULL, 0, &capacity_response,
-				   sizeof(capacity_response));
-	if (retval)
-		return retval;
+	if (gb->version_minor >= GB_BATTERY_VERSION_MINOR_ALL) {
+		retval = gb_operation_sync(gb->connection,
+					   GB_BATTERY_TYPE_GET_ALL, NULL, 0,
+					   &props, sizeof(props));
+		if (retval)
+			return retval;
+	} else {
+		retval = gb_operation_batch(gb->connection, batch,
+					    ARRAY_SIZE(batch));
+		if (retval)
+			return retval;
+
+		props.battery_status = status_response.battery_status;
+		props.capacity = capacity_response.capacity;
+		props.temperature = temp_response.temperature;
+		props.voltage = voltage_response.voltage;
+	}
 
-	capacity = le32_to_cpu(capacity_response.capacity);
-	return capacity;
+	snapshot_update(gb, &props);
+
+	return 0;
 }
 
-static int get_temp(struct gb_battery *gb)
+static bool snapshot_fresh(struct gb_battery *gb)
 {
-	struct gb_battery_temperature_response temp_response;
-	u32 temperature;
-	int retval;
+	unsigned long expires;
 
-	retval = gb_operation_sync(gb->connection, GB_BATTERY_TYPE_TEMPERATURE,
-				   NULL, 0,
-				   &temp_response, sizeof(temp_response));
-	if (retval)
-		return retval;
+	if (!gb->snapshot_valid)
+		return false;
+	if (gb->updates)
+		return true;
 
-	temperature = le32_to_cpu(temp_response.temperature);
-	return temperature;
+	expires = gb->snapshot_time + msecs_to_jiffies(snapshot_ms);
+
+	return time_before(jiffies, expires);
 }
 
-static int get_voltage(struct gb_battery *gb)
+static int snapshot_get(struct gb_battery *gb,
+			struct gb_battery_snapshot *snapshot)
 {
-	struct gb_battery_voltage_response voltage_response;
-	u32 voltage;
-	int retval;
+	unsigned long flags;
+	int retval = 0;
+
+	mutex_lock(&gb->refresh_lock);
+	spin_lock_irqsave(&gb->lock, flags);
+	if (snapshot_fresh(gb)) {
+		*snapshot = gb->snapshot;
+		spin_unlock_irqrestore(&gb->lock, flags);
+		goto out;
+	}
+	spin_unlock_irqrestore(&gb->lock, flags);
 
-	retval = gb_operation_sync(gb->connection, GB_BATTERY_TYPE_VOLTAGE,
-				   NULL, 0,
-				   &voltage_response, sizeof(voltage_response));
-	if (retval)
-		return retval;
+	retval = snapshot_refresh(gb);
+	if (!retval) {
+		spin_lock_irqsave(&gb->lock, flags);
+		*snapshot = gb->snapshot;
+		spin_unlock_irqrestore(&gb->lock, flags);
+	}
+out:
+	mutex_unlock(&gb->refresh_lock);
 
-	voltage = le32_to_cpu(voltage_response.voltage);
-	return voltage;
+	return retval;
 }
 
 static int get_property(struct power_supply *b,
@@ -240,39 +336,98 @@ static int get_property(struct power_supply *b,
 			union power_supply_propval *val)
 {
 	struct gb_battery *gb = to_gb_battery(b);
+	struct gb_battery_snapshot snapshot;
+	int retval;
 
 	switch (psp) {
 	case POWER_SUPPLY_PROP_TECHNOLOGY:
-		val->intval = get_tech(gb);
-		break;
+		val->intval = gb->technology;
+		return 0;
+
+	case POWER_SUPPLY_PROP_VOLTAGE_MAX_DESIGN:
+		val->intval = gb->max_voltage;
+		return 0;
 
 	case POWER_SUPPLY_PROP_STATUS:
-		val->intval = get_status(gb);
+	case POWER_SUPPLY_PROP_CAPACITY:
+	case POWER_SUPPLY_PROP_TEMP:
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
 		break;
 
-	case POWER_SUPPLY_PROP_VOLTAGE_MAX_DESIGN:
-		val->intval = get_max_voltage(gb);
+	default:
+		return -EINVAL;
+	}
+
+	retval = snapshot_get(gb, &snapshot);
+	if (retval)
+		return retval;
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_STATUS:
+		val->intval = snapshot.status;
 		break;
 
 	case POWER_SUPPLY_PROP_CAPACITY:
-		val->intval = get_percent_capacity(gb);
+		val->intval = snapshot.capacity;
 		break;
 
 	case POWER_SUPPLY_PROP_TEMP:
-		val->intval = get_temp(gb);
+		val->intval = snapshot.temperature;
 		break;
 
 	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-		val->intval = get_voltage(gb);
+		val->intval = snapshot.voltage;
 		break;
 
 	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int gb_battery_update(struct gb_battery *gb,
+			     struct gb_operation *operation)
+{
+	struct gb_message *request = operation->request;
+
+	if (request->payload_size != sizeof(struct gb_battery_properties)) {
+		dev_err(&gb->connection->dev,
+			"bad update size (%zu)\n", request->payload_size);
 		return -EINVAL;
 	}
 
+	snapshot_update(gb, request->payload);
+	gb->updates = true;
+	if (gb->registered)
+		power_supply_changed(&gb->bat);
+
 	return 0;
 }
 
+static void gb_battery_request_recv(u8 type, struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_battery *gb = connection->private;
+	int retval;
+
+	switch (type) {
+	case GB_BATTERY_TYPE_UPDATE:
+		retval = gb_battery_update(gb, operation);
+		break;
+	default:
+		dev_err(&connection->dev,
+			"unsupported unsolicited request: %hhu\n", type);
+		retval = -EINVAL;
+		break;
+	}
+
+	retval = gb_operation_response_send(operation, retval);
+	if (retval)
+		dev_err(&connection->dev,
+			"failed to send response: %d\n", retval);
+}
+
 // FIXME - verify this list, odds are some can be removed and others added.
 static enum power_supply_property battery_props[] = {
 	POWER_SUPPLY_PROP_TECHNOLOGY,
@@ -294,6 +449,8 @@ static int gb_battery_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 
 	gb->connection = connection;
+	mutex_init(&gb->refresh_lock);
+	spin_lock_init(&gb->lock);
 	connection->private = gb;
 
 	/* Check the version */
@@ -303,6 +460,8 @@ static int gb_battery_connection_init(struct gb_connection *connection)
 		return retval;
 	}
 
+	get_design(gb);
+
 	b = &gb->bat;
 	// FIXME - get a better (i.e. unique) name
 	// FIXME - anything else needs to be set?
@@ -317,6 +476,7 @@ static int gb_battery_connection_init(struct gb_connection *connection)
 		kfree(gb);
 		return retval;
 	}
+	gb->registered = true;
 
 	return 0;
 }
@@ -336,7 +496,7 @@ static struct gb_protocol battery_protocol = {
 	.minor			= 1,
 	.connection_init	= gb_battery_connection_init,
 	.connection_exit	= gb_battery_connection_exit,
-	.request_recv		= NULL,	/* no incoming requests */
+	.request_recv		= gb_battery_request_recv,
 };
 
 gb_protocol_driver(&battery_protocol);
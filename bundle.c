@@ -7,10 +7,29 @@
  * Released under the GPLv2 only.
  */
 
+#include <linux/async.h>
+#include <linux/moduleparam.h>
+
 #include "greybus.h"
 
+/*
+ * Connections are brought up (their version and setup operations
+ * done) concurrently, each by its own async function, so a module is
+ * usable after roughly as long as its slowest connection takes, and
+ * the SVC message loop can move on to the next bundle meanwhile.
+ * They are all in one domain, which anything tearing bundles down, or
+ * binding protocols to their connections, waits on first.
+ */
+static bool async_init = true;
+module_param(async_init, bool, 0644);
+MODULE_PARM_DESC(async_init, "Initialize connections concurrently");
+
+static ASYNC_DOMAIN_EXCLUSIVE(gb_bundle_domain);
+
 static void gb_bundle_connections_exit(struct gb_bundle *bundle);
 static int gb_bundle_connections_init(struct gb_bundle *bundle);
+static void gb_bundle_connections_init_async(struct gb_bundle *bundle);
+static bool gb_bundle_connections_failed_destroy(struct gb_bundle *bundle);
 
 
 static ssize_t device_id_show(struct device *dev, struct device_attribute *attr,
@@ -71,6 +90,8 @@ static int __bundle_bind_protocols(struct device *dev, void *data)
  */
 void gb_bundle_bind_protocols(void)
 {
+	async_synchronize_full_domain(&gb_bundle_domain);
+
 	bus_for_each_dev(&greybus_bus_type, NULL, NULL,
 			 __bundle_bind_protocols);
 }
@@ -133,6 +154,9 @@ void gb_bundle_destroy(struct gb_interface *intf)
 	if (WARN_ON(!intf))
 		return;
 
+	/* Let connections still being initialized finish first */
+	async_synchronize_full_domain(&gb_bundle_domain);
+
 	spin_lock_irq(&gb_bundles_lock);
 	list_splice_init(&intf->bundles, &list);
 	spin_unlock_irq(&gb_bundles_lock);
@@ -162,14 +186,21 @@ int gb_bundle_init(struct gb_interface *intf, u8 bundle_id, u8 device_id)
 		return ret;
 	}
 
+	if (async_init) {
+		gb_bundle_connections_init_async(bundle);
+		return 0;
+	}
+
 	ret = gb_bundle_connections_init(bundle);
 	if (ret) {
 		dev_err(intf->hd->parent, "interface bundle init error %d\n",
 			ret);
-		/* XXX clear route */
+		gb_bundle_connections_failed_destroy(bundle);
 		return ret;
 	}
 
+	kobject_uevent(&bundle->dev.kobj, KOBJ_CHANGE);
+
 	return 0;
 }
 
@@ -202,6 +233,68 @@ static int gb_bundle_connections_init(struct gb_bundle *bundle)
 	return ret;
 }
 
+/*
+ * Tear down the connections of a bundle that failed to initialize.
+ * Their protocol has already undone its own setup.
+ */
+static bool gb_bundle_connections_failed_destroy(struct gb_bundle *bundle)
+{
+	struct gb_connection *connection;
+	struct gb_connection *next;
+	bool failed = false;
+
+	list_for_each_entry_safe(connection, next, &bundle->connections,
+				 bundle_links) {
+		if (connection->state != GB_CONNECTION_STATE_ERROR)
+			continue;
+		dev_err(&connection->dev, "tearing down failed connection\n");
+		gb_connection_destroy(connection);
+		failed = true;
+	}
+
+	return failed;
+}
+
+static void gb_connection_init_async(void *data, async_cookie_t cookie)
+{
+	struct gb_connection *connection = data;
+	int ret;
+
+	ret = gb_connection_init(connection);
+	if (ret)
+		dev_err(&connection->dev, "init error %d\n", ret);
+}
+
+/*
+ * Scheduled after all of a bundle's connections.  Once everything
+ * scheduled before it is done, the bundle is fully up, and userspace
+ * is told so.
+ */
+static void gb_bundle_init_done(void *data, async_cookie_t cookie)
+{
+	struct gb_bundle *bundle = data;
+
+	async_synchronize_cookie_domain(cookie, &gb_bundle_domain);
+
+	if (gb_bundle_connections_failed_destroy(bundle)) {
+		dev_err(bundle->intf->hd->parent,
+			"interface bundle init error\n");
+		return;
+	}
+
+	kobject_uevent(&bundle->dev.kobj, KOBJ_CHANGE);
+}
+
+static void gb_bundle_connections_init_async(struct gb_bundle *bundle)
+{
+	struct gb_connection *connection;
+
+	list_for_each_entry(connection, &bundle->connections, bundle_links)
+		async_schedule_domain(gb_connection_init_async, connection,
+				      &gb_bundle_domain);
+	async_schedule_domain(gb_bundle_init_done, bundle, &gb_bundle_domain);
+}
+
 static void gb_bundle_connections_exit(struct gb_bundle *bundle)
 {
 	struct gb_connection *connection;
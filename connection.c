@@ -8,28 +8,30 @@
  */
 
 #include <linux/atomic.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 #include "kernel_ver.h"
 #include "greybus.h"
 
 static DEFINE_SPINLOCK(gb_connections_lock);
 
+/*
+ * Look up the connection using the given host device CPort id.
+ * This is called in interrupt context for every message received,
+ * so connections are indexed directly by their CPort id.  The
+ * caller must be in an RCU read-side critical section, and the
+ * connection returned is only valid until that section ends.
+ */
 struct gb_connection *gb_hd_connection_find(struct greybus_host_device *hd,
 						u16 cport_id)
 {
-	struct gb_connection *connection = NULL;
-	unsigned long flags;
-
-	spin_lock_irqsave(&gb_connections_lock, flags);
-	list_for_each_entry(connection, &hd->connections, hd_links)
-		if (connection->hd_cport_id == cport_id)
-			goto found;
-	connection = NULL;
- found:
-	spin_unlock_irqrestore(&gb_connections_lock, flags);
+	if (cport_id >= HOST_DEV_CPORT_ID_MAX)
+		return NULL;
 
-	return connection;
+	return rcu_dereference(hd->connections_by_cport[cport_id]);
 }
+EXPORT_SYMBOL_GPL(gb_hd_connection_find);
 
 /*
  * Callback from the host driver to let us know that data has been
@@ -40,16 +42,104 @@ void greybus_data_rcvd(struct greybus_host_device *hd, u16 cport_id,
 {
 	struct gb_connection *connection;
 
+	rcu_read_lock();
 	connection = gb_hd_connection_find(hd, cport_id);
 	if (!connection) {
+		rcu_read_unlock();
 		dev_err(hd->parent,
 			"nonexistent connection (%zu bytes dropped)\n", length);
 		return;
 	}
 	gb_connection_recv(connection, data, length);
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL_GPL(greybus_data_rcvd);
 
+/*
+ * Like greybus_data_rcvd(), but the host driver offers to lend its
+ * receive buffer to the core rather than have the data copied out
+ * of it.  If this returns true the core has kept the buffer, and
+ * the host driver must not reuse it until its buffer_release()
+ * callback is called with the same cookie.  Otherwise the data has
+ * already been consumed (copied or dropped) and the buffer can be
+ * reused immediately.
+ */
+bool greybus_data_rcvd_lent(struct greybus_host_device *hd, u16 cport_id,
+			u8 *data, size_t length, void *cookie)
+{
+	struct gb_connection *connection;
+	bool lent;
+
+	if (WARN_ON_ONCE(!hd->driver->buffer_release || !cookie)) {
+		greybus_data_rcvd(hd, cport_id, data, length);
+		return false;
+	}
+
+	rcu_read_lock();
+	connection = gb_hd_connection_find(hd, cport_id);
+	if (!connection) {
+		rcu_read_unlock();
+		dev_err(hd->parent,
+			"nonexistent connection (%zu bytes dropped)\n", length);
+		return false;
+	}
+	lent = gb_connection_recv_lent(connection, data, length, cookie);
+	rcu_read_unlock();
+
+	return lent;
+}
+EXPORT_SYMBOL_GPL(greybus_data_rcvd_lent);
+
+/*
+ * Callback from the host driver for a received transfer holding a
+ * sequence of messages, each preceded by a struct gb_frame_hdr (see
+ * greybus.h), possibly for different CPorts.  All of them are
+ * dispatched (copied, as by greybus_data_rcvd()) in one pass.  A
+ * malformed frame ends the pass, dropping the rest of the transfer.
+ */
+void greybus_data_rcvd_framed(struct greybus_host_device *hd,
+			u8 *data, size_t length)
+{
+	struct gb_connection *connection = NULL;
+	struct gb_frame_hdr *frame;
+	u16 cport_id = CPORT_ID_BAD;
+	size_t frame_size;
+	size_t size;
+
+	rcu_read_lock();
+	while (length >= sizeof(*frame)) {
+		frame = (struct gb_frame_hdr *)data;
+		size = le16_to_cpu(frame->size);
+		if (size > length - sizeof(*frame)) {
+			dev_err(hd->parent,
+				"bad frame size (%zu > %zu, %zu bytes dropped)\n",
+				size, length - sizeof(*frame), length);
+			break;
+		}
+
+		/* Bursts tend to be for one CPort, so remember the last */
+		if (!connection || le16_to_cpu(frame->cport_id) != cport_id) {
+			cport_id = le16_to_cpu(frame->cport_id);
+			connection = gb_hd_connection_find(hd, cport_id);
+		}
+		if (connection) {
+			gb_connection_recv(connection, frame + 1, size);
+		} else {
+			dev_err(hd->parent,
+				"nonexistent connection (%zu bytes dropped)\n",
+				size);
+		}
+
+		frame_size = ALIGN(sizeof(*frame) + size, GB_BUFFER_ALIGN);
+		if (frame_size >= length)
+			break;
+		data += frame_size;
+		length -= frame_size;
+	}
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL_GPL(greybus_data_rcvd_framed);
+
 /*
  * Allocate an available CPort Id for use for the host side of the
  * given connection.  The lowest-available id is returned, so the
@@ -105,9 +195,123 @@ protocol_id_show(struct device *dev, struct device_attribute *attr, char *buf)
 }
 static DEVICE_ATTR_RO(protocol_id);
 
+static ssize_t
+timeout_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%u\n", connection->timeout);
+}
+
+static ssize_t
+timeout_ms_store(struct device *dev, struct device_attribute *attr,
+		 const char *buf, size_t count)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int timeout;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &timeout);
+	if (retval)
+		return retval;
+	if (!timeout)
+		return -EINVAL;
+
+	connection->timeout = timeout;
+
+	return count;
+}
+static DEVICE_ATTR_RW(timeout_ms);
+
+static ssize_t
+timeout_adaptive_show(struct device *dev, struct device_attribute *attr,
+		      char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%d\n", connection->timeout_adaptive);
+}
+
+static ssize_t
+timeout_adaptive_store(struct device *dev, struct device_attribute *attr,
+		       const char *buf, size_t count)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	bool adaptive;
+	int retval;
+
+	retval = strtobool(buf, &adaptive);
+	if (retval)
+		return retval;
+
+	connection->timeout_adaptive = adaptive;
+
+	return count;
+}
+static DEVICE_ATTR_RW(timeout_adaptive);
+
+static ssize_t
+tx_priority_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%hhu\n", connection->tx_priority);
+}
+
+static ssize_t
+tx_priority_store(struct device *dev, struct device_attribute *attr,
+		  const char *buf, size_t count)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	u8 priority;
+	int retval;
+
+	retval = kstrtou8(buf, 10, &priority);
+	if (retval)
+		return retval;
+	if (priority >= GB_TX_PRIORITIES)
+		return -EINVAL;
+
+	connection->tx_priority_user = true;
+	gb_connection_tx_priority_set(connection, priority);
+
+	return count;
+}
+static DEVICE_ATTR_RW(tx_priority);
+
+static ssize_t
+window_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+
+	return sprintf(buf, "%u\n", connection->window);
+}
+
+static ssize_t
+window_store(struct device *dev, struct device_attribute *attr,
+	     const char *buf, size_t count)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	unsigned int window;
+	int retval;
+
+	retval = kstrtouint(buf, 10, &window);
+	if (retval)
+		return retval;
+
+	gb_connection_window_set(connection, window);
+
+	return count;
+}
+static DEVICE_ATTR_RW(window);
+
 static struct attribute *connection_attrs[] = {
 	&dev_attr_state.attr,
 	&dev_attr_protocol_id.attr,
+	&dev_attr_timeout_ms.attr,
+	&dev_attr_timeout_adaptive.attr,
+	&dev_attr_tx_priority.attr,
+	&dev_attr_window.attr,
 	NULL,
 };
 
@@ -117,6 +321,7 @@ static void gb_connection_release(struct device *dev)
 {
 	struct gb_connection *connection = to_gb_connection(dev);
 
+	free_percpu(connection->stats);
 	kfree(connection);
 }
 
@@ -142,6 +347,16 @@ void gb_connection_bind_protocol(struct gb_connection *connection)
 		return;
 	connection->protocol = protocol;
 
+	/* The protocol's default doesn't override the user's choice */
+	if (!connection->tx_priority_user) {
+		if (protocol->flags & GB_PROTOCOL_HIGHPRI)
+			gb_connection_tx_priority_set(connection,
+						GB_TX_PRIORITY_INTERACTIVE);
+		else if (protocol->flags & GB_PROTOCOL_BULK)
+			gb_connection_tx_priority_set(connection,
+						GB_TX_PRIORITY_BULK);
+	}
+
 	/*
 	 * If we have a valid device_id for the bundle, then we have an active
 	 * device, so bring up the connection at the same time.
@@ -175,14 +390,32 @@ struct gb_connection *gb_connection_create(struct gb_bundle *bundle,
 	if (!connection)
 		return NULL;
 
+	connection->stats = alloc_percpu(struct gb_connection_stats);
+	if (!connection->stats) {
+		kfree(connection);
+		return NULL;
+	}
+
 	connection->protocol_id = protocol_id;
 	connection->major = major;
 	connection->minor = minor;
 
+	spin_lock_init(&connection->lock);
+	mutex_init(&connection->send_mutex);
+	INIT_LIST_HEAD(&connection->operations);
+	idr_init(&connection->op_idr);
+	idr_init(&connection->partial_idr);
+	connection->timeout = GB_OPERATION_TIMEOUT_DEFAULT;
+	connection->tx_priority = GB_TX_PRIORITY_DEFAULT;
+	INIT_LIST_HEAD(&connection->tx_queue);
+	INIT_LIST_HEAD(&connection->tx_links);
+	gb_connection_window_init(connection);
+
 	hd = bundle->intf->hd;
 	connection->hd = hd;
 	if (!gb_connection_hd_cport_id_alloc(connection)) {
 		gb_protocol_put(connection->protocol);
+		free_percpu(connection->stats);
 		kfree(connection);
 		return NULL;
 	}
@@ -210,6 +443,8 @@ struct gb_connection *gb_connection_create(struct gb_bundle *bundle,
 		return NULL;
 	}
 
+	gb_debugfs_connection_add(connection);
+
 	/* XXX Will have to establish connections to get version */
 	gb_connection_bind_protocol(connection);
 	if (!connection->protocol)
@@ -219,11 +454,10 @@ struct gb_connection *gb_connection_create(struct gb_bundle *bundle,
 	spin_lock_irq(&gb_connections_lock);
 	list_add_tail(&connection->hd_links, &hd->connections);
 	list_add_tail(&connection->bundle_links, &bundle->connections);
+	rcu_assign_pointer(hd->connections_by_cport[connection->hd_cport_id],
+			   connection);
 	spin_unlock_irq(&gb_connections_lock);
 
-	atomic_set(&connection->op_cycle, 0);
-	INIT_LIST_HEAD(&connection->operations);
-
 	return connection;
 }
 
@@ -232,11 +466,15 @@ struct gb_connection *gb_connection_create(struct gb_bundle *bundle,
  */
 void gb_connection_destroy(struct gb_connection *connection)
 {
+	struct greybus_host_device *hd;
 	struct gb_operation *operation;
 	struct gb_operation *next;
 
 	if (WARN_ON(!connection))
 		return;
+	hd = connection->hd;
+
+	gb_connection_partial_flush(connection);
 
 	/* XXX Need to wait for any outstanding requests to complete */
 	if (WARN_ON(!list_empty(&connection->operations))) {
@@ -247,14 +485,54 @@ void gb_connection_destroy(struct gb_connection *connection)
 	spin_lock_irq(&gb_connections_lock);
 	list_del(&connection->bundle_links);
 	list_del(&connection->hd_links);
+	RCU_INIT_POINTER(hd->connections_by_cport[connection->hd_cport_id],
+			 NULL);
 	spin_unlock_irq(&gb_connections_lock);
 
+	/* Wait for the receive path to stop using the connection */
+	synchronize_rcu();
+
+	/* Nothing's queued to send now, but it may just have been */
+	flush_work(&connection->window_work);
+	flush_work(&hd->tx_work);
+
+	if (connection->wq)
+		destroy_workqueue(connection->wq);
+
+	idr_destroy(&connection->op_idr);
+	idr_destroy(&connection->partial_idr);
 	gb_connection_hd_cport_id_free(connection);
 	gb_protocol_put(connection->protocol);
 
+	gb_debugfs_connection_remove(connection);
 	device_del(&connection->dev);
 }
 
+/*
+ * Operation completions and incoming request handlers for a
+ * connection run one at a time, in order, on the connection's own
+ * workqueue.  These workqueues are unbound, so work for different
+ * connections runs concurrently.  Protocols flagged as latency
+ * sensitive get a high priority workqueue.
+ */
+static int gb_connection_wq_create(struct gb_connection *connection)
+{
+	unsigned int flags = 0;
+
+	if (connection->wq)
+		return 0;
+
+	if (connection->protocol->flags & GB_PROTOCOL_HIGHPRI)
+		flags |= WQ_HIGHPRI;
+
+	connection->wq = alloc_ordered_workqueue("gb_%s", flags,
+						 dev_name(&connection->dev));
+	if (!connection->wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
 int gb_connection_init(struct gb_connection *connection)
 {
 	int ret;
@@ -264,6 +542,12 @@ int gb_connection_init(struct gb_connection *connection)
 		return 0;
 	}
 
+	ret = gb_connection_wq_create(connection);
+	if (ret) {
+		connection->state = GB_CONNECTION_STATE_ERROR;
+		return ret;
+	}
+
 	/* Need to enable the connection to initialize it */
 	connection->state = GB_CONNECTION_STATE_ENABLED;
 	ret = connection->protocol->connection_init(connection);
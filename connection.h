@@ -11,6 +11,10 @@
 #define __CONNECTION_H
 
 #include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
 
 #include "greybus.h"
 
@@ -22,6 +26,43 @@ enum gb_connection_state {
 	GB_CONNECTION_STATE_DESTROYING	= 4,
 };
 
+/*
+ * Connection statistics are kept per-CPU, so updating them is cheap,
+ * and summed when read (through debugfs).  Latency bucket n counts
+ * round trips of at least 2^(n-1) and less than 2^n microseconds;
+ * the last bucket also counts anything longer.
+ */
+#define GB_CONNECTION_LATENCY_BUCKETS	24
+
+struct gb_connection_stats {
+	u64	requests_sent;
+	u64	requests_received;
+	u64	bytes_out;
+	u64	bytes_in;
+	u64	timeouts;
+	u64	cancels;
+	u64	window_waits;
+	u64	latency[GB_CONNECTION_LATENCY_BUCKETS];
+};
+
+/*
+ * When the host device can't take any more, messages waiting to be
+ * sent on connections of a higher transmit priority go first, and
+ * connections of equal priority take turns.  Latency sensitive
+ * protocols default to interactive priority, bulk ones to bulk.
+ */
+enum gb_tx_priority {
+	GB_TX_PRIORITY_BULK		= 0,
+	GB_TX_PRIORITY_DEFAULT		= 1,
+	GB_TX_PRIORITY_INTERACTIVE	= 2,
+};
+#define GB_TX_PRIORITIES		3
+
+#define gb_connection_stat_add(connection, field, n)	\
+	this_cpu_add((connection)->stats->field, (n))
+#define gb_connection_stat_inc(connection, field)	\
+	this_cpu_inc((connection)->stats->field)
+
 struct gb_connection {
 	struct greybus_host_device	*hd;
 	struct gb_bundle		*bundle;
@@ -39,8 +80,39 @@ struct gb_connection {
 
 	enum gb_connection_state	state;
 
-	atomic_t			op_cycle;
+	spinlock_t			lock;		/* operations, op_idr, errno */
+	struct mutex			send_mutex;	/* message cookies */
 	struct list_head		operations;
+	struct workqueue_struct		*wq;		/* operation work */
+	struct idr			op_idr;		/* outgoing, by id */
+	struct idr			partial_idr;	/* incoming, in pieces */
+	unsigned int			partial_count;
+	bool				fragments;	/* Module takes them */
+
+	unsigned int			timeout;	/* milliseconds */
+	bool				timeout_adaptive;
+	u32				rtt_avg;	/* microseconds */
+	u32				rtt_var;	/* microseconds */
+	unsigned int			rtt_samples;
+
+	/*
+	 * No more than window requests (if it's set) are in flight at a
+	 * time; more wait on window_queue.  Protected by lock.
+	 */
+	unsigned int			window;
+	unsigned int			window_inflight;
+	unsigned int			window_inflight_max;
+	unsigned int			window_queued;
+	struct list_head		window_queue;
+	struct work_struct		window_work;
+
+	u8				tx_priority;	/* enum gb_tx_priority */
+	bool				tx_priority_user; /* Set through sysfs */
+	struct list_head		tx_queue;	/* messages, hd->tx_lock */
+	struct list_head		tx_links;	/* hd->tx_queues[] */
+
+	struct gb_connection_stats __percpu *stats;
+	struct dentry			*debugfs_dentry;
 
 	void				*private;
 };
@@ -58,6 +130,10 @@ struct gb_connection *gb_hd_connection_find(struct greybus_host_device *hd,
 
 void greybus_data_rcvd(struct greybus_host_device *hd, u16 cport_id,
 			u8 *data, size_t length);
+bool greybus_data_rcvd_lent(struct greybus_host_device *hd, u16 cport_id,
+			u8 *data, size_t length, void *cookie);
+void greybus_data_rcvd_framed(struct greybus_host_device *hd,
+			u8 *data, size_t length);
 
 void gb_connection_bind_protocol(struct gb_connection *connection);
 
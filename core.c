@@ -18,6 +18,12 @@
 
 #include "greybus.h"
 
+#define CREATE_TRACE_POINTS
+#include "greybus_trace.h"
+
+/* Host drivers trace their own buffer submissions */
+EXPORT_TRACEPOINT_SYMBOL_GPL(gb_host_buffer_send);
+
 /* Allow greybus to be disabled at boot if needed */
 static bool nogreybus;
 #ifdef MODULE
@@ -189,6 +195,14 @@ struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver
 	INIT_LIST_HEAD(&hd->interfaces);
 	INIT_LIST_HEAD(&hd->connections);
 	ida_init(&hd->cport_id_map);
+	gb_hd_tx_init(hd);
+	gb_debugfs_hd_add(hd);
+
+	if (gb_ap_hd_init(hd)) {
+		gb_debugfs_hd_remove(hd);
+		kfree(hd);
+		return NULL;
+	}
 
 	return hd;
 }
@@ -196,9 +210,14 @@ EXPORT_SYMBOL_GPL(greybus_create_hd);
 
 void greybus_remove_hd(struct greybus_host_device *hd)
 {
+	/* No more SVC messages; finish with those already received */
+	gb_ap_hd_exit(hd);
+
 	/* Tear down all modules that happen to be associated with this host
 	 * controller */
 	gb_remove_interfaces(hd);
+	cancel_work_sync(&hd->tx_work);
+	gb_debugfs_hd_remove(hd);
 	kref_put_mutex(&hd->kref, free_hd, &hd_mutex);
 }
 EXPORT_SYMBOL_GPL(greybus_remove_hd);
@@ -10,6 +10,7 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "greybus.h"
 
@@ -35,3 +36,112 @@ struct dentry *gb_debugfs_get(void)
 	return gb_debug_root;
 }
 EXPORT_SYMBOL_GPL(gb_debugfs_get);
+
+/*
+ * Each host device gets a directory (named after its parent device),
+ * holding a directory for each of its connections.  Host drivers may
+ * add their own entries to the host device directory.
+ */
+void gb_debugfs_hd_add(struct greybus_host_device *hd)
+{
+	hd->debugfs_dentry = debugfs_create_dir(dev_name(hd->parent),
+						gb_debug_root);
+}
+
+void gb_debugfs_hd_remove(struct greybus_host_device *hd)
+{
+	debugfs_remove_recursive(hd->debugfs_dentry);
+	hd->debugfs_dentry = NULL;
+}
+
+static int gb_connection_stats_show(struct seq_file *s, void *unused)
+{
+	struct gb_connection *connection = s->private;
+	struct gb_connection_stats total = { 0 };
+	struct gb_connection_stats *stats;
+	struct list_head *links;
+	unsigned int window, window_inflight, window_inflight_max;
+	unsigned int window_queued;
+	unsigned int in_flight = 0;
+	unsigned int last = 0;
+	int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(connection->stats, cpu);
+		total.requests_sent += stats->requests_sent;
+		total.requests_received += stats->requests_received;
+		total.bytes_out += stats->bytes_out;
+		total.bytes_in += stats->bytes_in;
+		total.timeouts += stats->timeouts;
+		total.cancels += stats->cancels;
+		total.window_waits += stats->window_waits;
+		for (i = 0; i < GB_CONNECTION_LATENCY_BUCKETS; i++)
+			total.latency[i] += stats->latency[i];
+	}
+
+	spin_lock_irq(&connection->lock);
+	list_for_each(links, &connection->operations)
+		in_flight++;
+	window = connection->window;
+	window_inflight = connection->window_inflight;
+	window_inflight_max = connection->window_inflight_max;
+	window_queued = connection->window_queued;
+	spin_unlock_irq(&connection->lock);
+
+	seq_printf(s, "requests_sent: %llu\n", total.requests_sent);
+	seq_printf(s, "requests_received: %llu\n", total.requests_received);
+	seq_printf(s, "bytes_out: %llu\n", total.bytes_out);
+	seq_printf(s, "bytes_in: %llu\n", total.bytes_in);
+	seq_printf(s, "timeouts: %llu\n", total.timeouts);
+	seq_printf(s, "cancels: %llu\n", total.cancels);
+	seq_printf(s, "in_flight: %u\n", in_flight);
+	seq_printf(s, "window: %u\n", window);
+	seq_printf(s, "window_inflight: %u\n", window_inflight);
+	seq_printf(s, "window_inflight_max: %u\n", window_inflight_max);
+	seq_printf(s, "window_queued: %u\n", window_queued);
+	seq_printf(s, "window_waits: %llu\n", total.window_waits);
+
+	/* Skip the empty buckets at the top of the histogram */
+	for (i = 0; i < GB_CONNECTION_LATENCY_BUCKETS; i++)
+		if (total.latency[i])
+			last = i;
+	seq_puts(s, "latency_us:\n");
+	for (i = 0; i <= last; i++) {
+		if (i == GB_CONNECTION_LATENCY_BUCKETS - 1)
+			seq_printf(s, ">=%9lu: %llu\n", 1UL << (i - 1),
+				   total.latency[i]);
+		else
+			seq_printf(s, " <%9lu: %llu\n", 1UL << i,
+				   total.latency[i]);
+	}
+
+	return 0;
+}
+
+static int gb_connection_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_connection_stats_show, inode->i_private);
+}
+
+static const struct file_operations gb_connection_stats_fops = {
+	.open		= gb_connection_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void gb_debugfs_connection_add(struct gb_connection *connection)
+{
+	connection->debugfs_dentry =
+		debugfs_create_dir(dev_name(&connection->dev),
+				   connection->hd->debugfs_dentry);
+	debugfs_create_file("stats", S_IRUGO, connection->debugfs_dentry,
+			    connection, &gb_connection_stats_fops);
+}
+
+void gb_debugfs_connection_remove(struct gb_connection *connection)
+{
+	debugfs_remove_recursive(connection->debugfs_dentry);
+	connection->debugfs_dentry = NULL;
+}
@@ -12,8 +12,12 @@
 #include <linux/errno.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "greybus.h"
+#include "greybus_trace.h"
 #include "svc_msg.h"
 #include "kernel_ver.h"
 
@@ -38,15 +42,63 @@ MODULE_DEVICE_TABLE(usb, id_table);
 /*
  * Number of CPort IN urbs in flight at any point in time.
  * Adjust if we are having stalls in the USB buffer due to not enough urbs in
- * flight.
+ * flight.  The depth is fixed when the device is probed, unless adaptive
+ * mode is enabled, in which case it ranges between that and the maximum
+ * depending on how often the receive queue runs dry.
  */
 #define NUM_CPORT_IN_URB	4
+#define NUM_CPORT_IN_URB_MAX	32
+#define CPORT_IN_URB_LIMIT	256U	/* Sanity bound for either of the above */
 
-/* Number of CPort OUT urbs in flight at any point in time.
- * Adjust if we get messages saying we are out of urbs in the system log.
+static unsigned int cport_in_urbs = NUM_CPORT_IN_URB;
+module_param(cport_in_urbs, uint, 0644);
+MODULE_PARM_DESC(cport_in_urbs, "Number of CPort IN urbs of new devices");
+
+static unsigned int cport_in_urbs_max = NUM_CPORT_IN_URB_MAX;
+module_param(cport_in_urbs_max, uint, 0644);
+MODULE_PARM_DESC(cport_in_urbs_max, "Maximum number of adaptive CPort IN urbs");
+
+static bool cport_in_adaptive;
+module_param(cport_in_adaptive, bool, 0644);
+MODULE_PARM_DESC(cport_in_adaptive, "Adapt the number of CPort IN urbs to the load");
+
+/*
+ * In adaptive mode the depth is reconsidered every CPORT_IN_ADAPT_WINDOW
+ * completions.  It grows if every urb was found full at some point in
+ * the window, and shrinks if at least CPORT_IN_ADAPT_SPARE urbs were
+ * waiting for data throughout.
+ */
+#define CPORT_IN_ADAPT_WINDOW	256
+#define CPORT_IN_ADAPT_SPARE	2
+
+/*
+ * Default number of CPort OUT urbs in flight at any point in time.
+ * The pool size is fixed when the device is probed, and the core holds
+ * back messages once it is all in use, so it bounds what the bridge
+ * has to take at once.  Adjust it with the cport_out_urbs parameter.
  */
 #define NUM_CPORT_OUT_URB	8
 
+static unsigned int cport_out_urbs = NUM_CPORT_OUT_URB;
+module_param(cport_out_urbs, uint, 0644);
+MODULE_PARM_DESC(cport_out_urbs, "Size of the CPort OUT urb pool of new devices");
+
+/*
+ * When set, received CPort data is lent to the greybus core instead
+ * of being copied out of the urb buffer, and the urb is resubmitted
+ * only once the core gives the buffer back.
+ */
+static bool rx_zero_copy;
+module_param(rx_zero_copy, bool, 0444);
+MODULE_PARM_DESC(rx_zero_copy, "Lend CPort IN buffers to the greybus core");
+
+/*
+ * Offset of the urb transfer buffer within a CPort IN buffer when
+ * lending, so the message following the one-byte CPort id is 64-bit
+ * aligned (which the core requires to use a lent buffer in place).
+ */
+#define CPORT_IN_BUFFER_PAD	(rx_zero_copy ? sizeof(u64) - 1 : 0)
+
 /**
  * es1_ap_dev - ES1 USB Bridge to AP structure
  * @usb_dev: pointer to the USB device we are.
@@ -60,10 +112,24 @@ MODULE_DEVICE_TABLE(usb, id_table);
  * @svc_urb: urb for SVC messages coming in on @svc_endpoint
  * @cport_in_urb: array of urbs for the CPort in messages
  * @cport_in_buffer: array of buffers for the @cport_in_urb urbs
- * @cport_out_urb: array of urbs for the CPort out messages
- * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
- *			not.
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_in_urb_min: smallest depth of the CPort in queue
+ * @cport_in_urb_max: largest depth of the CPort in queue (@cport_in_urb size)
+ * @cport_in_urb_count: number of @cport_in_urb entries set up so far
+ * @cport_in_urb_target: number of @cport_in_urb entries to keep in flight
+ * @cport_in_urb_parked: bitmap of set up urbs beyond the target depth
+ * @cport_in_urb_active: number of CPort in urbs currently waiting for data
+ * @cport_in_urb_low: fewest urbs waiting for data in this adaptive window
+ * @cport_in_completions: completion count, for the adaptive windows
+ * @cport_in_starved: number of times no urb was waiting for data
+ * @cport_in_grown: number of times the queue was made deeper
+ * @cport_in_shrunk: number of times the queue was made shallower
+ * @cport_in_work: work adjusting the CPort in queue depth
+ * @cport_out_urb: pool of urbs for the CPort out messages
+ * @cport_out_urb_count: number of urbs in the @cport_out_urb pool
+ * @cport_out_urb_busy: bitmap of the @cport_out_urb entries in use
+ * @cport_out_urb_exhausted: number of sends that found the pool empty
+ * @cport_out_urb_alloc_failed: number of those that couldn't get an urb at all
+ * @debugfs_dir: debugfs directory holding our statistics
  */
 struct es1_ap_dev {
 	struct usb_device *usb_dev;
@@ -78,11 +144,27 @@ struct es1_ap_dev {
 	u8 *svc_buffer;
 	struct urb *svc_urb;
 
-	struct urb *cport_in_urb[NUM_CPORT_IN_URB];
-	u8 *cport_in_buffer[NUM_CPORT_IN_URB];
-	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
-	spinlock_t cport_out_urb_lock;
+	struct urb *cport_in_urb;
+	u8 **cport_in_buffer;
+	unsigned int cport_in_urb_min;
+	unsigned int cport_in_urb_max;
+	unsigned int cport_in_urb_count;
+	unsigned int cport_in_urb_target;
+	unsigned long *cport_in_urb_parked;
+	atomic_t cport_in_urb_active;
+	int cport_in_urb_low;
+	atomic_t cport_in_completions;
+	atomic_t cport_in_starved;
+	unsigned int cport_in_grown;
+	unsigned int cport_in_shrunk;
+	struct work_struct cport_in_work;
+	struct urb *cport_out_urb;
+	unsigned int cport_out_urb_count;
+	unsigned long *cport_out_urb_busy;
+	atomic_t cport_out_urb_exhausted;
+	atomic_t cport_out_urb_alloc_failed;
+
+	struct dentry *debugfs_dir;
 };
 
 static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
@@ -90,6 +172,7 @@ static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
 	return (struct es1_ap_dev *)&hd->hd_priv;
 }
 
+static void cport_in_callback(struct urb *urb);
 static void cport_out_callback(struct urb *urb);
 
 /*
@@ -153,57 +236,230 @@ static int submit_svc(struct svc_msg *svc_msg, struct greybus_host_device *hd)
 	return 0;
 }
 
+/*
+ * The CPort OUT urbs live in one array, so whether an urb belongs to
+ * the pool (and which slot it has) is known without searching.  The
+ * slots in use are tracked in a bitmap claimed and released with
+ * atomic bit operations, so neither sending nor completion takes a
+ * lock.
+ */
 static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
 {
-	struct urb *urb = NULL;
-	unsigned long flags;
-	int i;
-
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	unsigned int count = es1->cport_out_urb_count;
+	struct urb *urb;
+	unsigned int i;
 
-	/* Look in our pool of allocated urbs first, as that's the "fastest" */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es1->cport_out_urb_busy[i] == false) {
-			es1->cport_out_urb_busy[i] = true;
-			urb = es1->cport_out_urb[i];
+	do {
+		i = find_first_zero_bit(es1->cport_out_urb_busy, count);
+		if (i >= count)
 			break;
-		}
-	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
-	if (urb)
-		return urb;
+	} while (test_and_set_bit_lock(i, es1->cport_out_urb_busy));
+
+	if (i < count)
+		return &es1->cport_out_urb[i];
 
 	/*
-	 * Crap, pool is empty, complain to the syslog and go allocate one
-	 * dynamically as we have to succeed.
+	 * The pool is empty; count it and go allocate one dynamically,
+	 * as we have to succeed.
 	 */
-	dev_err(&es1->usb_dev->dev,
-		"No free CPort OUT urbs, having to dynamically allocate one!\n");
-	return usb_alloc_urb(0, gfp_mask);
+	atomic_inc(&es1->cport_out_urb_exhausted);
+	urb = usb_alloc_urb(0, gfp_mask);
+	if (!urb)
+		atomic_inc(&es1->cport_out_urb_alloc_failed);
+
+	return urb;
 }
 
 static void free_urb(struct es1_ap_dev *es1, struct urb *urb)
 {
-	unsigned long flags;
-	int i;
+	struct urb *pool = es1->cport_out_urb;
+
 	/*
 	 * See if this was an urb in our pool, if so mark it "free", otherwise
 	 * we need to free it ourselves.
 	 */
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es1->cport_out_urb[i]) {
-			es1->cport_out_urb_busy[i] = false;
-			urb = NULL;
-			break;
-		}
+	if (urb >= pool && urb < pool + es1->cport_out_urb_count) {
+		clear_bit_unlock(urb - pool, es1->cport_out_urb_busy);
+		return;
 	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
 
-	/* If urb is not NULL, then we need to free this urb */
 	usb_free_urb(urb);
 }
 
+static int cport_out_urbs_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+	unsigned int count = es1->cport_out_urb_count;
+
+	seq_printf(s, "size: %u\n", count);
+	seq_printf(s, "busy: %u\n",
+		   bitmap_weight(es1->cport_out_urb_busy, count));
+	seq_printf(s, "exhausted: %d\n",
+		   atomic_read(&es1->cport_out_urb_exhausted));
+	seq_printf(s, "alloc_failed: %d\n",
+		   atomic_read(&es1->cport_out_urb_alloc_failed));
+
+	return 0;
+}
+
+static int cport_out_urbs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_out_urbs_show, inode->i_private);
+}
+
+static const struct file_operations cport_out_urbs_fops = {
+	.open		= cport_out_urbs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int cport_in_urbs_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+
+	seq_printf(s, "adaptive: %s\n", cport_in_adaptive ? "yes" : "no");
+	seq_printf(s, "min: %u\n", es1->cport_in_urb_min);
+	seq_printf(s, "max: %u\n", es1->cport_in_urb_max);
+	seq_printf(s, "allocated: %u\n", ACCESS_ONCE(es1->cport_in_urb_count));
+	seq_printf(s, "target: %u\n", ACCESS_ONCE(es1->cport_in_urb_target));
+	seq_printf(s, "active: %d\n", atomic_read(&es1->cport_in_urb_active));
+	seq_printf(s, "starved: %d\n", atomic_read(&es1->cport_in_starved));
+	seq_printf(s, "grown: %u\n", ACCESS_ONCE(es1->cport_in_grown));
+	seq_printf(s, "shrunk: %u\n", ACCESS_ONCE(es1->cport_in_shrunk));
+
+	return 0;
+}
+
+static int cport_in_urbs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_in_urbs_show, inode->i_private);
+}
+
+static const struct file_operations cport_in_urbs_fops = {
+	.open		= cport_in_urbs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Put a CPort IN urb (back) in flight, unless the receive queue has
+ * been made shallower than its slot, in which case the urb is parked
+ * until the queue grows again.
+ */
+static void cport_in_urb_submit(struct es1_ap_dev *es1, struct urb *urb,
+				gfp_t gfp_mask)
+{
+	unsigned int i = urb - es1->cport_in_urb;
+	int retval;
+
+	if (i >= ACCESS_ONCE(es1->cport_in_urb_target)) {
+		set_bit(i, es1->cport_in_urb_parked);
+		/* Don't miss the queue having grown again meanwhile */
+		smp_mb__after_atomic();
+		if (i >= ACCESS_ONCE(es1->cport_in_urb_target) ||
+		    !test_and_clear_bit(i, es1->cport_in_urb_parked))
+			return;
+	}
+
+	atomic_inc(&es1->cport_in_urb_active);
+	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		atomic_dec(&es1->cport_in_urb_active);
+		/* A poisoned urb means we're disconnecting; just let it go */
+		if (retval != -EPERM)
+			dev_err(&urb->dev->dev,
+				"%s: error %d in submitting urb.\n",
+				__func__, retval);
+	}
+}
+
+/* Set up the CPort IN urb in the given slot and put it in flight */
+static int cport_in_urb_add(struct es1_ap_dev *es1, unsigned int i,
+			    gfp_t gfp_mask)
+{
+	struct usb_device *udev = es1->usb_dev;
+	u8 *buffer;
+
+	buffer = kmalloc(ES1_GBUF_MSG_SIZE_MAX + CPORT_IN_BUFFER_PAD, gfp_mask);
+	if (!buffer)
+		return -ENOMEM;
+
+	usb_fill_bulk_urb(&es1->cport_in_urb[i], udev,
+			  usb_rcvbulkpipe(udev, es1->cport_in_endpoint),
+			  buffer + CPORT_IN_BUFFER_PAD,
+			  ES1_GBUF_MSG_SIZE_MAX,
+			  cport_in_callback, es1->hd);
+	es1->cport_in_buffer[i] = buffer;
+
+	return 0;
+}
+
+/*
+ * Bring the number of CPort IN urbs in flight to the target depth,
+ * setting up new urbs or taking parked ones back into use as needed.
+ * Urbs beyond the target park themselves as they complete.
+ */
+static void cport_in_work(struct work_struct *work)
+{
+	struct es1_ap_dev *es1 = container_of(work, struct es1_ap_dev,
+					      cport_in_work);
+	unsigned int target = ACCESS_ONCE(es1->cport_in_urb_target);
+	unsigned int i;
+
+	for (i = 0; i < min(target, es1->cport_in_urb_count); i++) {
+		if (test_and_clear_bit(i, es1->cport_in_urb_parked))
+			cport_in_urb_submit(es1, &es1->cport_in_urb[i],
+					    GFP_KERNEL);
+	}
+
+	for (i = es1->cport_in_urb_count; i < target; i++) {
+		if (cport_in_urb_add(es1, i, GFP_KERNEL))
+			break;
+		es1->cport_in_urb_count = i + 1;
+		cport_in_urb_submit(es1, &es1->cport_in_urb[i], GFP_KERNEL);
+	}
+}
+
+/*
+ * Called from the CPort IN completion path with the number of urbs
+ * still waiting for data.  Track the fewest seen and, at the end of
+ * each window, grow or shrink the target depth by one.
+ */
+static void cport_in_adapt(struct es1_ap_dev *es1, int active)
+{
+	unsigned int target;
+	int low;
+
+	if (!active)
+		atomic_inc(&es1->cport_in_starved);
+
+	if (!cport_in_adaptive)
+		return;
+
+	/* Racy, but this is only a heuristic */
+	if (active < es1->cport_in_urb_low)
+		es1->cport_in_urb_low = active;
+
+	if (atomic_inc_return(&es1->cport_in_completions) %
+						CPORT_IN_ADAPT_WINDOW)
+		return;
+
+	low = es1->cport_in_urb_low;
+	target = es1->cport_in_urb_target;
+	if (!low && target < es1->cport_in_urb_max) {
+		ACCESS_ONCE(es1->cport_in_urb_target) = target + 1;
+		es1->cport_in_grown++;
+		schedule_work(&es1->cport_in_work);
+	} else if (low >= CPORT_IN_ADAPT_SPARE &&
+		   target > es1->cport_in_urb_min) {
+		ACCESS_ONCE(es1->cport_in_urb_target) = target - 1;
+		es1->cport_in_shrunk++;
+	}
+	es1->cport_in_urb_low = INT_MAX;
+}
+
 /*
  * Returns an opaque cookie value if successful, or a pointer coded
  * error otherwise.  If the caller wishes to cancel the in-flight
@@ -243,6 +499,7 @@ static void *buffer_send(struct greybus_host_device *hd, u16 cport_id,
 		pr_err("cport_id (%hd) is out of range for ES1\n", cport_id);
 		return ERR_PTR(-EINVAL);
 	}
+	trace_gb_host_buffer_send(hd, cport_id, buffer, buffer_size);
 	/* OK, the destination is fine; record it in the transfer buffer */
 	*transfer_buffer = cport_id;
 
@@ -283,11 +540,22 @@ static void buffer_cancel(void *cookie)
 		usb_kill_urb(reveal_urb(cookie));
 }
 
+/*
+ * The core is done with a CPort IN buffer lent to it through
+ * greybus_data_rcvd_lent(); the cookie is the urb that owns it.
+ * Put the urb back in the request pool.
+ */
+static void buffer_release(struct greybus_host_device *hd, void *cookie)
+{
+	cport_in_urb_submit(hd_to_es1(hd), cookie, GFP_ATOMIC);
+}
+
 static struct greybus_host_driver es1_driver = {
 	.hd_priv_size		= sizeof(struct es1_ap_dev),
 	.buffer_send		= buffer_send,
 	.buffer_cancel		= buffer_cancel,
 	.submit_svc		= submit_svc,
+	.buffer_release		= buffer_release,
 };
 
 /* Common function to report consistent warnings based on URB status */
@@ -320,6 +588,13 @@ static void ap_disconnect(struct usb_interface *interface)
 {
 	struct es1_ap_dev *es1;
 	struct usb_device *udev;
+	struct urb *cport_out_urb;
+	unsigned long *cport_out_urb_busy;
+	unsigned int out_count;
+	struct urb *cport_in_urb;
+	u8 **cport_in_buffer;
+	unsigned long *cport_in_urb_parked;
+	unsigned int count;
 	int i;
 
 	es1 = usb_get_intfdata(interface);
@@ -327,27 +602,37 @@ static void ap_disconnect(struct usb_interface *interface)
 		return;
 
 	/* Tear down everything! */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb = es1->cport_out_urb[i];
+	debugfs_remove_recursive(es1->debugfs_dir);
+	es1->debugfs_dir = NULL;
 
-		if (!urb)
-			break;
-		usb_kill_urb(urb);
-		usb_free_urb(urb);
-		es1->cport_out_urb[i] = NULL;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
+	/*
+	 * Tearing down the host device still sends messages, so the
+	 * CPort OUT urbs (and their bitmap) can only be freed once it
+	 * is gone, like the CPort IN ones below.
+	 */
+	cport_out_urb = es1->cport_out_urb;
+	cport_out_urb_busy = es1->cport_out_urb_busy;
+	out_count = es1->cport_out_urb_count;
+	if (cport_out_urb) {
+		for (i = 0; i < out_count; ++i)
+			usb_kill_urb(&cport_out_urb[i]);
 	}
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-		struct urb *urb = es1->cport_in_urb[i];
-
-		if (!urb)
-			break;
-		usb_kill_urb(urb);
-		usb_free_urb(urb);
-		kfree(es1->cport_in_buffer[i]);
-		es1->cport_in_buffer[i] = NULL;
+	/*
+	 * CPort IN buffers may still be lent to the core, so they (and
+	 * their urbs) can only be freed once the host device is gone.
+	 * Poison the urbs so buffer_release() can't resubmit them.
+	 * Poisoning the unused slots too keeps the work from using them.
+	 */
+	cport_in_urb = es1->cport_in_urb;
+	cport_in_buffer = es1->cport_in_buffer;
+	cport_in_urb_parked = es1->cport_in_urb_parked;
+	if (cport_in_urb) {
+		for (i = 0; i < es1->cport_in_urb_max; ++i)
+			usb_poison_urb(&cport_in_urb[i]);
+		cancel_work_sync(&es1->cport_in_work);
 	}
+	count = es1->cport_in_urb_count;
 
 	usb_kill_urb(es1->svc_urb);
 	usb_free_urb(es1->svc_urb);
@@ -359,6 +644,22 @@ static void ap_disconnect(struct usb_interface *interface)
 	udev = es1->usb_dev;
 	greybus_remove_hd(es1->hd);
 
+	/* Nothing is sent any more; make sure nothing is in flight */
+	if (cport_out_urb) {
+		for (i = 0; i < out_count; ++i)
+			usb_kill_urb(&cport_out_urb[i]);
+	}
+	kfree(cport_out_urb);
+	kfree(cport_out_urb_busy);
+
+	if (cport_in_buffer) {
+		for (i = 0; i < count; ++i)
+			kfree(cport_in_buffer[i]);
+	}
+	kfree(cport_in_buffer);
+	kfree(cport_in_urb);
+	kfree(cport_in_urb_parked);
+
 	usb_put_dev(udev);
 }
 
@@ -392,12 +693,14 @@ exit:
 static void cport_in_callback(struct urb *urb)
 {
 	struct greybus_host_device *hd = urb->context;
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
 	struct device *dev = &urb->dev->dev;
 	int status = check_urb_status(urb);
-	int retval;
 	u16 cport_id;
 	u8 *data;
 
+	cport_in_adapt(es1, atomic_dec_return(&es1->cport_in_urb_active));
+
 	if (status) {
 		if ((status == -EAGAIN) || (status == -EPROTO))
 			goto exit;
@@ -419,15 +722,21 @@ static void cport_in_callback(struct urb *urb)
 	cport_id = (u16)data[0];
 	data = &data[1];
 
-	/* Pass this data to the greybus core */
-	greybus_data_rcvd(hd, cport_id, data, urb->actual_length - 1);
+	/*
+	 * Pass this data to the greybus core.  If it holds on to our
+	 * buffer the urb gets resubmitted by buffer_release().
+	 */
+	if (rx_zero_copy) {
+		if (greybus_data_rcvd_lent(hd, cport_id, data,
+					   urb->actual_length - 1, urb))
+			return;
+	} else {
+		greybus_data_rcvd(hd, cport_id, data, urb->actual_length - 1);
+	}
 
 exit:
 	/* put our urb back in the request pool */
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
-		dev_err(dev, "%s: error %d in submitting urb.\n",
-			__func__, retval);
+	cport_in_urb_submit(es1, urb, GFP_ATOMIC);
 }
 
 static void cport_out_callback(struct urb *urb)
@@ -511,7 +820,6 @@ static int ap_probe(struct usb_interface *interface,
 	es1->hd = hd;
 	es1->usb_intf = interface;
 	es1->usb_dev = udev;
-	spin_lock_init(&es1->cport_out_urb_lock);
 	usb_set_intfdata(interface, es1);
 
 	/* Control endpoint is the pipe to talk to this AP, so save it off */
@@ -546,6 +854,30 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	/*
+	 * Allocate the pool of urbs for our CPort OUT messages.  They
+	 * are embedded in one array, and are never freed through
+	 * usb_free_urb() since we hold their initial reference.
+	 */
+	es1->cport_out_urb_count = max(cport_out_urbs, 1U);
+	es1->cport_out_urb = kcalloc(es1->cport_out_urb_count,
+				     sizeof(*es1->cport_out_urb), GFP_KERNEL);
+	es1->cport_out_urb_busy = kcalloc(BITS_TO_LONGS(es1->cport_out_urb_count),
+					  sizeof(unsigned long), GFP_KERNEL);
+	if (!es1->cport_out_urb || !es1->cport_out_urb_busy) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < es1->cport_out_urb_count; ++i)
+		usb_init_urb(&es1->cport_out_urb[i]);
+
+	/* Have the core queue messages rather than overrun the pool */
+	hd->tx_max = es1->cport_out_urb_count;
+
+	es1->debugfs_dir = debugfs_create_dir("bridge", hd->debugfs_dentry);
+	debugfs_create_file("cport_out_urbs", S_IRUGO, es1->debugfs_dir, es1,
+			    &cport_out_urbs_fops);
+
 	/* Create our buffer and URB to get SVC messages, and start it up */
 	es1->svc_buffer = kmalloc(ES1_SVC_MSG_SIZE, GFP_KERNEL);
 	if (!es1->svc_buffer)
@@ -561,40 +893,47 @@ static int ap_probe(struct usb_interface *interface,
 			 hd, svc_interval);
 
 	/* Allocate buffers for our cport in messages and start them up */
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-		struct urb *urb;
-		u8 *buffer;
-
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
-			goto error;
-		buffer = kmalloc(ES1_GBUF_MSG_SIZE_MAX, GFP_KERNEL);
-		if (!buffer)
-			goto error;
+	es1->cport_in_urb_min = clamp(cport_in_urbs, 1U, CPORT_IN_URB_LIMIT);
+	es1->cport_in_urb_max = es1->cport_in_urb_min;
+	if (cport_in_adaptive)
+		es1->cport_in_urb_max = clamp(cport_in_urbs_max,
+					      es1->cport_in_urb_min,
+					      CPORT_IN_URB_LIMIT);
+	es1->cport_in_urb_target = es1->cport_in_urb_min;
+	es1->cport_in_urb_low = INT_MAX;
+	INIT_WORK(&es1->cport_in_work, cport_in_work);
+
+	es1->cport_in_urb = kcalloc(es1->cport_in_urb_max,
+				    sizeof(*es1->cport_in_urb), GFP_KERNEL);
+	es1->cport_in_buffer = kcalloc(es1->cport_in_urb_max,
+				       sizeof(*es1->cport_in_buffer),
+				       GFP_KERNEL);
+	es1->cport_in_urb_parked = kcalloc(BITS_TO_LONGS(es1->cport_in_urb_max),
+					   sizeof(unsigned long), GFP_KERNEL);
+	if (!es1->cport_in_urb || !es1->cport_in_buffer ||
+	    !es1->cport_in_urb_parked) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < es1->cport_in_urb_max; ++i)
+		usb_init_urb(&es1->cport_in_urb[i]);
 
-		usb_fill_bulk_urb(urb, udev,
-				  usb_rcvbulkpipe(udev, es1->cport_in_endpoint),
-				  buffer, ES1_GBUF_MSG_SIZE_MAX,
-				  cport_in_callback, hd);
-		es1->cport_in_urb[i] = urb;
-		es1->cport_in_buffer[i] = buffer;
-		retval = usb_submit_urb(urb, GFP_KERNEL);
+	for (i = 0; i < es1->cport_in_urb_target; ++i) {
+		retval = cport_in_urb_add(es1, i, GFP_KERNEL);
 		if (retval)
 			goto error;
-	}
-
-	/* Allocate urbs for our CPort OUT messages */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb;
-
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
+		es1->cport_in_urb_count = i + 1;
+		atomic_inc(&es1->cport_in_urb_active);
+		retval = usb_submit_urb(&es1->cport_in_urb[i], GFP_KERNEL);
+		if (retval) {
+			atomic_dec(&es1->cport_in_urb_active);
 			goto error;
-
-		es1->cport_out_urb[i] = urb;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
+		}
 	}
 
+	debugfs_create_file("cport_in_urbs", S_IRUGO, es1->debugfs_dir, es1,
+			    &cport_in_urbs_fops);
+
 	/* Start up our svc urb, which allows events to start flowing */
 	retval = usb_submit_urb(es1->svc_urb, GFP_KERNEL);
 	if (retval)
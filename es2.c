@@ -12,8 +12,13 @@
 #include <linux/errno.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
 
 #include "greybus.h"
+#include "greybus_trace.h"
 #include "svc_msg.h"
 #include "kernel_ver.h"
 
@@ -24,6 +29,14 @@
 #define conceal_urb(urb)	((void *)((uintptr_t)(urb) ^ 0xbad))
 #define reveal_urb(cookie)	((void *)((uintptr_t)(cookie) ^ 0xbad))
 
+/*
+ * The same for messages queued for an aggregated transfer.  The two
+ * kinds of cookie can be told apart by their two low-order bits.
+ */
+#define conceal_tx_agg_msg(msg)	((void *)((uintptr_t)(msg) ^ 0xbae))
+#define reveal_tx_agg_msg(cookie) ((void *)((uintptr_t)(cookie) ^ 0xbae))
+#define cookie_is_tx_agg_msg(cookie)	(((uintptr_t)(cookie) & 0x3) == 0x2)
+
 /* Memory sizes for the buffers sent to/from the ES1 controller */
 #define ES1_SVC_MSG_SIZE	(sizeof(struct svc_msg) + SZ_64K)
 #define ES1_GBUF_MSG_SIZE_MAX	PAGE_SIZE
@@ -38,15 +51,140 @@ MODULE_DEVICE_TABLE(usb, id_table);
 /*
  * Number of CPort IN urbs in flight at any point in time.
  * Adjust if we are having stalls in the USB buffer due to not enough urbs in
- * flight.
+ * flight.  The depth is fixed when the device is probed, unless adaptive
+ * mode is enabled, in which case it ranges between that and the maximum
+ * depending on how often the receive queue runs dry.
  */
 #define NUM_CPORT_IN_URB	4
+#define NUM_CPORT_IN_URB_MAX	32
+#define CPORT_IN_URB_LIMIT	256U	/* Sanity bound for either of the above */
+
+static unsigned int cport_in_urbs = NUM_CPORT_IN_URB;
+module_param(cport_in_urbs, uint, 0644);
+MODULE_PARM_DESC(cport_in_urbs, "Number of CPort IN urbs of new devices");
+
+static unsigned int cport_in_urbs_max = NUM_CPORT_IN_URB_MAX;
+module_param(cport_in_urbs_max, uint, 0644);
+MODULE_PARM_DESC(cport_in_urbs_max, "Maximum number of adaptive CPort IN urbs");
+
+static bool cport_in_adaptive;
+module_param(cport_in_adaptive, bool, 0644);
+MODULE_PARM_DESC(cport_in_adaptive, "Adapt the number of CPort IN urbs to the load");
+
+/*
+ * In adaptive mode the depth is reconsidered every CPORT_IN_ADAPT_WINDOW
+ * completions.  It grows if every urb was found full at some point in
+ * the window, and shrinks if at least CPORT_IN_ADAPT_SPARE urbs were
+ * waiting for data throughout.
+ */
+#define CPORT_IN_ADAPT_WINDOW	256
+#define CPORT_IN_ADAPT_SPARE	2
 
-/* Number of CPort OUT urbs in flight at any point in time.
- * Adjust if we get messages saying we are out of urbs in the system log.
+/*
+ * Default number of CPort OUT urbs in flight at any point in time.
+ * The pool size is fixed when the device is probed; adjust it with the
+ * cport_out_urbs parameter if the "exhausted" counter in debugfs goes up.
  */
 #define NUM_CPORT_OUT_URB	8
 
+static unsigned int cport_out_urbs = NUM_CPORT_OUT_URB;
+module_param(cport_out_urbs, uint, 0644);
+MODULE_PARM_DESC(cport_out_urbs, "Size of the CPort OUT urb pool of new devices");
+
+/*
+ * When set, received CPort data is lent to the greybus core instead
+ * of being copied out of the urb buffer, and the urb is resubmitted
+ * only once the core gives the buffer back.
+ */
+static bool rx_zero_copy;
+module_param(rx_zero_copy, bool, 0444);
+MODULE_PARM_DESC(rx_zero_copy, "Lend CPort IN buffers to the greybus core");
+
+/*
+ * Offset of the urb transfer buffer within a CPort IN buffer when
+ * lending, so the message following the one-byte CPort id is 64-bit
+ * aligned (which the core requires to use a lent buffer in place).
+ */
+#define CPORT_IN_BUFFER_PAD	(rx_zero_copy && !rx_aggregate ? sizeof(u64) - 1 : 0)
+
+/*
+ * When set, every CPort OUT transfer is framed (see struct gb_frame_hdr),
+ * and small messages are copied into a shared buffer that is sent as a
+ * single transfer once it holds tx_aggregate_bytes, or tx_aggregate_usecs
+ * after the first message was queued, whichever comes first.  The bridge
+ * firmware has to expect framed transfers, so this can't change at run
+ * time.
+ */
+static bool tx_aggregate;
+module_param(tx_aggregate, bool, 0444);
+MODULE_PARM_DESC(tx_aggregate, "Pack CPort OUT messages into framed transfers");
+
+static unsigned int tx_aggregate_bytes = 2048;
+module_param(tx_aggregate_bytes, uint, 0644);
+MODULE_PARM_DESC(tx_aggregate_bytes, "Size at which an aggregated transfer is sent");
+
+static unsigned int tx_aggregate_usecs = 100;
+module_param(tx_aggregate_usecs, uint, 0644);
+MODULE_PARM_DESC(tx_aggregate_usecs, "Longest a message waits for others to join it");
+
+/*
+ * When set, every CPort IN transfer is expected to be framed the same
+ * way, holding one or more messages (possibly for different CPorts).
+ * Framed transfers are always copied out of rather than lent, since
+ * one buffer can't be handed to several messages.
+ */
+static bool rx_aggregate;
+module_param(rx_aggregate, bool, 0444);
+MODULE_PARM_DESC(rx_aggregate, "Expect framed CPort IN transfers");
+
+#define ES2_TX_AGG_COUNT	4	/* Aggregated transfers in flight */
+#define ES2_TX_AGG_SIZE		PAGE_SIZE
+#define ES2_TX_AGG_MSGS		32	/* Messages per aggregated transfer */
+#define ES2_TX_AGG_MSG_SIZE_MAX	512	/* Larger ones are sent on their own */
+
+/*
+ * An ES2 bridge may have several bulk IN/OUT endpoint pairs for CPort
+ * data, so bulk transfers on one CPort need not hold up others.  By
+ * default CPorts are spread over the pairs by CPort id.  With
+ * cport_ep_by_class set, CPorts whose protocol is latency-sensitive
+ * (GB_PROTOCOL_HIGHPRI) get the first pair to themselves, and the
+ * others are spread over the rest.  Only CPorts using the first pair
+ * have their messages aggregated, which keeps each CPort's messages
+ * in order.
+ */
+#define ES2_CPORT_EP_PAIRS_MAX	4
+
+static bool cport_ep_by_class;
+module_param(cport_ep_by_class, bool, 0644);
+MODULE_PARM_DESC(cport_ep_by_class, "Map CPorts to endpoints by protocol class");
+
+/* What precedes the message in a CPort OUT transfer buffer */
+#define CPORT_OUT_PREFIX_SIZE	(tx_aggregate ? sizeof(struct gb_frame_hdr) : 1)
+
+struct es1_ap_dev;
+struct es2_tx_agg;
+
+/*
+ * A message copied into an aggregated transfer.  The header is the
+ * sender's buffer, reported back through greybus_data_sent() once the
+ * transfer is done; it's cleared if the message has been canceled.
+ */
+struct es2_tx_agg_msg {
+	struct es2_tx_agg	*agg;
+	void			*header;
+};
+
+struct es2_tx_agg {
+	struct es1_ap_dev	*es1;
+	struct urb		urb;
+	u8			*buffer;
+	size_t			size;
+	unsigned int		count;
+	int			status;		/* If it couldn't be sent */
+	struct es2_tx_agg_msg	msgs[ES2_TX_AGG_MSGS];
+	void			*sent[ES2_TX_AGG_MSGS];	/* Being reported */
+};
+
 /**
  * es1_ap_dev - ES1 USB Bridge to AP structure
  * @usb_dev: pointer to the USB device we are.
@@ -54,16 +192,41 @@ MODULE_DEVICE_TABLE(usb, id_table);
  * @hd: pointer to our greybus_host_device structure
  * @control_endpoint: endpoint to send data to SVC
  * @svc_endpoint: endpoint for SVC data in
- * @cport_in_endpoint: bulk in endpoint for CPort data
- * @cport-out_endpoint: bulk out endpoint for CPort data
+ * @cport_in_endpoint: bulk in endpoints for CPort data
+ * @cport-out_endpoint: bulk out endpoints for CPort data
+ * @cport_ep_pairs: number of @cport_in_endpoint/@cport_out_endpoint pairs
  * @svc_buffer: buffer for SVC messages coming in on @svc_endpoint
  * @svc_urb: urb for SVC messages coming in on @svc_endpoint
  * @cport_in_urb: array of urbs for the CPort in messages
  * @cport_in_buffer: array of buffers for the @cport_in_urb urbs
- * @cport_out_urb: array of urbs for the CPort out messages
- * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
- *			not.
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_in_urb_min: smallest depth of the CPort in queue
+ * @cport_in_urb_max: largest depth of the CPort in queue (@cport_in_urb size)
+ * @cport_in_urb_count: number of @cport_in_urb entries set up so far
+ * @cport_in_urb_target: number of @cport_in_urb entries to keep in flight
+ * @cport_in_urb_parked: bitmap of set up urbs beyond the target depth
+ * @cport_in_urb_active: number of CPort in urbs currently waiting for data
+ * @cport_in_urb_low: fewest urbs waiting for data in this adaptive window
+ * @cport_in_completions: completion count, for the adaptive windows
+ * @cport_in_starved: number of times no urb was waiting for data
+ * @cport_in_grown: number of times the queue was made deeper
+ * @cport_in_shrunk: number of times the queue was made shallower
+ * @cport_in_work: work adjusting the CPort in queue depth
+ * @cport_out_urb: pool of urbs for the CPort out messages
+ * @cport_out_urb_count: number of urbs in the @cport_out_urb pool
+ * @cport_out_urb_busy: bitmap of the @cport_out_urb entries in use
+ * @cport_out_urb_exhausted: number of sends that found the pool empty
+ * @cport_out_urb_alloc_failed: number of those that couldn't get an urb at all
+ * @tx_agg: aggregated CPort out transfers, if tx_aggregate is set
+ * @tx_agg_busy: bitmap of the @tx_agg entries in use
+ * @tx_agg_failed: bitmap of the @tx_agg entries that couldn't be submitted
+ * @tx_agg_cur: the aggregated transfer messages are being added to
+ * @tx_agg_lock: protects the aggregated transfer state
+ * @tx_agg_timer: sends @tx_agg_cur when it has waited long enough
+ * @tx_agg_stopped: set on disconnect; messages are then sent on their own
+ * @tx_agg_transfers: number of aggregated transfers sent
+ * @tx_agg_messages: number of messages sent in aggregated transfers
+ * @tx_agg_direct: number of framed messages sent on their own
+ * @debugfs_dir: debugfs directory holding our statistics
  */
 struct es1_ap_dev {
 	struct usb_device *usb_dev;
@@ -72,17 +235,45 @@ struct es1_ap_dev {
 
 	__u8 control_endpoint;
 	__u8 svc_endpoint;
-	__u8 cport_in_endpoint;
-	__u8 cport_out_endpoint;
+	__u8 cport_in_endpoint[ES2_CPORT_EP_PAIRS_MAX];
+	__u8 cport_out_endpoint[ES2_CPORT_EP_PAIRS_MAX];
+	unsigned int cport_ep_pairs;
 
 	u8 *svc_buffer;
 	struct urb *svc_urb;
 
-	struct urb *cport_in_urb[NUM_CPORT_IN_URB];
-	u8 *cport_in_buffer[NUM_CPORT_IN_URB];
-	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
-	spinlock_t cport_out_urb_lock;
+	struct urb *cport_in_urb;
+	u8 **cport_in_buffer;
+	unsigned int cport_in_urb_min;
+	unsigned int cport_in_urb_max;
+	unsigned int cport_in_urb_count;
+	unsigned int cport_in_urb_target;
+	unsigned long *cport_in_urb_parked;
+	atomic_t cport_in_urb_active;
+	int cport_in_urb_low;
+	atomic_t cport_in_completions;
+	atomic_t cport_in_starved;
+	unsigned int cport_in_grown;
+	unsigned int cport_in_shrunk;
+	struct work_struct cport_in_work;
+	struct urb *cport_out_urb;
+	unsigned int cport_out_urb_count;
+	unsigned long *cport_out_urb_busy;
+	atomic_t cport_out_urb_exhausted;
+	atomic_t cport_out_urb_alloc_failed;
+
+	struct es2_tx_agg *tx_agg;
+	unsigned long tx_agg_busy;
+	unsigned long tx_agg_failed;
+	struct es2_tx_agg *tx_agg_cur;
+	spinlock_t tx_agg_lock;
+	struct hrtimer tx_agg_timer;
+	bool tx_agg_stopped;
+	unsigned long tx_agg_transfers;
+	unsigned long tx_agg_messages;
+	unsigned long tx_agg_direct;
+
+	struct dentry *debugfs_dir;
 };
 
 static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
@@ -90,7 +281,32 @@ static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
 	return (struct es1_ap_dev *)&hd->hd_priv;
 }
 
+/* Return which of our bulk endpoint pairs carries a CPort's data */
+static unsigned int cport_ep_pair(struct es1_ap_dev *es1, u16 cport_id)
+{
+	struct gb_connection *connection;
+	bool highpri = false;
+
+	if (es1->cport_ep_pairs == 1)
+		return 0;
+	if (!cport_ep_by_class)
+		return cport_id % es1->cport_ep_pairs;
+
+	rcu_read_lock();
+	connection = gb_hd_connection_find(es1->hd, cport_id);
+	if (connection && connection->protocol)
+		highpri = connection->protocol->flags & GB_PROTOCOL_HIGHPRI;
+	rcu_read_unlock();
+
+	if (highpri)
+		return 0;
+
+	return 1 + cport_id % (es1->cport_ep_pairs - 1);
+}
+
+static void cport_in_callback(struct urb *urb);
 static void cport_out_callback(struct urb *urb);
+static void tx_agg_callback(struct urb *urb);
 
 /*
  * Buffer constraints for the host driver.
@@ -123,12 +339,14 @@ static void cport_out_callback(struct urb *urb);
 static void hd_buffer_constraints(struct greybus_host_device *hd)
 {
 	/*
-	 * Only one byte is required, but this produces a result
-	 * that's better aligned for the user.
+	 * Only one byte is required (four for a frame header when
+	 * aggregating), but this produces a result that's better
+	 * aligned for the user.
 	 */
 	hd->buffer_headroom = sizeof(u32);	/* For cport id */
 	hd->buffer_size_max = ES1_GBUF_MSG_SIZE_MAX;
 	BUILD_BUG_ON(hd->buffer_headroom > GB_BUFFER_HEADROOM_MAX);
+	BUILD_BUG_ON(sizeof(struct gb_frame_hdr) > sizeof(u32));
 }
 
 #define ES1_TIMEOUT	500	/* 500 ms for the SVC to do something */
@@ -153,57 +371,473 @@ static int submit_svc(struct svc_msg *svc_msg, struct greybus_host_device *hd)
 	return 0;
 }
 
+/*
+ * The CPort OUT urbs live in one array, so whether an urb belongs to
+ * the pool (and which slot it has) is known without searching.  The
+ * slots in use are tracked in a bitmap claimed and released with
+ * atomic bit operations, so neither sending nor completion takes a
+ * lock.
+ */
 static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
 {
-	struct urb *urb = NULL;
-	unsigned long flags;
-	int i;
-
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	unsigned int count = es1->cport_out_urb_count;
+	struct urb *urb;
+	unsigned int i;
 
-	/* Look in our pool of allocated urbs first, as that's the "fastest" */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es1->cport_out_urb_busy[i] == false) {
-			es1->cport_out_urb_busy[i] = true;
-			urb = es1->cport_out_urb[i];
+	do {
+		i = find_first_zero_bit(es1->cport_out_urb_busy, count);
+		if (i >= count)
 			break;
-		}
-	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
-	if (urb)
-		return urb;
+	} while (test_and_set_bit_lock(i, es1->cport_out_urb_busy));
+
+	if (i < count)
+		return &es1->cport_out_urb[i];
 
 	/*
-	 * Crap, pool is empty, complain to the syslog and go allocate one
-	 * dynamically as we have to succeed.
+	 * The pool is empty; count it and go allocate one dynamically,
+	 * as we have to succeed.
 	 */
-	dev_err(&es1->usb_dev->dev,
-		"No free CPort OUT urbs, having to dynamically allocate one!\n");
-	return usb_alloc_urb(0, gfp_mask);
+	atomic_inc(&es1->cport_out_urb_exhausted);
+	urb = usb_alloc_urb(0, gfp_mask);
+	if (!urb)
+		atomic_inc(&es1->cport_out_urb_alloc_failed);
+
+	return urb;
 }
 
 static void free_urb(struct es1_ap_dev *es1, struct urb *urb)
 {
-	unsigned long flags;
-	int i;
+	struct urb *pool = es1->cport_out_urb;
+
 	/*
 	 * See if this was an urb in our pool, if so mark it "free", otherwise
 	 * we need to free it ourselves.
 	 */
-	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es1->cport_out_urb[i]) {
-			es1->cport_out_urb_busy[i] = false;
-			urb = NULL;
-			break;
-		}
+	if (urb >= pool && urb < pool + es1->cport_out_urb_count) {
+		clear_bit_unlock(urb - pool, es1->cport_out_urb_busy);
+		return;
 	}
-	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
 
-	/* If urb is not NULL, then we need to free this urb */
 	usb_free_urb(urb);
 }
 
+static int cport_out_urbs_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+	unsigned int count = es1->cport_out_urb_count;
+
+	seq_printf(s, "size: %u\n", count);
+	seq_printf(s, "busy: %u\n",
+		   bitmap_weight(es1->cport_out_urb_busy, count));
+	seq_printf(s, "exhausted: %d\n",
+		   atomic_read(&es1->cport_out_urb_exhausted));
+	seq_printf(s, "alloc_failed: %d\n",
+		   atomic_read(&es1->cport_out_urb_alloc_failed));
+
+	return 0;
+}
+
+static int cport_out_urbs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_out_urbs_show, inode->i_private);
+}
+
+static const struct file_operations cport_out_urbs_fops = {
+	.open		= cport_out_urbs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int cport_in_urbs_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+
+	seq_printf(s, "adaptive: %s\n", cport_in_adaptive ? "yes" : "no");
+	seq_printf(s, "min: %u\n", es1->cport_in_urb_min);
+	seq_printf(s, "max: %u\n", es1->cport_in_urb_max);
+	seq_printf(s, "allocated: %u\n", ACCESS_ONCE(es1->cport_in_urb_count));
+	seq_printf(s, "target: %u\n", ACCESS_ONCE(es1->cport_in_urb_target));
+	seq_printf(s, "active: %d\n", atomic_read(&es1->cport_in_urb_active));
+	seq_printf(s, "starved: %d\n", atomic_read(&es1->cport_in_starved));
+	seq_printf(s, "grown: %u\n", ACCESS_ONCE(es1->cport_in_grown));
+	seq_printf(s, "shrunk: %u\n", ACCESS_ONCE(es1->cport_in_shrunk));
+
+	return 0;
+}
+
+static int cport_in_urbs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cport_in_urbs_show, inode->i_private);
+}
+
+static const struct file_operations cport_in_urbs_fops = {
+	.open		= cport_in_urbs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Put a CPort IN urb (back) in flight, unless the receive queue has
+ * been made shallower than its slot, in which case the urb is parked
+ * until the queue grows again.
+ */
+static void cport_in_urb_submit(struct es1_ap_dev *es1, struct urb *urb,
+				gfp_t gfp_mask)
+{
+	unsigned int i = urb - es1->cport_in_urb;
+	int retval;
+
+	if (i >= ACCESS_ONCE(es1->cport_in_urb_target)) {
+		set_bit(i, es1->cport_in_urb_parked);
+		/* Don't miss the queue having grown again meanwhile */
+		smp_mb__after_atomic();
+		if (i >= ACCESS_ONCE(es1->cport_in_urb_target) ||
+		    !test_and_clear_bit(i, es1->cport_in_urb_parked))
+			return;
+	}
+
+	atomic_inc(&es1->cport_in_urb_active);
+	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		atomic_dec(&es1->cport_in_urb_active);
+		/* A poisoned urb means we're disconnecting; just let it go */
+		if (retval != -EPERM)
+			dev_err(&urb->dev->dev,
+				"%s: error %d in submitting urb.\n",
+				__func__, retval);
+	}
+}
+
+/*
+ * Set up the CPort IN urb in the given slot; slots are spread over
+ * the bulk in endpoints.
+ */
+static int cport_in_urb_add(struct es1_ap_dev *es1, unsigned int i,
+			    gfp_t gfp_mask)
+{
+	struct usb_device *udev = es1->usb_dev;
+	__u8 endpoint = es1->cport_in_endpoint[i % es1->cport_ep_pairs];
+	u8 *buffer;
+
+	buffer = kmalloc(ES1_GBUF_MSG_SIZE_MAX + CPORT_IN_BUFFER_PAD, gfp_mask);
+	if (!buffer)
+		return -ENOMEM;
+
+	usb_fill_bulk_urb(&es1->cport_in_urb[i], udev,
+			  usb_rcvbulkpipe(udev, endpoint),
+			  buffer + CPORT_IN_BUFFER_PAD,
+			  ES1_GBUF_MSG_SIZE_MAX,
+			  cport_in_callback, es1->hd);
+	es1->cport_in_buffer[i] = buffer;
+
+	return 0;
+}
+
+/*
+ * Bring the number of CPort IN urbs in flight to the target depth,
+ * setting up new urbs or taking parked ones back into use as needed.
+ * Urbs beyond the target park themselves as they complete.
+ */
+static void cport_in_work(struct work_struct *work)
+{
+	struct es1_ap_dev *es1 = container_of(work, struct es1_ap_dev,
+					      cport_in_work);
+	unsigned int target = ACCESS_ONCE(es1->cport_in_urb_target);
+	unsigned int i;
+
+	for (i = 0; i < min(target, es1->cport_in_urb_count); i++) {
+		if (test_and_clear_bit(i, es1->cport_in_urb_parked))
+			cport_in_urb_submit(es1, &es1->cport_in_urb[i],
+					    GFP_KERNEL);
+	}
+
+	for (i = es1->cport_in_urb_count; i < target; i++) {
+		if (cport_in_urb_add(es1, i, GFP_KERNEL))
+			break;
+		es1->cport_in_urb_count = i + 1;
+		cport_in_urb_submit(es1, &es1->cport_in_urb[i], GFP_KERNEL);
+	}
+}
+
+/*
+ * Called from the CPort IN completion path with the number of urbs
+ * still waiting for data.  Track the fewest seen and, at the end of
+ * each window, grow or shrink the target depth by one.
+ */
+static void cport_in_adapt(struct es1_ap_dev *es1, int active)
+{
+	unsigned int target;
+	int low;
+
+	if (!active)
+		atomic_inc(&es1->cport_in_starved);
+
+	if (!cport_in_adaptive)
+		return;
+
+	/* Racy, but this is only a heuristic */
+	if (active < es1->cport_in_urb_low)
+		es1->cport_in_urb_low = active;
+
+	if (atomic_inc_return(&es1->cport_in_completions) %
+						CPORT_IN_ADAPT_WINDOW)
+		return;
+
+	low = es1->cport_in_urb_low;
+	target = es1->cport_in_urb_target;
+	if (!low && target < es1->cport_in_urb_max) {
+		ACCESS_ONCE(es1->cport_in_urb_target) = target + 1;
+		es1->cport_in_grown++;
+		schedule_work(&es1->cport_in_work);
+	} else if (low >= CPORT_IN_ADAPT_SPARE &&
+		   target > es1->cport_in_urb_min) {
+		ACCESS_ONCE(es1->cport_in_urb_target) = target - 1;
+		es1->cport_in_shrunk++;
+	}
+	es1->cport_in_urb_low = INT_MAX;
+}
+
+static int tx_aggregate_show(struct seq_file *s, void *unused)
+{
+	struct es1_ap_dev *es1 = s->private;
+	unsigned long flags;
+	unsigned long transfers, messages, direct;
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+	transfers = es1->tx_agg_transfers;
+	messages = es1->tx_agg_messages;
+	direct = es1->tx_agg_direct;
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+
+	seq_printf(s, "transfers: %lu\n", transfers);
+	seq_printf(s, "messages: %lu\n", messages);
+	seq_printf(s, "direct: %lu\n", direct);
+
+	return 0;
+}
+
+static int tx_aggregate_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tx_aggregate_show, inode->i_private);
+}
+
+static const struct file_operations tx_aggregate_fops = {
+	.open		= tx_aggregate_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Report every (uncanceled) message in an aggregated transfer as sent
+ * with the given status, and make the transfer available again.  The
+ * messages are taken from the transfer with the aggregation lock held,
+ * so a cancel can't report them too, and reported once it's dropped:
+ * greybus_data_sent() takes the core's locks, and can call back into
+ * this driver.  The transfer stays busy until they have all been.
+ */
+static void tx_agg_complete(struct es2_tx_agg *agg, int status)
+{
+	struct es1_ap_dev *es1 = agg->es1;
+	unsigned int count = 0;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+	for (i = 0; i < agg->count; i++) {
+		if (agg->msgs[i].header)
+			agg->sent[count++] = agg->msgs[i].header;
+		agg->msgs[i].header = NULL;
+	}
+	agg->count = 0;
+	agg->size = 0;
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+
+	for (i = 0; i < count; i++)
+		greybus_data_sent(es1->hd, agg->sent[i], status);
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+	__clear_bit(agg - es1->tx_agg, &es1->tx_agg_busy);
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+}
+
+/*
+ * Complete the aggregated transfers tx_agg_flush() couldn't submit.
+ * Called without the aggregation lock held.
+ */
+static void tx_agg_complete_failed(struct es1_ap_dev *es1)
+{
+	unsigned long failed;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+	failed = es1->tx_agg_failed;
+	es1->tx_agg_failed = 0;
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+
+	for_each_set_bit(i, &failed, ES2_TX_AGG_COUNT)
+		tx_agg_complete(&es1->tx_agg[i], es1->tx_agg[i].status);
+}
+
+/*
+ * Send the aggregated transfer being filled, if any.  Lock held.  One
+ * that can't be submitted is marked failed, for the caller to complete
+ * with tx_agg_complete_failed() once the lock is dropped.
+ */
+static void tx_agg_flush(struct es1_ap_dev *es1)
+{
+	struct es2_tx_agg *agg = es1->tx_agg_cur;
+	struct usb_device *udev = es1->usb_dev;
+	int retval;
+
+	if (!agg)
+		return;
+	es1->tx_agg_cur = NULL;
+	hrtimer_try_to_cancel(&es1->tx_agg_timer);
+
+	usb_fill_bulk_urb(&agg->urb, udev,
+			  usb_sndbulkpipe(udev, es1->cport_out_endpoint[0]),
+			  agg->buffer, agg->size, tx_agg_callback, agg);
+	retval = usb_submit_urb(&agg->urb, GFP_ATOMIC);
+	if (retval) {
+		pr_err("error %d submitting URB\n", retval);
+		agg->status = retval;
+		__set_bit(agg - es1->tx_agg, &es1->tx_agg_failed);
+		return;
+	}
+	es1->tx_agg_transfers++;
+	es1->tx_agg_messages += agg->count;
+}
+
+/* Start filling a new aggregated transfer, if one is free.  Lock held. */
+static struct es2_tx_agg *tx_agg_start(struct es1_ap_dev *es1)
+{
+	unsigned int i;
+
+	i = find_first_zero_bit(&es1->tx_agg_busy, ES2_TX_AGG_COUNT);
+	if (i >= ES2_TX_AGG_COUNT)
+		return NULL;
+	__set_bit(i, &es1->tx_agg_busy);
+
+	es1->tx_agg_cur = &es1->tx_agg[i];
+	hrtimer_start(&es1->tx_agg_timer,
+		      ns_to_ktime((u64)tx_aggregate_usecs * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	return es1->tx_agg_cur;
+}
+
+static enum hrtimer_restart tx_agg_timer_func(struct hrtimer *timer)
+{
+	struct es1_ap_dev *es1 = container_of(timer, struct es1_ap_dev,
+					      tx_agg_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+	tx_agg_flush(es1);
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+	tx_agg_complete_failed(es1);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Send a message in framed form.  Small messages are copied into the
+ * aggregated transfer being filled; anything else is sent on its own,
+ * with its frame header written into the buffer headroom.  Either way
+ * everything is submitted with the aggregation lock held, so messages
+ * go out in the order they were sent.
+ */
+static void *buffer_send_framed(struct es1_ap_dev *es1, u16 cport_id,
+				void *buffer, size_t buffer_size)
+{
+	struct usb_device *udev = es1->usb_dev;
+	size_t frame_size = ALIGN(sizeof(struct gb_frame_hdr) + buffer_size,
+				  GB_BUFFER_ALIGN);
+	struct gb_frame_hdr *frame;
+	struct es2_tx_agg_msg *msg;
+	unsigned int pair = cport_ep_pair(es1, cport_id);
+	struct es2_tx_agg *agg;
+	unsigned long flags;
+	struct urb *urb;
+	bool aggregate;
+	void *cookie;
+	int retval;
+
+	if (buffer_size > (size_t)U16_MAX) {
+		pr_err("bad buffer size (%zu) supplied to send\n", buffer_size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	spin_lock_irqsave(&es1->tx_agg_lock, flags);
+
+	/* Only messages for the first endpoint pair are aggregated */
+	aggregate = !pair && !es1->tx_agg_stopped;
+	agg = es1->tx_agg_cur;
+	if (!aggregate) {
+		agg = NULL;
+	} else if (agg && (buffer_size > ES2_TX_AGG_MSG_SIZE_MAX ||
+		    agg->size + frame_size > ES2_TX_AGG_SIZE ||
+		    agg->count == ES2_TX_AGG_MSGS)) {
+		tx_agg_flush(es1);
+		agg = NULL;
+	}
+	if (aggregate && !agg && buffer_size <= ES2_TX_AGG_MSG_SIZE_MAX)
+		agg = tx_agg_start(es1);
+
+	if (agg) {
+		frame = (struct gb_frame_hdr *)(agg->buffer + agg->size);
+		frame->cport_id = cpu_to_le16(cport_id);
+		frame->size = cpu_to_le16(buffer_size);
+		memcpy(frame + 1, buffer, buffer_size);
+		memset((u8 *)(frame + 1) + buffer_size, 0,
+		       frame_size - sizeof(*frame) - buffer_size);
+		agg->size += frame_size;
+
+		msg = &agg->msgs[agg->count++];
+		msg->agg = agg;
+		msg->header = buffer;
+		cookie = conceal_tx_agg_msg(msg);
+
+		if (agg->size >= tx_aggregate_bytes)
+			tx_agg_flush(es1);
+		goto out;
+	}
+
+	/* Too big to be worth copying, or nowhere to copy it to */
+	frame = (struct gb_frame_hdr *)buffer - 1;
+	frame->cport_id = cpu_to_le16(cport_id);
+	frame->size = cpu_to_le16(buffer_size);
+
+	urb = next_free_urb(es1, GFP_ATOMIC);
+	if (!urb) {
+		cookie = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	usb_fill_bulk_urb(urb, udev,
+			  usb_sndbulkpipe(udev, es1->cport_out_endpoint[pair]),
+			  frame, sizeof(*frame) + buffer_size,
+			  cport_out_callback, es1->hd);
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval) {
+		pr_err("error %d submitting URB\n", retval);
+		free_urb(es1, urb);
+		cookie = ERR_PTR(retval);
+		goto out;
+	}
+	es1->tx_agg_direct++;
+	cookie = conceal_urb(urb);
+out:
+	spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+	tx_agg_complete_failed(es1);
+
+	return cookie;
+}
+
 /*
  * Returns an opaque cookie value if successful, or a pointer coded
  * error otherwise.  If the caller wishes to cancel the in-flight
@@ -243,6 +877,10 @@ static void *buffer_send(struct greybus_host_device *hd, u16 cport_id,
 		pr_err("cport_id (%hd) is out of range for ES1\n", cport_id);
 		return ERR_PTR(-EINVAL);
 	}
+	trace_gb_host_buffer_send(hd, cport_id, buffer, buffer_size);
+	if (tx_aggregate)
+		return buffer_send_framed(es1, cport_id, buffer, buffer_size);
+
 	/* OK, the destination is fine; record it in the transfer buffer */
 	*transfer_buffer = cport_id;
 
@@ -252,7 +890,8 @@ static void *buffer_send(struct greybus_host_device *hd, u16 cport_id,
 		return ERR_PTR(-ENOMEM);
 
 	usb_fill_bulk_urb(urb, udev,
-			  usb_sndbulkpipe(udev, es1->cport_out_endpoint),
+			  usb_sndbulkpipe(udev,
+				es1->cport_out_endpoint[cport_ep_pair(es1, cport_id)]),
 			  transfer_buffer, transfer_buffer_size,
 			  cport_out_callback, hd);
 	retval = usb_submit_urb(urb, gfp_mask);
@@ -273,6 +912,29 @@ static void *buffer_send(struct greybus_host_device *hd, u16 cport_id,
  */
 static void buffer_cancel(void *cookie)
 {
+	struct es2_tx_agg_msg *msg;
+	struct es1_ap_dev *es1;
+	unsigned long flags;
+	void *header;
+
+	/*
+	 * A message that was copied into an aggregated transfer can't
+	 * be pulled back out of it, but it can be reported as done now
+	 * so its buffer isn't needed any more.
+	 */
+	if (cookie_is_tx_agg_msg(cookie)) {
+		msg = reveal_tx_agg_msg(cookie);
+		es1 = msg->agg->es1;
+
+		spin_lock_irqsave(&es1->tx_agg_lock, flags);
+		header = msg->header;
+		msg->header = NULL;
+		spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+
+		if (header)
+			greybus_data_sent(es1->hd, header, -ECANCELED);
+		return;
+	}
 
 	/*
 	 * We really should be defensive and track all outstanding
@@ -283,11 +945,22 @@ static void buffer_cancel(void *cookie)
 		usb_kill_urb(reveal_urb(cookie));
 }
 
+/*
+ * The core is done with a CPort IN buffer lent to it through
+ * greybus_data_rcvd_lent(); the cookie is the urb that owns it.
+ * Put the urb back in the request pool.
+ */
+static void buffer_release(struct greybus_host_device *hd, void *cookie)
+{
+	cport_in_urb_submit(hd_to_es1(hd), cookie, GFP_ATOMIC);
+}
+
 static struct greybus_host_driver es1_driver = {
 	.hd_priv_size		= sizeof(struct es1_ap_dev),
 	.buffer_send		= buffer_send,
 	.buffer_cancel		= buffer_cancel,
 	.submit_svc		= submit_svc,
+	.buffer_release		= buffer_release,
 };
 
 /* Common function to report consistent warnings based on URB status */
@@ -320,6 +993,14 @@ static void ap_disconnect(struct usb_interface *interface)
 {
 	struct es1_ap_dev *es1;
 	struct usb_device *udev;
+	struct urb *cport_out_urb;
+	unsigned long *cport_out_urb_busy;
+	unsigned int out_count;
+	struct es2_tx_agg *tx_agg;
+	struct urb *cport_in_urb;
+	u8 **cport_in_buffer;
+	unsigned long *cport_in_urb_parked;
+	unsigned int count;
 	int i;
 
 	es1 = usb_get_intfdata(interface);
@@ -327,27 +1008,61 @@ static void ap_disconnect(struct usb_interface *interface)
 		return;
 
 	/* Tear down everything! */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb = es1->cport_out_urb[i];
+	debugfs_remove_recursive(es1->debugfs_dir);
+	es1->debugfs_dir = NULL;
 
-		if (!urb)
-			break;
-		usb_kill_urb(urb);
-		usb_free_urb(urb);
-		es1->cport_out_urb[i] = NULL;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
+	/*
+	 * Tearing down the host device still sends messages, so the
+	 * CPort OUT urbs (and their bitmap) can only be freed once it
+	 * is gone, like the CPort IN ones below.
+	 */
+	cport_out_urb = es1->cport_out_urb;
+	cport_out_urb_busy = es1->cport_out_urb_busy;
+	out_count = es1->cport_out_urb_count;
+	if (cport_out_urb) {
+		for (i = 0; i < out_count; ++i)
+			usb_kill_urb(&cport_out_urb[i]);
 	}
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-		struct urb *urb = es1->cport_in_urb[i];
+	/*
+	 * Stop aggregating, so nothing arms the timer again, and send
+	 * what comes from here on on its own.  The aggregated transfers
+	 * are freed along with the urbs.
+	 */
+	tx_agg = es1->tx_agg;
+	if (tx_agg) {
+		struct es2_tx_agg *agg;
+		unsigned long flags;
+
+		spin_lock_irqsave(&es1->tx_agg_lock, flags);
+		es1->tx_agg_stopped = true;
+		agg = es1->tx_agg_cur;
+		es1->tx_agg_cur = NULL;
+		spin_unlock_irqrestore(&es1->tx_agg_lock, flags);
+		hrtimer_cancel(&es1->tx_agg_timer);
+		if (agg)
+			tx_agg_complete(agg, -ESHUTDOWN);
+		tx_agg_complete_failed(es1);
+
+		for (i = 0; i < ES2_TX_AGG_COUNT; ++i)
+			usb_kill_urb(&tx_agg[i].urb);
+	}
 
-		if (!urb)
-			break;
-		usb_kill_urb(urb);
-		usb_free_urb(urb);
-		kfree(es1->cport_in_buffer[i]);
-		es1->cport_in_buffer[i] = NULL;
+	/*
+	 * CPort IN buffers may still be lent to the core, so they (and
+	 * their urbs) can only be freed once the host device is gone.
+	 * Poison the urbs so buffer_release() can't resubmit them.
+	 * Poisoning the unused slots too keeps the work from using them.
+	 */
+	cport_in_urb = es1->cport_in_urb;
+	cport_in_buffer = es1->cport_in_buffer;
+	cport_in_urb_parked = es1->cport_in_urb_parked;
+	if (cport_in_urb) {
+		for (i = 0; i < es1->cport_in_urb_max; ++i)
+			usb_poison_urb(&cport_in_urb[i]);
+		cancel_work_sync(&es1->cport_in_work);
 	}
+	count = es1->cport_in_urb_count;
 
 	usb_kill_urb(es1->svc_urb);
 	usb_free_urb(es1->svc_urb);
@@ -359,6 +1074,27 @@ static void ap_disconnect(struct usb_interface *interface)
 	udev = es1->usb_dev;
 	greybus_remove_hd(es1->hd);
 
+	/* Nothing is sent any more; make sure nothing is in flight */
+	if (cport_out_urb) {
+		for (i = 0; i < out_count; ++i)
+			usb_kill_urb(&cport_out_urb[i]);
+	}
+	kfree(cport_out_urb);
+	kfree(cport_out_urb_busy);
+	if (tx_agg) {
+		for (i = 0; i < ES2_TX_AGG_COUNT; ++i)
+			kfree(tx_agg[i].buffer);
+	}
+	kfree(tx_agg);
+
+	if (cport_in_buffer) {
+		for (i = 0; i < count; ++i)
+			kfree(cport_in_buffer[i]);
+	}
+	kfree(cport_in_buffer);
+	kfree(cport_in_urb);
+	kfree(cport_in_urb_parked);
+
 	usb_put_dev(udev);
 }
 
@@ -392,12 +1128,14 @@ exit:
 static void cport_in_callback(struct urb *urb)
 {
 	struct greybus_host_device *hd = urb->context;
+	struct es1_ap_dev *es1 = hd_to_es1(hd);
 	struct device *dev = &urb->dev->dev;
 	int status = check_urb_status(urb);
-	int retval;
 	u16 cport_id;
 	u8 *data;
 
+	cport_in_adapt(es1, atomic_dec_return(&es1->cport_in_urb_active));
+
 	if (status) {
 		if ((status == -EAGAIN) || (status == -EPROTO))
 			goto exit;
@@ -405,6 +1143,12 @@ static void cport_in_callback(struct urb *urb)
 		return;
 	}
 
+	if (rx_aggregate) {
+		greybus_data_rcvd_framed(hd, urb->transfer_buffer,
+					 urb->actual_length);
+		goto exit;
+	}
+
 	/* The size has to be at least one, for the cport id */
 	if (!urb->actual_length) {
 		dev_err(dev, "%s: no cport id in input buffer?\n", __func__);
@@ -419,15 +1163,21 @@ static void cport_in_callback(struct urb *urb)
 	cport_id = (u16)data[0];
 	data = &data[1];
 
-	/* Pass this data to the greybus core */
-	greybus_data_rcvd(hd, cport_id, data, urb->actual_length - 1);
+	/*
+	 * Pass this data to the greybus core.  If it holds on to our
+	 * buffer the urb gets resubmitted by buffer_release().
+	 */
+	if (rx_zero_copy) {
+		if (greybus_data_rcvd_lent(hd, cport_id, data,
+					   urb->actual_length - 1, urb))
+			return;
+	} else {
+		greybus_data_rcvd(hd, cport_id, data, urb->actual_length - 1);
+	}
 
 exit:
 	/* put our urb back in the request pool */
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
-		dev_err(dev, "%s: error %d in submitting urb.\n",
-			__func__, retval);
+	cport_in_urb_submit(es1, urb, GFP_ATOMIC);
 }
 
 static void cport_out_callback(struct urb *urb)
@@ -435,14 +1185,15 @@ static void cport_out_callback(struct urb *urb)
 	struct greybus_host_device *hd = urb->context;
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
 	int status = check_urb_status(urb);
-	u8 *data = urb->transfer_buffer + 1;
+	u8 *data;
 
 	/*
 	 * Tell the submitter that the buffer send (attempt) is
 	 * complete, and report the status.  The submitter's buffer
-	 * starts after the one-byte CPort id we inserted.
+	 * starts after the one-byte CPort id (or the frame header)
+	 * we inserted.
 	 */
-	data = urb->transfer_buffer + 1;
+	data = urb->transfer_buffer + CPORT_OUT_PREFIX_SIZE;
 	greybus_data_sent(hd, data, status);
 
 	free_urb(es1, urb);
@@ -474,6 +1225,14 @@ static void cport_out_callback(struct urb *urb)
 	 */
 }
 
+static void tx_agg_callback(struct urb *urb)
+{
+	struct es2_tx_agg *agg = urb->context;
+	int status = check_urb_status(urb);
+
+	tx_agg_complete(agg, status);
+}
+
 /*
  * The ES1 USB Bridge device contains 4 endpoints
  * 1 Control - usual USB stuff + AP -> SVC messages
@@ -490,8 +1249,8 @@ static int ap_probe(struct usb_interface *interface,
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
 	bool int_in_found = false;
-	bool bulk_in_found = false;
-	bool bulk_out_found = false;
+	unsigned int bulk_in_count = 0;
+	unsigned int bulk_out_count = 0;
 	int retval = -ENOMEM;
 	int i;
 	u8 svc_interval = 0;
@@ -511,14 +1270,13 @@ static int ap_probe(struct usb_interface *interface,
 	es1->hd = hd;
 	es1->usb_intf = interface;
 	es1->usb_dev = udev;
-	spin_lock_init(&es1->cport_out_urb_lock);
 	usb_set_intfdata(interface, es1);
 
 	/* Control endpoint is the pipe to talk to this AP, so save it off */
 	endpoint = &udev->ep0.desc;
 	es1->control_endpoint = endpoint->bEndpointAddress;
 
-	/* find all 3 of our endpoints */
+	/* find our endpoints; there may be several bulk pairs */
 	iface_desc = interface->cur_altsetting;
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
 		endpoint = &iface_desc->endpoint[i].desc;
@@ -528,11 +1286,15 @@ static int ap_probe(struct usb_interface *interface,
 			svc_interval = endpoint->bInterval;
 			int_in_found = true;
 		} else if (usb_endpoint_is_bulk_in(endpoint)) {
-			es1->cport_in_endpoint = endpoint->bEndpointAddress;
-			bulk_in_found = true;
+			if (bulk_in_count < ES2_CPORT_EP_PAIRS_MAX)
+				es1->cport_in_endpoint[bulk_in_count] =
+					endpoint->bEndpointAddress;
+			bulk_in_count++;
 		} else if (usb_endpoint_is_bulk_out(endpoint)) {
-			es1->cport_out_endpoint = endpoint->bEndpointAddress;
-			bulk_out_found = true;
+			if (bulk_out_count < ES2_CPORT_EP_PAIRS_MAX)
+				es1->cport_out_endpoint[bulk_out_count] =
+					endpoint->bEndpointAddress;
+			bulk_out_count++;
 		} else {
 			dev_err(&udev->dev,
 				"Unknown endpoint type found, address %x\n",
@@ -540,11 +1302,74 @@ static int ap_probe(struct usb_interface *interface,
 		}
 	}
 	if ((int_in_found == false) ||
-	    (bulk_in_found == false) ||
-	    (bulk_out_found == false)) {
+	    (bulk_in_count == 0) ||
+	    (bulk_out_count == 0)) {
 		dev_err(&udev->dev, "Not enough endpoints found in device, aborting!\n");
 		goto error;
 	}
+	es1->cport_ep_pairs = min3(bulk_in_count, bulk_out_count,
+				   (unsigned int)ES2_CPORT_EP_PAIRS_MAX);
+	if (bulk_in_count != es1->cport_ep_pairs ||
+	    bulk_out_count != es1->cport_ep_pairs)
+		dev_warn(&udev->dev,
+			 "using %u of %u bulk in and %u bulk out endpoints\n",
+			 es1->cport_ep_pairs, bulk_in_count, bulk_out_count);
+
+	/*
+	 * Allocate the pool of urbs for our CPort OUT messages.  They
+	 * are embedded in one array, and are never freed through
+	 * usb_free_urb() since we hold their initial reference.
+	 */
+	es1->cport_out_urb_count = max(cport_out_urbs, 1U);
+	es1->cport_out_urb = kcalloc(es1->cport_out_urb_count,
+				     sizeof(*es1->cport_out_urb), GFP_KERNEL);
+	es1->cport_out_urb_busy = kcalloc(BITS_TO_LONGS(es1->cport_out_urb_count),
+					  sizeof(unsigned long), GFP_KERNEL);
+	if (!es1->cport_out_urb || !es1->cport_out_urb_busy) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < es1->cport_out_urb_count; ++i)
+		usb_init_urb(&es1->cport_out_urb[i]);
+
+	/*
+	 * Have the core queue messages rather than overrun the pool;
+	 * unless they're aggregated, as that relies on messages being
+	 * handed over while transfers are in flight.
+	 */
+	if (!tx_aggregate)
+		hd->tx_max = es1->cport_out_urb_count;
+
+	es1->debugfs_dir = debugfs_create_dir("bridge", hd->debugfs_dentry);
+	debugfs_create_file("cport_out_urbs", S_IRUGO, es1->debugfs_dir, es1,
+			    &cport_out_urbs_fops);
+
+	/* Set up the buffers for aggregated CPort OUT transfers */
+	spin_lock_init(&es1->tx_agg_lock);
+	hrtimer_init(&es1->tx_agg_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	es1->tx_agg_timer.function = tx_agg_timer_func;
+	if (tx_aggregate) {
+		BUILD_BUG_ON(ES2_TX_AGG_COUNT > BITS_PER_LONG);
+		es1->tx_agg = kcalloc(ES2_TX_AGG_COUNT, sizeof(*es1->tx_agg),
+				      GFP_KERNEL);
+		if (!es1->tx_agg) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		for (i = 0; i < ES2_TX_AGG_COUNT; ++i) {
+			struct es2_tx_agg *agg = &es1->tx_agg[i];
+
+			agg->es1 = es1;
+			usb_init_urb(&agg->urb);
+			agg->buffer = kmalloc(ES2_TX_AGG_SIZE, GFP_KERNEL);
+			if (!agg->buffer) {
+				retval = -ENOMEM;
+				goto error;
+			}
+		}
+		debugfs_create_file("tx_aggregate", S_IRUGO, es1->debugfs_dir,
+				    es1, &tx_aggregate_fops);
+	}
 
 	/* Create our buffer and URB to get SVC messages, and start it up */
 	es1->svc_buffer = kmalloc(ES1_SVC_MSG_SIZE, GFP_KERNEL);
@@ -564,40 +1389,49 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 
 	/* Allocate buffers for our cport in messages and start them up */
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-		struct urb *urb;
-		u8 *buffer;
-
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
-			goto error;
-		buffer = kmalloc(ES1_GBUF_MSG_SIZE_MAX, GFP_KERNEL);
-		if (!buffer)
-			goto error;
+	/* Every bulk in endpoint needs at least one urb */
+	es1->cport_in_urb_min = clamp(cport_in_urbs, es1->cport_ep_pairs,
+				      CPORT_IN_URB_LIMIT);
+	es1->cport_in_urb_max = es1->cport_in_urb_min;
+	if (cport_in_adaptive)
+		es1->cport_in_urb_max = clamp(cport_in_urbs_max,
+					      es1->cport_in_urb_min,
+					      CPORT_IN_URB_LIMIT);
+	es1->cport_in_urb_target = es1->cport_in_urb_min;
+	es1->cport_in_urb_low = INT_MAX;
+	INIT_WORK(&es1->cport_in_work, cport_in_work);
+
+	es1->cport_in_urb = kcalloc(es1->cport_in_urb_max,
+				    sizeof(*es1->cport_in_urb), GFP_KERNEL);
+	es1->cport_in_buffer = kcalloc(es1->cport_in_urb_max,
+				       sizeof(*es1->cport_in_buffer),
+				       GFP_KERNEL);
+	es1->cport_in_urb_parked = kcalloc(BITS_TO_LONGS(es1->cport_in_urb_max),
+					   sizeof(unsigned long), GFP_KERNEL);
+	if (!es1->cport_in_urb || !es1->cport_in_buffer ||
+	    !es1->cport_in_urb_parked) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < es1->cport_in_urb_max; ++i)
+		usb_init_urb(&es1->cport_in_urb[i]);
 
-		usb_fill_bulk_urb(urb, udev,
-				  usb_rcvbulkpipe(udev, es1->cport_in_endpoint),
-				  buffer, ES1_GBUF_MSG_SIZE_MAX,
-				  cport_in_callback, hd);
-		es1->cport_in_urb[i] = urb;
-		es1->cport_in_buffer[i] = buffer;
-		retval = usb_submit_urb(urb, GFP_KERNEL);
+	for (i = 0; i < es1->cport_in_urb_target; ++i) {
+		retval = cport_in_urb_add(es1, i, GFP_KERNEL);
 		if (retval)
 			goto error;
-	}
-
-	/* Allocate urbs for our CPort OUT messages */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb;
-
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
+		es1->cport_in_urb_count = i + 1;
+		atomic_inc(&es1->cport_in_urb_active);
+		retval = usb_submit_urb(&es1->cport_in_urb[i], GFP_KERNEL);
+		if (retval) {
+			atomic_dec(&es1->cport_in_urb_active);
 			goto error;
-
-		es1->cport_out_urb[i] = urb;
-		es1->cport_out_urb_busy[i] = false;	/* just to be anal */
+		}
 	}
 
+	debugfs_create_file("cport_in_urbs", S_IRUGO, es1->debugfs_dir, es1,
+			    &cport_in_urbs_fops);
+
 	return 0;
 error:
 	ap_disconnect(interface);
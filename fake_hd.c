@@ -0,0 +1,668 @@
+/*
+ * Greybus fake host device
+ *
+ * A software-only host device, for exercising and benchmarking the
+ * greybus core without a USB bridge.  It announces a module whose
+ * manifest it makes up itself, and answers every request sent to
+ * that module after a configurable delay.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/random.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
+#include <linux/platform_device.h>
+
+#include "greybus.h"
+#include "greybus_trace.h"
+#include "svc_msg.h"
+#include "kernel_ver.h"
+
+/*
+ * Macros for making pointers explicitly opaque, such that the result
+ * isn't valid but also can't be mistaken for an ERR_PTR() value.
+ */
+#define conceal_msg(msg)	((void *)((uintptr_t)(msg) ^ 0xbad))
+#define reveal_msg(cookie)	((void *)((uintptr_t)(cookie) ^ 0xbad))
+
+#define FAKE_HD_BUFFER_SIZE_MAX	PAGE_SIZE
+#define FAKE_HD_CPORTS_MAX	32
+
+/* The made up module, and the one interface it has */
+#define FAKE_HD_MODULE_ID	1
+#define FAKE_HD_INTERFACE_ID	0
+#define FAKE_HD_DEVICE_ID	2
+
+/* Every protocol uses request type 1 to get the protocol version */
+#define FAKE_HD_TYPE_PROTOCOL_VERSION	0x01
+
+/* Loopback sink requests are answered without a payload (see loopback.c) */
+#define GB_LOOPBACK_TYPE_SINK		0x04
+
+/* Fragmented loopback requests are echoed, so fragments are taken */
+#define GB_LOOPBACK_VERSION_MINOR_FRAGMENTS	0x02
+
+/*
+ * i2c requests are answered as a module with only memory on its bus
+ * would (see i2c.c): every transfer succeeds, and reads get zeroes.
+ */
+#define GB_I2C_TYPE_FUNCTIONALITY	0x02
+#define GB_I2C_TYPE_TIMEOUT		0x03
+#define GB_I2C_TYPE_RETRIES		0x04
+#define GB_I2C_TYPE_TRANSFER		0x05
+
+#define FAKE_HD_I2C_FUNCTIONALITY	0x00000001	/* I2C_FUNC_I2C */
+#define FAKE_HD_I2C_M_RD		0x0001		/* I2C_M_RD */
+
+struct fake_i2c_transfer_op {
+	__le16	addr;
+	__le16	flags;
+	__le16	size;
+};
+
+static unsigned int hosts = 1;
+module_param(hosts, uint, 0444);
+MODULE_PARM_DESC(hosts, "Number of fake host devices to create");
+
+static unsigned int cports = 1;
+module_param(cports, uint, 0444);
+MODULE_PARM_DESC(cports, "Number of CPorts on each fake module");
+
+static unsigned int protocol = GREYBUS_PROTOCOL_LOOPBACK;
+module_param(protocol, uint, 0444);
+MODULE_PARM_DESC(protocol, "Protocol id of the CPorts on each fake module");
+
+static unsigned int delay_us;
+module_param(delay_us, uint, 0644);
+MODULE_PARM_DESC(delay_us, "Time taken to answer a request (usecs)");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, 0644);
+MODULE_PARM_DESC(jitter_us, "Largest random time added to delay_us (usecs)");
+
+/**
+ * fake_hd - fake host device private data
+ * @hd: pointer to our greybus_host_device structure
+ * @pdev: platform device standing in for the bridge (our parent)
+ * @lock: protects @pending, @completing, @current_msg and @stopped
+ * @pending: messages sent, in the order they are to be completed
+ * @completing: messages due, which the timer is about to complete
+ * @current_msg: the message the timer is completing right now
+ * @wait: woken up whenever @current_msg is done with
+ * @timer: fires when the first @pending message is due
+ * @stopped: no more messages are accepted
+ */
+struct fake_hd {
+	struct greybus_host_device *hd;
+	struct platform_device *pdev;
+	spinlock_t lock;
+	struct list_head pending;
+	struct list_head completing;
+	struct fake_msg *current_msg;
+	wait_queue_head_t wait;
+	struct hrtimer timer;
+	bool stopped;
+};
+
+/*
+ * A message handed to buffer_send(), along with the response to it
+ * (if it is a request).
+ */
+struct fake_msg {
+	struct list_head links;
+	void *header;			/* The core's message */
+	u16 cport_id;
+	ktime_t due;
+	size_t reply_size;		/* 0 if no response is to be sent */
+	struct gb_operation_msg_hdr reply[0];
+};
+
+/* The host devices, for buffer_cancel(), protected by fake_hds_lock */
+static struct greybus_host_device **fake_hds;
+static DEFINE_SPINLOCK(fake_hds_lock);
+
+static inline struct fake_hd *hd_to_fake(struct greybus_host_device *hd)
+{
+	return (struct fake_hd *)&hd->hd_priv;
+}
+
+/* Whether a message is a fragment, other than the last one */
+static bool fake_fragment_more(struct gb_operation_msg_hdr *header,
+			       size_t size)
+{
+	struct gb_operation_fragment_hdr *fragment_header;
+	size_t len;
+
+	if (!(header->flags & GB_OPERATION_FLAG_FRAGMENT) ||
+	    size < sizeof(*header) + sizeof(*fragment_header))
+		return false;
+
+	fragment_header = (struct gb_operation_fragment_hdr *)(header + 1);
+	len = size - sizeof(*header) - sizeof(*fragment_header);
+
+	return le32_to_cpu(fragment_header->offset) + len <
+		le32_to_cpu(fragment_header->payload_size);
+}
+
+/* How much an i2c transfer request reads, 0 if it's malformed */
+static size_t fake_i2c_read_size(struct gb_operation_msg_hdr *header,
+				 size_t size)
+{
+	__le16 *op_count = (__le16 *)(header + 1);
+	struct fake_i2c_transfer_op *op = (void *)(op_count + 1);
+	size_t read_size = 0;
+	unsigned int count;
+	unsigned int i;
+
+	if (size < sizeof(*header) + sizeof(*op_count))
+		return 0;
+	count = le16_to_cpu(*op_count);
+	if (size < sizeof(*header) + sizeof(*op_count) + count * sizeof(*op))
+		return 0;
+
+	for (i = 0; i < count; i++, op++) {
+		if (le16_to_cpu(op->flags) & FAKE_HD_I2C_M_RD)
+			read_size += le16_to_cpu(op->size);
+	}
+
+	return read_size;
+}
+
+static size_t fake_i2c_reply_size(struct gb_operation_msg_hdr *header,
+				  size_t size)
+{
+	switch (header->type) {
+	case GB_I2C_TYPE_FUNCTIONALITY:
+		return sizeof(*header) + sizeof(__le32);
+	case GB_I2C_TYPE_TIMEOUT:
+	case GB_I2C_TYPE_RETRIES:
+		return sizeof(*header);
+	case GB_I2C_TYPE_TRANSFER:
+		return sizeof(*header) + fake_i2c_read_size(header, size);
+	default:
+		return size;
+	}
+}
+
+/*
+ * Work out how big the response to a request is.  Version requests
+ * get the version of the connection's protocol (for loopback, one
+ * that takes fragments), loopback sink requests get an empty
+ * response, i2c requests get what an i2c module would answer, and
+ * everything else is echoed.
+ * Echoing a request sent in fragments answers it in fragments; an
+ * empty response is sent once, for the last of them.
+ */
+static size_t fake_reply_size(struct gb_connection *connection,
+			      struct gb_operation_msg_hdr *header,
+			      size_t size)
+{
+	if (header->type & GB_OPERATION_TYPE_RESPONSE)
+		return 0;
+
+	if (header->type == FAKE_HD_TYPE_PROTOCOL_VERSION)
+		return sizeof(*header) +
+			sizeof(struct gb_protocol_version_response);
+
+	if (connection && connection->protocol_id == GREYBUS_PROTOCOL_LOOPBACK &&
+	    header->type == GB_LOOPBACK_TYPE_SINK)
+		return fake_fragment_more(header, size) ? 0 : sizeof(*header);
+
+	if (connection && connection->protocol_id == GREYBUS_PROTOCOL_I2C)
+		return fake_i2c_reply_size(header, size);
+
+	return size;
+}
+
+static void fake_reply_fill(struct gb_connection *connection,
+			    struct fake_msg *msg,
+			    struct gb_operation_msg_hdr *header, size_t size)
+{
+	struct gb_operation_msg_hdr *reply = msg->reply;
+	struct gb_protocol_version_response *version;
+
+	memcpy(reply, header, min(msg->reply_size, size));
+	reply->size = cpu_to_le16(msg->reply_size);
+	reply->type |= GB_OPERATION_TYPE_RESPONSE;
+	reply->result = GB_OP_SUCCESS;
+	if (msg->reply_size == sizeof(*reply))
+		reply->flags = 0;
+
+	if (connection && connection->protocol_id == GREYBUS_PROTOCOL_I2C) {
+		memset(reply + 1, 0, msg->reply_size - sizeof(*reply));
+		if (header->type == GB_I2C_TYPE_FUNCTIONALITY)
+			*(__le32 *)(reply + 1) =
+				cpu_to_le32(FAKE_HD_I2C_FUNCTIONALITY);
+	}
+
+	if (header->type == FAKE_HD_TYPE_PROTOCOL_VERSION) {
+		version = (void *)(reply + 1);
+		if (connection && connection->protocol) {
+			version->major = connection->protocol->major;
+			version->minor = connection->protocol->minor;
+			if (connection->protocol_id == GREYBUS_PROTOCOL_LOOPBACK)
+				version->minor = GB_LOOPBACK_VERSION_MINOR_FRAGMENTS;
+		} else {
+			version->major = 0;
+			version->minor = 1;
+		}
+	}
+}
+
+/* Hand the message back to the core, and deliver the response to it */
+static void fake_msg_complete(struct fake_hd *fake, struct fake_msg *msg,
+			      int status)
+{
+	greybus_data_sent(fake->hd, msg->header, status);
+	if (!status && msg->reply_size)
+		greybus_data_rcvd(fake->hd, msg->cport_id, (u8 *)msg->reply,
+				  msg->reply_size);
+	kfree(msg);
+}
+
+/*
+ * Complete everything that is due.  Messages are handed back to the
+ * core without our lock held, as a real host driver would, one at a
+ * time so buffer_cancel() can tell (through @current_msg) when one it
+ * didn't find is still being completed.
+ */
+static enum hrtimer_restart fake_timer_func(struct hrtimer *timer)
+{
+	struct fake_hd *fake = container_of(timer, struct fake_hd, timer);
+	struct fake_msg *msg;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+
+	spin_lock_irqsave(&fake->lock, flags);
+	while (!list_empty(&fake->pending)) {
+		msg = list_first_entry(&fake->pending, struct fake_msg, links);
+		if (ktime_after(msg->due, now)) {
+			hrtimer_set_expires(timer, msg->due);
+			ret = HRTIMER_RESTART;
+			break;
+		}
+		list_move_tail(&msg->links, &fake->completing);
+	}
+
+	while (!list_empty(&fake->completing)) {
+		msg = list_first_entry(&fake->completing, struct fake_msg,
+				       links);
+		list_del(&msg->links);
+		fake->current_msg = msg;
+		spin_unlock_irqrestore(&fake->lock, flags);
+
+		fake_msg_complete(fake, msg, 0);
+
+		spin_lock_irqsave(&fake->lock, flags);
+		fake->current_msg = NULL;
+		wake_up(&fake->wait);
+	}
+	spin_unlock_irqrestore(&fake->lock, flags);
+
+	return ret;
+}
+
+static void *buffer_send(struct greybus_host_device *hd, u16 cport_id,
+			 void *buffer, size_t buffer_size, gfp_t gfp_mask)
+{
+	struct fake_hd *fake = hd_to_fake(hd);
+	struct gb_operation_msg_hdr *header = buffer;
+	struct gb_connection *connection;
+	struct fake_msg *msg;
+	unsigned long flags;
+	size_t reply_size;
+	u32 delay = delay_us;
+
+	trace_gb_host_buffer_send(hd, cport_id, buffer, buffer_size);
+
+	if (buffer_size < sizeof(*header)) {
+		pr_err("message too small (%zu)\n", buffer_size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* Room for the largest possible response */
+	reply_size = max(buffer_size, sizeof(*header) +
+			 sizeof(struct gb_protocol_version_response));
+	if (header->type == GB_I2C_TYPE_TRANSFER)
+		reply_size = max(reply_size, sizeof(*header) +
+				 fake_i2c_read_size(header, buffer_size));
+	if (reply_size > FAKE_HD_BUFFER_SIZE_MAX) {
+		pr_err("response too big (%zu)\n", reply_size);
+		return ERR_PTR(-EMSGSIZE);
+	}
+	msg = kmalloc(sizeof(*msg) + reply_size, gfp_mask);
+	if (!msg)
+		return ERR_PTR(-ENOMEM);
+	msg->header = buffer;
+	msg->cport_id = cport_id;
+
+	rcu_read_lock();
+	connection = gb_hd_connection_find(hd, cport_id);
+	msg->reply_size = fake_reply_size(connection, header, buffer_size);
+	if (msg->reply_size)
+		fake_reply_fill(connection, msg, header, buffer_size);
+	rcu_read_unlock();
+
+	if (jitter_us)
+		delay += prandom_u32() % (jitter_us + 1);
+
+	spin_lock_irqsave(&fake->lock, flags);
+	if (fake->stopped) {
+		spin_unlock_irqrestore(&fake->lock, flags);
+		kfree(msg);
+		return ERR_PTR(-ESHUTDOWN);
+	}
+
+	/* Messages complete in order, however the jitter falls */
+	msg->due = ktime_add_us(ktime_get(), delay);
+	if (list_empty(&fake->pending)) {
+		hrtimer_start(&fake->timer, msg->due, HRTIMER_MODE_ABS);
+	} else {
+		struct fake_msg *last;
+
+		last = list_entry(fake->pending.prev, struct fake_msg, links);
+		if (ktime_before(msg->due, last->due))
+			msg->due = last->due;
+	}
+	list_add_tail(&msg->links, &fake->pending);
+	spin_unlock_irqrestore(&fake->lock, flags);
+
+	return conceal_msg(msg);
+}
+
+/* Called with the fake host device's lock held */
+static bool fake_msg_find(struct list_head *list, struct fake_msg *cancel)
+{
+	struct fake_msg *msg;
+
+	list_for_each_entry(msg, list, links) {
+		if (msg == cancel) {
+			list_del(&msg->links);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The cookie may belong to a message that has already completed, so
+ * it is only used once it has been found on one of our lists.  If
+ * the timer is completing it right now, wait for that to finish, so
+ * the message is done with by the time we return, as it would be
+ * for a real host driver.
+ */
+static void buffer_cancel(void *cookie)
+{
+	struct fake_msg *cancel = reveal_msg(cookie);
+	struct fake_hd *fake = NULL;
+	bool found = false;
+	bool busy = false;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&fake_hds_lock, flags);
+	for (i = 0; i < hosts && !found && !busy; i++) {
+		if (!fake_hds[i])
+			continue;
+		fake = hd_to_fake(fake_hds[i]);
+
+		spin_lock(&fake->lock);
+		found = fake_msg_find(&fake->pending, cancel) ||
+			fake_msg_find(&fake->completing, cancel);
+		busy = fake->current_msg == cancel;
+		spin_unlock(&fake->lock);
+	}
+	spin_unlock_irqrestore(&fake_hds_lock, flags);
+
+	if (found)
+		fake_msg_complete(fake, cancel, -ECANCELED);
+	else if (busy)
+		wait_event(fake->wait, ACCESS_ONCE(fake->current_msg) != cancel);
+}
+
+/* Nothing listens to what the AP tells the SVC */
+static int submit_svc(struct svc_msg *svc_msg, struct greybus_host_device *hd)
+{
+	return 0;
+}
+
+static struct greybus_host_driver fake_driver = {
+	.hd_priv_size		= sizeof(struct fake_hd),
+	.buffer_send		= buffer_send,
+	.buffer_cancel		= buffer_cancel,
+	.submit_svc		= submit_svc,
+};
+
+/*
+ * Make up a manifest describing a module with a single interface,
+ * having the configured number of CPorts (ids 1 and up), all using
+ * the configured protocol.  Returns the manifest size.
+ */
+static size_t fake_manifest_fill(void *data)
+{
+	struct greybus_manifest_header *header = data;
+	struct greybus_descriptor *desc;
+	size_t size;
+	unsigned int i;
+
+	header->version_major = GREYBUS_VERSION_MAJOR;
+	header->version_minor = GREYBUS_VERSION_MINOR;
+	desc = (void *)(header + 1);
+
+	size = sizeof(desc->header) + sizeof(desc->module);
+	desc->header.size = cpu_to_le16(size);
+	desc->header.type = GREYBUS_TYPE_MODULE;
+	desc->module.vendor = cpu_to_le16(0xffff);
+	desc->module.product = cpu_to_le16(0xffff);
+	desc = (void *)desc + size;
+
+	size = sizeof(desc->header) + sizeof(desc->interface);
+	desc->header.size = cpu_to_le16(size);
+	desc->header.type = GREYBUS_TYPE_INTERFACE;
+	desc->interface.id = FAKE_HD_INTERFACE_ID;
+	desc = (void *)desc + size;
+
+	for (i = 0; i < cports; i++) {
+		size = sizeof(desc->header) + sizeof(desc->cport);
+		desc->header.size = cpu_to_le16(size);
+		desc->header.type = GREYBUS_TYPE_CPORT;
+		desc->cport.bundle = FAKE_HD_INTERFACE_ID;
+		desc->cport.id = cpu_to_le16(i + 1);
+		desc->cport.protocol_id = protocol;
+		desc = (void *)desc + size;
+	}
+
+	size = (void *)desc - data;
+	header->size = cpu_to_le16(size);
+
+	return size;
+}
+
+/*
+ * Announce the fake module as the SVC would: hot plug it (passing
+ * its manifest), then report its interface's link up.
+ */
+static int fake_hd_hotplug(struct greybus_host_device *hd)
+{
+	struct svc_msg *svc_msg;
+	size_t manifest_size;
+	size_t size;
+	int retval;
+
+	size = sizeof(svc_msg->header) + sizeof(svc_msg->hotplug) +
+		sizeof(struct greybus_manifest_header) +
+		sizeof(struct greybus_descriptor) * (cports + 2);
+	svc_msg = kzalloc(size, GFP_KERNEL);
+	if (!svc_msg)
+		return -ENOMEM;
+
+	manifest_size = fake_manifest_fill(svc_msg->hotplug.data);
+	svc_msg->header.function_id = SVC_FUNCTION_HOTPLUG;
+	svc_msg->header.message_type = SVC_MSG_DATA;
+	svc_msg->header.payload_length =
+		cpu_to_le16(sizeof(svc_msg->hotplug) + manifest_size);
+	svc_msg->hotplug.hotplug_event = SVC_HOTPLUG_EVENT;
+	svc_msg->hotplug.module_id = FAKE_HD_MODULE_ID;
+	retval = greybus_svc_in(hd, (u8 *)svc_msg, sizeof(svc_msg->header) +
+				sizeof(svc_msg->hotplug) + manifest_size);
+	if (retval)
+		goto out;
+
+	memset(svc_msg, 0, sizeof(*svc_msg));
+	svc_msg->header.function_id = SVC_FUNCTION_UNIPRO_NETWORK_MANAGEMENT;
+	svc_msg->header.message_type = SVC_MSG_DATA;
+	svc_msg->header.payload_length =
+		cpu_to_le16(sizeof(svc_msg->management));
+	svc_msg->management.management_packet_type = SVC_MANAGEMENT_LINK_UP;
+	svc_msg->management.link_up.module_id = FAKE_HD_MODULE_ID;
+	svc_msg->management.link_up.interface_id = FAKE_HD_INTERFACE_ID;
+	svc_msg->management.link_up.device_id = FAKE_HD_DEVICE_ID;
+	retval = greybus_svc_in(hd, (u8 *)svc_msg, sizeof(svc_msg->header) +
+				sizeof(svc_msg->management));
+out:
+	kfree(svc_msg);
+
+	return retval;
+}
+
+static struct greybus_host_device *fake_hd_create(int id)
+{
+	struct platform_device *pdev;
+	struct greybus_host_device *hd;
+	struct fake_hd *fake;
+	int retval;
+
+	pdev = platform_device_register_simple("gb-fake-hd", id, NULL, 0);
+	if (IS_ERR(pdev))
+		return ERR_CAST(pdev);
+
+	hd = greybus_create_hd(&fake_driver, &pdev->dev);
+	if (!hd) {
+		retval = -ENOMEM;
+		goto err_unregister;
+	}
+
+	fake = hd_to_fake(hd);
+	fake->hd = hd;
+	fake->pdev = pdev;
+	spin_lock_init(&fake->lock);
+	INIT_LIST_HEAD(&fake->pending);
+	INIT_LIST_HEAD(&fake->completing);
+	init_waitqueue_head(&fake->wait);
+	hrtimer_init(&fake->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	fake->timer.function = fake_timer_func;
+
+	hd->buffer_headroom = 0;
+	hd->buffer_size_max = FAKE_HD_BUFFER_SIZE_MAX;
+
+	retval = fake_hd_hotplug(hd);
+	if (retval) {
+		greybus_remove_hd(hd);
+		goto err_unregister;
+	}
+
+	return hd;
+
+err_unregister:
+	platform_device_unregister(pdev);
+	return ERR_PTR(retval);
+}
+
+/*
+ * Stop accepting messages and fail those still pending, as a real
+ * bridge going away would, before tearing down the host device.
+ */
+static void fake_hd_destroy(int id)
+{
+	struct greybus_host_device *hd = fake_hds[id];
+	struct fake_hd *fake = hd_to_fake(hd);
+	struct platform_device *pdev = fake->pdev;
+	struct fake_msg *msg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fake->lock, flags);
+	fake->stopped = true;
+	spin_unlock_irqrestore(&fake->lock, flags);
+
+	hrtimer_cancel(&fake->timer);
+
+	spin_lock_irqsave(&fake->lock, flags);
+	while (!list_empty(&fake->pending)) {
+		msg = list_first_entry(&fake->pending, struct fake_msg, links);
+		list_del(&msg->links);
+		spin_unlock_irqrestore(&fake->lock, flags);
+
+		fake_msg_complete(fake, msg, -ESHUTDOWN);
+
+		spin_lock_irqsave(&fake->lock, flags);
+	}
+	spin_unlock_irqrestore(&fake->lock, flags);
+
+	/* Nothing is pending any more; hide the host device from cancels */
+	spin_lock_irqsave(&fake_hds_lock, flags);
+	fake_hds[id] = NULL;
+	spin_unlock_irqrestore(&fake_hds_lock, flags);
+
+	greybus_remove_hd(hd);
+	platform_device_unregister(pdev);
+}
+
+static int __init fake_hd_init(void)
+{
+	struct greybus_host_device *hd;
+	int retval;
+	int i;
+
+	if (!hosts)
+		return -EINVAL;
+	if (!cports || cports > FAKE_HD_CPORTS_MAX)
+		return -EINVAL;
+	if (protocol > U8_MAX)
+		return -EINVAL;
+
+	fake_hds = kcalloc(hosts, sizeof(*fake_hds), GFP_KERNEL);
+	if (!fake_hds)
+		return -ENOMEM;
+
+	for (i = 0; i < hosts; i++) {
+		hd = fake_hd_create(i);
+		if (IS_ERR(hd)) {
+			retval = PTR_ERR(hd);
+			goto error;
+		}
+		spin_lock_irq(&fake_hds_lock);
+		fake_hds[i] = hd;
+		spin_unlock_irq(&fake_hds_lock);
+	}
+
+	return 0;
+
+error:
+	while (--i >= 0)
+		fake_hd_destroy(i);
+	kfree(fake_hds);
+	return retval;
+}
+
+static void __exit fake_hd_exit(void)
+{
+	int i;
+
+	for (i = 0; i < hosts; i++)
+		fake_hd_destroy(i);
+	kfree(fake_hds);
+}
+
+module_init(fake_hd_init);
+module_exit(fake_hd_exit);
+
+MODULE_LICENSE("GPL v2");
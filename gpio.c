@@ -10,6 +10,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <linux/gpio.h>
 #include <linux/irq.h>
 #include <linux/irqdomain.h>
@@ -20,10 +22,15 @@ struct gb_gpio_line {
 	/* --> make them just a flags field */
 	u8			active:    1,
 				direction: 1,	/* 0 = output, 1 = input */
-				value:     1;	/* 0 = low, 1 = high */
+				value:     1,	/* 0 = low, 1 = high */
+				cached:    1;	/* value known (output only) */
+	u8			irq_type;
 	u16			debounce_usec;
 };
 
+/* line_max is a u8, so there are never more lines than this */
+#define GB_GPIO_LINES_MAX		(U8_MAX + 1)
+
 struct gb_gpio_controller {
 	struct gb_connection	*connection;
 	u8			version_major;
@@ -38,11 +45,32 @@ struct gb_gpio_controller {
 	unsigned int		irq_base;
 	irq_flow_handler_t	irq_handler;
 	unsigned int		irq_default_type;
+
+	/*
+	 * irq_chip callbacks only record what they were asked to do
+	 * here; the changes are sent to the module in one batch when
+	 * the bus lock is dropped (or from irq_work for acks, which
+	 * are made outside the bus lock).
+	 */
+	struct mutex		irq_lock;	/* the irq bus lock */
+	struct work_struct	irq_work;
+	DECLARE_BITMAP(irq_masked, GB_GPIO_LINES_MAX);
+	DECLARE_BITMAP(irq_mask_pending, GB_GPIO_LINES_MAX);
+	DECLARE_BITMAP(irq_type_pending, GB_GPIO_LINES_MAX);
+	DECLARE_BITMAP(irq_ack_pending, GB_GPIO_LINES_MAX);
 };
 #define gpio_chip_to_gb_gpio_controller(chip) \
 	container_of(chip, struct gb_gpio_controller, chip)
 #define irq_data_to_gpio_chip(d) (d->domain->host_data)
 
+/*
+ * Modules reporting this protocol minor version or later handle
+ * GET_VALUES and SET_VALUES, which read or write any of the lines in
+ * a bank of GB_GPIO_BANK_LINES in a single operation.
+ */
+#define GB_GPIO_VERSION_MINOR_VALUES	0x02
+#define GB_GPIO_BANK_LINES		32
+
 /* Version of the Greybus GPIO protocol we support */
 #define	GB_GPIO_VERSION_MAJOR		0x00
 #define	GB_GPIO_VERSION_MINOR		0x01
@@ -64,6 +92,8 @@ struct gb_gpio_controller {
 #define GB_GPIO_TYPE_IRQ_MASK		0x0d
 #define GB_GPIO_TYPE_IRQ_UNMASK		0x0e
 #define GB_GPIO_TYPE_IRQ_EVENT		0x0f
+#define	GB_GPIO_TYPE_GET_VALUES		0x10
+#define	GB_GPIO_TYPE_SET_VALUES		0x11
 #define	GB_GPIO_TYPE_RESPONSE		0x80	/* OR'd with rest */
 
 #define	GB_GPIO_DEBOUNCE_USEC_DEFAULT	0	/* microseconds */
@@ -114,6 +144,22 @@ struct gb_gpio_set_value_request {
 };
 /* set value response has no payload */
 
+/* Bit n of mask and values refers to line first + n */
+struct gb_gpio_get_values_request {
+	__u8	first;
+	__le32	mask __packed;
+};
+struct gb_gpio_get_values_response {
+	__le32	values;
+};
+
+struct gb_gpio_set_values_request {
+	__u8	first;
+	__le32	mask __packed;
+	__le32	values __packed;
+};
+/* set values response has no payload */
+
 struct gb_gpio_set_debounce_request {
 	__u8	which;
 	__le16	usec __packed;
@@ -141,6 +187,14 @@ struct gb_gpio_irq_ack_request {
 };
 /* irq ack response has no payload */
 
+/* Any of the irq requests above, as sent in a batch */
+union gb_gpio_irq_request {
+	struct gb_gpio_irq_type_request		type;
+	struct gb_gpio_irq_mask_request		mask;
+	struct gb_gpio_irq_unmask_request	unmask;
+	struct gb_gpio_irq_ack_request		ack;
+};
+
 /* irq event requests originate on another module and are handled on the AP */
 struct gb_gpio_irq_event_request {
 	__u8	which;
@@ -185,37 +239,14 @@ static void gb_gpio_deactivate_operation(struct gb_gpio_controller *ggc,
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DEACTIVATE,
 				 &request, sizeof(request), NULL, 0);
 	if (ret) {
-		dev_err(ggc->chip.dev, "failed to deactivate gpio %u\n",
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to deactivate gpio %u\n",
 			which);
 		return;
 	}
 
 	ggc->lines[which].active = false;
-}
-
-static int gb_gpio_get_direction_operation(struct gb_gpio_controller *ggc,
-					u8 which)
-{
-	struct gb_gpio_get_direction_request request;
-	struct gb_gpio_get_direction_response response;
-	int ret;
-	u8 direction;
-
-	request.which = which;
-	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_DIRECTION,
-				&request, sizeof(request),
-				&response, sizeof(response));
-	if (ret)
-		return ret;
-
-	direction = response.direction;
-	if (direction && direction != 1) {
-		dev_warn(ggc->chip.dev,
-			 "gpio %u direction was %u (should be 0 or 1)\n",
-			 which, direction);
-	}
-	ggc->lines[which].direction = direction ? 1 : 0;
-	return 0;
+	ggc->lines[which].cached = false;
 }
 
 static int gb_gpio_direction_in_operation(struct gb_gpio_controller *ggc,
@@ -227,8 +258,10 @@ static int gb_gpio_direction_in_operation(struct gb_gpio_controller *ggc,
 	request.which = which;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_IN,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 1;
+		ggc->lines[which].cached = false;
+	}
 	return ret;
 }
 
@@ -242,8 +275,11 @@ static int gb_gpio_direction_out_operation(struct gb_gpio_controller *ggc,
 	request.value = value_high ? 1 : 0;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_OUT,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 0;
+		ggc->lines[which].value = request.value;
+		ggc->lines[which].cached = true;
+	}
 	return ret;
 }
 
@@ -260,18 +296,20 @@ static int gb_gpio_get_value_operation(struct gb_gpio_controller *ggc,
 				&request, sizeof(request),
 				&response, sizeof(response));
 	if (ret) {
-		dev_err(ggc->chip.dev, "failed to get value of gpio %u\n",
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to get value of gpio %u\n",
 			which);
 		return ret;
 	}
 
 	value = response.value;
 	if (value && value != 1) {
-		dev_warn(ggc->chip.dev,
+		dev_warn(gb_gpiochip_dev(&ggc->chip),
 			 "gpio %u value was %u (should be 0 or 1)\n",
 			 which, value);
 	}
 	ggc->lines[which].value = value ? 1 : 0;
+	ggc->lines[which].cached = !ggc->lines[which].direction;
 	return 0;
 }
 
@@ -282,7 +320,7 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 	int ret;
 
 	if (ggc->lines[which].direction == 1) {
-		dev_warn(ggc->chip.dev,
+		dev_warn(gb_gpiochip_dev(&ggc->chip),
 			 "refusing to set value of input gpio %u\n", which);
 		return;
 	}
@@ -292,12 +330,14 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_SET_VALUE,
 				&request, sizeof(request), NULL, 0);
 	if (ret) {
-		dev_err(ggc->chip.dev, "failed to set value of gpio %u\n",
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to set value of gpio %u\n",
 			which);
 		return;
 	}
 
 	ggc->lines[which].value = request.value;
+	ggc->lines[which].cached = true;
 }
 
 static int gb_gpio_set_debounce_operation(struct gb_gpio_controller *ggc,
@@ -315,60 +355,414 @@ static int gb_gpio_set_debounce_operation(struct gb_gpio_controller *ggc,
 	return ret;
 }
 
+/*
+ * A batch of operations of one type, at most one per line (or bank
+ * of lines).  fill() builds the request for line or bank i, and
+ * returns false if there's to be none; done() is then given each
+ * request and its response.
+ */
+struct gb_gpio_batch_ops {
+	u8	type;
+	size_t	request_size;
+	size_t	response_size;
+	bool	(*fill)(struct gb_gpio_controller *ggc, unsigned int i,
+			void *request, void *data);
+	void	(*done)(struct gb_gpio_controller *ggc, const void *request,
+			const void *response, void *data);
+};
+
+/*
+ * Build a batch of operations described by ops for count lines or
+ * banks, and send them all in a single gb_operation_batch().  done()
+ * (if any) is only called once every operation has succeeded.
+ */
+static int gb_gpio_batch_run(struct gb_gpio_controller *ggc,
+			     const struct gb_gpio_batch_ops *ops,
+			     unsigned int count, void *data)
+{
+	struct gb_operation_batch_entry *batch;
+	u8 *requests;
+	u8 *responses = NULL;
+	unsigned int i, n = 0;
+	int ret = -ENOMEM;
+
+	requests = kcalloc(count, ops->request_size, GFP_KERNEL);
+	if (ops->response_size)
+		responses = kcalloc(count, ops->response_size, GFP_KERNEL);
+	batch = kcalloc(count, sizeof(*batch), GFP_KERNEL);
+	if (!requests || (ops->response_size && !responses) || !batch)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		batch[n].request = requests + n * ops->request_size;
+		if (!ops->fill(ggc, i, batch[n].request, data))
+			continue;
+
+		batch[n].type = ops->type;
+		batch[n].request_size = ops->request_size;
+		if (ops->response_size) {
+			batch[n].response = responses + n * ops->response_size;
+			batch[n].response_size = ops->response_size;
+		}
+		n++;
+	}
+
+	ret = n ? gb_operation_batch(ggc->connection, batch, n) : 0;
+	if (ret || !ops->done)
+		goto out;
+
+	for (i = 0; i < n; i++)
+		ops->done(ggc, batch[i].request, batch[i].response, data);
+out:
+	kfree(batch);
+	kfree(responses);
+	kfree(requests);
+
+	return ret;
+}
+
+/* The lines a batch of values operations is for, and their values */
+struct gb_gpio_values {
+	const unsigned long	*mask;
+	const unsigned long	*set_bits;	/* To set */
+	unsigned long		*get_bits;	/* Read */
+};
+
+/* Return the bits of a line bitmap for the bank starting at first */
+static u32 gb_gpio_bank_bits(const unsigned long *bitmap, unsigned int first,
+			     unsigned int count)
+{
+	unsigned int bit;
+	u32 bits = 0;
+
+	for (bit = 0; bit < GB_GPIO_BANK_LINES && first + bit < count; bit++) {
+		if (test_bit(first + bit, bitmap))
+			bits |= BIT(bit);
+	}
+
+	return bits;
+}
+
+/* Record a value read from a line, and cache it for an input */
+static void gb_gpio_value_read(struct gb_gpio_controller *ggc,
+			       unsigned int which, u8 value,
+			       unsigned long *bits)
+{
+	ggc->lines[which].value = value ? 1 : 0;
+	ggc->lines[which].cached = !ggc->lines[which].direction;
+	if (ggc->lines[which].value)
+		set_bit(which, bits);
+	else
+		clear_bit(which, bits);
+}
+
+static bool gb_gpio_get_values_fill(struct gb_gpio_controller *ggc,
+				    unsigned int i, void *request, void *data)
+{
+	struct gb_gpio_get_values_request *req = request;
+	struct gb_gpio_values *values = data;
+	u32 bank_mask;
+
+	bank_mask = gb_gpio_bank_bits(values->mask, i * GB_GPIO_BANK_LINES,
+				      ggc->line_max + 1);
+	if (!bank_mask)
+		return false;
+
+	req->first = i * GB_GPIO_BANK_LINES;
+	req->mask = cpu_to_le32(bank_mask);
+
+	return true;
+}
+
+static void gb_gpio_get_values_done(struct gb_gpio_controller *ggc,
+				    const void *request, const void *response,
+				    void *data)
+{
+	const struct gb_gpio_get_values_request *req = request;
+	const struct gb_gpio_get_values_response *resp = response;
+	struct gb_gpio_values *values = data;
+	u32 bank_mask = le32_to_cpu(req->mask);
+	u32 bank_values = le32_to_cpu(resp->values);
+	unsigned int bit;
+
+	for (bit = 0; bit < GB_GPIO_BANK_LINES; bit++) {
+		if (bank_mask & BIT(bit))
+			gb_gpio_value_read(ggc, req->first + bit,
+					   !!(bank_values & BIT(bit)),
+					   values->get_bits);
+	}
+}
+
+static const struct gb_gpio_batch_ops gb_gpio_get_values_ops = {
+	.type		= GB_GPIO_TYPE_GET_VALUES,
+	.request_size	= sizeof(struct gb_gpio_get_values_request),
+	.response_size	= sizeof(struct gb_gpio_get_values_response),
+	.fill		= gb_gpio_get_values_fill,
+	.done		= gb_gpio_get_values_done,
+};
+
+static bool gb_gpio_get_value_fill(struct gb_gpio_controller *ggc,
+				   unsigned int i, void *request, void *data)
+{
+	struct gb_gpio_get_value_request *req = request;
+	struct gb_gpio_values *values = data;
+
+	if (!test_bit(i, values->mask))
+		return false;
+
+	req->which = i;
+
+	return true;
+}
+
+static void gb_gpio_get_value_done(struct gb_gpio_controller *ggc,
+				   const void *request, const void *response,
+				   void *data)
+{
+	const struct gb_gpio_get_value_request *req = request;
+	const struct gb_gpio_get_value_response *resp = response;
+	struct gb_gpio_values *values = data;
+
+	gb_gpio_value_read(ggc, req->which, resp->value, values->get_bits);
+}
+
+static const struct gb_gpio_batch_ops gb_gpio_get_value_ops = {
+	.type		= GB_GPIO_TYPE_GET_VALUE,
+	.request_size	= sizeof(struct gb_gpio_get_value_request),
+	.response_size	= sizeof(struct gb_gpio_get_value_response),
+	.fill		= gb_gpio_get_value_fill,
+	.done		= gb_gpio_get_value_done,
+};
+
+/*
+ * Read the value of every line set in mask into bits, using a
+ * GET_VALUES operation per bank of lines if the module supports it
+ * and a GET_VALUE per line otherwise.  Either way all operations are
+ * sent as a single batch.
+ */
+static int gb_gpio_get_values_operation(struct gb_gpio_controller *ggc,
+					const unsigned long *mask,
+					unsigned long *bits)
+{
+	struct gb_gpio_values values = {
+		.mask		= mask,
+		.get_bits	= bits,
+	};
+	unsigned int count = ggc->line_max + 1;
+	int ret;
+
+	if (ggc->version_minor >= GB_GPIO_VERSION_MINOR_VALUES)
+		ret = gb_gpio_batch_run(ggc, &gb_gpio_get_values_ops,
+					DIV_ROUND_UP(count, GB_GPIO_BANK_LINES),
+					&values);
+	else
+		ret = gb_gpio_batch_run(ggc, &gb_gpio_get_value_ops, count,
+					&values);
+	if (ret)
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to get gpio values: %d\n", ret);
+
+	return ret;
+}
+
+static bool gb_gpio_set_values_fill(struct gb_gpio_controller *ggc,
+				    unsigned int i, void *request, void *data)
+{
+	struct gb_gpio_set_values_request *req = request;
+	struct gb_gpio_values *values = data;
+	unsigned int first = i * GB_GPIO_BANK_LINES;
+	unsigned int count = ggc->line_max + 1;
+	u32 bank_mask;
+
+	bank_mask = gb_gpio_bank_bits(values->mask, first, count);
+	if (!bank_mask)
+		return false;
+
+	req->first = first;
+	req->mask = cpu_to_le32(bank_mask);
+	req->values = cpu_to_le32(bank_mask &
+			gb_gpio_bank_bits(values->set_bits, first, count));
+
+	return true;
+}
+
+static const struct gb_gpio_batch_ops gb_gpio_set_values_ops = {
+	.type		= GB_GPIO_TYPE_SET_VALUES,
+	.request_size	= sizeof(struct gb_gpio_set_values_request),
+	.fill		= gb_gpio_set_values_fill,
+};
+
+static bool gb_gpio_set_value_fill(struct gb_gpio_controller *ggc,
+				   unsigned int i, void *request, void *data)
+{
+	struct gb_gpio_set_value_request *req = request;
+	struct gb_gpio_values *values = data;
+
+	if (!test_bit(i, values->mask))
+		return false;
+
+	req->which = i;
+	req->value = test_bit(i, values->set_bits) ? 1 : 0;
+
+	return true;
+}
+
+static const struct gb_gpio_batch_ops gb_gpio_set_value_ops = {
+	.type		= GB_GPIO_TYPE_SET_VALUE,
+	.request_size	= sizeof(struct gb_gpio_set_value_request),
+	.fill		= gb_gpio_set_value_fill,
+};
+
+/*
+ * Drive every (output) line set in mask to the value given in bits,
+ * batched the same way as gb_gpio_get_values_operation().
+ */
+static int gb_gpio_set_values_operation(struct gb_gpio_controller *ggc,
+					const unsigned long *mask,
+					const unsigned long *bits)
+{
+	struct gb_gpio_values values = {
+		.mask		= mask,
+		.set_bits	= bits,
+	};
+	unsigned int count = ggc->line_max + 1;
+	unsigned int which;
+	int ret;
+
+	if (ggc->version_minor >= GB_GPIO_VERSION_MINOR_VALUES)
+		ret = gb_gpio_batch_run(ggc, &gb_gpio_set_values_ops,
+					DIV_ROUND_UP(count, GB_GPIO_BANK_LINES),
+					&values);
+	else
+		ret = gb_gpio_batch_run(ggc, &gb_gpio_set_value_ops, count,
+					&values);
+	if (ret) {
+		/* We no longer know which of the lines were changed */
+		for_each_set_bit(which, mask, count)
+			ggc->lines[which].cached = false;
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to set gpio values: %d\n", ret);
+		return ret;
+	}
+
+	for_each_set_bit(which, mask, count) {
+		ggc->lines[which].value = test_bit(which, bits) ? 1 : 0;
+		ggc->lines[which].cached = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the module every irq change recorded since the last flush.
+ * Called with the irq bus lock held.
+ */
+static void gb_gpio_irq_flush(struct gb_gpio_controller *ggc)
+{
+	union gb_gpio_irq_request *requests;
+	struct gb_operation_batch_entry *batch;
+	unsigned int count = ggc->line_max + 1;
+	unsigned int max = 3 * count;	/* type, (un)mask and ack per line */
+	unsigned int n = 0;
+	unsigned int which;
+	int ret;
+
+	if (bitmap_empty(ggc->irq_type_pending, count) &&
+	    bitmap_empty(ggc->irq_mask_pending, count) &&
+	    bitmap_empty(ggc->irq_ack_pending, count))
+		return;
+
+	requests = kcalloc(max, sizeof(*requests), GFP_KERNEL);
+	batch = kcalloc(max, sizeof(*batch), GFP_KERNEL);
+	if (!requests || !batch) {
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to update irqs: %d\n", -ENOMEM);
+		goto out;
+	}
+
+	for (which = 0; which < count; which++) {
+		if (test_and_clear_bit(which, ggc->irq_type_pending)) {
+			requests[n].type.which = which;
+			requests[n].type.type = ggc->lines[which].irq_type;
+			batch[n].type = GB_GPIO_TYPE_IRQ_TYPE;
+			batch[n].request = &requests[n];
+			batch[n].request_size = sizeof(requests[n].type);
+			n++;
+		}
+		if (test_and_clear_bit(which, ggc->irq_mask_pending)) {
+			if (test_bit(which, ggc->irq_masked)) {
+				requests[n].mask.which = which;
+				batch[n].type = GB_GPIO_TYPE_IRQ_MASK;
+				batch[n].request_size = sizeof(requests[n].mask);
+			} else {
+				requests[n].unmask.which = which;
+				batch[n].type = GB_GPIO_TYPE_IRQ_UNMASK;
+				batch[n].request_size = sizeof(requests[n].unmask);
+			}
+			batch[n].request = &requests[n];
+			n++;
+		}
+		if (test_and_clear_bit(which, ggc->irq_ack_pending)) {
+			requests[n].ack.which = which;
+			batch[n].type = GB_GPIO_TYPE_IRQ_ACK;
+			batch[n].request = &requests[n];
+			batch[n].request_size = sizeof(requests[n].ack);
+			n++;
+		}
+	}
+
+	ret = gb_operation_batch(ggc->connection, batch, n);
+	if (ret)
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"failed to update irqs: %d\n", ret);
+out:
+	kfree(batch);
+	kfree(requests);
+}
+
+static void gb_gpio_irq_work(struct work_struct *work)
+{
+	struct gb_gpio_controller *ggc;
+
+	ggc = container_of(work, struct gb_gpio_controller, irq_work);
+
+	mutex_lock(&ggc->irq_lock);
+	gb_gpio_irq_flush(ggc);
+	mutex_unlock(&ggc->irq_lock);
+}
+
 static void gb_gpio_ack_irq(struct irq_data *d)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
-	struct gb_gpio_irq_ack_request request;
-	int ret;
 
-	request.which = d->hwirq;
-	ret = gb_operation_sync(ggc->connection,
-				GB_GPIO_TYPE_IRQ_ACK,
-				&request, sizeof(request), NULL, 0);
-	if (ret)
-		dev_err(chip->dev, "failed to ack irq: %d\n", ret);
+	/* Flow handlers ack without taking the bus lock */
+	set_bit(d->hwirq, ggc->irq_ack_pending);
+	schedule_work(&ggc->irq_work);
 }
 
 static void gb_gpio_mask_irq(struct irq_data *d)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
-	struct gb_gpio_irq_mask_request request;
-	int ret;
 
-	request.which = d->hwirq;
-	ret = gb_operation_sync(ggc->connection,
-				GB_GPIO_TYPE_IRQ_MASK,
-				&request, sizeof(request), NULL, 0);
-	if (ret)
-		dev_err(chip->dev, "failed to mask irq: %d\n", ret);
+	set_bit(d->hwirq, ggc->irq_masked);
+	set_bit(d->hwirq, ggc->irq_mask_pending);
 }
 
 static void gb_gpio_unmask_irq(struct irq_data *d)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
-	struct gb_gpio_irq_unmask_request request;
-	int ret;
 
-	request.which = d->hwirq;
-	ret = gb_operation_sync(ggc->connection,
-				GB_GPIO_TYPE_IRQ_UNMASK,
-				&request, sizeof(request), NULL, 0);
-	if (ret)
-		dev_err(chip->dev, "failed to unmask irq: %d\n", ret);
+	clear_bit(d->hwirq, ggc->irq_masked);
+	set_bit(d->hwirq, ggc->irq_mask_pending);
 }
 
 static int gb_gpio_irq_set_type(struct irq_data *d, unsigned int type)
 {
 	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
-	struct gb_gpio_irq_type_request request;
-	int ret = 0;
-
-	request.which = d->hwirq;
-	request.type = type;
 
 	switch (type) {
 	case IRQ_TYPE_NONE:
@@ -378,20 +772,33 @@ static int gb_gpio_irq_set_type(struct irq_data *d, unsigned int type)
 	case IRQ_TYPE_EDGE_BOTH:
 	case IRQ_TYPE_LEVEL_LOW:
 	case IRQ_TYPE_LEVEL_HIGH:
-		ret = gb_operation_sync(ggc->connection,
-					GB_GPIO_TYPE_IRQ_TYPE,
-					&request, sizeof(request), NULL, 0);
-		if (ret) {
-			dev_err(chip->dev, "failed to set irq type: %d\n",
-				ret);
-		}
-                break;
+		ggc->lines[d->hwirq].irq_type = type;
+		set_bit(d->hwirq, ggc->irq_type_pending);
+		break;
 	default:
-		dev_err(chip->dev, "unsupported irq type: %u\n", type);
-		ret = -EINVAL;
+		dev_err(gb_gpiochip_dev(chip),
+			"unsupported irq type: %u\n", type);
+		return -EINVAL;
 	}
 
-	return ret;
+	return 0;
+}
+
+static void gb_gpio_irq_bus_lock(struct irq_data *d)
+{
+	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+
+	mutex_lock(&ggc->irq_lock);
+}
+
+static void gb_gpio_irq_bus_sync_unlock(struct irq_data *d)
+{
+	struct gpio_chip *chip = irq_data_to_gpio_chip(d);
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+
+	gb_gpio_irq_flush(ggc);
+	mutex_unlock(&ggc->irq_lock);
 }
 
 static void gb_gpio_request_recv(u8 type, struct gb_operation *op)
@@ -415,20 +822,24 @@ static void gb_gpio_request_recv(u8 type, struct gb_operation *op)
 	request = op->request;
 	event = request->payload;
 	if (event->which > ggc->line_max) {
-		dev_err(ggc->chip.dev, "invalid hw irq: %d\n", event->which);
+		dev_err(gb_gpiochip_dev(&ggc->chip),
+			"invalid hw irq: %d\n", event->which);
 		return;
 	}
 	irq = gpio_to_irq(ggc->chip.base + event->which);
 	desc = irq_to_desc(irq);
 
-	/* Dispatch interrupt */
+	/*
+	 * Dispatch interrupt.  Anything the handler asks of the irq chip
+	 * is sent from irq_work, not here.
+	 */
 	local_irq_disable();
 	handle_simple_irq(irq, desc);
 	local_irq_enable();
 
 	ret = gb_operation_response_send(op, 0);
 	if (ret) {
-		dev_err(ggc->chip.dev,
+		dev_err(gb_gpiochip_dev(&ggc->chip),
 			"failed to send response status %d: %d\n", 0, ret);
 	}
 }
@@ -450,15 +861,12 @@ static void gb_gpio_free(struct gpio_chip *chip, unsigned offset)
 static int gb_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
 {
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
-	u8 which;
-	int ret;
-
-	which = (u8)offset;
-	ret = gb_gpio_get_direction_operation(ggc, which);
-	if (ret)
-		return ret;
 
-	return ggc->lines[which].direction ? 1 : 0;
+	/*
+	 * Every line's direction is read at setup, and only changes
+	 * through us after that, so there's no need to ask the module.
+	 */
+	return ggc->lines[(u8)offset].direction ? 1 : 0;
 }
 
 static int gb_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
@@ -483,6 +891,11 @@ static int gb_gpio_get(struct gpio_chip *chip, unsigned offset)
 	int ret;
 
 	which = (u8)offset;
+
+	/* An output line is at whatever value we last drove it to */
+	if (ggc->lines[which].cached)
+		return ggc->lines[which].value;
+
 	ret = gb_gpio_get_value_operation(ggc, which);
 	if (ret)
 		return ret;
@@ -497,6 +910,61 @@ static void gb_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
 	gb_gpio_set_value_operation(ggc, (u8)offset, !!value);
 }
 
+#ifdef GPIO_CHIP_HAS_GET_MULTIPLE
+static int gb_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+				unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	DECLARE_BITMAP(fetch, GB_GPIO_LINES_MAX);
+	unsigned int count = ggc->line_max + 1;
+	unsigned int which;
+
+	/* Only lines whose value we don't already know go over the wire */
+	bitmap_zero(fetch, GB_GPIO_LINES_MAX);
+	for_each_set_bit(which, mask, count) {
+		if (!ggc->lines[which].cached) {
+			set_bit(which, fetch);
+			continue;
+		}
+
+		if (ggc->lines[which].value)
+			set_bit(which, bits);
+		else
+			clear_bit(which, bits);
+	}
+
+	if (bitmap_empty(fetch, count))
+		return 0;
+
+	return gb_gpio_get_values_operation(ggc, fetch, bits);
+}
+#endif
+
+#ifdef GPIO_CHIP_HAS_SET_MULTIPLE
+static void gb_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+				 unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	DECLARE_BITMAP(set, GB_GPIO_LINES_MAX);
+	unsigned int count = ggc->line_max + 1;
+	unsigned int which;
+
+	bitmap_zero(set, GB_GPIO_LINES_MAX);
+	for_each_set_bit(which, mask, count) {
+		if (ggc->lines[which].direction == 1) {
+			dev_warn(gb_gpiochip_dev(chip),
+				 "refusing to set value of input gpio %u\n",
+				 which);
+			continue;
+		}
+		set_bit(which, set);
+	}
+
+	if (!bitmap_empty(set, count))
+		gb_gpio_set_values_operation(ggc, set, bits);
+}
+#endif
+
 static int gb_gpio_set_debounce(struct gpio_chip *chip, unsigned offset,
 					unsigned debounce)
 {
@@ -515,6 +983,51 @@ static void gb_gpio_dbg_show(struct seq_file *s, struct gpio_chip *chip)
 	return;	/* XXX */
 }
 
+static bool gb_gpio_get_direction_fill(struct gb_gpio_controller *ggc,
+				       unsigned int i, void *request,
+				       void *data)
+{
+	struct gb_gpio_get_direction_request *req = request;
+
+	req->which = i;
+
+	return true;
+}
+
+static void gb_gpio_get_direction_done(struct gb_gpio_controller *ggc,
+				       const void *request,
+				       const void *response, void *data)
+{
+	const struct gb_gpio_get_direction_request *req = request;
+	const struct gb_gpio_get_direction_response *resp = response;
+	u8 direction = resp->direction;
+
+	if (direction && direction != 1) {
+		dev_warn(&ggc->connection->dev,
+			 "gpio %u direction was %u (should be 0 or 1)\n",
+			 req->which, direction);
+	}
+	ggc->lines[req->which].direction = direction ? 1 : 0;
+}
+
+static const struct gb_gpio_batch_ops gb_gpio_get_direction_ops = {
+	.type		= GB_GPIO_TYPE_GET_DIRECTION,
+	.request_size	= sizeof(struct gb_gpio_get_direction_request),
+	.response_size	= sizeof(struct gb_gpio_get_direction_response),
+	.fill		= gb_gpio_get_direction_fill,
+	.done		= gb_gpio_get_direction_done,
+};
+
+/*
+ * Read the direction of all lines, everything sent in a single
+ * batch so this costs one round trip rather than one per line.
+ */
+static int gb_gpio_get_directions(struct gb_gpio_controller *ggc)
+{
+	return gb_gpio_batch_run(ggc, &gb_gpio_get_direction_ops,
+				 ggc->line_max + 1, NULL);
+}
+
 static int gb_gpio_controller_setup(struct gb_gpio_controller *ggc)
 {
 	int ret;
@@ -534,6 +1047,13 @@ static int gb_gpio_controller_setup(struct gb_gpio_controller *ggc)
 	if (!ggc->lines)
 		return -ENOMEM;
 
+	/* Learn the initial direction of every line */
+	ret = gb_gpio_get_directions(ggc);
+	if (ret) {
+		kfree(ggc->lines);
+		ggc->lines = NULL;
+	}
+
 	return ret;
 }
 
@@ -685,6 +1205,8 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	if (!ggc)
 		return -ENOMEM;
 	ggc->connection = connection;
+	mutex_init(&ggc->irq_lock);
+	INIT_WORK(&ggc->irq_work, gb_gpio_irq_work);
 	connection->private = ggc;
 
 	ret = gb_gpio_controller_setup(ggc);
@@ -696,12 +1218,14 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	irqc->irq_mask = gb_gpio_mask_irq;
 	irqc->irq_unmask = gb_gpio_unmask_irq;
 	irqc->irq_set_type = gb_gpio_irq_set_type;
+	irqc->irq_bus_lock = gb_gpio_irq_bus_lock;
+	irqc->irq_bus_sync_unlock = gb_gpio_irq_bus_sync_unlock;
 	irqc->name = "greybus_gpio";
 
 	gpio = &ggc->chip;
 
 	gpio->label = "greybus_gpio";
-	gpio->dev = &connection->dev;
+	gb_gpiochip_set_dev(gpio, &connection->dev);
 	gpio->owner = THIS_MODULE;
 
 	gpio->request = gb_gpio_request;
@@ -711,6 +1235,12 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	gpio->direction_output = gb_gpio_direction_output;
 	gpio->get = gb_gpio_get;
 	gpio->set = gb_gpio_set;
+#ifdef GPIO_CHIP_HAS_GET_MULTIPLE
+	gpio->get_multiple = gb_gpio_get_multiple;
+#endif
+#ifdef GPIO_CHIP_HAS_SET_MULTIPLE
+	gpio->set_multiple = gb_gpio_set_multiple;
+#endif
 	gpio->set_debounce = gb_gpio_set_debounce;
 	gpio->dbg_show = gb_gpio_dbg_show;
 	gpio->to_irq = gb_gpio_to_irq;
@@ -751,6 +1281,7 @@ static void gb_gpio_connection_exit(struct gb_connection *connection)
 		return;
 
 	gb_gpio_irqchip_remove(ggc);
+	cancel_work_sync(&ggc->irq_work);
 	gb_gpiochip_remove(&ggc->chip);
 	/* kref_put(ggc->connection) */
 	kfree(ggc->lines);
@@ -765,6 +1296,7 @@ static struct gb_protocol gpio_protocol = {
 	.connection_init	= gb_gpio_connection_init,
 	.connection_exit	= gb_gpio_connection_exit,
 	.request_recv		= gb_gpio_request_recv,
+	.flags			= GB_PROTOCOL_HIGHPRI,
 };
 
 int gb_gpio_protocol_init(void)
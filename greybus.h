@@ -19,6 +19,8 @@
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/idr.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include "kernel_ver.h"
 #include "greybus_id.h"
@@ -70,6 +72,7 @@
 
 struct greybus_host_device;
 struct svc_msg;
+struct gb_svc_ring;
 
 /*
  * When the Greybus code allocates a buffer it sets aside bytes
@@ -82,6 +85,17 @@ struct svc_msg;
 /* Buffers allocated from the host driver will be aligned to this multiple */
 #define GB_BUFFER_ALIGN	sizeof(u32)
 
+/*
+ * A host device may pack several messages, possibly for different
+ * CPorts, into a single "framed" transfer.  Each message in such a
+ * transfer is preceded by this header, and is padded so the next
+ * header starts on a GB_BUFFER_ALIGN boundary.
+ */
+struct gb_frame_hdr {
+	__le16	cport_id;
+	__le16	size;		/* Size of the message following */
+} __packed;
+
 /* Greybus "Host driver" structure, needed by a host controller driver to be
  * able to handle both SVC control as well as "real" greybus messages
  */
@@ -93,6 +107,9 @@ struct greybus_host_driver {
 	void (*buffer_cancel)(void *cookie);
 	int (*submit_svc)(struct svc_msg *svc_msg,
 			    struct greybus_host_device *hd);
+
+	/* Optional, required to use greybus_data_rcvd_lent() */
+	void (*buffer_release)(struct greybus_host_device *hd, void *cookie);
 };
 
 struct greybus_host_device {
@@ -103,12 +120,30 @@ struct greybus_host_device {
 	struct list_head interfaces;
 	struct list_head connections;
 	struct ida cport_id_map;
+	/* Indexed by hd_cport_id, for the receive path */
+	struct gb_connection __rcu *connections_by_cport[HOST_DEV_CPORT_ID_MAX];
 	u8 device_id;
 
 	/* Host device buffer constraints */
 	size_t buffer_headroom;
 	size_t buffer_size_max;
 
+	struct dentry *debugfs_dentry;
+	struct gb_svc_ring *svc_ring;	/* Incoming SVC messages */
+
+	/*
+	 * No more than tx_max buffers (if it's set) are handed to the
+	 * host driver at a time; the rest wait, queued per connection,
+	 * and go out highest priority first (see gb_hd_buffer_send()).
+	 * The host driver sets tx_max before creating any connection.
+	 */
+	unsigned int tx_max;
+	spinlock_t tx_lock;		/* protects the fields below */
+	unsigned int tx_inflight;
+	unsigned int tx_queued;
+	struct list_head tx_queues[GB_TX_PRIORITIES];	/* connections */
+	struct work_struct tx_work;
+
 	/* Private data for the host driver */
 	unsigned long hd_priv[0] __aligned(sizeof(s64));
 };
@@ -158,9 +193,15 @@ int greybus_disabled(void);
 int greybus_svc_in(struct greybus_host_device *hd, u8 *data, int length);
 int gb_ap_init(void);
 void gb_ap_exit(void);
+int gb_ap_hd_init(struct greybus_host_device *hd);
+void gb_ap_hd_exit(struct greybus_host_device *hd);
 int gb_debugfs_init(void);
 void gb_debugfs_cleanup(void);
 struct dentry *gb_debugfs_get(void);
+void gb_debugfs_hd_add(struct greybus_host_device *hd);
+void gb_debugfs_hd_remove(struct greybus_host_device *hd);
+void gb_debugfs_connection_add(struct gb_connection *connection);
+void gb_debugfs_connection_remove(struct gb_connection *connection);
 
 extern struct bus_type greybus_bus_type;
 
@@ -0,0 +1,107 @@
+/*
+ * Greybus raw CPort interface, shared with user space.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+
+#ifndef __GREYBUS_RAW_H
+#define __GREYBUS_RAW_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Each connection using the raw protocol gets a character device,
+ * /dev/gb_raw<N>, through which user space sends requests on the
+ * connection and gets their responses, along with any requests the
+ * module sends, without a system call per message.
+ *
+ * It is used through a single shared memory area, mapped at offset
+ * 0 with the size (and the offset of everything in it) given by
+ * GB_RAW_IOC_INFO.  The area holds:
+ *
+ *  - struct gb_raw_rings: the head and tail of both rings
+ *  - the submission ring: sq_entries struct gb_raw_sqe
+ *  - the completion ring: cq_entries struct gb_raw_cqe
+ *  - slot_count request/response slots of slot_size bytes each
+ *  - cq_entries receive buffers of slot_size bytes each
+ *
+ * Ring sizes are powers of two, and head and tail are free running
+ * counters; entry (counter & (entries - 1)) is the one they refer
+ * to.  User space adds requests at the submission ring's tail and
+ * the kernel takes them from its head; the kernel adds completions
+ * at the completion ring's tail and user space takes them from its
+ * head.  Only the producer of a ring writes its tail, and only the
+ * consumer its head.
+ *
+ * A request's payload is put in a slot before it's submitted, and
+ * its response payload replaces it there once it completes.  The
+ * response must be exactly response_size bytes.  Requests are sent
+ * (all those in the submission ring) by GB_RAW_IOC_SUBMIT, which
+ * returns how many were taken.  It takes no more than there is room
+ * for in the completion ring, counting those already in flight.
+ *
+ * poll() reports POLLIN while the completion ring isn't empty, and
+ * POLLHUP once the connection has gone away.
+ *
+ * Requests from the module are reported in the completion ring too,
+ * flagged GB_RAW_CQE_REQUEST, with their payload in the receive
+ * buffer of the same index as the completion.  They have already
+ * been answered (with no payload) by then, or with -ENOSPC if there
+ * was no room to report them, in which case rings->dropped counts
+ * them.
+ */
+
+struct gb_raw_ring {
+	__u32	head;
+	__u32	tail;
+};
+
+struct gb_raw_rings {
+	struct gb_raw_ring	sq;
+	struct gb_raw_ring	cq;
+	__u32			dropped;
+	__u32			pad;
+};
+
+struct gb_raw_sqe {
+	__u64	user_data;		/* Returned in the completion */
+	__u32	slot;
+	__u16	request_size;
+	__u16	response_size;
+	__u16	timeout_ms;		/* 0 for the connection's timeout */
+	__u8	type;
+	__u8	pad[5];
+};
+
+#define GB_RAW_CQE_REQUEST	0x01	/* Request from the module */
+
+struct gb_raw_cqe {
+	__u64	user_data;		/* 0 for a request from the module */
+	__s32	status;			/* 0 or a negative errno */
+	__u16	size;			/* Response (or request) payload */
+	__u8	type;
+	__u8	flags;
+};
+
+struct gb_raw_info {
+	__u32	size;			/* Of the shared memory area */
+	__u32	sq_entries;
+	__u32	cq_entries;
+	__u32	slot_count;
+	__u32	slot_size;
+	__u32	sq_offset;
+	__u32	cq_offset;
+	__u32	slots_offset;
+	__u32	rx_offset;
+	__u32	pad;
+};
+
+#define GB_RAW_IOC_MAGIC	'G'
+#define GB_RAW_IOC_INFO		_IOR(GB_RAW_IOC_MAGIC, 0, struct gb_raw_info)
+#define GB_RAW_IOC_SUBMIT	_IO(GB_RAW_IOC_MAGIC, 1)
+
+#endif /* __GREYBUS_RAW_H */
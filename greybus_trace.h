@@ -0,0 +1,164 @@
+/*
+ * Greybus tracepoints
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM greybus
+
+#if !defined(_TRACE_GREYBUS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_GREYBUS_H
+
+#include <linux/tracepoint.h>
+
+struct gb_operation;
+struct gb_message;
+struct greybus_host_device;
+
+/*
+ * Events in the life of an operation.  The request payload size is
+ * recorded; the result is -EBADR until one has been set.
+ */
+DECLARE_EVENT_CLASS(gb_operation,
+
+	TP_PROTO(struct gb_operation *operation),
+
+	TP_ARGS(operation),
+
+	TP_STRUCT__entry(
+		__field(u16, cport_id)
+		__field(u16, id)
+		__field(u8, type)
+		__field(size_t, size)
+		__field(int, errno)
+	),
+
+	TP_fast_assign(
+		__entry->cport_id = operation->connection->hd_cport_id;
+		__entry->id = operation->id;
+		__entry->type = operation->type;
+		__entry->size = operation->request->payload_size;
+		__entry->errno = operation->errno;
+	),
+
+	TP_printk("cport_id=%hu id=%hu type=0x%02x size=%zu errno=%d",
+		  __entry->cport_id, __entry->id, __entry->type,
+		  __entry->size, __entry->errno)
+);
+
+#define DEFINE_OPERATION_EVENT(name)					\
+		DEFINE_EVENT(gb_operation, name,			\
+				TP_PROTO(struct gb_operation *operation), \
+				TP_ARGS(operation))
+
+/* An outgoing operation has been created */
+DEFINE_OPERATION_EVENT(gb_operation_create);
+
+/* An outgoing operation's request is about to be sent */
+DEFINE_OPERATION_EVENT(gb_operation_request_send);
+
+/* An incoming request has arrived and its operation been created */
+DEFINE_OPERATION_EVENT(gb_operation_recv_request);
+
+/* The response to an outgoing operation has arrived */
+DEFINE_OPERATION_EVENT(gb_operation_recv_response);
+
+/* An operation's callback (or request handler) is about to be run */
+DEFINE_OPERATION_EVENT(gb_operation_work);
+
+/* The last reference to an operation has been dropped */
+DEFINE_OPERATION_EVENT(gb_operation_destroy);
+
+#undef DEFINE_OPERATION_EVENT
+
+/*
+ * Events for a message (request or response) handed to, and
+ * reported back by, the host driver.  The size includes the header.
+ */
+DECLARE_EVENT_CLASS(gb_message,
+
+	TP_PROTO(struct gb_message *message, int status),
+
+	TP_ARGS(message, status),
+
+	TP_STRUCT__entry(
+		__field(u16, cport_id)
+		__field(u16, id)
+		__field(u8, type)
+		__field(u16, size)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->cport_id = message->operation->connection->hd_cport_id;
+		__entry->id = le16_to_cpu(message->header->operation_id);
+		__entry->type = message->header->type;
+		__entry->size = le16_to_cpu(message->header->size);
+		__entry->status = status;
+	),
+
+	TP_printk("cport_id=%hu id=%hu type=0x%02x size=%hu status=%d",
+		  __entry->cport_id, __entry->id, __entry->type,
+		  __entry->size, __entry->status)
+);
+
+/* A message is about to be passed to the host driver's buffer_send() */
+DEFINE_EVENT(gb_message, gb_message_send,
+	TP_PROTO(struct gb_message *message, int status),
+	TP_ARGS(message, status)
+);
+
+/* The host driver reported a message sent (greybus_data_sent()) */
+DEFINE_EVENT(gb_message, gb_message_sent,
+	TP_PROTO(struct gb_message *message, int status),
+	TP_ARGS(message, status)
+);
+
+/*
+ * A host driver is submitting a message buffer to its hardware.
+ * The buffer starts with the message header.
+ */
+TRACE_EVENT(gb_host_buffer_send,
+
+	TP_PROTO(struct greybus_host_device *hd, u16 cport_id,
+		 void *buffer, size_t size),
+
+	TP_ARGS(hd, cport_id, buffer, size),
+
+	TP_STRUCT__entry(
+		__string(hd, dev_name(hd->parent))
+		__field(u16, cport_id)
+		__field(u16, id)
+		__field(u8, type)
+		__field(size_t, size)
+	),
+
+	TP_fast_assign(
+		struct gb_operation_msg_hdr *header = buffer;
+
+		__assign_str(hd, dev_name(hd->parent));
+		__entry->cport_id = cport_id;
+		__entry->id = le16_to_cpu(header->operation_id);
+		__entry->type = header->type;
+		__entry->size = size;
+	),
+
+	TP_printk("hd=%s cport_id=%hu id=%hu type=0x%02x size=%zu",
+		  __get_str(hd), __entry->cport_id, __entry->id,
+		  __entry->type, __entry->size)
+);
+
+#endif /* _TRACE_GREYBUS_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE greybus_trace
+
+#include <trace/define_trace.h>
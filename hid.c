@@ -13,6 +13,7 @@
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "greybus.h"
 
@@ -81,7 +82,25 @@ struct gb_hid {
 
 	unsigned int			bufsize;
 	char				*inbuf;
+
+	/* Output reports, sent without waiting (see gb_hid_output_queue()) */
+	struct list_head		outputs;
+};
+
+/*
+ * The most recent output report set for a report id.  Only the latest
+ * one is sure to be sent (see struct gb_operation_latest).
+ */
+struct gb_hid_output {
+	struct list_head		links;
+	struct gb_hid			*ghid;
+	u8				report_id;
+	struct gb_operation_latest	latest;
+	unsigned int			len;		/* under latest.lock */
+	u8				buf[0];		/* ghid->bufsize */
 };
+#define latest_to_gb_hid_output(l) \
+	container_of(l, struct gb_hid_output, latest)
 
 static DEFINE_MUTEX(gb_hid_open_mutex);
 
@@ -148,6 +167,88 @@ static int gb_hid_set_report(struct gb_hid *ghid, u8 report_type, u8 report_id,
 	return ret;
 }
 
+/* A SET_REPORT sized for the output report set now */
+static struct gb_operation *
+gb_hid_output_create(struct gb_operation_latest *latest)
+{
+	struct gb_hid_output *output = latest_to_gb_hid_output(latest);
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&latest->lock, flags);
+	len = output->len;
+	spin_unlock_irqrestore(&latest->lock, flags);
+
+	return gb_operation_create(latest->connection, GB_HID_TYPE_SET_REPORT,
+			sizeof(struct gb_hid_set_report_request) + len, 0);
+}
+
+static bool gb_hid_output_fill(struct gb_operation_latest *latest,
+			       struct gb_operation *operation)
+{
+	struct gb_hid_output *output = latest_to_gb_hid_output(latest);
+	struct gb_hid_set_report_request *request;
+
+	/* Start over if a report of another size has replaced it */
+	if (operation->request->payload_size != sizeof(*request) + output->len)
+		return false;
+
+	request = operation->request->payload;
+	request->report_type = GB_HID_OUTPUT_REPORT;
+	request->report_id = output->report_id;
+	memcpy(request->report, output->buf, output->len);
+
+	return true;
+}
+
+static const struct gb_operation_latest_ops gb_hid_output_ops = {
+	.create		= gb_hid_output_create,
+	.fill		= gb_hid_output_fill,
+};
+
+/*
+ * Queue an output report.  It goes out right away unless one for the
+ * same report id is still in flight, in which case it is sent once
+ * that completes, if no later one has replaced it by then.  Returns
+ * the number of bytes queued, or -ENOENT if the report id isn't one
+ * we have a buffer for.
+ */
+static int gb_hid_output_queue(struct gb_hid *ghid, u8 report_id,
+			       unsigned char *buf, int len)
+{
+	struct gb_hid_output *output;
+	unsigned long flags;
+	bool send;
+
+	if (len > ghid->bufsize)
+		return -EINVAL;
+
+	/* The list only changes as the device is started or stopped */
+	list_for_each_entry(output, &ghid->outputs, links) {
+		if (output->report_id == report_id)
+			goto found;
+	}
+
+	return -ENOENT;
+
+found:
+	spin_lock_irqsave(&output->latest.lock, flags);
+	memcpy(output->buf, buf, len);
+	output->len = len;
+	send = gb_operation_latest_set(&output->latest);
+	spin_unlock_irqrestore(&output->latest.lock, flags);
+
+	if (send)
+		gb_operation_latest_send(&output->latest);
+
+	return len;
+}
+
+/*
+ * Input reports are delivered before the response is sent, straight
+ * from the request buffer.  The connection's work queue is a high
+ * priority one, and output report completions on it don't block.
+ */
 static void gb_hid_irq_handler(u8 type, struct gb_operation *op)
 {
 	struct gb_connection *connection = op->connection;
@@ -160,20 +261,29 @@ static void gb_hid_irq_handler(u8 type, struct gb_operation *op)
 		return;
 	}
 
-	ret = gb_operation_response_send(op, 0);
-	if (ret)
-		pr_err("%s: error %d sending response status %d\n", __func__,
-		       ret, 0);
+	if (op->request->payload_size < 2) {
+		pr_err("%s: report too short.\n", __func__);
+		goto out;
+	}
 
 	size = request->report[0] | request->report[1] << 8;
-	if (!size) {
-		pr_err("%s: size can't be zero.\n", __func__);
-		return;
+	if (size < 2) {
+		pr_err("%s: size %d too small.\n", __func__, size);
+		goto out;
+	}
+	if (size > op->request->payload_size) {
+		pr_err("%s: report size %d too big.\n", __func__, size);
+		goto out;
 	}
 
 	if (test_bit(GB_HID_STARTED, &ghid->flags))
 		hid_input_report(ghid->hid, HID_INPUT_REPORT,
 				 request->report + 2, size - 2, 1);
+out:
+	ret = gb_operation_response_send(op, 0);
+	if (ret)
+		pr_err("%s: error %d sending response status %d\n", __func__,
+		       ret, 0);
 }
 
 
@@ -198,19 +308,54 @@ static void gb_hid_find_max_report(struct hid_device *hid, unsigned int type,
 
 static void gb_hid_free_buffers(struct gb_hid *ghid)
 {
+	struct gb_hid_output *output, *next;
+
+	/* Drop whatever is pending, and wait for what's in flight */
+	list_for_each_entry(output, &ghid->outputs, links)
+		gb_operation_latest_drop(&output->latest);
+	list_for_each_entry(output, &ghid->outputs, links)
+		gb_operation_latest_flush(&output->latest);
+
+	list_for_each_entry_safe(output, next, &ghid->outputs, links) {
+		list_del(&output->links);
+		kfree(output);
+	}
+
 	kfree(ghid->inbuf);
 	ghid->inbuf = NULL;
 	ghid->bufsize = 0;
 }
 
+/*
+ * Besides the input buffer, every output report gets a buffer of
+ * its own for gb_hid_output_queue().
+ */
 static int gb_hid_alloc_buffers(struct gb_hid *ghid, size_t bufsize)
 {
+	struct hid_report_enum *report_enum;
+	struct gb_hid_output *output;
+	struct hid_report *report;
+
 	ghid->inbuf = kzalloc(bufsize, GFP_KERNEL);
 	if (!ghid->inbuf)
 		return -ENOMEM;
 
 	ghid->bufsize = bufsize;
 
+	report_enum = &ghid->hid->report_enum[HID_OUTPUT_REPORT];
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		output = kzalloc(sizeof(*output) + bufsize, GFP_KERNEL);
+		if (!output) {
+			gb_hid_free_buffers(ghid);
+			return -ENOMEM;
+		}
+		output->ghid = ghid;
+		output->report_id = report->id;
+		gb_operation_latest_init(&output->latest, ghid->connection,
+					 &gb_hid_output_ops);
+		list_add_tail(&output->links, &ghid->outputs);
+	}
+
 	return 0;
 }
 
@@ -278,7 +423,15 @@ static int __gb_hid_output_raw_report(struct hid_device *hid, __u8 *buf,
 		len--;
 	}
 
+	/* Output reports (LEDs, force feedback) don't need waiting for */
+	if (report_type == HID_OUTPUT_REPORT) {
+		ret = gb_hid_output_queue(ghid, report_id, buf, len);
+		if (ret != -ENOENT)
+			goto out;
+	}
+
 	ret = gb_hid_set_report(ghid, report_type, report_id, buf, len);
+out:
 	if (report_id && ret >= 0)
 		ret++; /* add report_id to the number of transfered bytes */
 
@@ -500,6 +653,7 @@ static int gb_hid_connection_init(struct gb_connection *connection)
 	connection->private = ghid;
 	ghid->connection = connection;
 	ghid->hid = hid;
+	INIT_LIST_HEAD(&ghid->outputs);
 
 	ret = gb_hid_init(ghid);
 	if (ret)
@@ -535,6 +689,7 @@ static struct gb_protocol hid_protocol = {
 	.connection_init	= gb_hid_connection_init,
 	.connection_exit	= gb_hid_connection_exit,
 	.request_recv		= gb_hid_irq_handler,
+	.flags			= GB_PROTOCOL_HIGHPRI,
 };
 
 int gb_hid_protocol_init(void)
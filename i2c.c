@@ -10,10 +10,31 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/semaphore.h>
 #include <linux/i2c.h>
 
 #include "greybus.h"
 
+/*
+ * Off by default: see gb_i2c_master_xfer() for what turning it on
+ * gives up.
+ */
+static bool i2c_concurrent;
+module_param(i2c_concurrent, bool, 0644);
+MODULE_PARM_DESC(i2c_concurrent,
+		 "Let i2c transfers from different clients be in flight together (unsafe for clients that lock the adapter)");
+
+/*
+ * Transfers from different clients of an adapter are sent without
+ * waiting for each other, up to this many at a time.  Each of them
+ * can use one of the adapter's cached operations if its request and
+ * response fit in GB_I2C_CACHED_PAYLOAD_MAX bytes.
+ */
+#define	GB_I2C_INFLIGHT_MAX		4
+#define	GB_I2C_CACHED_PAYLOAD_MAX	\
+	(64 - sizeof(struct gb_operation_msg_hdr))
+
 struct gb_i2c_device {
 	struct gb_connection	*connection;
 	u8			version_major;
@@ -23,6 +44,10 @@ struct gb_i2c_device {
 	u16			timeout_msec;
 	u8			retries;
 
+	struct semaphore	inflight;	/* GB_I2C_INFLIGHT_MAX slots */
+	spinlock_t		ops_lock;	/* protects ops[] */
+	struct gb_operation	*ops[GB_I2C_INFLIGHT_MAX];	/* idle */
+
 	struct i2c_adapter	adapter;
 };
 
@@ -162,10 +187,84 @@ gb_i2c_fill_transfer_op(struct gb_i2c_transfer_op *op, struct i2c_msg *msg)
 	op->size = cpu_to_le16(msg->len);
 }
 
+/*
+ * Get an operation for a transfer, either one of the adapter's idle
+ * cached operations or (if none is left, or the transfer is too big
+ * for one) a new one.
+ */
+static struct gb_operation *
+gb_i2c_operation_get(struct gb_i2c_device *gb_i2c_dev, size_t request_size,
+			size_t response_size)
+{
+	struct gb_connection *connection = gb_i2c_dev->connection;
+	struct gb_operation *operation = NULL;
+	int i;
+
+	if (request_size > GB_I2C_CACHED_PAYLOAD_MAX ||
+	    response_size > GB_I2C_CACHED_PAYLOAD_MAX)
+		return gb_operation_create(connection, GB_I2C_TYPE_TRANSFER,
+					   request_size, response_size);
+
+	spin_lock(&gb_i2c_dev->ops_lock);
+	for (i = 0; i < GB_I2C_INFLIGHT_MAX; i++) {
+		if (gb_i2c_dev->ops[i]) {
+			operation = gb_i2c_dev->ops[i];
+			gb_i2c_dev->ops[i] = NULL;
+			break;
+		}
+	}
+	spin_unlock(&gb_i2c_dev->ops_lock);
+
+	/* Make sure a new one is big enough to be cached afterward */
+	if (!operation) {
+		operation = gb_operation_create(connection,
+						GB_I2C_TYPE_TRANSFER,
+						GB_I2C_CACHED_PAYLOAD_MAX,
+						GB_I2C_CACHED_PAYLOAD_MAX);
+		if (!operation)
+			return NULL;
+	}
+
+	if (gb_operation_reuse(operation, request_size, response_size)) {
+		gb_operation_destroy(operation);
+		return NULL;
+	}
+
+	return operation;
+}
+
+/*
+ * Done with a transfer's operation.  A small one is kept for reuse
+ * as long as the module answered it; otherwise it's destroyed.
+ */
+static void gb_i2c_operation_put(struct gb_i2c_device *gb_i2c_dev,
+				struct gb_operation *operation, bool answered)
+{
+	int i;
+
+	if (answered && operation->request->payload_size <=
+						GB_I2C_CACHED_PAYLOAD_MAX &&
+	    operation->response->payload_size <= GB_I2C_CACHED_PAYLOAD_MAX) {
+		spin_lock(&gb_i2c_dev->ops_lock);
+		for (i = 0; i < GB_I2C_INFLIGHT_MAX; i++) {
+			if (!gb_i2c_dev->ops[i]) {
+				gb_i2c_dev->ops[i] = operation;
+				operation = NULL;
+				break;
+			}
+		}
+		spin_unlock(&gb_i2c_dev->ops_lock);
+	}
+
+	if (operation)
+		gb_operation_destroy(operation);
+}
+
 static struct gb_operation *
-gb_i2c_operation_create(struct gb_connection *connection,
+gb_i2c_operation_create(struct gb_i2c_device *gb_i2c_dev,
 			struct i2c_msg *msgs, u32 msg_count)
 {
+	struct gb_connection *connection = gb_i2c_dev->connection;
 	struct gb_i2c_transfer_request *request;
 	struct gb_operation *operation;
 	struct gb_i2c_transfer_op *op;
@@ -173,7 +272,7 @@ gb_i2c_operation_create(struct gb_connection *connection,
 	u32 data_out_size = 0;
 	u32 data_in_size = 0;
 	size_t request_size;
-	void *data;
+	u8 *data;
 	u16 op_count;
 	u32 i;
 
@@ -200,31 +299,26 @@ gb_i2c_operation_create(struct gb_connection *connection,
 	request_size += data_out_size;
 
 	/* Response consists only of incoming data */
-	operation = gb_operation_create(connection, GB_I2C_TYPE_TRANSFER,
-				request_size, data_in_size);
+	operation = gb_i2c_operation_get(gb_i2c_dev, request_size,
+					 data_in_size);
 	if (!operation)
 		return NULL;
 
+	/*
+	 * Fill in the ops array, and the outgoing data, which starts
+	 * after the last op, in a single pass.
+	 */
 	request = operation->request->payload;
 	request->op_count = cpu_to_le16(op_count);
-	/* Fill in the ops array */
 	op = &request->ops[0];
+	data = (u8 *)&request->ops[msg_count];
 	msg = msgs;
-	for (i = 0; i < msg_count; i++)
-		gb_i2c_fill_transfer_op(op++, msg++);
-
-	if (!data_out_size)
-		return operation;
-
-	/* Copy over the outgoing data; it starts after the last op */
-	data = op;
-	msg = msgs;
-	for (i = 0; i < msg_count; i++) {
+	for (i = 0; i < msg_count; i++, msg++) {
+		gb_i2c_fill_transfer_op(op++, msg);
 		if (!(msg->flags & I2C_M_RD)) {
 			memcpy(data, msg->buf, msg->len);
 			data += msg->len;
 		}
-		msg++;
 	}
 
 	return operation;
@@ -257,16 +351,25 @@ static bool gb_i2c_expected_transfer_error(int errno)
 	return errno == -EAGAIN || errno == -ENODEV;
 }
 
+/*
+ * Concurrent callers (see gb_i2c_master_xfer()) each send their
+ * transfer without waiting for the others, up to GB_I2C_INFLIGHT_MAX
+ * at a time.  Any more wait here for one of those to complete.
+ */
 static int gb_i2c_transfer_operation(struct gb_i2c_device *gb_i2c_dev,
 					struct i2c_msg *msgs, u32 msg_count)
 {
-	struct gb_connection *connection = gb_i2c_dev->connection;
 	struct gb_operation *operation;
+	bool answered;
 	int ret;
 
-	operation = gb_i2c_operation_create(connection, msgs, msg_count);
-	if (!operation)
-		return -ENOMEM;
+	down(&gb_i2c_dev->inflight);
+
+	operation = gb_i2c_operation_create(gb_i2c_dev, msgs, msg_count);
+	if (!operation) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	ret = gb_operation_request_send_sync(operation);
 	if (!ret) {
@@ -278,7 +381,12 @@ static int gb_i2c_transfer_operation(struct gb_i2c_device *gb_i2c_dev,
 	} else if (!gb_i2c_expected_transfer_error(ret)) {
 		pr_err("transfer operation failed (%d)\n", ret);
 	}
-	gb_operation_destroy(operation);
+
+	/* The expected errors are reported by the module */
+	answered = ret >= 0 || gb_i2c_expected_transfer_error(ret);
+	gb_i2c_operation_put(gb_i2c_dev, operation, answered);
+out:
+	up(&gb_i2c_dev->inflight);
 
 	return ret;
 }
@@ -287,10 +395,29 @@ static int gb_i2c_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
 		int msg_count)
 {
 	struct gb_i2c_device *gb_i2c_dev;
+	int ret;
 
 	gb_i2c_dev = i2c_get_adapdata(adap);
 
-	return gb_i2c_transfer_operation(gb_i2c_dev, msgs, msg_count);
+	if (!i2c_concurrent)
+		return gb_i2c_transfer_operation(gb_i2c_dev, msgs, msg_count);
+
+	/*
+	 * The i2c core holds the adapter lock while we're called, so
+	 * every other client waits for our round trip to the module.
+	 * With i2c_concurrent on, the lock is let go of until we're
+	 * done, so others' transfers queue up behind ours.  That lock
+	 * belongs to our caller, though: a client that takes it with
+	 * i2c_lock_adapter() to do several __i2c_transfer() calls in a
+	 * row, or a multi-message SMBus sequence, can then have another
+	 * client's transfer slip in between its own.  Only turn it on
+	 * when no client of the adapter does that.
+	 */
+	gb_i2c_unlock_adapter(adap);
+	ret = gb_i2c_transfer_operation(gb_i2c_dev, msgs, msg_count);
+	gb_i2c_lock_adapter(adap);
+
+	return ret;
 }
 
 #if 0
@@ -361,6 +488,8 @@ static int gb_i2c_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 
 	gb_i2c_dev->connection = connection;	/* refcount? */
+	sema_init(&gb_i2c_dev->inflight, GB_I2C_INFLIGHT_MAX);
+	spin_lock_init(&gb_i2c_dev->ops_lock);
 	connection->private = gb_i2c_dev;
 
 	ret = gb_i2c_device_setup(gb_i2c_dev);
@@ -395,8 +524,13 @@ out_err:
 static void gb_i2c_connection_exit(struct gb_connection *connection)
 {
 	struct gb_i2c_device *gb_i2c_dev = connection->private;
+	int i;
 
 	i2c_del_adapter(&gb_i2c_dev->adapter);
+	for (i = 0; i < GB_I2C_INFLIGHT_MAX; i++) {
+		if (gb_i2c_dev->ops[i])
+			gb_operation_destroy(gb_i2c_dev->ops[i]);
+	}
 	/* kref_put(gb_i2c_dev->connection) */
 	kfree(gb_i2c_dev);
 }
@@ -0,0 +1,170 @@
+/*
+ * Greybus i2c benchmark
+ *
+ * Measures how many transfers a second an i2c adapter gets through
+ * with several clients using it at once.  Each of the configured
+ * number of threads does a register read (a one byte write followed
+ * by a read) of a device on the adapter, over and over.  The result
+ * is logged, and left in the transfers_per_sec parameter, when the
+ * module is loaded.
+ *
+ * Paired with the fake host device, which answers for an i2c module
+ * without any hardware, this shows what the Greybus i2c driver
+ * itself gets through.  With N the number of the adapter it names
+ * "Greybus i2c adapter":
+ *
+ *   insmod gb-fake-hd.ko protocol=3 delay_us=100
+ *   insmod gb-i2c-bench.ko bus=N threads=4
+ *   cat /sys/module/gb_i2c_bench/parameters/transfers_per_sec
+ *
+ * Comparing runs with gb-phy's i2c_concurrent parameter off (the
+ * default) and on shows what keeping transfers in flight together
+ * gains; see i2c.c for why it isn't on by default.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/i2c.h>
+
+#define I2C_BENCH_SIZE_MAX	32
+#define I2C_BENCH_THREADS_MAX	64
+
+static int bus = -1;
+module_param(bus, int, 0444);
+MODULE_PARM_DESC(bus, "Number of the i2c adapter to benchmark");
+
+static ushort addr = 0x50;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "Address of the i2c device to read from");
+
+static uint size = 2;
+module_param(size, uint, 0444);
+MODULE_PARM_DESC(size, "Bytes read by each transfer");
+
+static uint threads = 1;
+module_param(threads, uint, 0444);
+MODULE_PARM_DESC(threads, "Number of clients doing transfers at once");
+
+static uint iterations = 1000;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "Transfers done by each client");
+
+static uint transfers_per_sec;
+module_param(transfers_per_sec, uint, 0444);
+MODULE_PARM_DESC(transfers_per_sec, "Result: transfers completed per second");
+
+static uint errors;
+module_param(errors, uint, 0444);
+MODULE_PARM_DESC(errors, "Result: transfers that failed");
+
+struct i2c_bench_client {
+	struct i2c_adapter	*adapter;
+	struct completion	done;
+	unsigned int		errors;
+};
+
+static int i2c_bench_thread(void *data)
+{
+	struct i2c_bench_client *client = data;
+	u8 buf[I2C_BENCH_SIZE_MAX];
+	u8 reg = 0;
+	struct i2c_msg msgs[] = {
+		{
+			.addr	= addr,
+			.len	= sizeof(reg),
+			.buf	= &reg,
+		},
+		{
+			.addr	= addr,
+			.flags	= I2C_M_RD,
+			.len	= size,
+			.buf	= buf,
+		},
+	};
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs)) !=
+							ARRAY_SIZE(msgs))
+			client->errors++;
+	}
+
+	complete_and_exit(&client->done, 0);
+}
+
+static int __init i2c_bench_init(void)
+{
+	struct i2c_bench_client *clients;
+	struct i2c_adapter *adapter;
+	struct task_struct *task;
+	unsigned int started;
+	unsigned int count;
+	ktime_t start;
+	s64 elapsed;
+	int retval = 0;
+	unsigned int i;
+
+	if (bus < 0 || !size || size > I2C_BENCH_SIZE_MAX ||
+	    !threads || threads > I2C_BENCH_THREADS_MAX || !iterations)
+		return -EINVAL;
+
+	adapter = i2c_get_adapter(bus);
+	if (!adapter)
+		return -ENODEV;
+
+	clients = kcalloc(threads, sizeof(*clients), GFP_KERNEL);
+	if (!clients) {
+		retval = -ENOMEM;
+		goto out_put;
+	}
+
+	start = ktime_get();
+	for (started = 0; started < threads; started++) {
+		clients[started].adapter = adapter;
+		init_completion(&clients[started].done);
+		task = kthread_run(i2c_bench_thread, &clients[started],
+				   "gb_i2c_bench/%u", started);
+		if (IS_ERR(task)) {
+			retval = PTR_ERR(task);
+			break;
+		}
+	}
+
+	errors = 0;
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&clients[i].done);
+		errors += clients[i].errors;
+	}
+	elapsed = max_t(s64, ktime_us_delta(ktime_get(), start), 1);
+	kfree(clients);
+	if (retval)
+		goto out_put;
+
+	count = threads * iterations - errors;
+	transfers_per_sec = div64_u64((u64)count * USEC_PER_SEC, elapsed);
+	pr_info("i2c-%d: %u clients, %u transfers in %lld us: %u transfers/s, %u errors\n",
+		bus, threads, count, elapsed, transfers_per_sec, errors);
+
+out_put:
+	i2c_put_adapter(adapter);
+
+	return retval;
+}
+
+static void __exit i2c_bench_exit(void)
+{
+}
+
+module_init(i2c_bench_init);
+module_exit(i2c_bench_exit);
+
+MODULE_LICENSE("GPL v2");
@@ -71,6 +71,149 @@ static inline void gb_gpiochip_remove(struct gpio_chip *chip)
 }
 #endif
 
+/*
+ * The device a gpio_chip belongs to was renamed from dev to parent in
+ * 4.5, so get at it through these.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+static inline struct device *gb_gpiochip_dev(struct gpio_chip *chip)
+{
+	return chip->parent;
+}
+
+static inline void gb_gpiochip_set_dev(struct gpio_chip *chip,
+				       struct device *dev)
+{
+	chip->parent = dev;
+}
+#else
+static inline struct device *gb_gpiochip_dev(struct gpio_chip *chip)
+{
+	return chip->dev;
+}
+
+static inline void gb_gpiochip_set_dev(struct gpio_chip *chip,
+				       struct device *dev)
+{
+	chip->dev = dev;
+}
+#endif
+
+/*
+ * gpio_chip picked up a set_multiple callback in 3.19, and the matching
+ * get_multiple in 4.10.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+#define GPIO_CHIP_HAS_SET_MULTIPLE
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define GPIO_CHIP_HAS_GET_MULTIPLE
+#endif
+
+/*
+ * The lock i2c_transfer() holds on an adapter is taken and dropped
+ * with i2c_lock_bus() and i2c_unlock_bus() since 4.7.  Before that it
+ * was i2c_lock_adapter() and i2c_unlock_adapter().
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define gb_i2c_lock_adapter(adap)	i2c_lock_bus(adap, I2C_LOCK_SEGMENT)
+#define gb_i2c_unlock_adapter(adap)	i2c_unlock_bus(adap, I2C_LOCK_SEGMENT)
+#else
+#define gb_i2c_lock_adapter(adap)	i2c_lock_adapter(adap)
+#define gb_i2c_unlock_adapter(adap)	i2c_unlock_adapter(adap)
+#endif
+
+/*
+ * reinit_completion() showed up in 3.13; before that there was only
+ * the INIT_COMPLETION() macro doing the same thing.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#include <linux/completion.h>
+
+static inline void reinit_completion(struct completion *x)
+{
+	x->done = 0;
+}
+#endif
+
+/*
+ * pwm_ops picked up an apply callback, setting the whole state of a
+ * pwm at once, in 4.7.  The pwm core then uses it in place of the
+ * separate config, polarity and enable/disable callbacks.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define PWM_OPS_HAS_APPLY
+#endif
+
+/*
+ * sg_pcopy_to_buffer() and sg_pcopy_from_buffer(), copying part way
+ * into a scatterlist, showed up in 3.11, so add them here.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
+
+static inline size_t gb_sg_pcopy_buffer(struct scatterlist *sgl,
+					unsigned int nents, void *buf,
+					size_t buflen, off_t skip,
+					bool to_buffer)
+{
+	unsigned int sg_flags = SG_MITER_ATOMIC;
+	struct sg_mapping_iter miter;
+	unsigned long flags;
+	size_t offset = 0;
+	size_t len;
+	void *addr;
+
+	if (to_buffer)
+		sg_flags |= SG_MITER_FROM_SG;
+	else
+		sg_flags |= SG_MITER_TO_SG;
+
+	sg_miter_start(&miter, sgl, nents, sg_flags);
+
+	local_irq_save(flags);
+
+	while (offset < buflen && sg_miter_next(&miter)) {
+		if (skip >= miter.length) {
+			skip -= miter.length;
+			continue;
+		}
+
+		addr = miter.addr + skip;
+		len = min(miter.length - (size_t)skip, buflen - offset);
+		skip = 0;
+
+		if (to_buffer)
+			memcpy(buf + offset, addr, len);
+		else
+			memcpy(addr, buf + offset, len);
+
+		offset += len;
+	}
+
+	sg_miter_stop(&miter);
+
+	local_irq_restore(flags);
+
+	return offset;
+}
+
+static inline size_t sg_pcopy_to_buffer(struct scatterlist *sgl,
+					unsigned int nents, void *buf,
+					size_t buflen, off_t skip)
+{
+	return gb_sg_pcopy_buffer(sgl, nents, buf, buflen, skip, true);
+}
+
+static inline size_t sg_pcopy_from_buffer(struct scatterlist *sgl,
+					  unsigned int nents, void *buf,
+					  size_t buflen, off_t skip)
+{
+	return gb_sg_pcopy_buffer(sgl, nents, buf, buflen, skip, false);
+}
+#endif
+
 /*
  * ATTRIBUTE_GROUPS showed up in 3.11-rc2, but we need to build on 3.10, so add
  * it here.
@@ -86,4 +229,35 @@ static const struct attribute_group *name##_groups[] = {	\
 }
 #endif
 
+/*
+ * tty_buffer_space_avail() showed up in 3.14.  Before that, reserve the
+ * room with tty_buffer_request_room() instead, which hands back how much
+ * of it the flip buffers could take; that space is then used by
+ * the next tty_insert_flip_string() calls.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+#define gb_tty_buffer_space_avail(port, max)			\
+	min_t(int, max, tty_buffer_space_avail(port))
+#else
+#define gb_tty_buffer_space_avail(port, max)			\
+	tty_buffer_request_room(port, max)
+#endif
+
+/*
+ * ktime_after() and ktime_before() showed up in 3.17, so add them here.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,17,0)
+#include <linux/ktime.h>
+
+static inline bool ktime_after(const ktime_t cmp1, const ktime_t cmp2)
+{
+	return ktime_to_ns(cmp1) > ktime_to_ns(cmp2);
+}
+
+static inline bool ktime_before(const ktime_t cmp1, const ktime_t cmp2)
+{
+	return ktime_to_ns(cmp1) < ktime_to_ns(cmp2);
+}
+#endif
+
 #endif	/* __GREYBUS_KERNEL_VER_H */
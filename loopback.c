@@ -0,0 +1,695 @@
+/*
+ * Greybus Loopback protocol driver.
+ *
+ * Generates request/response traffic on a connection and measures
+ * how the operation core and the link behave under it.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "greybus.h"
+
+/* Version of the Greybus loopback protocol we support */
+#define	GB_LOOPBACK_VERSION_MAJOR		0x00
+#define	GB_LOOPBACK_VERSION_MINOR		0x01
+
+/* Modules reporting this minor version or later take fragments */
+#define	GB_LOOPBACK_VERSION_MINOR_FRAGMENTS	0x02
+
+/* Greybus loopback request types */
+#define	GB_LOOPBACK_TYPE_INVALID		0x00
+#define	GB_LOOPBACK_TYPE_PROTOCOL_VERSION	0x01
+#define	GB_LOOPBACK_TYPE_PING			0x02	/* no payload */
+#define	GB_LOOPBACK_TYPE_TRANSFER		0x03	/* payload echoed */
+#define	GB_LOOPBACK_TYPE_SINK			0x04	/* payload dropped */
+#define	GB_LOOPBACK_TYPE_RESPONSE		0x80	/* OR'd with rest */
+
+/* Benchmark modes */
+#define LOOPBACK_MODE_SYNC		0
+#define LOOPBACK_MODE_ASYNC		1
+
+/* Limits on the benchmark configuration */
+#define LOOPBACK_ITERATIONS_MAX		100000
+#define LOOPBACK_CONCURRENCY_MAX	64
+#define LOOPBACK_STEPS_MAX		64
+
+/*
+ * The results of one step of a benchmark run (all of it, unless the
+ * payload size is swept).  Latencies are in microseconds, throughput
+ * counts payload bytes in both directions.
+ */
+struct gb_loopback_stats {
+	u32	size;
+	u32	count;
+	u32	errors;
+	u32	ops_per_sec;
+	u64	bytes_per_sec;
+	u32	latency_min;
+	u32	latency_avg;
+	u32	latency_max;
+	u32	latency_p50;
+	u32	latency_p90;
+	u32	latency_p99;
+};
+
+struct gb_loopback {
+	struct gb_connection	*connection;
+	u8			version_major;
+	u8			version_minor;
+
+	struct mutex		mutex;		/* configuration, task */
+	struct task_struct	*task;
+	wait_queue_head_t	wq;
+
+	/* Configuration, fixed while a run is going */
+	int			type;
+	int			mode;
+	int			size;
+	int			size_max;
+	int			size_step;
+	int			concurrency;
+	int			iteration_max;
+
+	/* The step being run */
+	spinlock_t		lock;		/* samples, count, errors */
+	u32			*samples;
+	unsigned int		count;
+	unsigned int		errors;
+	unsigned int		outstanding;	/* protected by lock */
+
+	/* Results, protected by lock */
+	struct gb_loopback_stats steps[LOOPBACK_STEPS_MAX];
+	unsigned int		step_count;
+	bool			running;
+
+	struct dentry		*debugfs_dentry;
+};
+
+/* Define get_version() routine */
+define_get_version(gb_loopback, LOOPBACK);
+
+/* Payloads too big for the host device are sent in fragments */
+static int gb_loopback_payload_max(struct gb_loopback *gb)
+{
+	return gb_operation_payload_max(gb->connection);
+}
+
+static struct gb_operation *
+gb_loopback_operation_create(struct gb_loopback *gb, int size)
+{
+	struct gb_operation *operation;
+	size_t request_size = 0;
+	size_t response_size = 0;
+
+	switch (gb->type) {
+	case GB_LOOPBACK_TYPE_TRANSFER:
+		response_size = size;
+		/* fall through */
+	case GB_LOOPBACK_TYPE_SINK:
+		request_size = size;
+		break;
+	}
+
+	operation = gb_operation_create(gb->connection, gb->type,
+					request_size, response_size);
+	if (operation && request_size)
+		memset(operation->request->payload, 0, request_size);
+
+	return operation;
+}
+
+/*
+ * Record the outcome of a completed operation.  The latency is the
+ * time from the request being handed to the host driver to the
+ * operation completing.
+ */
+static void gb_loopback_record(struct gb_loopback *gb,
+			       struct gb_operation *operation)
+{
+	int ret = gb_operation_result(operation);
+	s64 latency;
+
+	if (!ret && gb->type == GB_LOOPBACK_TYPE_TRANSFER &&
+	    memcmp(operation->request->payload,
+		   operation->response->payload,
+		   operation->request->payload_size))
+		ret = -EREMOTEIO;
+
+	latency = ktime_us_delta(ktime_get(), operation->send_time);
+
+	spin_lock(&gb->lock);
+	if (ret)
+		gb->errors++;
+	else if (gb->count < gb->iteration_max)
+		gb->samples[gb->count++] = clamp_t(s64, latency, 0, U32_MAX);
+	spin_unlock(&gb->lock);
+}
+
+static void gb_loopback_error(struct gb_loopback *gb)
+{
+	spin_lock(&gb->lock);
+	gb->errors++;
+	spin_unlock(&gb->lock);
+}
+
+static int gb_loopback_send_sync(struct gb_loopback *gb, int size)
+{
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_loopback_operation_create(gb, size);
+	if (!operation)
+		return -ENOMEM;
+
+	/* Anything but a dead connection is just counted as an error */
+	ret = gb_operation_request_send_sync(operation);
+	if (ret != -ENOTCONN) {
+		gb_loopback_record(gb, operation);
+		ret = 0;
+	}
+
+	gb_operation_put(operation);
+
+	return ret;
+}
+
+static void gb_loopback_callback(struct gb_operation *operation)
+{
+	struct gb_loopback *gb = operation->connection->private;
+
+	gb_loopback_record(gb, operation);
+	gb_operation_put(operation);
+
+	/* Woken under the lock, as once none are left gb can be freed */
+	spin_lock(&gb->lock);
+	gb->outstanding--;
+	wake_up(&gb->wq);
+	spin_unlock(&gb->lock);
+}
+
+static unsigned int gb_loopback_outstanding(struct gb_loopback *gb)
+{
+	unsigned int outstanding;
+
+	spin_lock(&gb->lock);
+	outstanding = gb->outstanding;
+	spin_unlock(&gb->lock);
+
+	return outstanding;
+}
+
+static int gb_loopback_send_async(struct gb_loopback *gb, int size)
+{
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_loopback_operation_create(gb, size);
+	if (!operation)
+		return -ENOMEM;
+
+	spin_lock(&gb->lock);
+	gb->outstanding++;
+	spin_unlock(&gb->lock);
+	ret = gb_operation_request_send(operation, gb_loopback_callback);
+	if (ret) {
+		spin_lock(&gb->lock);
+		gb->outstanding--;
+		spin_unlock(&gb->lock);
+		gb_operation_put(operation);
+	}
+
+	return ret;
+}
+
+static int gb_loopback_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Summarize the samples gathered for one step, taking elapsed usecs */
+static void gb_loopback_calculate(struct gb_loopback *gb,
+				  struct gb_loopback_stats *stats,
+				  int size, u64 elapsed)
+{
+	unsigned int count = gb->count;
+	u64 sum = 0;
+	u64 bytes;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->size = size;
+	stats->count = count;
+	stats->errors = gb->errors;
+	if (!count)
+		return;
+
+	sort(gb->samples, count, sizeof(*gb->samples), gb_loopback_cmp, NULL);
+	for (i = 0; i < count; i++)
+		sum += gb->samples[i];
+
+	stats->latency_min = gb->samples[0];
+	stats->latency_max = gb->samples[count - 1];
+	stats->latency_avg = div_u64(sum, count);
+	stats->latency_p50 = gb->samples[(count - 1) * 50 / 100];
+	stats->latency_p90 = gb->samples[(count - 1) * 90 / 100];
+	stats->latency_p99 = gb->samples[(count - 1) * 99 / 100];
+
+	switch (gb->type) {
+	case GB_LOOPBACK_TYPE_TRANSFER:
+		bytes = (u64)count * size * 2;
+		break;
+	case GB_LOOPBACK_TYPE_SINK:
+		bytes = (u64)count * size;
+		break;
+	default:
+		bytes = 0;
+		break;
+	}
+
+	elapsed = max_t(u64, elapsed, 1);
+	stats->ops_per_sec = div64_u64((u64)count * USEC_PER_SEC, elapsed);
+	stats->bytes_per_sec = div64_u64(bytes * USEC_PER_SEC, elapsed);
+}
+
+/* Run iteration_max operations of the given payload size */
+static int gb_loopback_step(struct gb_loopback *gb, int size)
+{
+	struct gb_loopback_stats stats;
+	ktime_t start;
+	int concurrency = gb->concurrency;
+	int ret = 0;
+	int i;
+
+	spin_lock(&gb->lock);
+	gb->count = 0;
+	gb->errors = 0;
+	spin_unlock(&gb->lock);
+
+	start = ktime_get();
+	for (i = 0; i < gb->iteration_max; i++) {
+		if (kthread_should_stop())
+			break;
+
+		if (gb->mode == LOOPBACK_MODE_SYNC) {
+			ret = gb_loopback_send_sync(gb, size);
+		} else {
+			wait_event(gb->wq,
+				   gb_loopback_outstanding(gb) < concurrency ||
+				   kthread_should_stop());
+			if (kthread_should_stop())
+				break;
+			ret = gb_loopback_send_async(gb, size);
+		}
+		if (ret) {
+			gb_loopback_error(gb);
+			break;
+		}
+	}
+	wait_event(gb->wq, !gb_loopback_outstanding(gb));
+
+	gb_loopback_calculate(gb, &stats, size,
+			      ktime_us_delta(ktime_get(), start));
+
+	spin_lock(&gb->lock);
+	gb->steps[gb->step_count++] = stats;
+	spin_unlock(&gb->lock);
+
+	return ret;
+}
+
+/*
+ * Runs the configured benchmark, stepping the payload size from
+ * size to size_max if a size step is set.  Once done the thread
+ * waits for gb_loopback_stop() to reap it.
+ */
+static int gb_loopback_thread(void *data)
+{
+	struct gb_loopback *gb = data;
+	int size = gb->size;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		ret = gb_loopback_step(gb, size);
+		if (ret) {
+			dev_err(&gb->connection->dev,
+				"loopback failed at size %d: %d\n", size, ret);
+			break;
+		}
+		if (!gb->size_step || size + gb->size_step > gb->size_max)
+			break;
+		size += gb->size_step;
+	}
+
+	spin_lock(&gb->lock);
+	gb->running = false;
+	spin_unlock(&gb->lock);
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* Stop the benchmark thread, if any.  Called with the mutex held. */
+static void gb_loopback_stop(struct gb_loopback *gb)
+{
+	if (!gb->task)
+		return;
+
+	kthread_stop(gb->task);
+	gb->task = NULL;
+}
+
+/* Start a new benchmark run.  Called with the mutex held. */
+static int gb_loopback_start(struct gb_loopback *gb)
+{
+	struct task_struct *task;
+	int payload_max = gb_loopback_payload_max(gb);
+	int size_max;
+
+	gb_loopback_stop(gb);
+
+	size_max = max(gb->size, gb->size_step ? gb->size_max : 0);
+	if (gb->type != GB_LOOPBACK_TYPE_PING && size_max > payload_max)
+		return -EMSGSIZE;
+	if (gb->size_step &&
+	    (gb->size_max - gb->size) / gb->size_step >= LOOPBACK_STEPS_MAX)
+		return -EINVAL;
+
+	gb->step_count = 0;
+	gb->running = true;
+	task = kthread_run(gb_loopback_thread, gb, "gb_loopback_%s",
+			   dev_name(&gb->connection->dev));
+	if (IS_ERR(task)) {
+		gb->running = false;
+		return PTR_ERR(task);
+	}
+	gb->task = task;
+
+	return 0;
+}
+
+/*
+ * The configuration attributes.  Writing type starts a run (0 stops
+ * a run that is going); everything else takes effect on the next.
+ */
+#define gb_loopback_config_attr(field, min, max)			\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct gb_connection *connection = to_gb_connection(dev);	\
+	struct gb_loopback *gb = connection->private;			\
+									\
+	return sprintf(buf, "%d\n", gb->field);				\
+}									\
+static ssize_t field##_store(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	struct gb_connection *connection = to_gb_connection(dev);	\
+	struct gb_loopback *gb = connection->private;			\
+	int val;							\
+	int ret;							\
+									\
+	ret = kstrtoint(buf, 10, &val);					\
+	if (ret)							\
+		return ret;						\
+	if (val < (min) || val > (max))					\
+		return -EINVAL;						\
+									\
+	mutex_lock(&gb->mutex);						\
+	if (gb->task) {							\
+		mutex_unlock(&gb->mutex);				\
+		return -EBUSY;						\
+	}								\
+	gb->field = val;						\
+	mutex_unlock(&gb->mutex);					\
+									\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(field)
+
+gb_loopback_config_attr(mode, LOOPBACK_MODE_SYNC, LOOPBACK_MODE_ASYNC);
+gb_loopback_config_attr(size, 0, INT_MAX);
+gb_loopback_config_attr(size_max, 0, INT_MAX);
+gb_loopback_config_attr(size_step, 0, INT_MAX);
+gb_loopback_config_attr(concurrency, 1, LOOPBACK_CONCURRENCY_MAX);
+gb_loopback_config_attr(iteration_max, 1, LOOPBACK_ITERATIONS_MAX);
+
+static ssize_t type_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	struct gb_loopback *gb = connection->private;
+
+	return sprintf(buf, "%d\n", gb->task ? gb->type : 0);
+}
+
+static ssize_t type_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	struct gb_loopback *gb = connection->private;
+	int val;
+	int ret;
+
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	switch (val) {
+	case 0:
+	case GB_LOOPBACK_TYPE_PING:
+	case GB_LOOPBACK_TYPE_TRANSFER:
+	case GB_LOOPBACK_TYPE_SINK:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&gb->mutex);
+	if (val) {
+		gb->type = val;
+		ret = gb_loopback_start(gb);
+	} else {
+		gb_loopback_stop(gb);
+	}
+	mutex_unlock(&gb->mutex);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(type);
+
+static ssize_t running_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct gb_connection *connection = to_gb_connection(dev);
+	struct gb_loopback *gb = connection->private;
+
+	return sprintf(buf, "%d\n", gb->running);
+}
+static DEVICE_ATTR_RO(running);
+
+/* The result attributes report the last completed step */
+#define gb_loopback_result_attr(field, format)				\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct gb_connection *connection = to_gb_connection(dev);	\
+	struct gb_loopback *gb = connection->private;			\
+	struct gb_loopback_stats stats = { 0 };				\
+									\
+	spin_lock(&gb->lock);						\
+	if (gb->step_count)						\
+		stats = gb->steps[gb->step_count - 1];			\
+	spin_unlock(&gb->lock);						\
+									\
+	return sprintf(buf, format "\n", stats.field);			\
+}									\
+static DEVICE_ATTR_RO(field)
+
+gb_loopback_result_attr(count, "%u");
+gb_loopback_result_attr(errors, "%u");
+gb_loopback_result_attr(ops_per_sec, "%u");
+gb_loopback_result_attr(bytes_per_sec, "%llu");
+gb_loopback_result_attr(latency_min, "%u");
+gb_loopback_result_attr(latency_avg, "%u");
+gb_loopback_result_attr(latency_max, "%u");
+gb_loopback_result_attr(latency_p50, "%u");
+gb_loopback_result_attr(latency_p90, "%u");
+gb_loopback_result_attr(latency_p99, "%u");
+
+static struct attribute *loopback_attrs[] = {
+	&dev_attr_type.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_size.attr,
+	&dev_attr_size_max.attr,
+	&dev_attr_size_step.attr,
+	&dev_attr_concurrency.attr,
+	&dev_attr_iteration_max.attr,
+	&dev_attr_running.attr,
+	&dev_attr_count.attr,
+	&dev_attr_errors.attr,
+	&dev_attr_ops_per_sec.attr,
+	&dev_attr_bytes_per_sec.attr,
+	&dev_attr_latency_min.attr,
+	&dev_attr_latency_avg.attr,
+	&dev_attr_latency_max.attr,
+	&dev_attr_latency_p50.attr,
+	&dev_attr_latency_p90.attr,
+	&dev_attr_latency_p99.attr,
+	NULL,
+};
+
+static const struct attribute_group loopback_group = {
+	.attrs = loopback_attrs,
+};
+
+/* One line per step of the last run; useful for payload size sweeps */
+static int gb_loopback_steps_show(struct seq_file *s, void *unused)
+{
+	struct gb_loopback *gb = s->private;
+	struct gb_loopback_stats stats;
+	unsigned int i;
+
+	seq_puts(s, "size count errors ops/s bytes/s min avg max p50 p90 p99\n");
+
+	for (i = 0; ; i++) {
+		spin_lock(&gb->lock);
+		if (i >= gb->step_count) {
+			spin_unlock(&gb->lock);
+			break;
+		}
+		stats = gb->steps[i];
+		spin_unlock(&gb->lock);
+
+		seq_printf(s, "%u %u %u %u %llu %u %u %u %u %u %u\n",
+			   stats.size, stats.count, stats.errors,
+			   stats.ops_per_sec, stats.bytes_per_sec,
+			   stats.latency_min, stats.latency_avg,
+			   stats.latency_max, stats.latency_p50,
+			   stats.latency_p90, stats.latency_p99);
+	}
+
+	return 0;
+}
+
+static int gb_loopback_steps_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_loopback_steps_show, inode->i_private);
+}
+
+static const struct file_operations gb_loopback_steps_fops = {
+	.open		= gb_loopback_steps_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int gb_loopback_connection_init(struct gb_connection *connection)
+{
+	struct gb_loopback *gb;
+	int retval;
+
+	gb = kzalloc(sizeof(*gb), GFP_KERNEL);
+	if (!gb)
+		return -ENOMEM;
+
+	gb->samples = vmalloc(LOOPBACK_ITERATIONS_MAX * sizeof(*gb->samples));
+	if (!gb->samples) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	gb->connection = connection;
+	mutex_init(&gb->mutex);
+	spin_lock_init(&gb->lock);
+	init_waitqueue_head(&gb->wq);
+	gb->type = GB_LOOPBACK_TYPE_PING;
+	gb->concurrency = 1;
+	gb->iteration_max = 1000;
+	connection->private = gb;
+
+	retval = get_version(gb);
+	if (retval)
+		goto err_free_samples;
+	if (gb->version_minor >= GB_LOOPBACK_VERSION_MINOR_FRAGMENTS)
+		connection->fragments = true;
+
+	retval = sysfs_create_group(&connection->dev.kobj, &loopback_group);
+	if (retval)
+		goto err_free_samples;
+
+	if (connection->debugfs_dentry)
+		gb->debugfs_dentry = debugfs_create_file("loopback", S_IRUGO,
+						connection->debugfs_dentry, gb,
+						&gb_loopback_steps_fops);
+
+	return 0;
+
+err_free_samples:
+	vfree(gb->samples);
+error:
+	kfree(gb);
+	return retval;
+}
+
+static void gb_loopback_connection_exit(struct gb_connection *connection)
+{
+	struct gb_loopback *gb = connection->private;
+
+	debugfs_remove(gb->debugfs_dentry);
+	sysfs_remove_group(&connection->dev.kobj, &loopback_group);
+
+	mutex_lock(&gb->mutex);
+	gb_loopback_stop(gb);
+	mutex_unlock(&gb->mutex);
+
+	vfree(gb->samples);
+	kfree(gb);
+}
+
+static struct gb_protocol loopback_protocol = {
+	.name			= "loopback",
+	.id			= GREYBUS_PROTOCOL_LOOPBACK,
+	.major			= 0,
+	.minor			= 1,
+	.connection_init	= gb_loopback_connection_init,
+	.connection_exit	= gb_loopback_connection_exit,
+	.request_recv		= NULL,	/* no incoming requests */
+};
+
+static __init int protocol_init(void)
+{
+	return gb_protocol_register(&loopback_protocol);
+}
+
+static __exit void protocol_exit(void)
+{
+	gb_protocol_deregister(&loopback_protocol);
+}
+
+module_init(protocol_init);
+module_exit(protocol_exit);
+
+MODULE_LICENSE("GPL v2");
@@ -14,33 +14,46 @@
 #include "greybus.h"
 
 /*
- * We scan the manifest once to identify where all the descriptors
- * are.  The result is a list of these manifest_desc structures.  We
- * then pick through them for what we're looking for (starting with
- * the module descriptor).  As each is processed we remove it from
- * the list.  When we're done the list should (probably) be empty.
+ * We scan the manifest once to validate it and count the descriptors
+ * it holds, then again to record where each is in an array of these
+ * manifest_desc structures.  As the array is filled in, string
+ * descriptors are indexed by string id, and CPort descriptors are
+ * chained together by the id of the bundle they belong to, so finding
+ * what we're looking for never requires another scan.  As each
+ * descriptor is processed it is marked used.  When we're done they
+ * should (probably) all have been used.
  */
 struct manifest_desc {
-	struct list_head		links;
+	struct manifest_desc		*next;	/* CPort of the same bundle */
 
 	size_t				size;
 	void				*data;
 	enum greybus_descriptor_type	type;
+	bool				used;
 };
 
-static void release_manifest_descriptor(struct manifest_desc *descriptor)
-{
-	list_del(&descriptor->links);
-	kfree(descriptor);
-}
+struct manifest_index {
+	struct manifest_desc		*descs;
+	unsigned int			count;
+	unsigned int			used;
 
-static void release_manifest_descriptors(struct gb_interface *intf)
-{
-	struct manifest_desc *descriptor;
-	struct manifest_desc *next;
+	struct manifest_desc		*module;
+	unsigned int			modules;
 
-	list_for_each_entry_safe(descriptor, next, &intf->manifest_descs, links)
-		release_manifest_descriptor(descriptor);
+	/* Indexed by string id; the first one of each id is used */
+	struct manifest_desc		*strings[U8_MAX + 1];
+	/* Indexed by bundle id, in manifest order */
+	struct manifest_desc		*cports[U8_MAX + 1];
+	struct manifest_desc		*cports_last[U8_MAX + 1];
+};
+
+static void use_manifest_descriptor(struct manifest_index *index,
+				    struct manifest_desc *descriptor)
+{
+	if (descriptor->used)
+		return;
+	descriptor->used = true;
+	index->used++;
 }
 
 /*
@@ -53,11 +66,9 @@ static void release_manifest_descriptors(struct gb_interface *intf)
  * Returns the number of bytes consumed by the descriptor, or a
  * negative errno.
  */
-static int identify_descriptor(struct gb_interface *intf,
-			       struct greybus_descriptor *desc, size_t size)
+static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
 {
 	struct greybus_descriptor_header *desc_header = &desc->header;
-	struct manifest_desc *descriptor;
 	int desc_size;
 	size_t expected_size;
 
@@ -108,16 +119,45 @@ static int identify_descriptor(struct gb_interface *intf,
 		return -EINVAL;
 	}
 
-	descriptor = kzalloc(sizeof(*descriptor), GFP_KERNEL);
-	if (!descriptor)
-		return -ENOMEM;
+	return desc_size;
+}
+
+/*
+ * Record a (validated) descriptor in the next slot of the array, and
+ * add it to the index for its type.
+ */
+static void index_descriptor(struct manifest_index *index,
+			     struct greybus_descriptor *desc)
+{
+	struct greybus_descriptor_header *desc_header = &desc->header;
+	struct manifest_desc *descriptor = &index->descs[index->count++];
+	u8 id;
 
-	descriptor->size = desc_size;
+	descriptor->size = le16_to_cpu(desc_header->size);
 	descriptor->data = (u8 *)desc + sizeof(*desc_header);
 	descriptor->type = desc_header->type;
-	list_add_tail(&descriptor->links, &intf->manifest_descs);
 
-	return desc_size;
+	switch (descriptor->type) {
+	case GREYBUS_TYPE_MODULE:
+		if (!index->modules++)
+			index->module = descriptor;
+		break;
+	case GREYBUS_TYPE_STRING:
+		id = desc->string.id;
+		if (!index->strings[id])
+			index->strings[id] = descriptor;
+		break;
+	case GREYBUS_TYPE_CPORT:
+		id = desc->cport.bundle;
+		if (index->cports_last[id])
+			index->cports_last[id]->next = descriptor;
+		else
+			index->cports[id] = descriptor;
+		index->cports_last[id] = descriptor;
+		break;
+	default:
+		break;
+	}
 }
 
 /*
@@ -131,30 +171,20 @@ static int identify_descriptor(struct gb_interface *intf,
  * Otherwise returns a pointer to a newly-allocated copy of the
  * descriptor string, or an error-coded pointer on failure.
  */
-static char *gb_string_get(struct gb_interface *intf, u8 string_id)
+static char *gb_string_get(struct manifest_index *index, u8 string_id)
 {
 	struct greybus_descriptor_string *desc_string;
 	struct manifest_desc *descriptor;
-	bool found = false;
 	char *string;
 
 	/* A zero string id means no string (but no error) */
 	if (!string_id)
 		return NULL;
 
-	list_for_each_entry(descriptor, &intf->manifest_descs, links) {
-
-		if (descriptor->type != GREYBUS_TYPE_STRING)
-			continue;
-
-		desc_string = descriptor->data;
-		if (desc_string->id == string_id) {
-			found = true;
-			break;
-		}
-	}
-	if (!found)
+	descriptor = index->strings[string_id];
+	if (!descriptor)
 		return ERR_PTR(-ENOENT);
+	desc_string = descriptor->data;
 
 	/* Allocate an extra byte so we can guarantee it's NUL-terminated */
 	string = kmemdup(&desc_string->string, (size_t)desc_string->length + 1,
@@ -164,7 +194,7 @@ static char *gb_string_get(struct gb_interface *intf, u8 string_id)
 	string[desc_string->length] = '\0';
 
 	/* Ok we've used this string, so we're done with it */
-	release_manifest_descriptor(descriptor);
+	use_manifest_descriptor(index, descriptor);
 
 	return string;
 }
@@ -174,30 +204,21 @@ static char *gb_string_get(struct gb_interface *intf, u8 string_id)
  * for the functions that use them.  Returns the number of bundles
  * set up for the given interface, or 0 if there is an error.
  */
-static u32 gb_manifest_parse_cports(struct gb_interface *intf,
+static u32 gb_manifest_parse_cports(struct manifest_index *index,
 				    struct gb_bundle *bundle)
 {
+	struct manifest_desc *descriptor;
 	u32 count = 0;
 
-	while (true) {
-		struct manifest_desc *descriptor;
-		struct greybus_descriptor_cport *desc_cport;
+	for (descriptor = index->cports[bundle->id]; descriptor;
+	     descriptor = descriptor->next) {
+		struct greybus_descriptor_cport *desc_cport = descriptor->data;
 		u8 protocol_id;
 		u16 cport_id;
-		bool found = false;
-
-		/* Find a cport descriptor */
-		list_for_each_entry(descriptor, &intf->manifest_descs, links) {
-			if (descriptor->type == GREYBUS_TYPE_CPORT) {
-				desc_cport = descriptor->data;
-				if (desc_cport->bundle == bundle->id) {
-					found = true;
-					break;
-				}
-			}
-		}
-		if (!found)
-			break;
+
+		/* Taken by an earlier bundle with the same id */
+		if (descriptor->used)
+			continue;
 
 		/* Found one.  Set up its function structure */
 		protocol_id = desc_cport->protocol_id;
@@ -206,8 +227,8 @@ static u32 gb_manifest_parse_cports(struct gb_interface *intf,
 			return 0;	/* Error */
 
 		count++;
-		/* Release the cport descriptor */
-		release_manifest_descriptor(descriptor);
+		/* Done with the cport descriptor */
+		use_manifest_descriptor(index, descriptor);
 	}
 
 	return count;
@@ -218,25 +239,19 @@ static u32 gb_manifest_parse_cports(struct gb_interface *intf,
  * structures.  Returns the number of bundles set up for the
  * given module.
  */
-static u32 gb_manifest_parse_bundles(struct gb_interface *intf)
+static u32 gb_manifest_parse_bundles(struct gb_interface *intf,
+				     struct manifest_index *index)
 {
 	u32 count = 0;
+	unsigned int i;
 
-	while (true) {
-		struct manifest_desc *descriptor;
+	for (i = 0; i < index->count; i++) {
+		struct manifest_desc *descriptor = &index->descs[i];
 		struct greybus_descriptor_interface *desc_interface;
 		struct gb_bundle *bundle;
-		bool found = false;
-
-		/* Find an bundle descriptor */
-		list_for_each_entry(descriptor, &intf->manifest_descs, links) {
-			if (descriptor->type == GREYBUS_TYPE_INTERFACE) {
-				found = true;
-				break;
-			}
-		}
-		if (!found)
-			break;
+
+		if (descriptor->type != GREYBUS_TYPE_INTERFACE)
+			continue;
 
 		/* Found one.  Set up its bundle structure*/
 		desc_interface = descriptor->data;
@@ -245,29 +260,30 @@ static u32 gb_manifest_parse_bundles(struct gb_interface *intf)
 			return 0;	/* Error */
 
 		/* Now go set up this bundle's functions and cports */
-		if (!gb_manifest_parse_cports(intf, bundle))
+		if (!gb_manifest_parse_cports(index, bundle))
 			return 0;	/* Error parsing cports */
 
 		count++;
 
 		/* Done with this bundle descriptor */
-		release_manifest_descriptor(descriptor);
+		use_manifest_descriptor(index, descriptor);
 	}
 
 	return count;
 }
 
 static bool gb_manifest_parse_module(struct gb_interface *intf,
-				     struct manifest_desc *module_desc)
+				     struct manifest_index *index)
 {
+	struct manifest_desc *module_desc = index->module;
 	struct greybus_descriptor_module *desc_module = module_desc->data;
 
 	/* Handle the strings first--they can fail */
-	intf->vendor_string = gb_string_get(intf, desc_module->vendor_stringid);
+	intf->vendor_string = gb_string_get(index, desc_module->vendor_stringid);
 	if (IS_ERR(intf->vendor_string))
 		return false;
 
-	intf->product_string = gb_string_get(intf,
+	intf->product_string = gb_string_get(index,
 					     desc_module->product_stringid);
 	if (IS_ERR(intf->product_string)) {
 		goto out_free_vendor_string;
@@ -277,11 +293,11 @@ static bool gb_manifest_parse_module(struct gb_interface *intf,
 	intf->product = le16_to_cpu(desc_module->product);
 	intf->unique_id = le64_to_cpu(desc_module->unique_id);
 
-	/* Release the module descriptor, now that we're done with it */
-	release_manifest_descriptor(module_desc);
+	/* We're done with the module descriptor now */
+	use_manifest_descriptor(index, module_desc);
 
 	/* An interface must have at least one bundle descriptor */
-	if (!gb_manifest_parse_bundles(intf)) {
+	if (!gb_manifest_parse_bundles(intf, index)) {
 		pr_err("manifest bundle descriptors not valid\n");
 		goto out_err;
 	}
@@ -306,14 +322,14 @@ out_free_vendor_string:
  * The first requirement is that the manifest's version is
  * one we can parse.
  *
- * We make an initial pass through the buffer and identify all of
- * the descriptors it contains, keeping track for each its type
- * and the location size of its data in the buffer.
+ * We make an initial pass through the buffer to validate all of
+ * the descriptors it contains and count them.  A second pass then
+ * records the type and the location and size of the data of each,
+ * and indexes them.
  *
- * Next we scan the descriptors, looking for a module descriptor;
- * there must be exactly one of those.  When found, we record the
- * information it contains, and then remove that descriptor (and any
- * string descriptors it refers to) from further consideration.
+ * Next we look at the module descriptor; there must be exactly one
+ * of those.  We record the information it contains, and then mark
+ * that descriptor (and any string descriptors it refers to) used.
  *
  * After that we look for the interface's bundles--there must be at
  * least one of those.
@@ -325,16 +341,12 @@ bool gb_manifest_parse(struct gb_interface *intf, void *data, size_t size)
 	struct greybus_manifest *manifest;
 	struct greybus_manifest_header *header;
 	struct greybus_descriptor *desc;
-	struct manifest_desc *descriptor;
-	struct manifest_desc *module_desc = NULL;
+	struct manifest_index *index;
+	unsigned int count = 0;
 	u16 manifest_size;
-	u32 found = 0;
+	size_t remaining;
 	bool result;
 
-	/* Manifest descriptor list should be empty here */
-	if (WARN_ON(!list_empty(&intf->manifest_descs)))
-		return false;
-
 	/* we have to have at _least_ the manifest header */
 	if (size <= sizeof(manifest->header)) {
 		pr_err("short manifest (%zu)\n", size);
@@ -359,47 +371,60 @@ bool gb_manifest_parse(struct gb_interface *intf, void *data, size_t size)
 		return false;
 	}
 
-	/* OK, find all the descriptors */
+	/* OK, validate all the descriptors */
 	desc = (struct greybus_descriptor *)(header + 1);
-	size -= sizeof(*header);
-	while (size) {
+	remaining = size - sizeof(*header);
+	while (remaining) {
 		int desc_size;
 
-		desc_size = identify_descriptor(intf, desc, size);
+		desc_size = identify_descriptor(desc, remaining);
 		if (desc_size <= 0) {
 			if (!desc_size)
 				pr_err("zero-sized manifest descriptor\n");
-			result = false;
-			goto out;
+			return false;
 		}
 		desc = (struct greybus_descriptor *)((char *)desc + desc_size);
-		size -= desc_size;
+		remaining -= desc_size;
+		count++;
 	}
 
-	/* There must be a single module descriptor */
-	list_for_each_entry(descriptor, &intf->manifest_descs, links) {
-		if (descriptor->type == GREYBUS_TYPE_MODULE)
-			if (!found++)
-				module_desc = descriptor;
+	index = kzalloc(sizeof(*index), GFP_KERNEL);
+	if (!index)
+		return false;
+	index->descs = kcalloc(count, sizeof(*index->descs), GFP_KERNEL);
+	if (!index->descs) {
+		result = false;
+		goto out;
+	}
+
+	/* Now record and index them */
+	desc = (struct greybus_descriptor *)(header + 1);
+	while (index->count < count) {
+		index_descriptor(index, desc);
+		desc = (struct greybus_descriptor *)((char *)desc +
+					le16_to_cpu(desc->header.size));
 	}
-	if (found != 1) {
+
+	/* There must be a single module descriptor */
+	if (index->modules != 1) {
 		pr_err("manifest must have 1 module descriptor (%u found)\n",
-			found);
+			index->modules);
 		result = false;
 		goto out;
 	}
 
 	/* Parse the module manifest, starting with the module descriptor */
-	result = gb_manifest_parse_module(intf, module_desc);
+	result = gb_manifest_parse_module(intf, index);
 
 	/*
 	 * We really should have no remaining descriptors, but we
 	 * don't know what newer format manifests might leave.
 	 */
-	if (result && !list_empty(&intf->manifest_descs))
+	if (result && index->used != index->count)
 		pr_info("excess descriptors in module manifest\n");
 out:
-	release_manifest_descriptors(intf);
+	kfree(index->descs);
+	kfree(index);
 
 	return result;
 }
@@ -9,13 +9,22 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/workqueue.h>
+#include <linux/idr.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 
 #include "greybus.h"
+#include "greybus_trace.h"
 
-/* The default amount of time a request is given to complete */
-#define OPERATION_TIMEOUT_DEFAULT	1000	/* milliseconds */
+/*
+ * Bounds on the timeout used in adaptive mode, and the number of
+ * round trip samples required before it is used
+ */
+#define OPERATION_TIMEOUT_ADAPTIVE_MIN	10	/* milliseconds */
+#define OPERATION_RTT_SAMPLES_MIN	8
 
 /*
  * XXX This needs to be coordinated with host driver parameters
@@ -23,49 +32,65 @@
  */
 #define GB_OPERATION_MESSAGE_SIZE_MAX	4096
 
-static struct kmem_cache *gb_operation_cache;
-static struct kmem_cache *gb_simple_message_cache;
-
-/* Workqueue to handle Greybus operation completions. */
-static struct workqueue_struct *gb_operation_workqueue;
+/*
+ * Messages are limited to this size (header included) on connections
+ * that allow fragments (see GB_OPERATION_FLAG_FRAGMENT).  Those too
+ * big for the message pools are kmalloc()ed.
+ */
+#define GB_OPERATION_FRAGMENTED_SIZE_MAX	(32 * 1024)
 
-/* Protects the cookie representing whether a message is in flight */
-static DEFINE_MUTEX(gb_message_mutex);
+/*
+ * No more than this many incoming requests are reassembled from
+ * fragments on a connection at a time, and one whose fragments
+ * haven't all arrived within the timeout is dropped.
+ */
+#define GB_OPERATION_PARTIAL_MAX		4
+#define GB_OPERATION_PARTIAL_TIMEOUT		1000	/* milliseconds */
 
 /*
- * All operation messages (both requests and responses) begin with
- * a header that encodes the size of the message (header included).
- * This header also contains a unique identifier, that associates a
- * response message with its operation.  The header contains an
- * operation type field, whose interpretation is dependent on what
- * type of protocol is used over the connection.  The high bit
- * (0x80) of the operation type field is used to indicate whether
- * the message is a request (clear) or a response (set).
- *
- * Response messages include an additional result byte, which
- * communicates the result of the corresponding request.  A zero
- * result value means the operation completed successfully.  Any
- * other value indicates an error; in this case, the payload of the
- * response message (if any) is ignored.  The result byte must be
- * zero in the header for a request message.
- *
- * The wire format for all numeric fields in the header is little
- * endian.  Any operation-specific data begins immediately after the
- * header, and is 64-bit aligned.
+ * Number of operations and of messages in each size class kept in
+ * reserve, so incoming requests (allocated in interrupt context)
+ * can still be received when memory is tight.
  */
-struct gb_operation_msg_hdr {
-	__le16	size;		/* Size in bytes of header + payload */
-	__le16	operation_id;	/* Operation unique id */
-	__u8	type;		/* E.g GB_I2C_TYPE_* or GB_GPIO_TYPE_* */
-	__u8	result;		/* Result of request (in responses only) */
-	/* 2 bytes pad, must be zero (ignore when read) */
-} __aligned(sizeof(u64));
+#define GB_OPERATION_POOL_RESERVE	4
+
+static struct kmem_cache *gb_operation_cache;
+static mempool_t *gb_operation_pool;
 
 /*
- * Protects access to connection operations lists, as well as
- * updates to operation->errno.
+ * Message buffers are allocated from a small set of size classes,
+ * each with its own slab cache and mempool.  The size of a class is
+ * the largest message (header plus payload) it holds; every buffer
+ * also has room for the message structure and the maximum host
+ * device headroom.  The last class covers the largest message any
+ * host device can send.
  */
-static DEFINE_SPINLOCK(gb_operations_lock);
+struct gb_message_pool {
+	const char		*name;
+	size_t			size;
+	struct kmem_cache	*cache;
+	mempool_t		*pool;
+};
+
+static struct gb_message_pool gb_message_pools[] = {
+	{ "gb_message_hdr",	sizeof(struct gb_operation_msg_hdr)	},
+	{ "gb_message_64",	64					},
+	{ "gb_message_256",	256					},
+	{ "gb_message_1024",	1024					},
+	{ "gb_message_max",	GB_OPERATION_MESSAGE_SIZE_MAX		},
+};
+
+/* Find the smallest size class that holds a message of the given size */
+static struct gb_message_pool *gb_message_pool_find(size_t message_size)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_message_pools); i++)
+		if (message_size <= gb_message_pools[i].size)
+			return &gb_message_pools[i];
+
+	return NULL;
+}
 
 /*
  * Set an operation's result.
@@ -92,9 +117,13 @@ static DEFINE_SPINLOCK(gb_operations_lock);
  * Attempts to do otherwise will also record a (successful) -EILSEQ
  * operation result.
  */
+static bool gb_operation_window_put(struct gb_operation *operation);
+
 static bool gb_operation_result_set(struct gb_operation *operation, int result)
 {
+	struct gb_connection *connection = operation->connection;
 	unsigned long flags;
+	bool kick = false;
 	int prev;
 
 	if (result == -EINPROGRESS) {
@@ -105,13 +134,13 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 		 * and record an implementation error if it's
 		 * set at any other time.
 		 */
-		spin_lock_irqsave(&gb_operations_lock, flags);
+		spin_lock_irqsave(&connection->lock, flags);
 		prev = operation->errno;
 		if (prev == -EBADR)
 			operation->errno = result;
 		else
 			operation->errno = -EILSEQ;
-		spin_unlock_irqrestore(&gb_operations_lock, flags);
+		spin_unlock_irqrestore(&connection->lock, flags);
 		WARN_ON(prev != -EBADR);
 
 		return true;
@@ -129,11 +158,16 @@ static bool gb_operation_result_set(struct gb_operation *operation, int result)
 	if (WARN_ON(result == -EBADR))
 		result = -EILSEQ; /* Nobody should be setting -EBADR */
 
-	spin_lock_irqsave(&gb_operations_lock, flags);
+	spin_lock_irqsave(&connection->lock, flags);
 	prev = operation->errno;
-	if (prev == -EINPROGRESS)
+	if (prev == -EINPROGRESS) {
 		operation->errno = result;	/* First and final result */
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+		kick = gb_operation_window_put(operation);
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	if (kick)
+		schedule_work(&connection->window_work);
 
 	return prev == -EINPROGRESS;
 }
@@ -153,17 +187,376 @@ gb_operation_find(struct gb_connection *connection, u16 operation_id)
 {
 	struct gb_operation *operation;
 	unsigned long flags;
-	bool found = false;
 
-	spin_lock_irqsave(&gb_operations_lock, flags);
-	list_for_each_entry(operation, &connection->operations, links)
-		if (operation->id == operation_id) {
-			found = true;
+	spin_lock_irqsave(&connection->lock, flags);
+	operation = idr_find(&connection->op_idr, operation_id);
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return operation;
+}
+
+/*
+ * Assign an outgoing operation an id that is unique among the
+ * connection's outgoing operations, and record it in the
+ * connection's operation table so its response can be found.
+ * Zero is a reserved operation id.  Ids are handed out cyclically,
+ * so a stale response is unlikely to match a newer operation.
+ *
+ * Returns 0 if successful, or a negative errno otherwise.
+ */
+static int gb_operation_id_alloc(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	int id;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock_irq(&connection->lock);
+	id = idr_alloc_cyclic(&connection->op_idr, operation, 1,
+				(int)U16_MAX + 1, GFP_NOWAIT);
+	spin_unlock_irq(&connection->lock);
+	idr_preload_end();
+	if (id < 0)
+		return id;
+
+	operation->id = (u16)id;
+
+	return 0;
+}
+
+static bool gb_connection_fragments(struct gb_connection *connection)
+{
+	return connection->fragments;
+}
+
+/* The payload data of each fragment but the last of a message */
+static size_t gb_connection_fragment_data_max(struct gb_connection *connection)
+{
+	return connection->hd->buffer_size_max -
+		sizeof(struct gb_operation_msg_hdr) -
+		sizeof(struct gb_operation_fragment_hdr);
+}
+
+/*
+ * Return the largest payload a message sent on a connection can
+ * have: what fits in a host device buffer, unless the connection
+ * allows messages to be fragmented.
+ */
+size_t gb_operation_payload_max(struct gb_connection *connection)
+{
+	size_t message_size_max = connection->hd->buffer_size_max;
+
+	if (gb_connection_fragments(connection))
+		message_size_max = GB_OPERATION_FRAGMENTED_SIZE_MAX;
+
+	return message_size_max - sizeof(struct gb_operation_msg_hdr);
+}
+EXPORT_SYMBOL_GPL(gb_operation_payload_max);
+
+static struct gb_message *
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
+				size_t payload_size, gfp_t gfp_flags);
+static void gb_operation_message_free(struct gb_message *message);
+static void gb_message_sent(struct gb_message *message, int status);
+
+static void gb_message_fragments_free(struct gb_message *message)
+{
+	unsigned int i;
+
+	kfree(message->fragments_received);
+	message->fragments_received = NULL;
+	if (!message->fragments)
+		return;
+
+	for (i = 0; i < message->fragment_count; i++)
+		gb_operation_message_free(message->fragments[i]);
+	kfree(message->fragments);
+	message->fragments = NULL;
+	message->fragment_count = 0;
+}
+
+/*
+ * Split a message too big for the host device into fragments, each
+ * as big as the host device allows.
+ */
+static int gb_message_fragments_alloc(struct gb_message *message)
+{
+	struct gb_connection *connection = message->operation->connection;
+	struct gb_operation_fragment_hdr *fragment_header;
+	struct gb_message *fragment;
+	size_t data_max, offset, len;
+	unsigned int count, i;
+
+	data_max = gb_connection_fragment_data_max(connection);
+	count = DIV_ROUND_UP(message->payload_size, data_max);
+
+	message->fragments = kcalloc(count, sizeof(*message->fragments),
+					GFP_KERNEL);
+	if (!message->fragments)
+		return -ENOMEM;
+	message->fragment_count = count;
+
+	offset = 0;
+	for (i = 0; i < count; i++) {
+		len = min(message->payload_size - offset, data_max);
+		fragment = gb_operation_message_alloc(connection,
+					message->header->type,
+					sizeof(*fragment_header) + len,
+					GFP_KERNEL);
+		if (!fragment) {
+			gb_message_fragments_free(message);
+			return -ENOMEM;
+		}
+		fragment->operation = message->operation;
+		fragment->parent = message;
+		message->fragments[i] = fragment;
+
+		fragment->header->operation_id = message->header->operation_id;
+		fragment->header->result = message->header->result;
+		fragment->header->flags = GB_OPERATION_FLAG_FRAGMENT;
+
+		fragment_header = fragment->payload;
+		fragment_header->offset = cpu_to_le32(offset);
+		fragment_header->payload_size =
+					cpu_to_le32(message->payload_size);
+		memcpy(fragment_header + 1, message->payload + offset, len);
+		offset += len;
+	}
+
+	return 0;
+}
+
+static void gb_message_buffer_sent(struct gb_message *message, int status);
+static void gb_hd_tx_work(struct work_struct *work);
+static void gb_connection_window_work(struct work_struct *work);
+
+/*
+ * Transmit scheduling.  If the host device has set tx_max, once that
+ * many buffers are in flight further messages are queued on their
+ * connection, and its host device work hands them to the host driver
+ * as earlier ones are sent, highest priority connection first, in
+ * turns between connections of the same priority.  Nothing goes
+ * straight to the host driver while anything is queued, and messages
+ * of one connection are only ever sent, by either path, with its
+ * send_mutex held, so they stay in order.
+ */
+void gb_hd_tx_init(struct greybus_host_device *hd)
+{
+	int i;
+
+	spin_lock_init(&hd->tx_lock);
+	for (i = 0; i < GB_TX_PRIORITIES; i++)
+		INIT_LIST_HEAD(&hd->tx_queues[i]);
+	INIT_WORK(&hd->tx_work, gb_hd_tx_work);
+}
+
+/* Called with the host device's tx_lock held */
+static void gb_hd_tx_enqueue(struct gb_connection *connection,
+			     struct gb_message *message)
+{
+	struct greybus_host_device *hd = connection->hd;
+
+	list_add_tail(&message->tx_links, &connection->tx_queue);
+	hd->tx_queued++;
+	if (list_empty(&connection->tx_links))
+		list_add_tail(&connection->tx_links,
+			      &hd->tx_queues[connection->tx_priority]);
+}
+
+/* Called with the host device's tx_lock held */
+static void gb_hd_tx_dequeue(struct gb_connection *connection,
+			     struct gb_message *message)
+{
+	list_del_init(&message->tx_links);
+	connection->hd->tx_queued--;
+	if (list_empty(&connection->tx_queue))
+		list_del_init(&connection->tx_links);
+}
+
+/* A buffer handed to the host driver is done with */
+static void gb_hd_tx_done(struct greybus_host_device *hd)
+{
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	hd->tx_inflight--;
+	queued = hd->tx_queued;
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	if (queued)
+		schedule_work(&hd->tx_work);
+}
+
+/*
+ * Hand a message's buffer to the host driver, or queue it if the
+ * host device is busy.  Called with the connection's send_mutex
+ * held.  Returns an error only if the host driver refused it then;
+ * one refused later is reported as not sent, as if the host driver
+ * had failed to send it.
+ */
+static int gb_hd_buffer_send(struct gb_connection *connection,
+			     struct gb_message *message)
+{
+	struct greybus_host_device *hd = connection->hd;
+	size_t size = sizeof(*message->header) + message->payload_size;
+	void *cookie;
+
+	if (hd->tx_max) {
+		spin_lock_irq(&hd->tx_lock);
+		if (hd->tx_queued || hd->tx_inflight >= hd->tx_max) {
+			gb_hd_tx_enqueue(connection, message);
+			spin_unlock_irq(&hd->tx_lock);
+			return 0;
+		}
+		hd->tx_inflight++;
+		spin_unlock_irq(&hd->tx_lock);
+	}
+
+	cookie = hd->driver->buffer_send(hd, connection->hd_cport_id,
+					 message->header, size, GFP_KERNEL);
+	if (IS_ERR(cookie)) {
+		if (hd->tx_max)
+			gb_hd_tx_done(hd);
+		return PTR_ERR(cookie);
+	}
+	message->cookie = cookie;
+
+	return 0;
+}
+
+/*
+ * Cancel a message's buffer, whether it's been handed to the host
+ * driver or is still queued.  Called with the connection's
+ * send_mutex held.
+ */
+static void gb_hd_buffer_cancel(struct gb_connection *connection,
+				struct gb_message *message)
+{
+	struct greybus_host_device *hd = connection->hd;
+	bool queued;
+
+	spin_lock_irq(&hd->tx_lock);
+	queued = !list_empty(&message->tx_links);
+	if (queued)
+		gb_hd_tx_dequeue(connection, message);
+	spin_unlock_irq(&hd->tx_lock);
+
+	if (queued)
+		gb_message_buffer_sent(message, -ECANCELED);
+	else if (message->cookie)
+		hd->driver->buffer_cancel(message->cookie);
+}
+
+/*
+ * Send queued messages while the host device has room for them.
+ * A connection removed from the queues meanwhile is not destroyed
+ * before this returns (see gb_connection_destroy()).
+ */
+static void gb_hd_tx_work(struct work_struct *work)
+{
+	struct greybus_host_device *hd;
+	struct gb_connection *connection;
+	struct gb_message *message;
+	size_t size;
+	void *cookie;
+	int i;
+
+	hd = container_of(work, struct greybus_host_device, tx_work);
+	while (1) {
+		spin_lock_irq(&hd->tx_lock);
+		if (!hd->tx_queued || hd->tx_inflight >= hd->tx_max) {
+			spin_unlock_irq(&hd->tx_lock);
 			break;
 		}
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+		for (i = GB_TX_PRIORITIES - 1; i >= 0; i--) {
+			if (!list_empty(&hd->tx_queues[i]))
+				break;
+		}
+		connection = list_first_entry(&hd->tx_queues[i],
+					      struct gb_connection, tx_links);
+		list_move_tail(&connection->tx_links, &hd->tx_queues[i]);
+		spin_unlock_irq(&hd->tx_lock);
+
+		mutex_lock(&connection->send_mutex);
+		spin_lock_irq(&hd->tx_lock);
+		message = list_first_entry_or_null(&connection->tx_queue,
+						   struct gb_message, tx_links);
+		if (message) {
+			gb_hd_tx_dequeue(connection, message);
+			hd->tx_inflight++;
+		}
+		spin_unlock_irq(&hd->tx_lock);
+
+		if (message) {
+			size = sizeof(*message->header) + message->payload_size;
+			cookie = hd->driver->buffer_send(hd,
+					connection->hd_cport_id,
+					message->header, size, GFP_KERNEL);
+			if (IS_ERR(cookie)) {
+				gb_hd_tx_done(hd);
+				gb_message_buffer_sent(message,
+						       PTR_ERR(cookie));
+			} else {
+				message->cookie = cookie;
+			}
+		}
+		mutex_unlock(&connection->send_mutex);
+	}
+}
+
+void gb_connection_tx_priority_set(struct gb_connection *connection,
+				   u8 priority)
+{
+	struct greybus_host_device *hd = connection->hd;
+
+	spin_lock_irq(&hd->tx_lock);
+	connection->tx_priority = priority;
+	if (!list_empty(&connection->tx_links))
+		list_move_tail(&connection->tx_links,
+			       &hd->tx_queues[priority]);
+	spin_unlock_irq(&hd->tx_lock);
+}
+
+/*
+ * Send a message in fragments.  Once all of them have been handed
+ * back (see greybus_data_sent()) the message is done, as if it had
+ * gone in one piece.  The count of fragments pending holds an extra
+ * reference for us while we're still sending.  If a fragment can't
+ * be sent the ones already on their way are canceled, so by the
+ * time an error is returned nothing is in flight.
+ */
+static int gb_message_send_fragments(struct gb_message *message)
+{
+	struct gb_connection *connection = message->operation->connection;
+	unsigned int i, j;
+	int ret;
+
+	gb_message_fragments_free(message);	/* From an earlier send */
+	ret = gb_message_fragments_alloc(message);
+	if (ret)
+		return ret;
+
+	message->fragment_status = 0;
+	atomic_set(&message->fragments_pending, message->fragment_count + 1);
+
+	mutex_lock(&connection->send_mutex);
+	for (i = 0; i < message->fragment_count; i++) {
+		ret = gb_hd_buffer_send(connection, message->fragments[i]);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		for (j = 0; j < i; j++)
+			gb_hd_buffer_cancel(connection, message->fragments[j]);
+		atomic_sub(message->fragment_count - i,
+			   &message->fragments_pending);
+	}
+	mutex_unlock(&connection->send_mutex);
+
+	if (atomic_dec_and_test(&message->fragments_pending) && !ret)
+		gb_message_sent(message, message->fragment_status);
 
-	return found ? operation : NULL;
+	return ret;
 }
 
 static int gb_message_send(struct gb_message *message)
@@ -171,19 +564,22 @@ static int gb_message_send(struct gb_message *message)
 	size_t message_size = sizeof(*message->header) + message->payload_size;
 	struct gb_connection *connection = message->operation->connection;
 	int ret = 0;
-	void *cookie;
 
-	mutex_lock(&gb_message_mutex);
-	cookie = connection->hd->driver->buffer_send(connection->hd,
-					connection->hd_cport_id,
-					message->header,
-					message_size,
-					GFP_KERNEL);
-	if (IS_ERR(cookie))
-		ret = PTR_ERR(cookie);
-	else
-		message->cookie = cookie;
-	mutex_unlock(&gb_message_mutex);
+	trace_gb_message_send(message, 0);
+	if (message_size > connection->hd->buffer_size_max) {
+		ret = gb_message_send_fragments(message);
+		goto out;
+	}
+
+	mutex_lock(&connection->send_mutex);
+	ret = gb_hd_buffer_send(connection, message);
+	mutex_unlock(&connection->send_mutex);
+out:
+	if (!ret) {
+		gb_connection_stat_add(connection, bytes_out, message_size);
+		if (message == message->operation->request)
+			gb_connection_stat_inc(connection, requests_sent);
+	}
 
 	return ret;
 }
@@ -194,14 +590,14 @@ static int gb_message_send(struct gb_message *message)
  */
 static void gb_message_cancel(struct gb_message *message)
 {
-	mutex_lock(&gb_message_mutex);
-	if (message->cookie) {
-		struct greybus_host_device *hd;
+	struct gb_connection *connection = message->operation->connection;
+	unsigned int i;
 
-		hd = message->operation->connection->hd;
-		hd->driver->buffer_cancel(message->cookie);
-	}
-	mutex_unlock(&gb_message_mutex);
+	mutex_lock(&connection->send_mutex);
+	gb_hd_buffer_cancel(connection, message);
+	for (i = 0; i < message->fragment_count; i++)
+		gb_hd_buffer_cancel(connection, message->fragments[i]);
+	mutex_unlock(&connection->send_mutex);
 }
 
 static void gb_operation_request_handle(struct gb_operation *operation)
@@ -223,11 +619,44 @@ static void gb_operation_request_handle(struct gb_operation *operation)
 	dev_err(&operation->connection->dev,
 		"unexpected incoming request type 0x%02hhx\n", operation->type);
 	if (gb_operation_result_set(operation, -EPROTONOSUPPORT))
-		queue_work(gb_operation_workqueue, &operation->work);
+		queue_work(operation->connection->wq, &operation->work);
 	else
 		WARN(true, "failed to mark request bad\n");
 }
 
+/*
+ * Cancel an operation's pending timeout, if any, and drop the
+ * reference it held.  If the timeout handler is already running it
+ * drops that reference itself.
+ */
+static void gb_operation_timeout_cancel(struct gb_operation *operation)
+{
+	if (cancel_delayed_work(&operation->timeout_work))
+		gb_operation_put(operation);
+}
+
+/*
+ * An asynchronous operation's response didn't arrive in time.
+ * Record the timeout as its result, cancel the request if it is
+ * still being sent, and complete the operation as usual so its
+ * callback gets to see the result.  If the operation completed
+ * some other way first there's nothing to do but drop the
+ * reference held by the timeout.
+ */
+static void gb_operation_timeout(struct work_struct *work)
+{
+	struct gb_operation *operation;
+
+	operation = container_of(to_delayed_work(work), struct gb_operation,
+				 timeout_work);
+	if (gb_operation_result_set(operation, -ETIMEDOUT)) {
+		gb_connection_stat_inc(operation->connection, timeouts);
+		gb_message_cancel(operation->request);
+		queue_work(operation->connection->wq, &operation->work);
+	}
+	gb_operation_put(operation);
+}
+
 /*
  * Complete an operation in non-atomic context.  For incoming
  * requests, the callback function is the request handler, and
@@ -243,6 +672,8 @@ static void gb_operation_work(struct work_struct *work)
 	struct gb_operation *operation;
 
 	operation = container_of(work, struct gb_operation, work);
+	gb_operation_timeout_cancel(operation);
+	trace_gb_operation_work(operation);
 	if (operation->callback) {
 		operation->callback(operation);
 		operation->callback = NULL;
@@ -282,6 +713,10 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
 	message->header = header;
 	message->payload = payload_size ? header + 1 : NULL;
 	message->payload_size = payload_size;
+	message->received = 0;
+	kfree(message->fragments_received);	/* Sized for an old payload */
+	message->fragments_received = NULL;
+	INIT_LIST_HEAD(&message->tx_links);
 
 	/*
 	 * The type supplied for incoming message buffers will be
@@ -304,6 +739,7 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
 		header->operation_id = 0;
 		header->type = type;
 		header->result = 0;
+		header->flags = 0;
 	}
 }
 
@@ -322,15 +758,20 @@ static void gb_operation_message_init(struct greybus_host_device *hd,
  *	headroom
  *	message header  \_ these combined are
  *	message payload /  the message size
+ *
+ * A message bigger than the host device allows can only be used on
+ * a connection that allows fragments.
  */
 static struct gb_message *
-gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
 				size_t payload_size, gfp_t gfp_flags)
 {
+	struct greybus_host_device *hd = connection->hd;
 	struct gb_message *message;
 	struct gb_operation_msg_hdr *header;
+	struct gb_message_pool *pool;
 	size_t message_size = payload_size + sizeof(*header);
-	size_t size;
+	size_t message_size_max;
 
 	if (hd->buffer_size_max > GB_OPERATION_MESSAGE_SIZE_MAX) {
 		pr_warn("limiting buffer size to %u\n",
@@ -338,21 +779,26 @@ gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
 		hd->buffer_size_max = GB_OPERATION_MESSAGE_SIZE_MAX;
 	}
 
-	/* Allocate the message.  Use the slab cache for simple messages */
-	if (payload_size) {
-		if (message_size > hd->buffer_size_max) {
-			pr_warn("requested message size too big (%zu > %zu)\n",
-				message_size, hd->buffer_size_max);
-			return NULL;
-		}
-
-		size = sizeof(*message) + hd->buffer_headroom + message_size;
-		message = kzalloc(size, gfp_flags);
-	} else {
-		message = kmem_cache_zalloc(gb_simple_message_cache, gfp_flags);
+	message_size_max = sizeof(*header) +
+				gb_operation_payload_max(connection);
+	if (message_size > message_size_max) {
+		pr_warn("requested message size too big (%zu > %zu)\n",
+			message_size, message_size_max);
+		return NULL;
 	}
+
+	/* Allocate the message from the smallest size class that fits */
+	pool = gb_message_pool_find(message_size);
+	if (pool)
+		message = mempool_alloc(pool->pool, gfp_flags);
+	else
+		message = kmalloc(sizeof(*message) + hd->buffer_headroom +
+					message_size, gfp_flags);
 	if (!message)
 		return NULL;
+	memset(message, 0, sizeof(*message) + hd->buffer_headroom +
+				message_size);
+	message->pool = pool;
 
 	/* Initialize the message.  Operation id is filled in later. */
 	gb_operation_message_init(hd, message, 0, payload_size, type);
@@ -362,10 +808,43 @@ gb_operation_message_alloc(struct greybus_host_device *hd, u8 type,
 
 static void gb_operation_message_free(struct gb_message *message)
 {
-	if (message->payload_size)
-		kfree(message);
+	struct greybus_host_device *hd;
+
+	if (!message)
+		return;
+
+	/* Give a lent receive buffer back to the host driver */
+	if (message->rx_cookie) {
+		hd = message->operation->connection->hd;
+		hd->driver->buffer_release(hd, message->rx_cookie);
+	}
+	gb_message_fragments_free(message);
+	if (message->pool)
+		mempool_free(message, message->pool->pool);
 	else
-		kmem_cache_free(gb_simple_message_cache, message);
+		kfree(message);
+}
+
+/*
+ * Make a message use a receive buffer lent by the host driver (see
+ * greybus_data_rcvd_lent()) in place of its own buffer space.  The
+ * buffer is handed back when the message is freed.
+ */
+static void gb_message_lend(struct gb_message *message, void *data,
+				void *cookie)
+{
+	message->header = data;
+	message->payload = message->payload_size ? message->header + 1 : NULL;
+	message->rx_cookie = cookie;
+}
+
+/*
+ * A message header (and so its payload) must be 64-bit aligned for
+ * a lent buffer to be used in place.
+ */
+static bool gb_message_can_lend(void *data, void *cookie)
+{
+	return cookie && IS_ALIGNED((uintptr_t)data, sizeof(u64));
 }
 
 /*
@@ -439,14 +918,13 @@ static u8 gb_operation_errno_map(int errno)
 bool gb_operation_response_alloc(struct gb_operation *operation,
 					size_t response_size)
 {
-	struct greybus_host_device *hd = operation->connection->hd;
 	struct gb_operation_msg_hdr *request_header;
 	struct gb_message *response;
 	u8 type;
 
 	type = operation->type | GB_OPERATION_TYPE_RESPONSE;
-	response = gb_operation_message_alloc(hd, type, response_size,
-						GFP_KERNEL);
+	response = gb_operation_message_alloc(operation->connection, type,
+						response_size, GFP_KERNEL);
 	if (!response)
 		return false;
 	response->operation = operation;
@@ -490,7 +968,6 @@ static struct gb_operation *
 gb_operation_create_common(struct gb_connection *connection, u8 type,
 				size_t request_size, size_t response_size)
 {
-	struct greybus_host_device *hd = connection->hd;
 	struct gb_operation *operation;
 	unsigned long flags;
 	gfp_t gfp_flags;
@@ -504,13 +981,14 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 		gfp_flags = GFP_ATOMIC;
 	else
 		gfp_flags = GFP_KERNEL;
-	operation = kmem_cache_zalloc(gb_operation_cache, gfp_flags);
+	operation = mempool_alloc(gb_operation_pool, gfp_flags);
 	if (!operation)
 		return NULL;
+	memset(operation, 0, sizeof(*operation));
 	operation->connection = connection;
 
-	operation->request = gb_operation_message_alloc(hd, type, request_size,
-							gfp_flags);
+	operation->request = gb_operation_message_alloc(connection, type,
+							request_size, gfp_flags);
 	if (!operation->request)
 		goto err_cache;
 	operation->request->operation = operation;
@@ -524,20 +1002,22 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 	operation->errno = -EBADR;  /* Initial value--means "never set" */
 
 	INIT_WORK(&operation->work, gb_operation_work);
+	INIT_DELAYED_WORK(&operation->timeout_work, gb_operation_timeout);
+	INIT_LIST_HEAD(&operation->window_links);
 	operation->callback = NULL;	/* set at submit time */
 	init_completion(&operation->completion);
 	kref_init(&operation->kref);
 
-	spin_lock_irqsave(&gb_operations_lock, flags);
+	spin_lock_irqsave(&connection->lock, flags);
 	list_add_tail(&operation->links, &connection->operations);
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+	spin_unlock_irqrestore(&connection->lock, flags);
 
 	return operation;
 
 err_request:
 	gb_operation_message_free(operation->request);
 err_cache:
-	kmem_cache_free(gb_operation_cache, operation);
+	mempool_free(operation, gb_operation_pool);
 
 	return NULL;
 }
@@ -554,34 +1034,117 @@ struct gb_operation *gb_operation_create(struct gb_connection *connection,
 					u8 type, size_t request_size,
 					size_t response_size)
 {
+	struct gb_operation *operation;
+
 	if (WARN_ON_ONCE(type == GB_OPERATION_TYPE_INVALID))
 		return NULL;
 	if (WARN_ON_ONCE(type & GB_OPERATION_TYPE_RESPONSE))
 		type &= ~GB_OPERATION_TYPE_RESPONSE;
 
-	return gb_operation_create_common(connection, type,
+	operation = gb_operation_create_common(connection, type,
 					request_size, response_size);
+	if (operation)
+		trace_gb_operation_create(operation);
+
+	return operation;
 }
 EXPORT_SYMBOL_GPL(gb_operation_create);
 
+/*
+ * Create an operation for an incoming request message of the given
+ * size (header included).  If a lent receive buffer cookie is
+ * supplied the request message uses the received data in place,
+ * and only a header-sized message needs to be allocated.  Otherwise
+ * the data is copied into the new request message.
+ */
 static struct gb_operation *
 gb_operation_create_incoming(struct gb_connection *connection, u16 id,
-				u8 type, void *data, size_t request_size)
+				u8 type, void *data, size_t size,
+				void *cookie)
 {
 	struct gb_operation *operation;
+	size_t payload_size;
 
+	payload_size = size - sizeof(struct gb_operation_msg_hdr);
 	operation = gb_operation_create_common(connection,
 					GB_OPERATION_TYPE_INVALID,
-					request_size, 0);
-	if (operation) {
-		operation->id = id;
-		operation->type = type;
-		memcpy(operation->request->header, data, request_size);
+					cookie ? 0 : payload_size, 0);
+	if (!operation)
+		return NULL;
+
+	operation->id = id;
+	operation->type = type;
+	if (cookie) {
+		operation->request->payload_size = payload_size;
+		gb_message_lend(operation->request, data, cookie);
+	} else {
+		memcpy(operation->request->header, data, size);
 	}
 
 	return operation;
 }
 
+/*
+ * Make an outgoing operation that has completed ready to be sent
+ * again, with new request and response payload sizes.  This saves
+ * allocating a new operation for every request on a hot path.
+ *
+ * Only the creator may do this, once it holds the sole reference
+ * and a response to the previous request has arrived (a request that
+ * was canceled or timed out may still get an answer, which must not
+ * land in the reused buffers).  The operation keeps its type, and
+ * the new sizes must fit within its message buffers.  The request
+ * payload is left for the caller to fill in.
+ *
+ * Returns 0 if successful, or -EMSGSIZE if a payload doesn't fit.
+ */
+int gb_operation_reuse(struct gb_operation *operation, size_t request_size,
+			size_t response_size)
+{
+	struct gb_connection *connection = operation->connection;
+	struct greybus_host_device *hd = connection->hd;
+	struct gb_message *request = operation->request;
+	struct gb_message *response = operation->response;
+	size_t header_size = sizeof(*request->header);
+	unsigned long flags;
+
+	if (!request->pool || !response->pool ||
+	    header_size + request_size > request->pool->size ||
+	    header_size + response_size > response->pool->size ||
+	    header_size + max(request_size, response_size) >
+							hd->buffer_size_max)
+		return -EMSGSIZE;
+
+	/* Let the completion work drop its reference */
+	flush_work(&operation->work);
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (operation->id &&
+	    idr_find(&connection->op_idr, operation->id) == operation)
+		idr_remove(&connection->op_idr, operation->id);
+	spin_unlock_irqrestore(&connection->lock, flags);
+	operation->id = 0;
+
+	if (response->rx_cookie) {
+		hd->driver->buffer_release(hd, response->rx_cookie);
+		response->rx_cookie = NULL;
+	}
+	request->cookie = NULL;
+	response->cookie = NULL;
+
+	gb_operation_message_init(hd, request, 0, request_size,
+				  operation->type);
+	gb_operation_message_init(hd, response, 0, response_size,
+				  operation->type | GB_OPERATION_TYPE_RESPONSE);
+
+	operation->errno = -EBADR;
+	operation->callback = NULL;
+	reinit_completion(&operation->completion);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gb_operation_reuse);
+
 /*
  * Get an additional reference on an operation.
  */
@@ -596,19 +1159,26 @@ void gb_operation_get(struct gb_operation *operation)
 static void _gb_operation_destroy(struct kref *kref)
 {
 	struct gb_operation *operation;
+	struct gb_connection *connection;
 	unsigned long flags;
 
 	operation = container_of(kref, struct gb_operation, kref);
+	connection = operation->connection;
+	trace_gb_operation_destroy(operation);
 
 	/* XXX Make sure it's not in flight */
-	spin_lock_irqsave(&gb_operations_lock, flags);
+	spin_lock_irqsave(&connection->lock, flags);
 	list_del(&operation->links);
-	spin_unlock_irqrestore(&gb_operations_lock, flags);
+	/* Only outgoing operations are recorded in the id table */
+	if (operation->id &&
+	    idr_find(&connection->op_idr, operation->id) == operation)
+		idr_remove(&connection->op_idr, operation->id);
+	spin_unlock_irqrestore(&connection->lock, flags);
 
 	gb_operation_message_free(operation->response);
 	gb_operation_message_free(operation->request);
 
-	kmem_cache_free(gb_operation_cache, operation);
+	mempool_free(operation, gb_operation_pool);
 }
 
 /*
@@ -629,29 +1199,231 @@ static void gb_operation_sync_callback(struct gb_operation *operation)
 }
 
 /*
- * Send an operation request message.  The caller has filled in
- * any payload so the request message is ready to go.  If non-null,
- * the callback function supplied will be called when the response
- * message has arrived indicating the operation is complete.  In
- * that case, the callback function is responsible for fetching the
- * result of the operation using gb_operation_result() if desired,
- * and dropping the final reference to (i.e., destroying) the
- * operation.  A null callback function is used for a synchronous
- * request; in that case return from this function won't occur until
- * the operation is complete.
+ * In-flight window.  A connection with a window set has no more than
+ * that many requests outstanding at a time, so a module (and the
+ * bridge in front of it) is never given more than it can take.  A
+ * request sent while the window is full waits in the connection's
+ * queue, its timeout (if any) already running, and is sent by the
+ * connection's window work once an earlier one has completed.  The
+ * number of requests in flight is kept, for debugfs, whether or not
+ * there is a window.
  */
-int gb_operation_request_send(struct gb_operation *operation,
-				gb_operation_callback callback)
+static unsigned int op_window;
+module_param(op_window, uint, 0644);
+MODULE_PARM_DESC(op_window, "In-flight window of new connections (0 for none)");
+
+void gb_connection_window_init(struct gb_connection *connection)
 {
-	struct gb_connection *connection = operation->connection;
-	struct gb_operation_msg_hdr *header;
-	unsigned int cycle;
+	connection->window = op_window;
+	INIT_LIST_HEAD(&connection->window_queue);
+	INIT_WORK(&connection->window_work, gb_connection_window_work);
+}
 
-	if (connection->state != GB_CONNECTION_STATE_ENABLED)
+/* Called with the connection lock held */
+static bool gb_connection_window_room(struct gb_connection *connection)
+{
+	return !connection->window ||
+		connection->window_inflight < connection->window;
+}
+
+/* Called with the connection lock held */
+static void gb_operation_window_take(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+
+	operation->window_held = true;
+	connection->window_inflight++;
+	if (connection->window_inflight > connection->window_inflight_max)
+		connection->window_inflight_max = connection->window_inflight;
+}
+
+/*
+ * Take a place in the window for a request about to be sent, or
+ * queue it if there's none (or others are already waiting).
+ * Returns true if the request can be sent now.
+ */
+static bool gb_operation_window_get(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+	bool room;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	room = !connection->window_queued &&
+		gb_connection_window_room(connection);
+	if (room) {
+		gb_operation_window_take(operation);
+	} else {
+		list_add_tail(&operation->window_links,
+			      &connection->window_queue);
+		connection->window_queued++;
+		gb_connection_stat_inc(connection, window_waits);
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return room;
+}
+
+/*
+ * Give up a request's place in the window, or in the queue for it.
+ * Called with the connection lock held, once the request's result
+ * is final.  Returns true if a queued request can now be sent.
+ */
+static bool gb_operation_window_put(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+
+	if (operation->window_held) {
+		operation->window_held = false;
+		connection->window_inflight--;
+
+		return connection->window_queued;
+	}
+
+	if (!list_empty(&operation->window_links)) {
+		list_del_init(&operation->window_links);
+		connection->window_queued--;
+	}
+
+	return false;
+}
+
+/*
+ * Send queued requests while there's room in the window.  One that
+ * fails to be sent completes with the error.
+ */
+static void gb_connection_window_work(struct work_struct *work)
+{
+	struct gb_connection *connection;
+	struct gb_operation *operation;
+	int ret;
+
+	connection = container_of(work, struct gb_connection, window_work);
+	while (1) {
+		spin_lock_irq(&connection->lock);
+		if (!connection->window_queued ||
+		    !gb_connection_window_room(connection)) {
+			spin_unlock_irq(&connection->lock);
+			break;
+		}
+		operation = list_first_entry(&connection->window_queue,
+					     struct gb_operation, window_links);
+		list_del_init(&operation->window_links);
+		connection->window_queued--;
+		gb_operation_window_take(operation);
+		gb_operation_get(operation);
+		spin_unlock_irq(&connection->lock);
+
+		ret = gb_message_send(operation->request);
+		if (ret && gb_operation_result_set(operation, ret))
+			queue_work(connection->wq, &operation->work);
+		gb_operation_put(operation);
+	}
+}
+
+void gb_connection_window_set(struct gb_connection *connection,
+			      unsigned int window)
+{
+	bool kick;
+
+	spin_lock_irq(&connection->lock);
+	connection->window = window;
+	kick = connection->window_queued &&
+		gb_connection_window_room(connection);
+	spin_unlock_irq(&connection->lock);
+
+	if (kick)
+		schedule_work(&connection->window_work);
+}
+
+/*
+ * Undo what gb_operation_request_send_timeout() did for a request
+ * that couldn't be sent after all, leaving the operation as it was
+ * before, holding only the caller's reference.  Returns false if the
+ * operation got its final result some other way in the meantime, in
+ * which case it completes (and its callback is called) as usual.
+ */
+static bool gb_operation_request_unsend(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+	bool kick;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (operation->errno != -EINPROGRESS) {
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return false;
+	}
+	operation->errno = -EBADR;
+	kick = gb_operation_window_put(operation);
+	if (idr_find(&connection->op_idr, operation->id) == operation)
+		idr_remove(&connection->op_idr, operation->id);
+	operation->id = 0;
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	if (kick)
+		schedule_work(&connection->window_work);
+
+	gb_operation_timeout_cancel(operation);
+	operation->callback = NULL;
+	gb_operation_put(operation);
+
+	return true;
+}
+
+/*
+ * Send an operation request message.  The caller has filled in
+ * any payload so the request message is ready to go.  If non-null,
+ * the callback function supplied will be called when the response
+ * message has arrived indicating the operation is complete.  In
+ * that case, the callback function is responsible for fetching the
+ * result of the operation using gb_operation_result() if desired,
+ * and dropping the final reference to (i.e., destroying) the
+ * operation.  A null callback function is used for a synchronous
+ * request; in that case return from this function won't occur until
+ * the operation is complete.
+ *
+ * An asynchronous operation is given the connection's timeout (see
+ * gb_connection_timeout()) to complete.
+ */
+int gb_operation_request_send(struct gb_operation *operation,
+				gb_operation_callback callback)
+{
+	unsigned int timeout = gb_connection_timeout(operation->connection);
+
+	return gb_operation_request_send_timeout(operation, callback, timeout);
+}
+EXPORT_SYMBOL_GPL(gb_operation_request_send);
+
+/*
+ * Send an operation request message, as gb_operation_request_send()
+ * does.  If a non-zero timeout (in milliseconds) is given and no
+ * response has arrived by the time it expires, the request is
+ * canceled and the operation completes with -ETIMEDOUT.  No thread
+ * waits for this; the expiry is handled by a delayed work item.
+ */
+int gb_operation_request_send_timeout(struct gb_operation *operation,
+					gb_operation_callback callback,
+					unsigned int timeout_ms)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_operation_msg_hdr *header;
+	int ret;
+
+	if (connection->state != GB_CONNECTION_STATE_ENABLED)
 		return -ENOTCONN;
 
 	/*
-	 * First, get an extra reference on the operation.
+	 * Assign the operation's id, and store it in the request header.
+	 */
+	ret = gb_operation_id_alloc(operation);
+	if (ret)
+		return ret;
+	header = operation->request->header;
+	header->operation_id = cpu_to_le16(operation->id);
+
+	/*
+	 * Next, get an extra reference on the operation.
 	 * It'll be dropped when the operation completes.
 	 */
 	gb_operation_get(operation);
@@ -663,37 +1435,133 @@ int gb_operation_request_send(struct gb_operation *operation,
 	 */
 	operation->callback = callback;
 
-	/*
-	 * Assign the operation's id, and store it in the request header.
-	 * Zero is a reserved operation id.
-	 */
-	cycle = (unsigned int)atomic_inc_return(&connection->op_cycle);
-	operation->id = (u16)(cycle % U16_MAX + 1);
-	header = operation->request->header;
-	header->operation_id = cpu_to_le16(operation->id);
-
 	/* All set, send the request */
 	gb_operation_result_set(operation, -EINPROGRESS);
+	operation->send_time = ktime_get();
+	trace_gb_operation_request_send(operation);
+
+	/* The pending timeout holds its own reference */
+	if (timeout_ms) {
+		gb_operation_get(operation);
+		queue_delayed_work(connection->wq, &operation->timeout_work,
+				   msecs_to_jiffies(timeout_ms));
+	}
+
+	/* Wait for room in the connection's window if need be */
+	if (!gb_operation_window_get(operation))
+		return 0;
+
+	ret = gb_message_send(operation->request);
+	if (ret && !gb_operation_request_unsend(operation))
+		ret = 0;
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_request_send_timeout);
+
+/*
+ * Record the round trip time of an operation whose response has
+ * just arrived.  A smoothed mean and mean deviation are kept (in
+ * microseconds) the same way TCP does for its retransmit timer,
+ * and the sample is added to the connection's latency histogram.
+ * Called in interrupt context.
+ */
+static void gb_connection_rtt_update(struct gb_connection *connection,
+					struct gb_operation *operation)
+{
+	unsigned long flags;
+	unsigned int bucket;
+	s64 sample;
+	s32 rtt;
+	s32 delta;
+
+	sample = ktime_us_delta(ktime_get(), operation->send_time);
+	rtt = (s32)clamp_t(s64, sample, 0, S32_MAX / 8);
+
+	bucket = rtt ? ilog2(rtt) + 1 : 0;
+	bucket = min_t(unsigned int, bucket, GB_CONNECTION_LATENCY_BUCKETS - 1);
+	gb_connection_stat_inc(connection, latency[bucket]);
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (!connection->rtt_samples) {
+		connection->rtt_avg = rtt;
+		connection->rtt_var = rtt / 2;
+	} else {
+		delta = rtt - (s32)connection->rtt_avg;
+		connection->rtt_avg = (s32)connection->rtt_avg + delta / 8;
+		delta = abs(delta) - (s32)connection->rtt_var;
+		connection->rtt_var = (s32)connection->rtt_var + delta / 4;
+	}
+	if (connection->rtt_samples < UINT_MAX)
+		connection->rtt_samples++;
+	spin_unlock_irqrestore(&connection->lock, flags);
+}
 
-	return gb_message_send(operation->request);
+/*
+ * Return the timeout (in milliseconds) to use for a synchronous
+ * operation on a connection.  This is the connection's configured
+ * timeout, unless adaptive timeouts are enabled and enough round
+ * trips have been seen.  In that case the timeout is the smoothed
+ * round trip time plus four times its mean deviation, bounded by
+ * OPERATION_TIMEOUT_ADAPTIVE_MIN and the configured timeout.
+ */
+unsigned int gb_connection_timeout(struct gb_connection *connection)
+{
+	unsigned int timeout = connection->timeout;
+	unsigned long flags;
+	u32 rto;
+
+	if (!connection->timeout_adaptive)
+		return timeout;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (connection->rtt_samples < OPERATION_RTT_SAMPLES_MIN) {
+		spin_unlock_irqrestore(&connection->lock, flags);
+		return timeout;
+	}
+	rto = connection->rtt_avg + 4 * connection->rtt_var;
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	rto = DIV_ROUND_UP(rto, USEC_PER_MSEC);
+	rto = max_t(u32, rto, OPERATION_TIMEOUT_ADAPTIVE_MIN);
+
+	return min_t(u32, rto, timeout);
 }
+EXPORT_SYMBOL_GPL(gb_connection_timeout);
 
 /*
  * Send a synchronous operation.  This function is expected to
  * block, returning only when the response has arrived, (or when an
  * error is detected.  The return value is the result of the
- * operation.
+ * operation.  The connection's timeout is used (see
+ * gb_connection_timeout()).
  */
 int gb_operation_request_send_sync(struct gb_operation *operation)
+{
+	unsigned int timeout = gb_connection_timeout(operation->connection);
+
+	return gb_operation_request_send_sync_timeout(operation, timeout);
+}
+EXPORT_SYMBOL_GPL(gb_operation_request_send_sync);
+
+/*
+ * Send a synchronous operation, waiting at most the given number
+ * of milliseconds for its response.  If none has arrived by then
+ * the operation is canceled with -ETIMEDOUT.
+ */
+int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
+						unsigned int timeout_ms)
 {
 	int ret;
 	unsigned long timeout;
 
-	ret = gb_operation_request_send(operation, gb_operation_sync_callback);
+	/* We do our own waiting, so no timeout is armed */
+	ret = gb_operation_request_send_timeout(operation,
+					gb_operation_sync_callback, 0);
 	if (ret)
 		return ret;
 
-	timeout = msecs_to_jiffies(OPERATION_TIMEOUT_DEFAULT);
+	timeout = msecs_to_jiffies(timeout_ms);
 	ret = wait_for_completion_interruptible_timeout(&operation->completion, timeout);
 	if (ret < 0) {
 		/* Cancel the operation if interrupted */
@@ -705,7 +1573,7 @@ int gb_operation_request_send_sync(struct gb_operation *operation)
 
 	return gb_operation_result(operation);
 }
-EXPORT_SYMBOL_GPL(gb_operation_request_send_sync);
+EXPORT_SYMBOL_GPL(gb_operation_request_send_sync_timeout);
 
 /*
  * Send a response for an incoming operation request.  A non-zero
@@ -749,12 +1617,42 @@ void
 greybus_data_sent(struct greybus_host_device *hd, void *header, int status)
 {
 	struct gb_message *message;
-	struct gb_operation *operation;
 
-	/* Get the message and record that it is no longer in flight */
 	message = gb_hd_message_find(hd, header);
+	if (hd->tx_max)
+		gb_hd_tx_done(hd);
+	gb_message_buffer_sent(message, status);
+}
+EXPORT_SYMBOL_GPL(greybus_data_sent);
+
+/*
+ * A message's buffer has been sent, or failed to be, or was canceled
+ * before it was handed to the host driver.
+ */
+static void gb_message_buffer_sent(struct gb_message *message, int status)
+{
+	/* Record that it is no longer in flight */
 	message->cookie = NULL;
 
+	/* The whole message is done once its last fragment is */
+	if (message->parent) {
+		message = message->parent;
+		if (status)
+			message->fragment_status = status;
+		if (!atomic_dec_and_test(&message->fragments_pending))
+			return;
+		status = message->fragment_status;
+	}
+
+	gb_message_sent(message, status);
+}
+
+static void gb_message_sent(struct gb_message *message, int status)
+{
+	struct gb_operation *operation;
+
+	trace_gb_message_sent(message, status);
+
 	/*
 	 * If the message was a response, we just need to drop our
 	 * reference to the operation.  If an error occurred, report
@@ -772,30 +1670,36 @@ greybus_data_sent(struct greybus_host_device *hd, void *header, int status)
 		gb_operation_put(operation);
 	} else if (status) {
 		if (gb_operation_result_set(operation, status))
-			queue_work(gb_operation_workqueue, &operation->work);
+			queue_work(operation->connection->wq, &operation->work);
 	}
 }
-EXPORT_SYMBOL_GPL(greybus_data_sent);
 
 /*
  * We've received data on a connection, and it doesn't look like a
  * response, so we assume it's a request.
  *
  * This is called in interrupt context, so just copy the incoming
- * data into the request buffer and handle the rest via workqueue.
+ * data into the request buffer (or take over the lent buffer, if
+ * there is one) and handle the rest via workqueue.  Returns true
+ * if the lent buffer was kept.
  */
-static void gb_connection_recv_request(struct gb_connection *connection,
+static bool gb_connection_recv_request(struct gb_connection *connection,
 				       u16 operation_id, u8 type,
-				       void *data, size_t size)
+				       void *data, size_t size, void *cookie)
 {
 	struct gb_operation *operation;
 
+	if (!gb_message_can_lend(data, cookie))
+		cookie = NULL;
+
 	operation = gb_operation_create_incoming(connection, operation_id,
-						type, data, size);
+						type, data, size, cookie);
 	if (!operation) {
 		dev_err(&connection->dev, "can't create operation\n");
-		return;		/* XXX Respond with pre-allocated ENOMEM */
+		return false;	/* XXX Respond with pre-allocated ENOMEM */
 	}
+	gb_connection_stat_inc(connection, requests_received);
+	trace_gb_operation_recv_request(operation);
 
 	/*
 	 * Incoming requests are handled by arranging for the
@@ -809,7 +1713,9 @@ static void gb_connection_recv_request(struct gb_connection *connection,
 	 */
 	operation->callback = gb_operation_request_handle;
 	if (gb_operation_result_set(operation, -EINPROGRESS))
-		queue_work(gb_operation_workqueue, &operation->work);
+		queue_work(connection->wq, &operation->work);
+
+	return cookie != NULL;
 }
 
 /*
@@ -818,10 +1724,13 @@ static void gb_connection_recv_request(struct gb_connection *connection,
  * its response.
  *
  * This is called in interrupt context, so just copy the incoming
- * data into the response buffer and handle the rest via workqueue.
+ * data into the response buffer (or take over the lent buffer, if
+ * there is one) and handle the rest via workqueue.  Returns true
+ * if the lent buffer was kept.
  */
-static void gb_connection_recv_response(struct gb_connection *connection,
-			u16 operation_id, u8 result, void *data, size_t size)
+static bool gb_connection_recv_response(struct gb_connection *connection,
+			u16 operation_id, u8 result, void *data, size_t size,
+			void *cookie)
 {
 	struct gb_operation *operation;
 	struct gb_message *message;
@@ -831,9 +1740,11 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	operation = gb_operation_find(connection, operation_id);
 	if (!operation) {
 		dev_err(&connection->dev, "operation not found\n");
-		return;
+		return false;
 	}
 
+	trace_gb_operation_recv_response(operation);
+
 	message = operation->response;
 	message_size = sizeof(*message->header) + message->payload_size;
 	if (!errno && size != message_size) {
@@ -842,23 +1753,388 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 		errno = -EMSGSIZE;
 	}
 
-	/* We must ignore the payload if a bad status is returned */
+	/*
+	 * We must ignore the payload if a bad status is returned, so
+	 * there's no point in keeping a lent buffer in that case.
+	 * Never take a second buffer for the same response either.
+	 */
+	if (errno || message->rx_cookie || !gb_message_can_lend(data, cookie))
+		cookie = NULL;
+
 	if (errno)
 		size = sizeof(*message->header);
-	memcpy(message->header, data, size);
+	else
+		gb_connection_rtt_update(connection, operation);
+	if (cookie)
+		gb_message_lend(message, data, cookie);
+	else
+		memcpy(message->header, data, size);
 
 	/* The rest will be handled in work queue context */
 	if (gb_operation_result_set(operation, errno))
-		queue_work(gb_operation_workqueue, &operation->work);
+		queue_work(connection->wq, &operation->work);
+
+	return cookie != NULL;
 }
 
 /*
- * Handle data arriving on a connection.  As soon as we return the
- * supplied data buffer will be reused (so unless we do something
- * with, it's effectively dropped).
+ * Incoming requests sent in fragments are kept in the connection's
+ * partial_idr, by operation id, until the last of their fragments
+ * arrives.  The table holds the operation's original reference, and
+ * its reassembly timeout another one.
  */
-void gb_connection_recv(struct gb_connection *connection,
+static bool gb_operation_partial_remove(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+
+	if (idr_find(&connection->partial_idr, operation->id) != operation)
+		return false;
+	idr_remove(&connection->partial_idr, operation->id);
+	connection->partial_count--;
+
+	return true;
+}
+
+/* Give up on an incoming request whose fragments didn't all arrive */
+static void gb_operation_partial_drop(struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	unsigned long flags;
+	bool dropped;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	dropped = gb_operation_partial_remove(operation);
+	spin_unlock_irqrestore(&connection->lock, flags);
+	if (!dropped)
+		return;
+
+	gb_operation_timeout_cancel(operation);
+	gb_operation_put(operation);
+}
+
+static void gb_operation_partial_timeout(struct work_struct *work)
+{
+	struct gb_operation *operation;
+	struct gb_connection *connection;
+	bool expired;
+
+	operation = container_of(to_delayed_work(work), struct gb_operation,
+				 timeout_work);
+	connection = operation->connection;
+
+	spin_lock_irq(&connection->lock);
+	expired = gb_operation_partial_remove(operation);
+	spin_unlock_irq(&connection->lock);
+	if (expired) {
+		dev_err(&connection->dev, "dropping incomplete request %hu\n",
+			operation->id);
+		gb_operation_put(operation);
+	}
+	gb_operation_put(operation);
+}
+
+/*
+ * Find the incoming request a fragment belongs to, if an earlier
+ * fragment has already arrived, and take a reference to it.
+ */
+static struct gb_operation *
+gb_operation_partial_find(struct gb_connection *connection, u16 id)
+{
+	struct gb_operation *operation;
+	unsigned long flags;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	operation = idr_find(&connection->partial_idr, id);
+	if (operation)
+		gb_operation_get(operation);
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return operation;
+}
+
+/*
+ * Set up the incoming request the first fragment to arrive belongs
+ * to, and record it in the connection's table, taking a reference
+ * for the caller.  A slot in the table is claimed before the
+ * (possibly big) request buffer is allocated.
+ */
+static struct gb_operation *
+gb_operation_partial_create(struct gb_connection *connection,
+				struct gb_operation_msg_hdr *header,
+				size_t payload_size)
+{
+	u16 id = le16_to_cpu(header->operation_id);
+	struct gb_operation *operation;
+	unsigned long flags;
+	bool full;
+	int ret;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	full = connection->partial_count >= GB_OPERATION_PARTIAL_MAX;
+	if (!full)
+		connection->partial_count++;
+	spin_unlock_irqrestore(&connection->lock, flags);
+	if (full) {
+		dev_err(&connection->dev, "too many incomplete requests\n");
+		return NULL;
+	}
+
+	operation = gb_operation_create_common(connection,
+				GB_OPERATION_TYPE_INVALID, payload_size, 0);
+	if (!operation) {
+		dev_err(&connection->dev, "can't create operation\n");
+		goto err_unclaim;
+	}
+	operation->id = id;
+	operation->type = header->type;
+	INIT_DELAYED_WORK(&operation->timeout_work,
+			  gb_operation_partial_timeout);
+
+	spin_lock_irqsave(&connection->lock, flags);
+	ret = idr_alloc(&connection->partial_idr, operation, id, id + 1,
+			GFP_ATOMIC);
+	if (ret >= 0) {
+		gb_operation_get(operation);	/* The caller's */
+		gb_operation_get(operation);	/* The timeout's */
+		queue_delayed_work(connection->wq, &operation->timeout_work,
+			msecs_to_jiffies(GB_OPERATION_PARTIAL_TIMEOUT));
+	}
+	spin_unlock_irqrestore(&connection->lock, flags);
+	if (ret < 0) {
+		dev_err(&connection->dev, "can't record operation\n");
+		gb_operation_put(operation);
+		goto err_unclaim;
+	}
+
+	return operation;
+
+err_unclaim:
+	spin_lock_irqsave(&connection->lock, flags);
+	connection->partial_count--;
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	return NULL;
+}
+
+/*
+ * Drop the incoming requests still being reassembled when the
+ * connection goes away.
+ */
+void gb_connection_partial_flush(struct gb_connection *connection)
+{
+	struct gb_operation *operation;
+	int id;
+
+	for (;;) {
+		id = 0;
+		spin_lock_irq(&connection->lock);
+		operation = idr_get_next(&connection->partial_idr, &id);
+		if (operation)
+			gb_operation_partial_remove(operation);
+		spin_unlock_irq(&connection->lock);
+		if (!operation)
+			break;
+
+		if (cancel_delayed_work_sync(&operation->timeout_work))
+			gb_operation_put(operation);
+		gb_operation_put(operation);
+	}
+}
+
+/*
+ * Add a fragment's data to the message being reassembled.  Which
+ * fragment it is follows from its offset, as all but the last carry
+ * the same amount of data; each is recorded in the message's bitmap
+ * as it arrives, so a repeated one isn't counted twice.  Returns 1
+ * if the fragment completes the message, whose header is then
+ * filled in from the fragment's as it would have been had it
+ * arrived in one piece; 0 if more are to come; -EALREADY if the
+ * fragment is a repeat; or another negative errno if it is bad.
+ */
+static int gb_message_reassemble(struct gb_message *message,
+				struct gb_operation_msg_hdr *header,
+				size_t offset, void *data, size_t len)
+{
+	struct gb_connection *connection = message->operation->connection;
+	size_t message_size = sizeof(*header) + message->payload_size;
+	size_t data_max = gb_connection_fragment_data_max(connection);
+	unsigned int count = DIV_ROUND_UP(message->payload_size, data_max);
+	unsigned int index = offset / data_max;
+	unsigned long flags;
+	int ret = 0;
+
+	if (!len || offset % data_max ||
+	    (len != data_max && offset + len != message->payload_size))
+		return -EINVAL;
+
+	spin_lock_irqsave(&connection->lock, flags);
+	if (!message->fragments_received)
+		message->fragments_received = kcalloc(BITS_TO_LONGS(count),
+						sizeof(unsigned long),
+						GFP_ATOMIC);
+	if (!message->fragments_received)
+		ret = -ENOMEM;
+	else if (__test_and_set_bit(index, message->fragments_received))
+		ret = -EALREADY;
+	spin_unlock_irqrestore(&connection->lock, flags);
+	if (ret)
+		return ret;
+
+	memcpy(message->payload + offset, data, len);
+
+	/* Counted only once copied, so the last one sees them all done */
+	spin_lock_irqsave(&connection->lock, flags);
+	message->received += len;
+	if (message->received == message->payload_size)
+		ret = 1;
+	spin_unlock_irqrestore(&connection->lock, flags);
+
+	if (ret) {
+		memcpy(message->header, header, sizeof(*header));
+		message->header->size = cpu_to_le16(message_size);
+		message->header->flags = 0;
+	}
+
+	return ret;
+}
+
+static void gb_connection_recv_request_fragment(struct gb_connection *connection,
+				struct gb_operation_msg_hdr *header,
+				size_t offset, size_t payload_size,
+				void *data, size_t len)
+{
+	u16 operation_id = le16_to_cpu(header->operation_id);
+	struct gb_operation *operation;
+	unsigned long flags;
+	bool done;
+	int ret;
+
+	operation = gb_operation_partial_find(connection, operation_id);
+	if (!operation) {
+		operation = gb_operation_partial_create(connection, header,
+							payload_size);
+		if (!operation)
+			return;
+	}
+
+	if (payload_size != operation->request->payload_size) {
+		dev_err(&connection->dev, "bad fragment payload size\n");
+		gb_operation_partial_drop(operation);
+		goto out_put;
+	}
+
+	ret = gb_message_reassemble(operation->request, header, offset, data,
+				    len);
+	if (ret == -EALREADY) {
+		dev_err(&connection->dev, "dropping repeated fragment\n");
+		goto out_put;
+	}
+	if (ret < 0) {
+		dev_err(&connection->dev, "bad fragment (%d)\n", ret);
+		gb_operation_partial_drop(operation);
+		goto out_put;
+	}
+	if (!ret)
+		goto out_put;
+
+	/* The table's reference becomes that of the request handling */
+	spin_lock_irqsave(&connection->lock, flags);
+	done = gb_operation_partial_remove(operation);
+	spin_unlock_irqrestore(&connection->lock, flags);
+	if (!done)
+		goto out_put;	/* Timed out just now */
+
+	gb_connection_stat_inc(connection, requests_received);
+	trace_gb_operation_recv_request(operation);
+
+	/* Handled as gb_connection_recv_request() does */
+	operation->callback = gb_operation_request_handle;
+	if (gb_operation_result_set(operation, -EINPROGRESS))
+		queue_work(connection->wq, &operation->work);
+out_put:
+	gb_operation_put(operation);
+}
+
+static void gb_connection_recv_response_fragment(struct gb_connection *connection,
+				struct gb_operation_msg_hdr *header,
+				size_t offset, size_t payload_size,
+				void *data, size_t len)
+{
+	u16 operation_id = le16_to_cpu(header->operation_id);
+	int errno = gb_operation_status_map(header->result);
+	struct gb_operation *operation;
+	struct gb_message *message;
+	int ret;
+
+	operation = gb_operation_find(connection, operation_id);
+	if (!operation) {
+		dev_err(&connection->dev, "operation not found\n");
+		return;
+	}
+
+	message = operation->response;
+	if (!errno && payload_size != message->payload_size) {
+		dev_err(&connection->dev, "bad message size (%zu != %zu)\n",
+			payload_size, message->payload_size);
+		errno = -EMSGSIZE;
+	}
+
+	if (errno) {
+		memcpy(message->header, header, sizeof(*header));
+	} else {
+		ret = gb_message_reassemble(message, header, offset, data, len);
+		if (ret < 0)
+			dev_err(&connection->dev, "dropping fragment (%d)\n",
+				ret);
+		if (ret <= 0)
+			return;
+		gb_connection_rtt_update(connection, operation);
+	}
+
+	trace_gb_operation_recv_response(operation);
+
+	if (gb_operation_result_set(operation, errno))
+		queue_work(connection->wq, &operation->work);
+}
+
+/*
+ * A fragment of a message has arrived; its data is always copied.
+ * This is called in interrupt context, like the rest of the receive
+ * path.
+ */
+static void gb_connection_recv_fragment(struct gb_connection *connection,
 				void *data, size_t size)
+{
+	struct gb_operation_msg_hdr *header = data;
+	struct gb_operation_fragment_hdr *fragment_header;
+	size_t offset, payload_size, len;
+
+	if (size < sizeof(*header) + sizeof(*fragment_header)) {
+		dev_err(&connection->dev, "dropping bad fragment\n");
+		return;
+	}
+
+	fragment_header = (struct gb_operation_fragment_hdr *)(header + 1);
+	offset = le32_to_cpu(fragment_header->offset);
+	payload_size = le32_to_cpu(fragment_header->payload_size);
+	len = size - sizeof(*header) - sizeof(*fragment_header);
+	if (offset > payload_size || len > payload_size - offset) {
+		dev_err(&connection->dev, "dropping bad fragment\n");
+		return;
+	}
+
+	if (header->type & GB_OPERATION_TYPE_RESPONSE)
+		gb_connection_recv_response_fragment(connection, header,
+					offset, payload_size,
+					fragment_header + 1, len);
+	else
+		gb_connection_recv_request_fragment(connection, header,
+					offset, payload_size,
+					fragment_header + 1, len);
+}
+
+static bool gb_connection_recv_common(struct gb_connection *connection,
+				void *data, size_t size, void *cookie)
 {
 	struct gb_operation_msg_hdr *header;
 	size_t msg_size;
@@ -867,50 +2143,97 @@ void gb_connection_recv(struct gb_connection *connection,
 	if (connection->state != GB_CONNECTION_STATE_ENABLED) {
 		dev_err(&connection->dev, "dropping %zu received bytes\n",
 			size);
-		return;
+		return false;
 	}
 
 	if (size < sizeof(*header)) {
 		dev_err(&connection->dev, "message too small\n");
-		return;
+		return false;
 	}
 
 	header = data;
 	msg_size = le16_to_cpu(header->size);
 	if (msg_size > size) {
 		dev_err(&connection->dev, "incomplete message\n");
-		return;		/* XXX Should still complete operation */
+		return false;	/* XXX Should still complete operation */
+	}
+
+	gb_connection_stat_add(connection, bytes_in, msg_size);
+
+	/* The flags mean nothing unless fragments have been agreed on */
+	if (gb_connection_fragments(connection) &&
+	    header->flags & GB_OPERATION_FLAG_FRAGMENT) {
+		gb_connection_recv_fragment(connection, data, msg_size);
+		return false;
 	}
 
 	operation_id = le16_to_cpu(header->operation_id);
 	if (header->type & GB_OPERATION_TYPE_RESPONSE)
-		gb_connection_recv_response(connection, operation_id,
-						header->result, data, msg_size);
+		return gb_connection_recv_response(connection, operation_id,
+					header->result, data, msg_size, cookie);
 	else
-		gb_connection_recv_request(connection, operation_id,
-						header->type, data, msg_size);
+		return gb_connection_recv_request(connection, operation_id,
+					header->type, data, msg_size, cookie);
+}
+
+/*
+ * Handle data arriving on a connection.  As soon as we return the
+ * supplied data buffer will be reused (so unless we do something
+ * with, it's effectively dropped).
+ */
+void gb_connection_recv(struct gb_connection *connection,
+				void *data, size_t size)
+{
+	gb_connection_recv_common(connection, data, size, NULL);
+}
+
+/*
+ * Handle data arriving on a connection in a buffer lent by the host
+ * driver.  If the buffer is suitably aligned it becomes the buffer
+ * of the request or response message, and true is returned; the
+ * buffer is given back through the host driver's buffer_release()
+ * callback when the message is freed.  Otherwise the data is copied
+ * (or dropped) as gb_connection_recv() would, and false is returned.
+ */
+bool gb_connection_recv_lent(struct gb_connection *connection,
+				void *data, size_t size, void *cookie)
+{
+	return gb_connection_recv_common(connection, data, size, cookie);
 }
 
 /*
  * Cancel an operation, and record the given error to indicate why.
+ * Returns true if the operation was canceled, in which case its
+ * callback will not be called; false if it had already completed.
  */
-void gb_operation_cancel(struct gb_operation *operation, int errno)
+bool gb_operation_cancel(struct gb_operation *operation, int errno)
 {
-	if (gb_operation_result_set(operation, errno)) {
+	bool canceled;
+
+	gb_operation_timeout_cancel(operation);
+	canceled = gb_operation_result_set(operation, errno);
+	if (canceled) {
+		if (errno == -ETIMEDOUT)
+			gb_connection_stat_inc(operation->connection, timeouts);
+		else
+			gb_connection_stat_inc(operation->connection, cancels);
 		gb_message_cancel(operation->request);
 		gb_message_cancel(operation->response);
 	}
 	gb_operation_put(operation);
+
+	return canceled;
 }
 
 /**
- * gb_operation_sync: implement a "simple" synchronous gb operation.
+ * gb_operation_sync_timeout: implement a "simple" synchronous gb operation.
  * @connection: the Greybus connection to send this to
  * @type: the type of operation to send
  * @request: pointer to a memory buffer to copy the request from
  * @request_size: size of @request
  * @response: pointer to a memory buffer to copy the response to
  * @response_size: the size of @response.
+ * @timeout: operation timeout, in milliseconds
  *
  * This function implements a simple synchronous Greybus operation.  It sends
  * the provided operation request and waits (sleeps) until the corresponding
@@ -921,13 +2244,15 @@ void gb_operation_cancel(struct gb_operation *operation, int errno)
  *
  * If a response payload is to come back, and @response is not NULL,
  * @response_size number of bytes will be copied into @response if the operation
- * is successful.
+ * is successful.  If no response arrives within @timeout milliseconds the
+ * operation fails with -ETIMEDOUT.
  *
  * If there is an error, the response buffer is left alone.
  */
-int gb_operation_sync(struct gb_connection *connection, int type,
-		      void *request, int request_size,
-		      void *response, int response_size)
+int gb_operation_sync_timeout(struct gb_connection *connection, int type,
+				void *request, int request_size,
+				void *response, int response_size,
+				unsigned int timeout)
 {
 	struct gb_operation *operation;
 	int ret;
@@ -944,7 +2269,7 @@ int gb_operation_sync(struct gb_connection *connection, int type,
 	if (request_size)
 		memcpy(operation->request->payload, request, request_size);
 
-	ret = gb_operation_request_send_sync(operation);
+	ret = gb_operation_request_send_sync_timeout(operation, timeout);
 	if (ret) {
 		dev_err(&connection->dev, "synchronous operation failed: %d\n",
 			ret);
@@ -958,14 +2283,316 @@ int gb_operation_sync(struct gb_connection *connection, int type,
 
 	return ret;
 }
+EXPORT_SYMBOL_GPL(gb_operation_sync_timeout);
+
+/*
+ * As gb_operation_sync_timeout(), using the connection's timeout (see
+ * gb_connection_timeout()).
+ */
+int gb_operation_sync(struct gb_connection *connection, int type,
+		      void *request, int request_size,
+		      void *response, int response_size)
+{
+	return gb_operation_sync_timeout(connection, type,
+					 request, request_size,
+					 response, response_size,
+					 gb_connection_timeout(connection));
+}
 EXPORT_SYMBOL_GPL(gb_operation_sync);
 
-int gb_operation_init(void)
+/**
+ * gb_operation_batch: perform a batch of "simple" gb operations.
+ * @connection: the Greybus connection to send the requests to
+ * @batch: array of requests to perform
+ * @count: number of entries in @batch
+ *
+ * Each entry in @batch describes an operation as the arguments to
+ * gb_operation_sync() do.  All of the requests are sent back-to-back
+ * without waiting for responses in between, and then this function
+ * sleeps until every operation has completed.  A batch of
+ * independent requests thereby costs about one round trip rather
+ * than one per request.
+ *
+ * The whole batch is given the connection's timeout (see
+ * gb_connection_timeout()) to complete.  The result of each operation
+ * is recorded in its entry, and the response (if any) of each
+ * successful one is copied into its response buffer.  The return
+ * value is zero if all operations succeeded, or the first error
+ * encountered otherwise.
+ */
+int gb_operation_batch(struct gb_connection *connection,
+			struct gb_operation_batch_entry *batch,
+			unsigned int count)
 {
-	size_t size;
+	struct gb_operation_batch_entry *entry;
+	struct gb_operation **operations;
+	struct gb_operation *operation;
+	unsigned long deadline;
+	long timeout;
+	unsigned int i;
+	int ret = 0;
 
-	BUILD_BUG_ON(GB_OPERATION_MESSAGE_SIZE_MAX >
-			U16_MAX - sizeof(struct gb_operation_msg_hdr));
+	if (!count)
+		return 0;
+
+	operations = kcalloc(count, sizeof(*operations), GFP_KERNEL);
+	if (!operations)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		entry = &batch[i];
+		if ((entry->response_size && !entry->response) ||
+		    (entry->request_size && !entry->request)) {
+			entry->result = -EINVAL;
+			continue;
+		}
+
+		operation = gb_operation_create(connection, entry->type,
+						entry->request_size,
+						entry->response_size);
+		if (!operation) {
+			entry->result = -ENOMEM;
+			continue;
+		}
+
+		if (entry->request_size)
+			memcpy(operation->request->payload, entry->request,
+			       entry->request_size);
+		operations[i] = operation;
+	}
+
+	/* Get all the requests on their way before waiting for any */
+	for (i = 0; i < count; i++) {
+		operation = operations[i];
+		if (!operation)
+			continue;
+
+		/* We do our own waiting, so no timeout is armed */
+		entry = &batch[i];
+		entry->result = gb_operation_request_send_timeout(operation,
+					gb_operation_sync_callback, 0);
+		if (entry->result) {
+			gb_operation_destroy(operation);
+			operations[i] = NULL;
+		}
+	}
+
+	deadline = jiffies + msecs_to_jiffies(gb_connection_timeout(connection));
+	for (i = 0; i < count; i++) {
+		operation = operations[i];
+		if (!operation)
+			continue;
+
+		timeout = max_t(long, (long)(deadline - jiffies), 0);
+		timeout = wait_for_completion_interruptible_timeout(
+					&operation->completion, timeout);
+		if (timeout < 0) {
+			/* Cancel the operation if interrupted */
+			gb_operation_cancel(operation, -ECANCELED);
+		} else if (timeout == 0) {
+			/* Cancel the operation if the batch timed out */
+			gb_operation_cancel(operation, -ETIMEDOUT);
+		}
+
+		entry = &batch[i];
+		entry->result = gb_operation_result(operation);
+		if (!entry->result && entry->response_size)
+			memcpy(entry->response, operation->response->payload,
+			       entry->response_size);
+		gb_operation_destroy(operation);
+	}
+	kfree(operations);
+
+	for (i = 0; i < count; i++) {
+		if (batch[i].result) {
+			ret = batch[i].result;
+			dev_err(&connection->dev,
+				"batched operation %u failed: %d\n", i, ret);
+			break;
+		}
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_batch);
+
+void gb_operation_latest_init(struct gb_operation_latest *latest,
+			      struct gb_connection *connection,
+			      const struct gb_operation_latest_ops *ops)
+{
+	latest->connection = connection;
+	latest->ops = ops;
+	spin_lock_init(&latest->lock);
+	latest->inflight = false;
+	latest->pending = false;
+	init_waitqueue_head(&latest->wait);
+}
+EXPORT_SYMBOL_GPL(gb_operation_latest_init);
+
+/*
+ * Nothing is in flight any more.  Called with the lock held, and
+ * woken under it, so gb_operation_latest_flush() can't return (and
+ * the caller free the value) before we're done with it.
+ */
+static void gb_operation_latest_done(struct gb_operation_latest *latest)
+{
+	latest->pending = false;
+	latest->inflight = false;
+	wake_up(&latest->wait);
+}
+
+static void gb_operation_latest_callback(struct gb_operation *operation)
+{
+	struct gb_operation_latest *latest = operation->private;
+	unsigned long flags;
+	bool pending;
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret)
+		dev_err(&operation->connection->dev,
+			"operation type 0x%02hhx failed: %d\n",
+			operation->type, ret);
+	gb_operation_put(operation);
+
+	spin_lock_irqsave(&latest->lock, flags);
+	pending = latest->pending;
+	if (!pending)
+		gb_operation_latest_done(latest);
+	spin_unlock_irqrestore(&latest->lock, flags);
+
+	if (pending)
+		gb_operation_latest_send(latest);
+}
+
+/**
+ * gb_operation_latest_set: note that the value has changed
+ * @latest: the value
+ *
+ * Called with the lock held, once the value has been updated.  If
+ * this returns true, nothing was in flight, and the caller must call
+ * gb_operation_latest_send() once it has dropped the lock.  Otherwise
+ * the value is sent when what's in flight completes.
+ */
+bool gb_operation_latest_set(struct gb_operation_latest *latest)
+{
+	latest->pending = true;
+	if (latest->inflight)
+		return false;
+	latest->inflight = true;
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(gb_operation_latest_set);
+
+/**
+ * gb_operation_latest_send: send the pending value
+ * @latest: the value, marked in flight by gb_operation_latest_set()
+ *
+ * Completion is handled by gb_operation_latest_callback(), which
+ * sends whatever became pending in the meantime.  Errors are only
+ * logged.
+ */
+void gb_operation_latest_send(struct gb_operation_latest *latest)
+{
+	struct gb_operation *operation;
+	unsigned long flags;
+	int ret;
+
+	while (1) {
+		operation = latest->ops->create(latest);
+		if (!operation) {
+			ret = -ENOMEM;
+			goto err_done;
+		}
+
+		spin_lock_irqsave(&latest->lock, flags);
+		if (!latest->pending) {
+			/* Dropped meanwhile (see gb_operation_latest_drop()) */
+			gb_operation_latest_done(latest);
+			spin_unlock_irqrestore(&latest->lock, flags);
+			gb_operation_put(operation);
+			return;
+		}
+		if (latest->ops->fill(latest, operation))
+			break;
+		spin_unlock_irqrestore(&latest->lock, flags);
+
+		gb_operation_put(operation);
+	}
+	latest->pending = false;
+	spin_unlock_irqrestore(&latest->lock, flags);
+
+	operation->private = latest;
+	ret = gb_operation_request_send(operation,
+					gb_operation_latest_callback);
+	if (ret) {
+		gb_operation_put(operation);
+		goto err_done;
+	}
+
+	return;
+
+err_done:
+	dev_err(&latest->connection->dev, "failed to send operation: %d\n",
+		ret);
+	spin_lock_irqsave(&latest->lock, flags);
+	gb_operation_latest_done(latest);
+	spin_unlock_irqrestore(&latest->lock, flags);
+}
+EXPORT_SYMBOL_GPL(gb_operation_latest_send);
+
+/* Forget a pending value that hasn't been sent yet */
+void gb_operation_latest_drop(struct gb_operation_latest *latest)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&latest->lock, flags);
+	latest->pending = false;
+	spin_unlock_irqrestore(&latest->lock, flags);
+}
+EXPORT_SYMBOL_GPL(gb_operation_latest_drop);
+
+static bool gb_operation_latest_idle(struct gb_operation_latest *latest)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&latest->lock, flags);
+	idle = !latest->inflight;
+	spin_unlock_irqrestore(&latest->lock, flags);
+
+	return idle;
+}
+
+/* Wait until what's been set has all been sent (or dropped) */
+void gb_operation_latest_flush(struct gb_operation_latest *latest)
+{
+	wait_event(latest->wait, gb_operation_latest_idle(latest));
+}
+EXPORT_SYMBOL_GPL(gb_operation_latest_flush);
+
+static void gb_message_pools_exit(void)
+{
+	struct gb_message_pool *pool;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_message_pools); i++) {
+		pool = &gb_message_pools[i];
+		if (pool->pool)
+			mempool_destroy(pool->pool);
+		pool->pool = NULL;
+		if (pool->cache)
+			kmem_cache_destroy(pool->cache);
+		pool->cache = NULL;
+	}
+}
+
+static int gb_message_pools_init(void)
+{
+	struct gb_message_pool *pool;
+	size_t size;
+	int i;
 
 	/*
 	 * A message structure consists of:
@@ -973,43 +2600,61 @@ int gb_operation_init(void)
 	 *  - the headroom set aside for the host device
 	 *  - the message header
 	 *  - space for the message payload
-	 * Messages with no payload are a fairly common case and
-	 * have a known fixed maximum size, so we use a slab cache
-	 * for them.
 	 */
-	size = sizeof(struct gb_message) + GB_BUFFER_HEADROOM_MAX +
-				sizeof(struct gb_operation_msg_hdr);
-	gb_simple_message_cache = kmem_cache_create("gb_simple_message_cache",
-							size, 0, 0, NULL);
-	if (!gb_simple_message_cache)
+	for (i = 0; i < ARRAY_SIZE(gb_message_pools); i++) {
+		pool = &gb_message_pools[i];
+		size = sizeof(struct gb_message) + GB_BUFFER_HEADROOM_MAX +
+				pool->size;
+		pool->cache = kmem_cache_create(pool->name, size, 0, 0, NULL);
+		if (!pool->cache)
+			goto err_exit;
+		pool->pool = mempool_create_slab_pool(GB_OPERATION_POOL_RESERVE,
+							pool->cache);
+		if (!pool->pool)
+			goto err_exit;
+	}
+
+	return 0;
+err_exit:
+	gb_message_pools_exit();
+
+	return -ENOMEM;
+}
+
+int gb_operation_init(void)
+{
+	BUILD_BUG_ON(GB_OPERATION_MESSAGE_SIZE_MAX >
+			U16_MAX - sizeof(struct gb_operation_msg_hdr));
+	BUILD_BUG_ON(GB_OPERATION_FRAGMENTED_SIZE_MAX > U16_MAX);
+
+	if (gb_message_pools_init())
 		return -ENOMEM;
 
 	gb_operation_cache = kmem_cache_create("gb_operation_cache",
 				sizeof(struct gb_operation), 0, 0, NULL);
 	if (!gb_operation_cache)
-		goto err_simple;
+		goto err_message_pools;
 
-	gb_operation_workqueue = alloc_workqueue("greybus_operation", 0, 1);
-	if (!gb_operation_workqueue)
-		goto err_operation;
+	gb_operation_pool = mempool_create_slab_pool(GB_OPERATION_POOL_RESERVE,
+							gb_operation_cache);
+	if (!gb_operation_pool)
+		goto err_operation_cache;
 
 	return 0;
-err_operation:
+err_operation_cache:
 	kmem_cache_destroy(gb_operation_cache);
 	gb_operation_cache = NULL;
-err_simple:
-	kmem_cache_destroy(gb_simple_message_cache);
-	gb_simple_message_cache = NULL;
+err_message_pools:
+	gb_message_pools_exit();
 
 	return -ENOMEM;
 }
 
 void gb_operation_exit(void)
 {
-	destroy_workqueue(gb_operation_workqueue);
-	gb_operation_workqueue = NULL;
+	mempool_destroy(gb_operation_pool);
+	gb_operation_pool = NULL;
 	kmem_cache_destroy(gb_operation_cache);
 	gb_operation_cache = NULL;
-	kmem_cache_destroy(gb_simple_message_cache);
-	gb_simple_message_cache = NULL;
+	gb_message_pools_exit();
 }
@@ -11,8 +11,16 @@
 #define __OPERATION_H
 
 #include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 struct gb_operation;
+struct gb_message_pool;
+
+/* The default amount of time a request is given to complete */
+#define GB_OPERATION_TIMEOUT_DEFAULT	1000	/* milliseconds */
 
 /*
  * No protocol may define an operation that has numeric value 0x00.
@@ -26,6 +34,55 @@ struct gb_operation;
  */
 #define GB_OPERATION_TYPE_RESPONSE	((u8)0x80)
 
+/*
+ * All operation messages (both requests and responses) begin with
+ * a header that encodes the size of the message (header included).
+ * This header also contains a unique identifier, that associates a
+ * response message with its operation.  The header contains an
+ * operation type field, whose interpretation is dependent on what
+ * type of protocol is used over the connection.  The high bit
+ * (0x80) of the operation type field is used to indicate whether
+ * the message is a request (clear) or a response (set).
+ *
+ * Response messages include an additional result byte, which
+ * communicates the result of the corresponding request.  A zero
+ * result value means the operation completed successfully.  Any
+ * other value indicates an error; in this case, the payload of the
+ * response message (if any) is ignored.  The result byte must be
+ * zero in the header for a request message.
+ *
+ * The wire format for all numeric fields in the header is little
+ * endian.  Any operation-specific data begins immediately after the
+ * header, and is 64-bit aligned.
+ */
+struct gb_operation_msg_hdr {
+	__le16	size;		/* Size in bytes of header + payload */
+	__le16	operation_id;	/* Operation unique id */
+	__u8	type;		/* E.g GB_I2C_TYPE_* or GB_GPIO_TYPE_* */
+	__u8	result;		/* Result of request (in responses only) */
+	__u8	flags;		/* GB_OPERATION_FLAG_* */
+	/* 1 byte pad, must be zero (ignore when read) */
+} __aligned(sizeof(u64));
+
+/*
+ * A message too big for the host device can be sent in fragments,
+ * on connections whose protocol driver has found (from the version
+ * the module reports) that the module takes them, and has set the
+ * connection's fragments flag.  Elsewhere the FRAGMENT flag means
+ * nothing and is ignored.  Each fragment is a message of its own,
+ * with the header of the whole message (but its own size) and the
+ * FRAGMENT flag set.  Its payload starts with a fragment header
+ * telling where its data go.  All but the last fragment carry as
+ * much data as fits in a host device buffer.  Fragments can arrive
+ * in any order; the message is complete once each has arrived.
+ */
+#define GB_OPERATION_FLAG_FRAGMENT	((u8)0x01)
+
+struct gb_operation_fragment_hdr {
+	__le32	offset;		/* Of the data following, in the payload */
+	__le32	payload_size;	/* Of the whole message */
+};
+
 enum gb_operation_result {
 	GB_OP_SUCCESS		= 0x00,
 	GB_OP_INTERRUPTED	= 0x01,
@@ -53,6 +110,19 @@ struct gb_message {
 	void				*payload;
 	size_t				payload_size;
 
+	struct gb_message_pool		*pool;		/* NULL if kmalloc()ed */
+	void				*rx_cookie;	/* Lent host buffer */
+	struct list_head		tx_links;	/* connection->tx_queue */
+
+	/* For a message sent, or received, in fragments */
+	struct gb_message		*parent;	/* If a fragment */
+	struct gb_message		**fragments;
+	unsigned int			fragment_count;
+	atomic_t			fragments_pending;
+	int				fragment_status;
+	unsigned long			*fragments_received;	/* Bitmap */
+	size_t				received;	/* Payload bytes */
+
 	u8				buffer[];
 };
 
@@ -86,21 +156,80 @@ struct gb_operation {
 	int			errno;		/* Operation result */
 
 	struct work_struct	work;
+	struct delayed_work	timeout_work;	/* If asynchronous */
 	gb_operation_callback	callback;	/* If asynchronous */
 	struct completion	completion;	/* Used if no callback */
+	ktime_t			send_time;	/* For round trip time */
+	void			*private;	/* For the operation's user */
 
 	struct kref		kref;
 	struct list_head	links;		/* connection->operations */
+
+	/* See gb_operation_window_get() */
+	struct list_head	window_links;	/* connection->window_queue */
+	bool			window_held;
+};
+
+/*
+ * One operation in a batch sent with gb_operation_batch().  The
+ * buffers are used as by gb_operation_sync(); the result of the
+ * operation is stored in result.
+ */
+struct gb_operation_batch_entry {
+	int			type;
+	void			*request;
+	int			request_size;
+	void			*response;
+	int			response_size;
+	int			result;
+};
+
+struct gb_operation_latest;
+
+/*
+ * The request for a gb_operation_latest is built in two steps.
+ * create() makes an operation for the value as it is now, without
+ * the lock held.  fill() then copies the value into its request with
+ * the lock held; it returns false if the value has changed meanwhile
+ * so that the operation no longer fits it, and create() is called
+ * again.
+ */
+struct gb_operation_latest_ops {
+	struct gb_operation *(*create)(struct gb_operation_latest *latest);
+	bool (*fill)(struct gb_operation_latest *latest,
+		     struct gb_operation *operation);
+};
+
+/*
+ * A value kept up to date on the other end of a connection without
+ * waiting, where only the most recent one matters.  One request is
+ * in flight at a time; a value set while it is becomes pending
+ * (replacing any already pending) and is sent once the first has
+ * completed.  The lock also protects the value itself, which lives
+ * in whatever embeds this.
+ */
+struct gb_operation_latest {
+	struct gb_connection			*connection;
+	const struct gb_operation_latest_ops	*ops;
+	spinlock_t				lock;
+	bool					inflight;
+	bool					pending;
+	wait_queue_head_t			wait;	/* Nothing in flight */
 };
 
 void gb_connection_recv(struct gb_connection *connection,
 					void *data, size_t size);
+bool gb_connection_recv_lent(struct gb_connection *connection,
+					void *data, size_t size, void *cookie);
+void gb_connection_partial_flush(struct gb_connection *connection);
 
 int gb_operation_result(struct gb_operation *operation);
 
 struct gb_operation *gb_operation_create(struct gb_connection *connection,
 					u8 type, size_t request_size,
 					size_t response_size);
+int gb_operation_reuse(struct gb_operation *operation, size_t request_size,
+			size_t response_size);
 void gb_operation_get(struct gb_operation *operation);
 void gb_operation_put(struct gb_operation *operation);
 static inline void gb_operation_destroy(struct gb_operation *operation)
@@ -113,17 +242,48 @@ bool gb_operation_response_alloc(struct gb_operation *operation,
 
 int gb_operation_request_send(struct gb_operation *operation,
 				gb_operation_callback callback);
+int gb_operation_request_send_timeout(struct gb_operation *operation,
+					gb_operation_callback callback,
+					unsigned int timeout_ms);
 int gb_operation_request_send_sync(struct gb_operation *operation);
+int gb_operation_request_send_sync_timeout(struct gb_operation *operation,
+						unsigned int timeout_ms);
 int gb_operation_response_send(struct gb_operation *operation, int errno);
 
-void gb_operation_cancel(struct gb_operation *operation, int errno);
+bool gb_operation_cancel(struct gb_operation *operation, int errno);
 
 void greybus_data_sent(struct greybus_host_device *hd,
 				void *header, int status);
 
+int gb_operation_sync_timeout(struct gb_connection *connection, int type,
+				void *request, int request_size,
+				void *response, int response_size,
+				unsigned int timeout);
 int gb_operation_sync(struct gb_connection *connection, int type,
 		      void *request, int request_size,
 		      void *response, int response_size);
+int gb_operation_batch(struct gb_connection *connection,
+			struct gb_operation_batch_entry *batch,
+			unsigned int count);
+
+void gb_operation_latest_init(struct gb_operation_latest *latest,
+			      struct gb_connection *connection,
+			      const struct gb_operation_latest_ops *ops);
+bool gb_operation_latest_set(struct gb_operation_latest *latest);
+void gb_operation_latest_send(struct gb_operation_latest *latest);
+void gb_operation_latest_drop(struct gb_operation_latest *latest);
+void gb_operation_latest_flush(struct gb_operation_latest *latest);
+
+unsigned int gb_connection_timeout(struct gb_connection *connection);
+size_t gb_operation_payload_max(struct gb_connection *connection);
+
+void gb_connection_window_init(struct gb_connection *connection);
+void gb_connection_window_set(struct gb_connection *connection,
+			      unsigned int window);
+
+void gb_hd_tx_init(struct greybus_host_device *hd);
+void gb_connection_tx_priority_set(struct gb_connection *connection,
+				   u8 priority);
 
 int gb_operation_init(void);
 void gb_operation_exit(void);
@@ -20,6 +20,10 @@ struct gb_protocol_version_response {
 	__u8	minor;
 };
 
+/* Protocol flags */
+#define GB_PROTOCOL_HIGHPRI		BIT(0)	/* Latency sensitive */
+#define GB_PROTOCOL_BULK		BIT(2)	/* Sends bulk data */
+
 typedef int (*gb_connection_init_t)(struct gb_connection *);
 typedef void (*gb_connection_exit_t)(struct gb_connection *);
 typedef void (*gb_request_recv_t)(u8, struct gb_operation *);
@@ -34,6 +38,7 @@ struct gb_protocol {
 	u8			major;
 	u8			minor;
 	u8			count;
+	unsigned long		flags;
 
 	struct list_head	links;		/* global list */
 
@@ -10,9 +10,37 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/pwm.h>
 #include "greybus.h"
 
+static bool async_apply = true;
+module_param(async_apply, bool, 0644);
+MODULE_PARM_DESC(async_apply,
+		 "Don't wait for pwm updates, and drop those superseded before being sent");
+
+/* Everything about a pwm that's set with an APPLY request */
+struct gb_pwm_state {
+	u32			duty;
+	u32			period;
+	u8			polarity;
+	bool			enabled;
+};
+
+/*
+ * The most recent state set for a pwm.  With async_apply, it is sent
+ * without waiting, and only the latest one is sure to be (see struct
+ * gb_operation_latest).
+ */
+struct gb_pwm_channel {
+	struct gb_pwm_chip	*pwmc;
+	u8			which;
+	struct gb_operation_latest	latest;
+	struct gb_pwm_state	state;		/* under latest.lock */
+};
+#define latest_to_gb_pwm_channel(l) \
+	container_of(l, struct gb_pwm_channel, latest)
+
 struct gb_pwm_chip {
 	struct gb_connection	*connection;
 	u8			version_major;
@@ -21,6 +49,11 @@ struct gb_pwm_chip {
 
 	struct pwm_chip		chip;
 	struct pwm_chip		*pwm;
+
+	/* Used if the module handles APPLY (see gb_pwm_apply_queue()) */
+	bool			apply;
+	bool			async;
+	struct gb_pwm_channel	*channels;
 };
 #define pwm_chip_to_gb_pwm_chip(chip) \
 	container_of(chip, struct gb_pwm_chip, chip)
@@ -29,6 +62,9 @@ struct gb_pwm_chip {
 #define	GB_PWM_VERSION_MAJOR		0x00
 #define	GB_PWM_VERSION_MINOR		0x01
 
+/* Modules reporting this minor version or later handle APPLY */
+#define	GB_PWM_VERSION_MINOR_APPLY	0x02
+
 /* Greybus PWM request types */
 #define	GB_PWM_TYPE_INVALID		0x00
 #define	GB_PWM_TYPE_PROTOCOL_VERSION	0x01
@@ -39,6 +75,7 @@ struct gb_pwm_chip {
 #define	GB_PWM_TYPE_POLARITY		0x06
 #define	GB_PWM_TYPE_ENABLE		0x07
 #define	GB_PWM_TYPE_DISABLE		0x08
+#define	GB_PWM_TYPE_APPLY		0x09
 #define	GB_PWM_TYPE_RESPONSE		0x80	/* OR'd with rest */
 
 /* pwm count request has no payload */
@@ -73,6 +110,15 @@ struct gb_pwm_disable_request {
 	__u8	which;
 };
 
+/* Config, polarity and enable (or disable) at once */
+struct gb_pwm_apply_request {
+	__u8	which;
+	__u8	polarity;
+	__u8	enabled;
+	__le32	duty __packed;
+	__le32	period __packed;
+};
+
 /* Define get_version() routine */
 define_get_version(gb_pwm_chip, PWM);
 
@@ -171,6 +217,83 @@ static int gb_pwm_disable_operation(struct gb_pwm_chip *pwmc,
 				 &request, sizeof(request), NULL, 0);
 }
 
+static void gb_pwm_apply_fill(struct gb_pwm_apply_request *request,
+			      struct gb_pwm_channel *channel)
+{
+	struct gb_pwm_state *state = &channel->state;
+
+	request->which = channel->which;
+	request->polarity = state->polarity;
+	request->enabled = state->enabled;
+	request->duty = cpu_to_le32(state->duty);
+	request->period = cpu_to_le32(state->period);
+}
+
+static struct gb_operation *
+gb_pwm_apply_create(struct gb_operation_latest *latest)
+{
+	return gb_operation_create(latest->connection, GB_PWM_TYPE_APPLY,
+				   sizeof(struct gb_pwm_apply_request), 0);
+}
+
+static bool gb_pwm_apply_latest_fill(struct gb_operation_latest *latest,
+				     struct gb_operation *operation)
+{
+	gb_pwm_apply_fill(operation->request->payload,
+			  latest_to_gb_pwm_channel(latest));
+
+	return true;
+}
+
+static const struct gb_operation_latest_ops gb_pwm_apply_ops = {
+	.create		= gb_pwm_apply_create,
+	.fill		= gb_pwm_apply_latest_fill,
+};
+
+/*
+ * Set the whole state of a pwm with a single APPLY request.  With
+ * async_apply it is sent without waiting, and errors are only
+ * logged; a state superseded before it could be sent never is.
+ */
+static int gb_pwm_apply_queue(struct gb_pwm_chip *pwmc, u8 which,
+			      struct gb_pwm_state *state)
+{
+	struct gb_pwm_channel *channel;
+	struct gb_pwm_apply_request request;
+	unsigned long flags;
+	bool send;
+
+	if (which > pwmc->pwm_max)
+		return -EINVAL;
+	channel = &pwmc->channels[which];
+
+	spin_lock_irqsave(&channel->latest.lock, flags);
+	channel->state = *state;
+	if (!pwmc->async) {
+		gb_pwm_apply_fill(&request, channel);
+		spin_unlock_irqrestore(&channel->latest.lock, flags);
+
+		return gb_operation_sync(pwmc->connection, GB_PWM_TYPE_APPLY,
+					 &request, sizeof(request), NULL, 0);
+	}
+	send = gb_operation_latest_set(&channel->latest);
+	spin_unlock_irqrestore(&channel->latest.lock, flags);
+
+	if (send)
+		gb_operation_latest_send(&channel->latest);
+
+	return 0;
+}
+
+/* Wait until what's been applied to a pwm has all been sent */
+static void gb_pwm_flush(struct gb_pwm_chip *pwmc, u8 which)
+{
+	if (!pwmc->apply || which > pwmc->pwm_max)
+		return;
+
+	gb_operation_latest_flush(&pwmc->channels[which].latest);
+}
+
 static int gb_pwm_request(struct pwm_chip *chip, struct pwm_device *pwm)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
@@ -182,16 +305,95 @@ static void gb_pwm_free(struct pwm_chip *chip, struct pwm_device *pwm)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
 
+#ifdef PWM_OPS_HAS_APPLY
+	if (pwm_is_enabled(pwm))
+#else
 	if (test_bit(PWMF_ENABLED, &pwm->flags))
+#endif
 		dev_warn(chip->dev, "freeing PWM device without disabling\n");
 
+	/* Don't let the deactivate overtake an update not yet sent */
+	gb_pwm_flush(pwmc, pwm->hwpwm);
 	gb_pwm_deactivate_operation(pwmc, pwm->hwpwm);
 }
 
+#ifdef PWM_OPS_HAS_APPLY
+static int gb_pwm_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+			struct pwm_state *state)
+{
+	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+	struct gb_pwm_state gb_state;
+	int ret;
+
+	if (pwmc->apply) {
+		gb_state.duty = state->duty_cycle;
+		gb_state.period = state->period;
+		gb_state.polarity = state->polarity;
+		gb_state.enabled = state->enabled;
+
+		return gb_pwm_apply_queue(pwmc, pwm->hwpwm, &gb_state);
+	}
+
+	/* One request for each part of the state */
+	if (!state->enabled) {
+		if (pwm_is_enabled(pwm))
+			return gb_pwm_disable_operation(pwmc, pwm->hwpwm);
+		return 0;
+	}
+
+	ret = gb_pwm_set_polarity_operation(pwmc, pwm->hwpwm,
+					    state->polarity);
+	if (ret)
+		return ret;
+
+	ret = gb_pwm_config_operation(pwmc, pwm->hwpwm, state->duty_cycle,
+				      state->period);
+	if (ret)
+		return ret;
+
+	if (!pwm_is_enabled(pwm))
+		return gb_pwm_enable_operation(pwmc, pwm->hwpwm);
+
+	return 0;
+}
+
+static const struct pwm_ops gb_pwm_ops = {
+	.request = gb_pwm_request,
+	.free = gb_pwm_free,
+	.apply = gb_pwm_apply,
+	.owner = THIS_MODULE,
+};
+#else
+/*
+ * The callbacks below each change one part of the state, and send
+ * all of it, to a module that takes APPLY requests.
+ */
+static struct gb_pwm_state gb_pwm_state_get(struct gb_pwm_chip *pwmc, u8 which)
+{
+	struct gb_pwm_channel *channel = &pwmc->channels[which];
+	struct gb_pwm_state state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&channel->latest.lock, flags);
+	state = channel->state;
+	spin_unlock_irqrestore(&channel->latest.lock, flags);
+
+	return state;
+}
+
 static int gb_pwm_config(struct pwm_chip *chip, struct pwm_device *pwm,
 			 int duty_ns, int period_ns)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+	struct gb_pwm_state state;
+
+	if (pwmc->apply) {
+		state = gb_pwm_state_get(pwmc, pwm->hwpwm);
+		state.duty = duty_ns;
+		state.period = period_ns;
+
+		return gb_pwm_apply_queue(pwmc, pwm->hwpwm, &state);
+	}
 
 	return gb_pwm_config_operation(pwmc, pwm->hwpwm, duty_ns, period_ns);
 };
@@ -200,6 +402,14 @@ static int gb_pwm_set_polarity(struct pwm_chip *chip, struct pwm_device *pwm,
 			       enum pwm_polarity polarity)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+	struct gb_pwm_state state;
+
+	if (pwmc->apply) {
+		state = gb_pwm_state_get(pwmc, pwm->hwpwm);
+		state.polarity = polarity;
+
+		return gb_pwm_apply_queue(pwmc, pwm->hwpwm, &state);
+	}
 
 	return gb_pwm_set_polarity_operation(pwmc, pwm->hwpwm, polarity);
 };
@@ -207,6 +417,14 @@ static int gb_pwm_set_polarity(struct pwm_chip *chip, struct pwm_device *pwm,
 static int gb_pwm_enable(struct pwm_chip *chip, struct pwm_device *pwm)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+	struct gb_pwm_state state;
+
+	if (pwmc->apply) {
+		state = gb_pwm_state_get(pwmc, pwm->hwpwm);
+		state.enabled = true;
+
+		return gb_pwm_apply_queue(pwmc, pwm->hwpwm, &state);
+	}
 
 	return gb_pwm_enable_operation(pwmc, pwm->hwpwm);
 };
@@ -214,6 +432,15 @@ static int gb_pwm_enable(struct pwm_chip *chip, struct pwm_device *pwm)
 static void gb_pwm_disable(struct pwm_chip *chip, struct pwm_device *pwm)
 {
 	struct gb_pwm_chip *pwmc = pwm_chip_to_gb_pwm_chip(chip);
+	struct gb_pwm_state state;
+
+	if (pwmc->apply) {
+		state = gb_pwm_state_get(pwmc, pwm->hwpwm);
+		state.enabled = false;
+
+		gb_pwm_apply_queue(pwmc, pwm->hwpwm, &state);
+		return;
+	}
 
 	gb_pwm_disable_operation(pwmc, pwm->hwpwm);
 };
@@ -227,12 +454,14 @@ static const struct pwm_ops gb_pwm_ops = {
 	.disable = gb_pwm_disable,
 	.owner = THIS_MODULE,
 };
+#endif
 
 static int gb_pwm_connection_init(struct gb_connection *connection)
 {
 	struct gb_pwm_chip *pwmc;
 	struct pwm_chip *pwm;
 	int ret;
+	int i;
 
 	pwmc = kzalloc(sizeof(*pwmc), GFP_KERNEL);
 	if (!pwmc)
@@ -250,6 +479,21 @@ static int gb_pwm_connection_init(struct gb_connection *connection)
 	if (ret)
 		goto out_err;
 
+	pwmc->channels = kcalloc(pwmc->pwm_max + 1, sizeof(*pwmc->channels),
+				 GFP_KERNEL);
+	if (!pwmc->channels) {
+		ret = -ENOMEM;
+		goto out_err;
+	}
+	for (i = 0; i <= pwmc->pwm_max; i++) {
+		pwmc->channels[i].pwmc = pwmc;
+		pwmc->channels[i].which = i;
+		gb_operation_latest_init(&pwmc->channels[i].latest,
+					 connection, &gb_pwm_apply_ops);
+	}
+	pwmc->apply = pwmc->version_minor >= GB_PWM_VERSION_MINOR_APPLY;
+	pwmc->async = async_apply;
+
 	pwm = &pwmc->chip;
 
 	pwm->dev = &connection->dev;
@@ -266,6 +510,7 @@ static int gb_pwm_connection_init(struct gb_connection *connection)
 
 	return 0;
 out_err:
+	kfree(pwmc->channels);
 	kfree(pwmc);
 	return ret;
 }
@@ -273,12 +518,16 @@ out_err:
 static void gb_pwm_connection_exit(struct gb_connection *connection)
 {
 	struct gb_pwm_chip *pwmc = connection->private;
+	int i;
 
 	if (!pwmc)
 		return;
 
 	pwmchip_remove(&pwmc->chip);
+	for (i = 0; i <= pwmc->pwm_max; i++)
+		gb_pwm_flush(pwmc, i);
 	/* kref_put(pwmc->connection) */
+	kfree(pwmc->channels);
 	kfree(pwmc);
 }
 
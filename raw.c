@@ -0,0 +1,579 @@
+/*
+ * Greybus raw protocol driver.
+ *
+ * Gives user space direct access to a connection through a character
+ * device and a pair of rings in memory shared with it (see
+ * greybus_raw.h), so protocols can be prototyped, and connections
+ * driven at high rates, without a kernel driver.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2014 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include "greybus.h"
+#include "greybus_raw.h"
+
+#define GB_RAW_MINORS_MAX	256
+
+static unsigned int ring_entries = 64;
+module_param(ring_entries, uint, 0644);
+MODULE_PARM_DESC(ring_entries, "Submission ring size of new raw devices (rounded up to a power of two)");
+
+struct gb_raw {
+	struct gb_connection	*connection;
+	struct kref		kref;
+	struct cdev		*cdev;
+	struct device		*device;
+	int			minor;
+
+	/* The shared memory area, and where things are in it */
+	void			*area;
+	struct gb_raw_info	info;
+	struct gb_raw_rings	*rings;
+	struct gb_raw_sqe	*sqes;
+	struct gb_raw_cqe	*cqes;
+	u8			*slots;
+	u8			*rx;
+
+	struct mutex		submit_lock;	/* sq_head, disconnected */
+	u32			sq_head;
+	bool			disconnected;
+	bool			opened;
+
+	spinlock_t		lock;		/* cq_tail, inflight */
+	u32			cq_tail;
+	unsigned int		inflight;
+	wait_queue_head_t	wait;		/* completions, idle */
+};
+
+/* What a request in flight needs to complete it */
+struct gb_raw_request {
+	struct gb_raw		*raw;
+	u64			user_data;
+	u32			slot;
+};
+
+static struct class *raw_class;
+static dev_t raw_dev_num;
+static DEFINE_IDR(minors);
+static DEFINE_MUTEX(minors_lock);
+
+static void gb_raw_release(struct kref *kref)
+{
+	struct gb_raw *raw = container_of(kref, struct gb_raw, kref);
+
+	vfree(raw->area);
+	kfree(raw);
+}
+
+/*
+ * Entries in the completion ring, as far as we can tell; user space
+ * owns its head.  Called with the lock held.
+ */
+static u32 gb_raw_cq_used(struct gb_raw *raw)
+{
+	u32 used = raw->cq_tail - ACCESS_ONCE(raw->rings->cq.head);
+
+	return min(used, raw->info.cq_entries);
+}
+
+/*
+ * Add a completion, for which room has been made.  Called with the
+ * lock held.
+ */
+static void gb_raw_cqe_post(struct gb_raw *raw, u64 user_data, int status,
+			    u16 size, u8 type, u8 flags)
+{
+	struct gb_raw_cqe *cqe;
+
+	cqe = &raw->cqes[raw->cq_tail & (raw->info.cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->status = status;
+	cqe->size = size;
+	cqe->type = type;
+	cqe->flags = flags;
+
+	/* The entry must be seen before the new tail */
+	smp_wmb();
+	raw->cq_tail++;
+	ACCESS_ONCE(raw->rings->cq.tail) = raw->cq_tail;
+}
+
+/* Complete a request that came from (or had room made in) a submission */
+static void gb_raw_complete(struct gb_raw *raw, u64 user_data, int status,
+			    u16 size, u8 type)
+{
+	unsigned long flags;
+
+	/*
+	 * Woken with the lock held, as once inflight reaches zero
+	 * gb_raw_connection_exit() can go on to free raw.
+	 */
+	spin_lock_irqsave(&raw->lock, flags);
+	gb_raw_cqe_post(raw, user_data, status, size, type, 0);
+	raw->inflight--;
+	wake_up_interruptible(&raw->wait);
+	spin_unlock_irqrestore(&raw->lock, flags);
+}
+
+static void gb_raw_request_callback(struct gb_operation *operation)
+{
+	struct gb_raw_request *request = operation->private;
+	struct gb_raw *raw = request->raw;
+	u16 size = 0;
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (!ret) {
+		size = operation->response->payload_size;
+		memcpy(raw->slots + request->slot * raw->info.slot_size,
+		       operation->response->payload, size);
+	}
+	gb_raw_complete(raw, request->user_data, ret, size, operation->type);
+
+	kfree(request);
+	gb_operation_put(operation);
+}
+
+/* Send one submitted request; a copy of its entry is passed in */
+static int gb_raw_request_send(struct gb_raw *raw, struct gb_raw_sqe *sqe)
+{
+	struct gb_connection *connection = raw->connection;
+	struct gb_raw_request *request;
+	struct gb_operation *operation;
+	unsigned int timeout;
+	int ret;
+
+	if (sqe->type == GB_OPERATION_TYPE_INVALID ||
+	    sqe->type & GB_OPERATION_TYPE_RESPONSE)
+		return -EINVAL;
+	if (sqe->slot >= raw->info.slot_count ||
+	    sqe->request_size > raw->info.slot_size ||
+	    sqe->response_size > raw->info.slot_size)
+		return -EINVAL;
+
+	request = kmalloc(sizeof(*request), GFP_KERNEL);
+	if (!request)
+		return -ENOMEM;
+	request->raw = raw;
+	request->user_data = sqe->user_data;
+	request->slot = sqe->slot;
+
+	operation = gb_operation_create(connection, sqe->type,
+					sqe->request_size, sqe->response_size);
+	if (!operation) {
+		kfree(request);
+		return -ENOMEM;
+	}
+	operation->private = request;
+	memcpy(operation->request->payload,
+	       raw->slots + sqe->slot * raw->info.slot_size,
+	       sqe->request_size);
+
+	timeout = sqe->timeout_ms ? : gb_connection_timeout(connection);
+	ret = gb_operation_request_send_timeout(operation,
+					gb_raw_request_callback, timeout);
+	if (ret) {
+		kfree(request);
+		gb_operation_put(operation);
+	}
+
+	return ret;
+}
+
+/*
+ * Send whatever's in the submission ring, as long as there's room
+ * for its completion.  A request that can't be sent completes right
+ * away with the error.  Returns the number of requests taken, or an
+ * error if there were some but none could be taken.
+ */
+static long gb_raw_submit(struct gb_raw *raw)
+{
+	u32 mask = raw->info.sq_entries - 1;
+	struct gb_raw_sqe sqe;
+	long count = 0;
+	bool room;
+	u32 tail;
+	int ret;
+
+	mutex_lock(&raw->submit_lock);
+	if (raw->disconnected) {
+		mutex_unlock(&raw->submit_lock);
+		return -ENODEV;
+	}
+
+	tail = ACCESS_ONCE(raw->rings->sq.tail);
+	if (tail - raw->sq_head > raw->info.sq_entries) {
+		mutex_unlock(&raw->submit_lock);
+		return -EINVAL;
+	}
+	/* Read the entries only after the tail */
+	smp_rmb();
+
+	while (raw->sq_head != tail) {
+		spin_lock_irq(&raw->lock);
+		room = gb_raw_cq_used(raw) + raw->inflight <
+							raw->info.cq_entries;
+		if (room)
+			raw->inflight++;
+		spin_unlock_irq(&raw->lock);
+		if (!room)
+			break;
+
+		memcpy(&sqe, &raw->sqes[raw->sq_head & mask], sizeof(sqe));
+		ret = gb_raw_request_send(raw, &sqe);
+		if (ret)
+			gb_raw_complete(raw, sqe.user_data, ret, 0, sqe.type);
+
+		raw->sq_head++;
+		count++;
+	}
+	ACCESS_ONCE(raw->rings->sq.head) = raw->sq_head;
+	if (!count && raw->sq_head != tail)
+		count = -EBUSY;
+	mutex_unlock(&raw->submit_lock);
+
+	return count;
+}
+
+/*
+ * Requests from the module are reported, payload and all, as a
+ * completion, and answered straight away.
+ */
+static void gb_raw_request_recv(u8 type, struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_raw *raw = connection->private;
+	struct gb_message *request = operation->request;
+	unsigned long flags;
+	u32 index;
+	int ret = 0;
+
+	spin_lock_irqsave(&raw->lock, flags);
+	if (request->payload_size > raw->info.slot_size) {
+		ret = -EMSGSIZE;
+	} else if (gb_raw_cq_used(raw) + raw->inflight >=
+						raw->info.cq_entries) {
+		raw->rings->dropped++;
+		ret = -ENOSPC;
+	} else {
+		index = raw->cq_tail & (raw->info.cq_entries - 1);
+		memcpy(raw->rx + index * raw->info.slot_size,
+		       request->payload, request->payload_size);
+		gb_raw_cqe_post(raw, 0, 0, request->payload_size, type,
+				GB_RAW_CQE_REQUEST);
+	}
+	spin_unlock_irqrestore(&raw->lock, flags);
+
+	if (!ret)
+		wake_up_interruptible(&raw->wait);
+
+	ret = gb_operation_response_send(operation, ret);
+	if (ret)
+		dev_err(&connection->dev, "failed to send response: %d\n",
+			ret);
+}
+
+static int gb_raw_open(struct inode *inode, struct file *file)
+{
+	struct gb_raw *raw;
+	int ret = 0;
+
+	mutex_lock(&minors_lock);
+	raw = idr_find(&minors, iminor(inode));
+	if (!raw) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	/* The rings have room for only one user */
+	mutex_lock(&raw->submit_lock);
+	if (raw->opened)
+		ret = -EBUSY;
+	else
+		raw->opened = true;
+	mutex_unlock(&raw->submit_lock);
+	if (ret)
+		goto out;
+
+	kref_get(&raw->kref);
+	file->private_data = raw;
+out:
+	mutex_unlock(&minors_lock);
+
+	return ret;
+}
+
+static int gb_raw_release_file(struct inode *inode, struct file *file)
+{
+	struct gb_raw *raw = file->private_data;
+
+	mutex_lock(&raw->submit_lock);
+	raw->opened = false;
+	mutex_unlock(&raw->submit_lock);
+
+	kref_put(&raw->kref, gb_raw_release);
+
+	return 0;
+}
+
+static int gb_raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gb_raw *raw = file->private_data;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start > raw->info.size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, raw->area, 0);
+}
+
+static unsigned int gb_raw_poll(struct file *file, poll_table *wait)
+{
+	struct gb_raw *raw = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &raw->wait, wait);
+
+	spin_lock_irq(&raw->lock);
+	if (gb_raw_cq_used(raw))
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irq(&raw->lock);
+
+	if (ACCESS_ONCE(raw->disconnected))
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static long gb_raw_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct gb_raw *raw = file->private_data;
+
+	switch (cmd) {
+	case GB_RAW_IOC_INFO:
+		if (copy_to_user((void __user *)arg, &raw->info,
+				 sizeof(raw->info)))
+			return -EFAULT;
+		return 0;
+	case GB_RAW_IOC_SUBMIT:
+		return gb_raw_submit(raw);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations gb_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= gb_raw_open,
+	.release	= gb_raw_release_file,
+	.mmap		= gb_raw_mmap,
+	.poll		= gb_raw_poll,
+	.unlocked_ioctl	= gb_raw_ioctl,
+	.compat_ioctl	= gb_raw_ioctl,
+	.llseek		= noop_llseek,
+};
+
+/* Lay out and allocate the shared memory area */
+static int gb_raw_area_alloc(struct gb_raw *raw)
+{
+	struct gb_raw_info *info = &raw->info;
+	size_t size;
+
+	info->sq_entries = roundup_pow_of_two(clamp(ring_entries, 1U, 4096U));
+	info->cq_entries = 2 * info->sq_entries;
+	info->slot_count = info->sq_entries;
+	info->slot_size = ALIGN(gb_operation_payload_max(raw->connection),
+				sizeof(u64));
+
+	size = ALIGN(sizeof(struct gb_raw_rings), sizeof(u64));
+	info->sq_offset = size;
+	size += info->sq_entries * sizeof(struct gb_raw_sqe);
+	info->cq_offset = size;
+	size += info->cq_entries * sizeof(struct gb_raw_cqe);
+	size = PAGE_ALIGN(size);
+	info->slots_offset = size;
+	size += info->slot_count * info->slot_size;
+	info->rx_offset = size;
+	size += info->cq_entries * info->slot_size;
+	info->size = PAGE_ALIGN(size);
+
+	raw->area = vmalloc_user(info->size);
+	if (!raw->area)
+		return -ENOMEM;
+
+	raw->rings = raw->area;
+	raw->sqes = raw->area + info->sq_offset;
+	raw->cqes = raw->area + info->cq_offset;
+	raw->slots = raw->area + info->slots_offset;
+	raw->rx = raw->area + info->rx_offset;
+
+	return 0;
+}
+
+static int gb_raw_connection_init(struct gb_connection *connection)
+{
+	struct gb_raw *raw;
+	dev_t devt;
+	int retval;
+
+	raw = kzalloc(sizeof(*raw), GFP_KERNEL);
+	if (!raw)
+		return -ENOMEM;
+
+	raw->connection = connection;
+	connection->private = raw;
+	kref_init(&raw->kref);
+	mutex_init(&raw->submit_lock);
+	spin_lock_init(&raw->lock);
+	init_waitqueue_head(&raw->wait);
+
+	retval = gb_raw_area_alloc(raw);
+	if (retval)
+		goto error;
+
+	mutex_lock(&minors_lock);
+	raw->minor = idr_alloc(&minors, raw, 0, GB_RAW_MINORS_MAX, GFP_KERNEL);
+	mutex_unlock(&minors_lock);
+	if (raw->minor < 0) {
+		retval = raw->minor;
+		goto error;
+	}
+	devt = MKDEV(MAJOR(raw_dev_num), raw->minor);
+
+	raw->cdev = cdev_alloc();
+	if (!raw->cdev) {
+		retval = -ENOMEM;
+		goto err_idr_remove;
+	}
+	raw->cdev->owner = THIS_MODULE;
+	raw->cdev->ops = &gb_raw_fops;
+	retval = cdev_add(raw->cdev, devt, 1);
+	if (retval) {
+		kobject_put(&raw->cdev->kobj);
+		goto err_idr_remove;
+	}
+
+	raw->device = device_create(raw_class, &connection->dev, devt, raw,
+				    "gb_raw%d", raw->minor);
+	if (IS_ERR(raw->device)) {
+		retval = PTR_ERR(raw->device);
+		goto err_cdev_del;
+	}
+
+	return 0;
+
+err_cdev_del:
+	cdev_del(raw->cdev);
+err_idr_remove:
+	mutex_lock(&minors_lock);
+	idr_remove(&minors, raw->minor);
+	mutex_unlock(&minors_lock);
+error:
+	connection->private = NULL;
+	vfree(raw->area);
+	kfree(raw);
+	return retval;
+}
+
+static bool gb_raw_idle(struct gb_raw *raw)
+{
+	bool idle;
+
+	spin_lock_irq(&raw->lock);
+	idle = !raw->inflight;
+	spin_unlock_irq(&raw->lock);
+
+	return idle;
+}
+
+static void gb_raw_connection_exit(struct gb_connection *connection)
+{
+	struct gb_raw *raw = connection->private;
+
+	/* No new opens, and no more submissions */
+	mutex_lock(&minors_lock);
+	idr_remove(&minors, raw->minor);
+	mutex_unlock(&minors_lock);
+
+	mutex_lock(&raw->submit_lock);
+	raw->disconnected = true;
+	mutex_unlock(&raw->submit_lock);
+	wake_up_interruptible(&raw->wait);
+
+	/* Every request in flight has a timeout, so this ends */
+	wait_event(raw->wait, gb_raw_idle(raw));
+
+	device_destroy(raw_class, raw->device->devt);
+	cdev_del(raw->cdev);
+
+	/* The rings stay until the last user lets go of them */
+	kref_put(&raw->kref, gb_raw_release);
+}
+
+static struct gb_protocol raw_protocol = {
+	.name			= "raw",
+	.id			= GREYBUS_PROTOCOL_RAW,
+	.major			= 0,
+	.minor			= 1,
+	.connection_init	= gb_raw_connection_init,
+	.connection_exit	= gb_raw_connection_exit,
+	.request_recv		= gb_raw_request_recv,
+};
+
+static __init int protocol_init(void)
+{
+	int retval;
+
+	raw_class = class_create(THIS_MODULE, "gb_raw");
+	if (IS_ERR(raw_class))
+		return PTR_ERR(raw_class);
+
+	retval = alloc_chrdev_region(&raw_dev_num, 0, GB_RAW_MINORS_MAX,
+				     "gb_raw");
+	if (retval)
+		goto err_class;
+
+	retval = gb_protocol_register(&raw_protocol);
+	if (retval)
+		goto err_chrdev;
+
+	return 0;
+
+err_chrdev:
+	unregister_chrdev_region(raw_dev_num, GB_RAW_MINORS_MAX);
+err_class:
+	class_destroy(raw_class);
+	return retval;
+}
+
+static __exit void protocol_exit(void)
+{
+	gb_protocol_deregister(&raw_protocol);
+	unregister_chrdev_region(raw_dev_num, GB_RAW_MINORS_MAX);
+	class_destroy(raw_class);
+	idr_destroy(&minors);
+}
+
+module_init(protocol_init);
+module_exit(protocol_exit);
+
+MODULE_LICENSE("GPL v2");
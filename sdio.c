@@ -9,43 +9,619 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/mmc/core.h>
 #include <linux/mmc/host.h>
 
 #include "greybus.h"
 
+/* Version of the Greybus SDIO protocol we support */
+#define GB_SDIO_VERSION_MAJOR		0x00
+#define GB_SDIO_VERSION_MINOR		0x01
+
+/* Greybus SDIO request types */
+#define GB_SDIO_TYPE_INVALID		0x00
+#define GB_SDIO_TYPE_PROTOCOL_VERSION	0x01
+#define GB_SDIO_TYPE_GET_CAPABILITIES	0x02
+#define GB_SDIO_TYPE_SET_IOS		0x03
+#define GB_SDIO_TYPE_COMMAND		0x04
+#define GB_SDIO_TYPE_TRANSFER		0x05
+#define GB_SDIO_TYPE_EVENT		0x06	/* Unsolicited data */
+
+/* Host capabilities */
+#define GB_SDIO_CAP_NONREMOVABLE	0x00000001
+#define GB_SDIO_CAP_4_BIT_DATA		0x00000002
+#define GB_SDIO_CAP_8_BIT_DATA		0x00000004
+#define GB_SDIO_CAP_MMC_HS		0x00000008
+#define GB_SDIO_CAP_SD_HS		0x00000010
+#define GB_SDIO_CAP_ERASE		0x00000020
+#define GB_SDIO_CAP_1_8V_DDR		0x00000040
+#define GB_SDIO_CAP_POWER_OFF_CARD	0x00000080
+
+struct gb_sdio_get_caps_response {
+	__le32	caps;
+	__le32	ocr;			/* voltages supported, MMC_VDD_* */
+	__le32	f_min;
+	__le32	f_max;
+	__le16	max_blk_count;
+	__le16	max_blk_size;
+};
+
+/*
+ * The bus mode, power mode, timing, signal voltage and driver type
+ * values are those of the same name in <linux/mmc/host.h>.
+ */
+struct gb_sdio_set_ios_request {
+	__le32	clock;
+	__le32	vdd;			/* MMC_VDD_* bit, or 0 */
+	__u8	bus_mode;
+	__u8	power_mode;
+	__u8	bus_width;
+	__u8	timing;
+	__u8	signal_voltage;
+	__u8	drv_type;
+};
+
+#define GB_SDIO_BUS_WIDTH_1		0x00
+#define GB_SDIO_BUS_WIDTH_4		0x02
+#define GB_SDIO_BUS_WIDTH_8		0x03
+
+/* Command response flags; as the MMC_RSP_* flags */
+#define GB_SDIO_RSP_PRESENT		0x01
+#define GB_SDIO_RSP_136			0x02
+#define GB_SDIO_RSP_CRC			0x04
+#define GB_SDIO_RSP_BUSY		0x08
+#define GB_SDIO_RSP_OPCODE		0x10
+#define GB_SDIO_RSP_MASK		0x1f
+
+/* Command types */
+#define GB_SDIO_CMD_AC			0x00
+#define GB_SDIO_CMD_ADTC		0x01
+#define GB_SDIO_CMD_BC			0x02
+#define GB_SDIO_CMD_BCR			0x03
+
+/*
+ * For a command with data, the blocks are then moved by one or more
+ * TRANSFER operations; data_blocks is the total number of them.
+ */
+struct gb_sdio_command_request {
+	__u8	cmd;
+	__u8	cmd_flags;
+	__u8	cmd_type;
+	__le32	cmd_arg __packed;
+	__le16	data_blocks __packed;
+	__le16	data_blksz __packed;
+};
+
+struct gb_sdio_command_response {
+	__le32	resp[4];
+};
+
+#define GB_SDIO_DATA_WRITE		0x01
+#define GB_SDIO_DATA_READ		0x02
+
+/* Write data follows the request, read data the response */
+struct gb_sdio_transfer_request {
+	__u8	data_flags;
+	__le16	data_blocks __packed;
+	__le16	data_blksz __packed;
+	__u8	data[0];
+};
+
+struct gb_sdio_transfer_response {
+	__le16	data_blocks;
+	__le16	data_blksz;
+	__u8	data[0];
+};
+
+#define GB_SDIO_CARD_INSERTED		0x01
+#define GB_SDIO_CARD_REMOVED		0x02
+#define GB_SDIO_WP			0x04
+
+/* Event request has no response payload */
+struct gb_sdio_event_request {
+	__u8	event;
+};
+
+/*
+ * The blocks of a request are split into TRANSFER operations as big
+ * as the host device allows, up to this many of them in flight.  An
+ * mmc request is limited to GB_SDIO_SEGS_MAX segments of up to one
+ * operation's worth of data each.
+ */
+#define GB_SDIO_INFLIGHT_MAX		4
+#define GB_SDIO_SEGS_MAX		64
+
 struct gb_sdio_host {
 	struct gb_connection *connection;
+	u8 version_major;
+	u8 version_minor;
+
 	struct mmc_host	*mmc;
+	size_t data_max;		/* most data bytes in a transfer */
+	bool card_present;
+	bool read_only;
+
+	/* The current request is handled by mrq_work, in workqueue */
+	struct mutex lock;		/* protects mrq and removed */
 	struct mmc_request *mrq;
-	// FIXME - some lock?
+	bool removed;
+	struct workqueue_struct *workqueue;
+	struct work_struct mrq_work;
 };
 
+/* One TRANSFER operation of a request's data */
+struct gb_sdio_xfer {
+	struct gb_operation *operation;
+	unsigned long deadline;		/* jiffies */
+	size_t offset;			/* into the scatterlist */
+	u16 blocks;
+};
+
+/* Define get_version() routine */
+define_get_version(gb_sdio_host, SDIO);
+
+static int gb_sdio_get_caps(struct gb_sdio_host *host)
+{
+	struct gb_connection *connection = host->connection;
+	struct gb_sdio_get_caps_response response;
+	struct mmc_host *mmc = host->mmc;
+	size_t payload_max;
+	u32 blocks_max;
+	u16 blksz;
+	u32 caps;
+	int ret;
+
+	ret = gb_operation_sync(connection, GB_SDIO_TYPE_GET_CAPABILITIES,
+				NULL, 0, &response, sizeof(response));
+	if (ret)
+		return ret;
+
+	caps = le32_to_cpu(response.caps);
+	mmc->caps = 0;
+	if (caps & GB_SDIO_CAP_NONREMOVABLE)
+		mmc->caps |= MMC_CAP_NONREMOVABLE;
+	if (caps & GB_SDIO_CAP_4_BIT_DATA)
+		mmc->caps |= MMC_CAP_4_BIT_DATA;
+	if (caps & GB_SDIO_CAP_8_BIT_DATA)
+		mmc->caps |= MMC_CAP_8_BIT_DATA;
+	if (caps & GB_SDIO_CAP_MMC_HS)
+		mmc->caps |= MMC_CAP_MMC_HIGHSPEED;
+	if (caps & GB_SDIO_CAP_SD_HS)
+		mmc->caps |= MMC_CAP_SD_HIGHSPEED;
+	if (caps & GB_SDIO_CAP_ERASE)
+		mmc->caps |= MMC_CAP_ERASE;
+	if (caps & GB_SDIO_CAP_1_8V_DDR)
+		mmc->caps |= MMC_CAP_1_8V_DDR;
+	if (caps & GB_SDIO_CAP_POWER_OFF_CARD)
+		mmc->caps |= MMC_CAP_POWER_OFF_CARD;
+
+	mmc->ocr_avail = le32_to_cpu(response.ocr);
+	mmc->f_min = le32_to_cpu(response.f_min);
+	mmc->f_max = le32_to_cpu(response.f_max);
+
+	/*
+	 * Data is copied straight between the scatterlist and message
+	 * buffers, so a segment can be of any length; one that fits an
+	 * operation keeps each operation to a segment or two.
+	 */
+	payload_max = connection->hd->buffer_size_max -
+			sizeof(struct gb_operation_msg_hdr);
+	host->data_max = payload_max - sizeof(struct gb_sdio_transfer_request);
+
+	blksz = le16_to_cpu(response.max_blk_size);
+	blksz = min_t(size_t, blksz, host->data_max);
+	if (!blksz) {
+		dev_err(&connection->dev, "bad block size\n");
+		return -EINVAL;
+	}
+	blocks_max = host->data_max / blksz;
+
+	mmc->max_blk_size = blksz;
+	mmc->max_seg_size = blocks_max * blksz;
+	mmc->max_segs = GB_SDIO_SEGS_MAX;
+	mmc->max_blk_count = min_t(u32, le16_to_cpu(response.max_blk_count),
+				   blocks_max * GB_SDIO_SEGS_MAX);
+	mmc->max_req_size = mmc->max_blk_count * blksz;
+
+	return 0;
+}
+
+static int gb_sdio_command(struct gb_sdio_host *host, struct mmc_command *cmd)
+{
+	struct gb_sdio_command_request request;
+	struct gb_sdio_command_response response;
+	struct mmc_data *data = cmd->data;
+	int ret;
+
+	request.cmd = cmd->opcode;
+	request.cmd_flags = mmc_resp_type(cmd) & GB_SDIO_RSP_MASK;
+	switch (mmc_cmd_type(cmd)) {
+	case MMC_CMD_ADTC:
+		request.cmd_type = GB_SDIO_CMD_ADTC;
+		break;
+	case MMC_CMD_BC:
+		request.cmd_type = GB_SDIO_CMD_BC;
+		break;
+	case MMC_CMD_BCR:
+		request.cmd_type = GB_SDIO_CMD_BCR;
+		break;
+	case MMC_CMD_AC:
+	default:
+		request.cmd_type = GB_SDIO_CMD_AC;
+		break;
+	}
+	request.cmd_arg = cpu_to_le32(cmd->arg);
+	request.data_blocks = cpu_to_le16(data ? data->blocks : 0);
+	request.data_blksz = cpu_to_le16(data ? data->blksz : 0);
+
+	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_COMMAND,
+				&request, sizeof(request),
+				&response, sizeof(response));
+	if (ret) {
+		cmd->error = ret;
+		return ret;
+	}
+
+	if (cmd->flags & MMC_RSP_136) {
+		cmd->resp[0] = le32_to_cpu(response.resp[0]);
+		cmd->resp[1] = le32_to_cpu(response.resp[1]);
+		cmd->resp[2] = le32_to_cpu(response.resp[2]);
+		cmd->resp[3] = le32_to_cpu(response.resp[3]);
+	} else if (cmd->flags & MMC_RSP_PRESENT) {
+		cmd->resp[0] = le32_to_cpu(response.resp[0]);
+	}
+	cmd->error = 0;
+
+	return 0;
+}
+
+/* We do our own waiting, see gb_sdio_transfer() */
+static void gb_sdio_transfer_callback(struct gb_operation *operation)
+{
+	complete(&operation->completion);
+}
+
+/*
+ * Send a TRANSFER of some of the blocks of a request, write data
+ * copied into the request straight from the scatterlist.
+ */
+static int gb_sdio_transfer_send(struct gb_sdio_host *host,
+				 struct mmc_data *data,
+				 struct gb_sdio_xfer *xfer)
+{
+	struct gb_sdio_transfer_request *request;
+	struct gb_operation *operation;
+	size_t len = xfer->blocks * data->blksz;
+	size_t request_size = sizeof(*request);
+	size_t response_size = sizeof(struct gb_sdio_transfer_response);
+	unsigned int timeout;
+	int ret;
+
+	if (data->flags & MMC_DATA_WRITE)
+		request_size += len;
+	else
+		response_size += len;
+
+	operation = gb_operation_create(host->connection,
+					GB_SDIO_TYPE_TRANSFER,
+					request_size, response_size);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->data_blocks = cpu_to_le16(xfer->blocks);
+	request->data_blksz = cpu_to_le16(data->blksz);
+	if (data->flags & MMC_DATA_WRITE) {
+		request->data_flags = GB_SDIO_DATA_WRITE;
+		if (sg_pcopy_to_buffer(data->sg, data->sg_len, request->data,
+				       len, xfer->offset) != len) {
+			ret = -EINVAL;
+			goto err_destroy;
+		}
+	} else {
+		request->data_flags = GB_SDIO_DATA_READ;
+	}
+
+	timeout = gb_connection_timeout(host->connection);
+	xfer->deadline = jiffies + msecs_to_jiffies(timeout);
+
+	/* We do our own waiting, so no timeout is armed */
+	ret = gb_operation_request_send_timeout(operation,
+					gb_sdio_transfer_callback, 0);
+	if (ret)
+		goto err_destroy;
+
+	xfer->operation = operation;
+
+	return 0;
+
+err_destroy:
+	gb_operation_destroy(operation);
+
+	return ret;
+}
+
+/*
+ * Wait for a TRANSFER to complete, and copy what it read straight
+ * into the scatterlist.  Returns the number of bytes moved, or a
+ * negative errno.
+ */
+static ssize_t gb_sdio_transfer_wait(struct gb_sdio_host *host,
+				     struct mmc_data *data,
+				     struct gb_sdio_xfer *xfer)
+{
+	struct gb_operation *operation = xfer->operation;
+	struct gb_sdio_transfer_response *response;
+	size_t len = xfer->blocks * data->blksz;
+	long timeout;
+	ssize_t ret;
+
+	timeout = max_t(long, (long)(xfer->deadline - jiffies), 0);
+	timeout = wait_for_completion_interruptible_timeout(
+					&operation->completion, timeout);
+	if (timeout < 0)
+		gb_operation_cancel(operation, -ECANCELED);
+	else if (timeout == 0)
+		gb_operation_cancel(operation, -ETIMEDOUT);
+
+	ret = gb_operation_result(operation);
+	if (ret)
+		goto out;
+
+	response = operation->response->payload;
+	if (le16_to_cpu(response->data_blocks) != xfer->blocks ||
+	    le16_to_cpu(response->data_blksz) != data->blksz) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if ((data->flags & MMC_DATA_READ) &&
+	    sg_pcopy_from_buffer(data->sg, data->sg_len, response->data,
+				 len, xfer->offset) != len) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = len;
+out:
+	gb_operation_destroy(operation);
+	xfer->operation = NULL;
+
+	return ret;
+}
+
+/*
+ * Move the data of a request, as a series of TRANSFER operations
+ * kept GB_SDIO_INFLIGHT_MAX deep.  They are completed in order, so
+ * bytes_xfered only ever counts data moved without a gap.
+ */
+static int gb_sdio_transfer(struct gb_sdio_host *host, struct mmc_data *data)
+{
+	struct gb_sdio_xfer xfers[GB_SDIO_INFLIGHT_MAX];
+	struct gb_sdio_xfer *xfer;
+	unsigned int head = 0, tail = 0;
+	unsigned int left = data->blocks;
+	unsigned int chunk_blocks;
+	size_t offset = 0;
+	ssize_t len;
+	int ret = 0;
+
+	data->bytes_xfered = 0;
+
+	chunk_blocks = min_t(size_t, host->data_max / data->blksz, U16_MAX);
+	if (!chunk_blocks) {
+		data->error = -EINVAL;
+		return -EINVAL;
+	}
+
+	for (;;) {
+		while (left && !ret && head - tail < GB_SDIO_INFLIGHT_MAX) {
+			xfer = &xfers[head % GB_SDIO_INFLIGHT_MAX];
+			xfer->blocks = min(left, chunk_blocks);
+			xfer->offset = offset;
+			ret = gb_sdio_transfer_send(host, data, xfer);
+			if (ret)
+				break;
+
+			offset += xfer->blocks * data->blksz;
+			left -= xfer->blocks;
+			head++;
+		}
+		if (tail == head)
+			break;
+
+		xfer = &xfers[tail % GB_SDIO_INFLIGHT_MAX];
+		len = gb_sdio_transfer_wait(host, data, xfer);
+		tail++;
+		if (len < 0) {
+			if (!ret)
+				ret = len;
+		} else if (!ret) {
+			data->bytes_xfered += len;
+		}
+	}
+
+	if (ret)
+		dev_err(&host->connection->dev, "transfer failed (%d)\n", ret);
+	data->error = ret;
+
+	return ret;
+}
+
+static void gb_sdio_mrq_work(struct work_struct *work)
+{
+	struct gb_sdio_host *host = container_of(work, struct gb_sdio_host,
+						 mrq_work);
+	struct mmc_request *mrq;
+	int ret;
+
+	mutex_lock(&host->lock);
+	mrq = host->mrq;
+	if (!mrq) {
+		mutex_unlock(&host->lock);
+		return;
+	}
+
+	if (host->removed) {
+		mrq->cmd->error = -ESHUTDOWN;
+		goto done;
+	}
+
+	if (mrq->sbc) {
+		ret = gb_sdio_command(host, mrq->sbc);
+		if (ret)
+			goto done;
+	}
+
+	ret = gb_sdio_command(host, mrq->cmd);
+	if (ret)
+		goto done;
+
+	/* A stop command is sent even if moving the data failed */
+	if (mrq->data) {
+		gb_sdio_transfer(host, mrq->data);
+		if (mrq->stop)
+			gb_sdio_command(host, mrq->stop);
+	}
+done:
+	host->mrq = NULL;
+	mutex_unlock(&host->lock);
+
+	mmc_request_done(host->mmc, mrq);
+}
+
 static void gb_sd_request(struct mmc_host *mmc, struct mmc_request *mrq)
 {
-	// FIXME - do something here...
+	struct gb_sdio_host *host = mmc_priv(mmc);
+
+	mutex_lock(&host->lock);
+	if (host->removed || !host->card_present) {
+		mutex_unlock(&host->lock);
+		mrq->cmd->error = host->removed ? -ESHUTDOWN : -ENOMEDIUM;
+		mmc_request_done(mmc, mrq);
+		return;
+	}
+
+	WARN_ON(host->mrq);
+	host->mrq = mrq;
+	mutex_unlock(&host->lock);
+
+	queue_work(host->workqueue, &host->mrq_work);
 }
 
 static void gb_sd_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
 {
-	// FIXME - do something here...
+	struct gb_sdio_host *host = mmc_priv(mmc);
+	struct gb_sdio_set_ios_request request;
+	int ret;
+
+	request.clock = cpu_to_le32(ios->clock);
+	request.vdd = cpu_to_le32(ios->vdd ? 1 << ios->vdd : 0);
+	request.bus_mode = ios->bus_mode;
+	request.power_mode = ios->power_mode;
+	switch (ios->bus_width) {
+	case MMC_BUS_WIDTH_4:
+		request.bus_width = GB_SDIO_BUS_WIDTH_4;
+		break;
+	case MMC_BUS_WIDTH_8:
+		request.bus_width = GB_SDIO_BUS_WIDTH_8;
+		break;
+	case MMC_BUS_WIDTH_1:
+	default:
+		request.bus_width = GB_SDIO_BUS_WIDTH_1;
+		break;
+	}
+	request.timing = ios->timing;
+	request.signal_voltage = ios->signal_voltage;
+	request.drv_type = ios->drv_type;
+
+	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_SET_IOS,
+				&request, sizeof(request), NULL, 0);
+	if (ret)
+		dev_err(&host->connection->dev, "set ios failed (%d)\n", ret);
 }
 
 static int gb_sd_get_ro(struct mmc_host *mmc)
 {
-	// FIXME - do something here...
-	return 0;
+	struct gb_sdio_host *host = mmc_priv(mmc);
+
+	return host->read_only;
+}
+
+static int gb_sd_get_cd(struct mmc_host *mmc)
+{
+	struct gb_sdio_host *host = mmc_priv(mmc);
+
+	return host->card_present;
 }
 
 static const struct mmc_host_ops gb_sd_ops = {
 	.request	= gb_sd_request,
 	.set_ios	= gb_sd_set_ios,
 	.get_ro		= gb_sd_get_ro,
+	.get_cd		= gb_sd_get_cd,
 };
 
+static int gb_sdio_event(struct gb_sdio_host *host,
+			 struct gb_operation *operation)
+{
+	struct gb_message *request = operation->request;
+	struct gb_sdio_event_request *payload = request->payload;
+	bool changed = false;
+
+	if (request->payload_size != sizeof(*payload)) {
+		dev_err(&host->connection->dev,
+			"bad event size (%zu)\n", request->payload_size);
+		return -EINVAL;
+	}
+
+	if (payload->event & GB_SDIO_CARD_INSERTED && !host->card_present) {
+		host->card_present = true;
+		changed = true;
+	}
+	if (payload->event & GB_SDIO_CARD_REMOVED && host->card_present) {
+		host->card_present = false;
+		changed = true;
+	}
+	host->read_only = !!(payload->event & GB_SDIO_WP);
+
+	if (changed)
+		mmc_detect_change(host->mmc, 0);
+
+	return 0;
+}
+
+static void gb_sdio_request_recv(u8 type, struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_sdio_host *host = connection->private;
+	int ret;
+
+	switch (type) {
+	case GB_SDIO_TYPE_EVENT:
+		ret = gb_sdio_event(host, operation);
+		break;
+	default:
+		dev_err(&connection->dev,
+			"unsupported unsolicited request: %hhu\n", type);
+		ret = -EINVAL;
+		break;
+	}
+
+	ret = gb_operation_response_send(operation, ret);
+	if (ret)
+		dev_err(&connection->dev,
+			"failed to send response: %d\n", ret);
+}
+
 static int gb_sdio_connection_init(struct gb_connection *connection)
 {
 	struct mmc_host *mmc;
 	struct gb_sdio_host *host;
+	int ret;
 
 	mmc = mmc_alloc_host(sizeof(*host), &connection->dev);
 	if (!mmc)
@@ -53,14 +629,41 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 	host = mmc_priv(mmc);
 	host->mmc = mmc;
+	host->connection = connection;
+	host->card_present = true;	/* until the module says otherwise */
+	mutex_init(&host->lock);
+	INIT_WORK(&host->mrq_work, gb_sdio_mrq_work);
+	connection->private = host;
+
+	ret = get_version(host);
+	if (ret)
+		goto error_free;
+
+	ret = gb_sdio_get_caps(host);
+	if (ret)
+		goto error_free;
 
 	mmc->ops = &gb_sd_ops;
-	// FIXME - set up size limits we can handle.
-	// FIXME - register the host controller.
 
-	host->connection = connection;
-	connection->private = host;
+	host->workqueue = alloc_ordered_workqueue("gb_sdio_%s", 0,
+						  dev_name(&connection->dev));
+	if (!host->workqueue) {
+		ret = -ENOMEM;
+		goto error_free;
+	}
+
+	ret = mmc_add_host(mmc);
+	if (ret)
+		goto error_workqueue;
+
 	return 0;
+
+error_workqueue:
+	destroy_workqueue(host->workqueue);
+error_free:
+	connection->private = NULL;
+	mmc_free_host(mmc);
+	return ret;
 }
 
 static void gb_sdio_connection_exit(struct gb_connection *connection)
@@ -72,8 +675,14 @@ static void gb_sdio_connection_exit(struct gb_connection *connection)
 	if (!host)
 		return;
 
+	mutex_lock(&host->lock);
+	host->removed = true;
+	mutex_unlock(&host->lock);
+
 	mmc = host->mmc;
 	mmc_remove_host(mmc);
+	flush_workqueue(host->workqueue);
+	destroy_workqueue(host->workqueue);
 	mmc_free_host(mmc);
 	connection->private = NULL;
 }
@@ -85,7 +694,8 @@ static struct gb_protocol sdio_protocol = {
 	.minor			= 1,
 	.connection_init	= gb_sdio_connection_init,
 	.connection_exit	= gb_sdio_connection_exit,
-	.request_recv		= NULL,	/* no incoming requests */
+	.request_recv		= gb_sdio_request_recv,
+	.flags			= GB_PROTOCOL_BULK,
 };
 
 int gb_sdio_protocol_init(void)
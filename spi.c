@@ -11,6 +11,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
 #include <linux/spi/spi.h>
 
 #include "greybus.h"
@@ -41,6 +42,37 @@ struct gb_spi {
 	 * use board-specific GPIOs.
 	 */
 	u16			num_chipselect;
+
+	/*
+	 * The message being transferred.  It is sent as a series of
+	 * operations ("chunks") each as big as the host device allows,
+	 * up to GB_SPI_INFLIGHT_MAX of them outstanding at a time.
+	 * xfer and xfer_offset record where the next chunk starts.
+	 * cs_asserted records whether the last chunk sent leaves chip
+	 * select asserted.
+	 */
+	struct spi_master	*master;
+	struct mutex		lock;		/* protects the fields below */
+	struct spi_message	*msg;
+	struct spi_transfer	*xfer;		/* NULL once all are sent */
+	u32			xfer_offset;
+	unsigned int		inflight;
+	int			status;		/* first error */
+	bool			cs_asserted;
+};
+
+#define GB_SPI_INFLIGHT_MAX		4
+
+/* Where the data read by one transfer in a chunk is to go */
+struct gb_spi_piece {
+	void			*rx_buf;
+	u32			len;
+};
+
+struct gb_spi_chunk {
+	struct gb_spi		*spi;
+	unsigned int		count;
+	struct gb_spi_piece	pieces[0];
 };
 
 /* Version of the Greybus spi protocol we support */
@@ -128,39 +160,120 @@ struct gb_spi_transfer_response {
 };
 
 /* Routines to transfer data */
-static struct gb_operation *
-gb_spi_operation_create(struct gb_connection *connection,
-			struct spi_message *msg, u32 *total_len)
+
+static struct spi_transfer *gb_spi_next_xfer(struct spi_message *msg,
+					     struct spi_transfer *xfer)
+{
+	if (list_is_last(&xfer->transfer_list, &msg->transfers))
+		return NULL;
+
+	return list_entry(xfer->transfer_list.next, struct spi_transfer,
+			  transfer_list);
+}
+
+/* A transfer can only be split on a word boundary */
+static u32 gb_spi_word_size(struct spi_device *dev, struct spi_transfer *xfer)
 {
+	u8 bits_per_word = xfer->bits_per_word ? : dev->bits_per_word;
+
+	if (bits_per_word <= 8)
+		return 1;
+	if (bits_per_word <= 16)
+		return 2;
+	return 4;
+}
+
+/*
+ * Work out how much of a transfer, starting offset bytes in, fits in
+ * the room left in a chunk, and take that room.  Returns false if
+ * none of it fits.
+ */
+static bool gb_spi_piece_fit(struct gb_spi *spi, struct spi_transfer *xfer,
+			     u32 offset, size_t *tx_room, size_t *rx_room,
+			     u32 *len)
+{
+	u32 size = xfer->len - offset;
+
+	if (*tx_room < sizeof(struct gb_spi_transfer))
+		return false;
+
+	if (xfer->tx_buf)
+		size = min_t(size_t, size,
+			     *tx_room - sizeof(struct gb_spi_transfer));
+	if (xfer->rx_buf)
+		size = min_t(size_t, size, *rx_room);
+	if (size < xfer->len - offset) {
+		size = rounddown(size, gb_spi_word_size(spi->msg->spi, xfer));
+		if (!size)
+			return false;
+	}
+
+	*tx_room -= sizeof(struct gb_spi_transfer);
+	if (xfer->tx_buf)
+		*tx_room -= size;
+	if (xfer->rx_buf)
+		*rx_room -= size;
+	*len = size;
+
+	return true;
+}
+
+/*
+ * Build an operation carrying as much of the rest of the message as
+ * fits, starting where the previous chunk left off.
+ *
+ * The module asserts chip select when it starts an operation and,
+ * unless the last transfer in it has cs_change set, releases it at
+ * the end, just as for a whole spi_message.  So cs_change on the
+ * last transfer of a chunk that ends part way through the message
+ * is set to keep chip select asserted into the next chunk, or clear
+ * if the message asked for it to be toggled there anyway.
+ */
+static struct gb_operation *gb_spi_operation_create(struct gb_spi *spi)
+{
+	struct gb_connection *connection = spi->connection;
+	struct spi_message *msg = spi->msg;
 	struct gb_spi_transfer_request *request;
 	struct spi_device *dev = msg->spi;
-	struct spi_transfer *xfer;
+	struct spi_transfer *xfer, *next;
 	struct gb_spi_transfer *gb_xfer;
 	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
 	u32 tx_size = 0, rx_size = 0, count = 0, request_size;
+	size_t payload_max, tx_room, rx_room;
+	bool last_piece;
 	void *tx_data;
-
-	/* Find number of transfers queued and tx/rx length in the message */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
-		if (!xfer->tx_buf && !xfer->rx_buf) {
-			dev_err(&connection->dev,
-				"bufferless transfer, length %u\n", xfer->len);
-			return NULL;
-		}
+	u32 offset, len;
+	u32 i;
+
+	payload_max = connection->hd->buffer_size_max -
+			sizeof(struct gb_operation_msg_hdr);
+
+	/* Find how many (parts of) transfers fit, and their tx/rx length */
+	tx_room = payload_max - sizeof(*request);
+	rx_room = payload_max;
+	xfer = spi->xfer;
+	offset = spi->xfer_offset;
+	while (xfer && count < U16_MAX) {
+		if (!gb_spi_piece_fit(spi, xfer, offset, &tx_room, &rx_room,
+				      &len))
+			break;
 
 		if (xfer->tx_buf)
-			tx_size += xfer->len;
+			tx_size += len;
 		if (xfer->rx_buf)
-			rx_size += xfer->len;
-
-		*total_len += xfer->len;
+			rx_size += len;
 		count++;
+
+		offset += len;
+		if (offset < xfer->len)
+			break;		/* the rest goes in the next chunk */
+		xfer = gb_spi_next_xfer(msg, xfer);
+		offset = 0;
 	}
 
-	/* Too many transfers ? */
-	if (count > (u32)U16_MAX) {
-		dev_err(&connection->dev, "transfer count (%u) too big\n",
-			count);
+	if (!count) {
+		dev_err(&connection->dev, "transfer doesn't fit a message\n");
 		return NULL;
 	}
 
@@ -172,11 +285,21 @@ gb_spi_operation_create(struct gb_connection *connection,
 	request_size += count * sizeof(*gb_xfer);
 	request_size += tx_size;
 
+	chunk = kmalloc(sizeof(*chunk) + count * sizeof(chunk->pieces[0]),
+			GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+	chunk->spi = spi;
+	chunk->count = count;
+
 	/* Response consists only of incoming data */
 	operation = gb_operation_create(connection, GB_SPI_TYPE_TRANSFER,
 					request_size, rx_size);
-	if (!operation)
+	if (!operation) {
+		kfree(chunk);
 		return NULL;
+	}
+	operation->private = chunk;
 
 	request = operation->request->payload;
 	request->count = cpu_to_le16(count);
@@ -186,69 +309,249 @@ gb_spi_operation_create(struct gb_connection *connection,
 	gb_xfer = &request->transfers[0];
 	tx_data = gb_xfer + count;	/* place tx data after last gb_xfer */
 
-	/* Fill in the transfers array */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+	/* Fill in the transfers array, the same pieces as above */
+	tx_room = payload_max - sizeof(*request);
+	rx_room = payload_max;
+	xfer = spi->xfer;
+	offset = spi->xfer_offset;
+	for (i = 0; i < count; i++) {
+		gb_spi_piece_fit(spi, xfer, offset, &tx_room, &rx_room, &len);
+		last_piece = offset + len == xfer->len;
+		next = last_piece ? gb_spi_next_xfer(msg, xfer) : xfer;
+
 		gb_xfer->speed_hz = cpu_to_le32(xfer->speed_hz);
-		gb_xfer->len = cpu_to_le32(xfer->len);
-		gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
-		gb_xfer->cs_change = xfer->cs_change;
+		gb_xfer->len = cpu_to_le32(len);
 		gb_xfer->bits_per_word = xfer->bits_per_word;
+		if (last_piece) {
+			gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
+			gb_xfer->cs_change = xfer->cs_change;
+		} else {
+			gb_xfer->delay_usecs = 0;
+			gb_xfer->cs_change = 0;
+		}
+		if (i == count - 1 && next)
+			gb_xfer->cs_change = !gb_xfer->cs_change;
 		gb_xfer++;
 
 		/* Copy tx data */
 		if (xfer->tx_buf) {
-			memcpy(tx_data, xfer->tx_buf, xfer->len);
-			tx_data += xfer->len;
+			memcpy(tx_data, xfer->tx_buf + offset, len);
+			tx_data += len;
 		}
+
+		chunk->pieces[i].rx_buf = xfer->rx_buf ?
+						xfer->rx_buf + offset : NULL;
+		chunk->pieces[i].len = len;
+
+		offset = last_piece ? 0 : offset + len;
+		xfer = next;
 	}
+	spi->xfer = xfer;
+	spi->xfer_offset = offset;
+	spi->cs_asserted = (gb_xfer - 1)->cs_change;
 
 	return operation;
 }
 
-static void gb_spi_decode_response(struct spi_message *msg,
+static void gb_spi_decode_response(struct gb_spi_chunk *chunk,
 				   struct gb_spi_transfer_response *response)
 {
-	struct spi_transfer *xfer;
+	struct gb_spi_piece *piece;
 	void *rx_data = response->data;
+	unsigned int i;
+
+	for (i = 0; i < chunk->count; i++) {
+		piece = &chunk->pieces[i];
 
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
 		/* Copy rx data */
-		if (xfer->rx_buf) {
-			memcpy(xfer->rx_buf, rx_data, xfer->len);
-			rx_data += xfer->len;
+		if (piece->rx_buf) {
+			memcpy(piece->rx_buf, rx_data, piece->len);
+			rx_data += piece->len;
 		}
 	}
 }
 
-static int gb_spi_transfer_one_message(struct spi_master *master,
-				       struct spi_message *msg)
+static void gb_spi_transfer_callback(struct gb_operation *operation);
+static bool gb_spi_pump(struct gb_spi *spi);
+
+static void gb_spi_cs_release_callback(struct gb_operation *operation)
 {
-	struct gb_spi *spi = spi_master_get_devdata(master);
-	struct gb_connection *connection = spi->connection;
-	struct gb_spi_transfer_response *response;
+	struct gb_spi *spi = operation->private;
+	struct spi_master *master = spi->master;
+	bool done;
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret)
+		pr_err("chip select release failed (%d)\n", ret);
+
+	mutex_lock(&spi->lock);
+	spi->inflight--;
+	done = gb_spi_pump(spi);
+	mutex_unlock(&spi->lock);
+
+	gb_operation_put(operation);
+
+	if (done)
+		spi_finalize_current_message(master);
+}
+
+/*
+ * Send an empty transfer, with chip select released at the end of
+ * it, after a failed message left chip select asserted.  Called with
+ * spi->lock held.  Returns 0 if it is on its way.
+ */
+static int gb_spi_cs_release(struct gb_spi *spi)
+{
+	struct spi_device *dev = spi->msg->spi;
+	struct gb_spi_transfer_request *request;
 	struct gb_operation *operation;
-	u32 len = 0;
 	int ret;
 
-	operation = gb_spi_operation_create(connection, msg, &len);
+	operation = gb_operation_create(spi->connection, GB_SPI_TYPE_TRANSFER,
+					sizeof(*request) +
+					sizeof(request->transfers[0]), 0);
 	if (!operation)
 		return -ENOMEM;
+	operation->private = spi;
+
+	request = operation->request->payload;
+	request->count = cpu_to_le16(1);
+	request->mode = dev->mode;
+	request->chip_select = dev->chip_select;
+	memset(&request->transfers[0], 0, sizeof(request->transfers[0]));
+
+	spi->inflight++;
+	ret = gb_operation_request_send(operation, gb_spi_cs_release_callback);
+	if (ret) {
+		spi->inflight--;
+		gb_operation_put(operation);
+	}
+
+	return ret;
+}
+
+/*
+ * Send chunks of the current message until the window is full or
+ * there's nothing left to send.  Called with spi->lock held.  Returns
+ * true if the message is done, in which case the caller finalizes it
+ * once the lock is dropped.
+ */
+static bool gb_spi_pump(struct gb_spi *spi)
+{
+	struct gb_operation *operation;
+	int ret;
+
+	while (spi->xfer && !spi->status &&
+	       spi->inflight < GB_SPI_INFLIGHT_MAX) {
+		operation = gb_spi_operation_create(spi);
+		if (!operation) {
+			spi->status = -ENOMEM;
+			break;
+		}
+
+		spi->inflight++;
+		ret = gb_operation_request_send(operation,
+						gb_spi_transfer_callback);
+		if (ret) {
+			pr_err("transfer operation failed (%d)\n", ret);
+			spi->inflight--;
+			kfree(operation->private);
+			gb_operation_put(operation);
+			spi->status = ret;
+			break;
+		}
+	}
+
+	if (spi->inflight || (spi->xfer && !spi->status))
+		return false;
+
+	/* A failed message doesn't leave chip select asserted */
+	if (spi->status && spi->cs_asserted) {
+		spi->cs_asserted = false;
+		if (!gb_spi_cs_release(spi))
+			return false;
+		pr_err("can't release chip select\n");
+	}
 
-	ret = gb_operation_request_send_sync(operation);
+	spi->msg->status = spi->status;
+	spi->msg = NULL;
+
+	return true;
+}
+
+static void gb_spi_transfer_callback(struct gb_operation *operation)
+{
+	struct gb_spi_chunk *chunk = operation->private;
+	struct gb_spi *spi = chunk->spi;
+	struct spi_master *master = spi->master;
+	struct gb_spi_transfer_response *response;
+	unsigned int i;
+	bool done;
+	int ret;
+
+	mutex_lock(&spi->lock);
+	ret = gb_operation_result(operation);
 	if (!ret) {
 		response = operation->response->payload;
 		if (response)
-			gb_spi_decode_response(msg, response);
-	} else {
+			gb_spi_decode_response(chunk, response);
+		for (i = 0; i < chunk->count; i++)
+			spi->msg->actual_length += chunk->pieces[i].len;
+	} else if (!spi->status) {
 		pr_err("transfer operation failed (%d)\n", ret);
+		spi->status = ret;
 	}
-	gb_operation_destroy(operation);
+	spi->inflight--;
+	done = gb_spi_pump(spi);
+	mutex_unlock(&spi->lock);
 
-	msg->actual_length = len;
-	msg->status = 0;
-	spi_finalize_current_message(master);
+	kfree(chunk);
+	gb_operation_put(operation);
 
-	return ret;
+	if (done)
+		spi_finalize_current_message(master);
+}
+
+/*
+ * Start sending a message.  It is completed asynchronously, once the
+ * last of its chunks has been answered.
+ */
+static int gb_spi_transfer_one_message(struct spi_master *master,
+				       struct spi_message *msg)
+{
+	struct gb_spi *spi = spi_master_get_devdata(master);
+	struct gb_connection *connection = spi->connection;
+	struct spi_transfer *xfer;
+	bool done;
+
+	mutex_lock(&spi->lock);
+	spi->msg = msg;
+	spi->xfer = NULL;
+	spi->xfer_offset = 0;
+	spi->status = 0;
+	msg->actual_length = 0;
+
+	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+		if (!xfer->tx_buf && !xfer->rx_buf) {
+			dev_err(&connection->dev,
+				"bufferless transfer, length %u\n", xfer->len);
+			spi->status = -EINVAL;
+			break;
+		}
+	}
+	if (!spi->status && !list_empty(&msg->transfers))
+		spi->xfer = list_first_entry(&msg->transfers,
+					     struct spi_transfer,
+					     transfer_list);
+
+	done = gb_spi_pump(spi);
+	mutex_unlock(&spi->lock);
+
+	if (done)
+		spi_finalize_current_message(master);
+
+	return 0;
 }
 
 static int gb_spi_setup(struct spi_device *spi)
@@ -387,6 +690,8 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 
 	spi = spi_master_get_devdata(master);
 	spi->connection = connection;
+	spi->master = master;
+	mutex_init(&spi->lock);
 	connection->private = master;
 
 	ret = gb_spi_init(spi);
@@ -429,6 +734,7 @@ static struct gb_protocol spi_protocol = {
 	.connection_init	= gb_spi_connection_init,
 	.connection_exit	= gb_spi_connection_exit,
 	.request_recv		= NULL,
+	.flags			= GB_PROTOCOL_BULK,
 };
 
 int gb_spi_protocol_init(void)
@@ -27,12 +27,32 @@
 #include <linux/idr.h>
 #include <linux/fs.h>
 #include <linux/kdev_t.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
 
 #include "greybus.h"
 
 #define GB_NUM_MINORS	255	/* 255 is enough for anyone... */
 #define GB_NAME		"ttyGB"
 
+/*
+ * Data written to a port is queued in a FIFO of this size, and sent
+ * in SEND_DATA requests as large as the host device allows, with up
+ * to GB_UART_TX_INFLIGHT_MAX of them outstanding.
+ */
+#define GB_UART_WRITE_FIFO_SIZE		PAGE_SIZE
+#define GB_UART_TX_INFLIGHT_MAX		4
+
+/*
+ * Modules reporting this protocol minor version or later only send
+ * as much data as they have been granted credit for.  Up to
+ * GB_UART_RX_CREDIT_WINDOW bytes of credit (no more than there is
+ * room for in the tty flip buffers) are kept granted, topped up once
+ * half of it has been used.
+ */
+#define GB_UART_VERSION_MINOR_RX_CREDIT	0x02
+#define GB_UART_RX_CREDIT_WINDOW	4096
+
 /* Version of the Greybus PWM protocol we support */
 #define GB_UART_VERSION_MAJOR		0x00
 #define GB_UART_VERSION_MINOR		0x01
@@ -46,6 +66,7 @@
 #define GB_UART_TYPE_SET_CONTROL_LINE_STATE	0x05
 #define GB_UART_TYPE_SET_BREAK			0x06
 #define GB_UART_TYPE_SERIAL_STATE		0x07	/* Unsolicited data */
+#define GB_UART_TYPE_RX_CREDIT			0x08
 #define GB_UART_TYPE_RESPONSE			0x80	/* OR'd with rest */
 
 struct gb_uart_send_data_request {
@@ -53,6 +74,16 @@ struct gb_uart_send_data_request {
 	__u8	data[0];
 };
 
+struct gb_uart_recv_data_request {
+	__le16	size;
+	__u8	data[0];
+};
+
+/* Bytes the module may send in addition to those already granted */
+struct gb_uart_rx_credit_request {
+	__le16	credit;
+};
+
 struct gb_serial_line_coding {
 	__le32	rate;
 	__u8	format;
@@ -97,7 +128,7 @@ struct gb_uart_set_break_request {
 #define GB_UART_CTRL_OVERRUN		0x40
 
 struct gb_uart_serial_state_request {
-	__u16	control;
+	__le16	control;
 };
 
 struct gb_tty {
@@ -107,8 +138,16 @@ struct gb_tty {
 	unsigned int minor;
 	unsigned char clocal;
 	bool disconnected;
-	spinlock_t read_lock;
-	spinlock_t write_lock;
+	spinlock_t read_lock;		/* iocount, ctrlin, rx_* */
+	spinlock_t write_lock;		/* write_fifo in, tx_inflight* */
+	struct kfifo write_fifo;
+	struct work_struct tx_work;
+	unsigned int tx_inflight;	/* SEND_DATA operations */
+	unsigned int tx_inflight_bytes;
+	wait_queue_head_t tx_wait;	/* for tx_inflight to drop to 0 */
+	bool rx_credits;		/* module supports RX_CREDIT */
+	bool rx_throttled;
+	unsigned int rx_credit;		/* bytes granted, not yet received */
 	struct async_icount iocount;
 	struct async_icount oldcount;
 	wait_queue_head_t wioctl;
@@ -129,25 +168,292 @@ static atomic_t reference_count = ATOMIC_INIT(0);
 /* Define get_version() routine */
 define_get_version(gb_tty, UART);
 
-static int send_data(struct gb_tty *tty, u16 size, const u8 *data)
+static void gb_tty_tx_callback(struct gb_operation *operation)
 {
+	struct gb_tty *gb_tty = operation->connection->private;
 	struct gb_uart_send_data_request *request;
+	unsigned long flags;
 	int retval;
 
-	if (!data || !size)
-		return 0;
+	request = operation->request->payload;
+	retval = gb_operation_result(operation);
+	if (retval)
+		dev_err_ratelimited(&operation->connection->dev,
+				    "send data failed: %d\n", retval);
+
+	/* Kick the sender before letting disconnect see us finish */
+	if (!gb_tty->disconnected)
+		schedule_work(&gb_tty->tx_work);
+	tty_port_tty_wakeup(&gb_tty->port);
+
+	/*
+	 * Disconnect checks for the last of these under the lock (see
+	 * gb_tty_tx_idle()), and gb_tty may be gone once it's dropped.
+	 */
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	gb_tty->tx_inflight--;
+	gb_tty->tx_inflight_bytes -= le16_to_cpu(request->size);
+	wake_up_all(&gb_tty->tx_wait);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	gb_operation_put(operation);
+}
 
-	request = kmalloc(sizeof(*request) + size, GFP_KERNEL);
-	if (!request)
-		return -ENOMEM;
+static bool gb_tty_tx_idle(struct gb_tty *gb_tty)
+{
+	unsigned long flags;
+	bool idle;
 
-	request->size = cpu_to_le16(size);
-	memcpy(&request->data[0], data, size);
-	retval = gb_operation_sync(tty->connection, GB_UART_TYPE_SEND_DATA,
-				   request, sizeof(*request) + size, NULL, 0);
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	idle = !gb_tty->tx_inflight;
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
 
-	kfree(request);
-	return retval;
+	return idle;
+}
+
+/*
+ * Send what is in the write FIFO, in as few requests as the host
+ * device's buffer size allows, keeping up to GB_UART_TX_INFLIGHT_MAX
+ * of them in flight.  Data is only taken out of the FIFO here, so it
+ * goes out in the order it was written.
+ */
+static void gb_tty_tx_work(struct work_struct *work)
+{
+	struct gb_tty *gb_tty = container_of(work, struct gb_tty, tx_work);
+	struct gb_connection *connection = gb_tty->connection;
+	struct gb_uart_send_data_request *request;
+	struct gb_operation *operation;
+	size_t size_max;
+	unsigned long flags;
+	unsigned int size;
+	int retval;
+
+	size_max = connection->hd->buffer_size_max -
+			sizeof(struct gb_operation_msg_hdr) - sizeof(*request);
+	size_max = min_t(size_t, size_max, U16_MAX);
+
+	while (!gb_tty->disconnected) {
+		spin_lock_irqsave(&gb_tty->write_lock, flags);
+		size = min_t(size_t, kfifo_len(&gb_tty->write_fifo), size_max);
+		if (!size || gb_tty->tx_inflight >= GB_UART_TX_INFLIGHT_MAX) {
+			spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+		operation = gb_operation_create(connection,
+						GB_UART_TYPE_SEND_DATA,
+						sizeof(*request) + size, 0);
+		if (!operation) {
+			dev_err_ratelimited(&connection->dev,
+					    "can't allocate send data request\n");
+			break;
+		}
+		request = operation->request->payload;
+		request->size = cpu_to_le16(size);
+
+		spin_lock_irqsave(&gb_tty->write_lock, flags);
+		size = kfifo_out(&gb_tty->write_fifo, request->data, size);
+		gb_tty->tx_inflight++;
+		gb_tty->tx_inflight_bytes += size;
+		spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+		retval = gb_operation_request_send(operation,
+						   gb_tty_tx_callback);
+		if (retval) {
+			dev_err_ratelimited(&connection->dev,
+					    "send data failed: %d\n", retval);
+			gb_operation_put(operation);
+			spin_lock_irqsave(&gb_tty->write_lock, flags);
+			gb_tty->tx_inflight--;
+			gb_tty->tx_inflight_bytes -= size;
+			wake_up_all(&gb_tty->tx_wait);
+			spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+			break;
+		}
+	}
+}
+
+static void gb_tty_rx_credit_callback(struct gb_operation *operation)
+{
+	int retval = gb_operation_result(operation);
+
+	if (retval)
+		dev_err_ratelimited(&operation->connection->dev,
+				    "rx credit grant failed: %d\n", retval);
+	gb_operation_put(operation);
+}
+
+/*
+ * Top up the receive credit granted to the module, unless the tty is
+ * throttled.  The grant is sent asynchronously, as this is called
+ * from the incoming request handler.
+ */
+static void gb_tty_rx_credit_refill(struct gb_tty *gb_tty)
+{
+	struct gb_uart_rx_credit_request *request;
+	struct gb_operation *operation;
+	unsigned long flags;
+	unsigned int target;
+	unsigned int grant;
+	int retval;
+
+	if (!gb_tty->rx_credits || gb_tty->disconnected)
+		return;
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	target = gb_tty_buffer_space_avail(&gb_tty->port,
+					   GB_UART_RX_CREDIT_WINDOW);
+	if (gb_tty->rx_throttled || gb_tty->rx_credit >= target / 2) {
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+		return;
+	}
+	grant = target - gb_tty->rx_credit;
+	gb_tty->rx_credit += grant;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	operation = gb_operation_create(gb_tty->connection,
+					GB_UART_TYPE_RX_CREDIT,
+					sizeof(*request), 0);
+	if (!operation) {
+		retval = -ENOMEM;
+		goto err_undo;
+	}
+	request = operation->request->payload;
+	request->credit = cpu_to_le16(grant);
+
+	retval = gb_operation_request_send(operation, gb_tty_rx_credit_callback);
+	if (retval) {
+		gb_operation_put(operation);
+		goto err_undo;
+	}
+
+	return;
+
+err_undo:
+	dev_err_ratelimited(&gb_tty->connection->dev,
+			    "can't grant rx credit: %d\n", retval);
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	gb_tty->rx_credit -= grant;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+}
+
+/* Push received data straight from the request into the flip buffer */
+static int gb_tty_receive_data(struct gb_tty *gb_tty,
+			       struct gb_operation *operation)
+{
+	struct gb_uart_recv_data_request *request;
+	struct tty_port *port = &gb_tty->port;
+	size_t payload_size = operation->request->payload_size;
+	unsigned long flags;
+	u16 size;
+	int count;
+
+	if (payload_size < sizeof(*request))
+		return -EINVAL;
+	request = operation->request->payload;
+	size = le16_to_cpu(request->size);
+	if (payload_size < sizeof(*request) + size)
+		return -EINVAL;
+
+	count = tty_insert_flip_string(port, request->data, size);
+	if (count != size) {
+		dev_err_ratelimited(&operation->connection->dev,
+				    "rx overrun, %d bytes dropped\n",
+				    size - count);
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		gb_tty->iocount.buf_overrun++;
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+	}
+	tty_flip_buffer_push(port);
+
+	if (gb_tty->rx_credits) {
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		if (size > gb_tty->rx_credit)
+			dev_warn_ratelimited(&operation->connection->dev,
+					     "rx credit exceeded (%hu > %u)\n",
+					     size, gb_tty->rx_credit);
+		gb_tty->rx_credit -= min_t(unsigned int, size,
+					   gb_tty->rx_credit);
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+		gb_tty_rx_credit_refill(gb_tty);
+	}
+
+	return 0;
+}
+
+static int gb_tty_serial_state(struct gb_tty *gb_tty,
+			       struct gb_operation *operation)
+{
+	struct gb_uart_serial_state_request *request;
+	unsigned int newctrl;
+	unsigned int difference;
+	unsigned long flags;
+
+	if (operation->request->payload_size < sizeof(*request))
+		return -EINVAL;
+	request = operation->request->payload;
+	newctrl = le16_to_cpu(request->control);
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	difference = gb_tty->ctrlin ^ newctrl;
+	gb_tty->ctrlin = newctrl;
+	if (difference & GB_UART_CTRL_DSR)
+		gb_tty->iocount.dsr++;
+	if (difference & GB_UART_CTRL_DCD)
+		gb_tty->iocount.dcd++;
+	if (newctrl & GB_UART_CTRL_BRK)
+		gb_tty->iocount.brk++;
+	if (newctrl & GB_UART_CTRL_RI)
+		gb_tty->iocount.rng++;
+	if (newctrl & GB_UART_CTRL_FRAMING)
+		gb_tty->iocount.frame++;
+	if (newctrl & GB_UART_CTRL_PARITY)
+		gb_tty->iocount.parity++;
+	if (newctrl & GB_UART_CTRL_OVERRUN)
+		gb_tty->iocount.overrun++;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	if (difference & (GB_UART_CTRL_DSR | GB_UART_CTRL_DCD |
+			  GB_UART_CTRL_RI))
+		wake_up_all(&gb_tty->wioctl);
+
+	if (!gb_tty->clocal && (difference & GB_UART_CTRL_DCD) &&
+	    !(newctrl & GB_UART_CTRL_DCD))
+		tty_port_tty_hangup(&gb_tty->port, false);
+
+	return 0;
+}
+
+static void gb_uart_request_recv(u8 type, struct gb_operation *operation)
+{
+	struct gb_connection *connection = operation->connection;
+	struct gb_tty *gb_tty = connection->private;
+	int retval;
+
+	if (!gb_tty) {
+		retval = -ENODEV;
+		goto out;
+	}
+
+	switch (type) {
+	case GB_UART_TYPE_RECEIVE_DATA:
+		retval = gb_tty_receive_data(gb_tty, operation);
+		break;
+	case GB_UART_TYPE_SERIAL_STATE:
+		retval = gb_tty_serial_state(gb_tty, operation);
+		break;
+	default:
+		dev_err(&connection->dev,
+			"unsupported unsolicited request: %hhu\n", type);
+		retval = -EINVAL;
+		break;
+	}
+out:
+	retval = gb_operation_response_send(operation, retval);
+	if (retval)
+		dev_err(&connection->dev,
+			"failed to send response: %d\n", retval);
 }
 
 static int send_line_coding(struct gb_tty *tty)
@@ -276,28 +582,60 @@ static void gb_tty_hangup(struct tty_struct *tty)
 	tty_port_hangup(&gb_tty->port);
 }
 
+/* Queue the data for sending; this never blocks */
 static int gb_tty_write(struct tty_struct *tty, const unsigned char *buf,
 			int count)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	count = kfifo_in(&gb_tty->write_fifo, buf, count);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	if (count)
+		schedule_work(&gb_tty->tx_work);
 
-	return send_data(gb_tty, count, buf);
+	return count;
 }
 
 static int gb_tty_write_room(struct tty_struct *tty)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int room;
 
-	// FIXME - how much do we want to say we have room for?
-	return 0;
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	room = kfifo_avail(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return room;
 }
 
+/* Data queued, or sent but not yet acknowledged */
 static int gb_tty_chars_in_buffer(struct tty_struct *tty)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int chars;
 
-	// FIXME - how many left to send?
-	return 0;
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	chars = kfifo_len(&gb_tty->write_fifo) + gb_tty->tx_inflight_bytes;
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return chars;
+}
+
+static void gb_tty_flush_buffer(struct tty_struct *tty)
+{
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	kfifo_reset(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	tty_port_tty_wakeup(&gb_tty->port);
 }
 
 static int gb_tty_break_ctl(struct tty_struct *tty, int state)
@@ -389,13 +727,23 @@ static int gb_tty_tiocmset(struct tty_struct *tty, unsigned int set,
 	return send_control(gb_tty, newctrl);
 }
 
+/*
+ * When the module supports receive credit, throttling just stops
+ * more credit being granted; otherwise XOFF is sent (if enabled).
+ * RTS is dropped either way if hardware flow control is in use.
+ */
 static void gb_tty_throttle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
 	unsigned char stop_char;
+	unsigned long flags;
 	int retval;
 
-	if (I_IXOFF(tty)) {
+	if (gb_tty->rx_credits) {
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		gb_tty->rx_throttled = true;
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+	} else if (I_IXOFF(tty)) {
 		stop_char = STOP_CHAR(tty);
 		retval = gb_tty_write(tty, &stop_char, 1);
 		if (retval <= 0)
@@ -413,9 +761,15 @@ static void gb_tty_unthrottle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
 	unsigned char start_char;
+	unsigned long flags;
 	int retval;
 
-	if (I_IXOFF(tty)) {
+	if (gb_tty->rx_credits) {
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		gb_tty->rx_throttled = false;
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+		gb_tty_rx_credit_refill(gb_tty);
+	} else if (I_IXOFF(tty)) {
 		start_char = START_CHAR(tty);
 		retval = gb_tty_write(tty, &start_char, 1);
 		if (retval <= 0)
@@ -565,6 +919,23 @@ static int gb_tty_ioctl(struct tty_struct *tty, unsigned int cmd,
 }
 
 
+/*
+ * The gb_tty lives as long as its port: until the connection has
+ * gone away and the tty has been closed.
+ */
+static void gb_tty_port_destruct(struct tty_port *port)
+{
+	struct gb_tty *gb_tty = container_of(port, struct gb_tty, port);
+
+	cancel_work_sync(&gb_tty->tx_work);
+	kfifo_free(&gb_tty->write_fifo);
+	kfree(gb_tty);
+}
+
+static const struct tty_port_operations gb_port_ops = {
+	.destruct =		gb_tty_port_destruct,
+};
+
 static const struct tty_operations gb_ops = {
 	.install =		gb_tty_install,
 	.open =			gb_tty_open,
@@ -573,6 +944,7 @@ static const struct tty_operations gb_ops = {
 	.hangup =		gb_tty_hangup,
 	.write =		gb_tty_write,
 	.write_room =		gb_tty_write_room,
+	.flush_buffer =		gb_tty_flush_buffer,
 	.ioctl =		gb_tty_ioctl,
 	.throttle =		gb_tty_throttle,
 	.unthrottle =		gb_tty_unthrottle,
@@ -606,8 +978,19 @@ static int gb_uart_connection_init(struct gb_connection *connection)
 	gb_tty = kzalloc(sizeof(*gb_tty), GFP_KERNEL);
 	if (!gb_tty)
 		return -ENOMEM;
+	tty_port_init(&gb_tty->port);
+	gb_tty->port.ops = &gb_port_ops;
 	gb_tty->connection = connection;
 	connection->private = gb_tty;
+	spin_lock_init(&gb_tty->write_lock);
+	spin_lock_init(&gb_tty->read_lock);
+	INIT_WORK(&gb_tty->tx_work, gb_tty_tx_work);
+	init_waitqueue_head(&gb_tty->tx_wait);
+
+	retval = kfifo_alloc(&gb_tty->write_fifo, GB_UART_WRITE_FIFO_SIZE,
+			     GFP_KERNEL);
+	if (retval)
+		goto error_fifo;
 
 	/* Check for compatible protocol version */
 	retval = get_version(gb_tty);
@@ -625,8 +1008,6 @@ static int gb_uart_connection_init(struct gb_connection *connection)
 	}
 
 	gb_tty->minor = minor;
-	spin_lock_init(&gb_tty->write_lock);
-	spin_lock_init(&gb_tty->read_lock);
 	init_waitqueue_head(&gb_tty->wioctl);
 	mutex_init(&gb_tty->mutex);
 
@@ -639,6 +1020,11 @@ static int gb_uart_connection_init(struct gb_connection *connection)
 	gb_tty->line_coding.data = 8;
 	send_line_coding(gb_tty);
 
+	/* Nothing is received until some credit is granted */
+	gb_tty->rx_credits =
+		gb_tty->version_minor >= GB_UART_VERSION_MINOR_RX_CREDIT;
+	gb_tty_rx_credit_refill(gb_tty);
+
 	tty_dev = tty_port_register_device(&gb_tty->port, gb_tty_driver, minor,
 					   &connection->dev);
 	if (IS_ERR(tty_dev)) {
@@ -650,7 +1036,10 @@ static int gb_uart_connection_init(struct gb_connection *connection)
 error:
 	release_minor(gb_tty);
 error_version:
+	kfifo_free(&gb_tty->write_fifo);
+error_fifo:
 	connection->private = NULL;
+	tty_port_destroy(&gb_tty->port);
 	kfree(gb_tty);
 	return retval;
 }
@@ -667,9 +1056,17 @@ static void gb_uart_connection_exit(struct gb_connection *connection)
 	gb_tty->disconnected = true;
 
 	wake_up_all(&gb_tty->wioctl);
-	connection->private = NULL;
 	mutex_unlock(&gb_tty->mutex);
 
+	/*
+	 * Stop sending, and wait for what has been sent to complete.
+	 * Completions may have queued the sender again meanwhile.
+	 */
+	cancel_work_sync(&gb_tty->tx_work);
+	wait_event(gb_tty->tx_wait, gb_tty_tx_idle(gb_tty));
+	cancel_work_sync(&gb_tty->tx_work);
+	connection->private = NULL;
+
 	tty = tty_port_tty_get(&gb_tty->port);
 	if (tty) {
 		tty_vhangup(tty);
@@ -679,12 +1076,9 @@ static void gb_uart_connection_exit(struct gb_connection *connection)
 
 	tty_unregister_device(gb_tty_driver, gb_tty->minor);
 
-	/* FIXME - free transmit / receive buffers */
-
+	/* The last reference frees gb_tty (see gb_tty_port_destruct()) */
 	tty_port_put(&gb_tty->port);
 
-	kfree(gb_tty);
-
 	/* If last device is gone, tear down the tty structures */
 	if (atomic_dec_return(&reference_count) == 0)
 		gb_tty_exit();
@@ -743,7 +1137,8 @@ static struct gb_protocol uart_protocol = {
 	.minor			= 1,
 	.connection_init	= gb_uart_connection_init,
 	.connection_exit	= gb_uart_connection_exit,
-	.request_recv		= NULL,	/* FIXME we have 2 types of requests!!! */
+	.request_recv		= gb_uart_request_recv,
+	.flags			= GB_PROTOCOL_BULK,
 };
 
 int gb_uart_protocol_init(void)
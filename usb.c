@@ -10,6 +10,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 
@@ -19,6 +21,12 @@
 #define GB_USB_VERSION_MAJOR		0x00
 #define GB_USB_VERSION_MINOR		0x01
 
+/*
+ * Modules reporting this minor version or later answer URB_ENQUEUE
+ * with the URB's status and data, and handle URB_DEQUEUE requests.
+ */
+#define GB_USB_VERSION_MINOR_STATUS	0x02
+
 /* Greybus USB request types */
 #define GB_USB_TYPE_INVALID		0x00
 #define GB_USB_TYPE_PROTOCOL_VERSION	0x01
@@ -43,8 +51,16 @@ struct gb_usb_urb_enqueue_request {
 	u8 payload[0];
 };
 
+/* IN data follows; the payload is as big as the URB's buffer */
+struct gb_usb_urb_enqueue_response {
+	__le32 status;			/* negative errno, or 0 */
+	__le32 actual_length;
+	u8 payload[0];
+};
+
+/* Identifies the URB by the id of the operation that enqueued it */
 struct gb_usb_urb_dequeue_request {
-	__le64 hcpriv_ep;
+	__le16 operation_id;
 };
 
 struct gb_usb_endpoint_disable_request {
@@ -62,21 +78,20 @@ struct gb_usb_hub_control_response {
 	u8 buf[0];
 };
 
-struct gb_usb_header {
-	__le16	size;
-	__le16	id;
-	__u8	type;
+/* Sent by the module in GET_FRAME_NUMBER requests */
+struct gb_usb_frame_number {
+	__le32 frame_number;
 };
 
+/* Sent by the module in HUB_STATUS_DATA requests */
 struct gb_usb_hub_status {
 	__le32 status;
 	__le16 buf_size;
 	u8 buf[0];
 };
 
-static struct gb_usb_hub_status *hub_status;	// FIXME!!!
-static DEFINE_SPINLOCK(hub_status_lock);
-static atomic_t frame_number;			// FIXME!!!
+/* Root hubs with more than 31 ports aren't supported by the usb core */
+#define GB_USB_HUB_STATUS_BUF_MAX	4
 
 struct gb_usb_device {
 	struct gb_connection *connection;
@@ -84,9 +99,34 @@ struct gb_usb_device {
 	struct usb_hcd *hcd;
 	u8 version_major;
 	u8 version_minor;
+
+	/*
+	 * URBs are enqueued from atomic context, so they are sent from
+	 * work: those not sent yet are on the pending list, and those
+	 * in flight the usb core wants back are on the dequeues list.
+	 * Every URB sent is on the inflight list until it's given back.
+	 * The lock also protects the hcd's endpoint lists.
+	 */
+	spinlock_t lock;
+	struct list_head pending;
+	struct list_head dequeues;
+	struct list_head inflight;
+	struct work_struct work;
+
+	struct gb_usb_hub_status *hub_status;	/* protected by lock */
+	atomic_t frame_number;
 };
 
-#define to_gb_usb_device(d) ((struct gb_usb_device*) d->hcd_priv)
+/* Our state for an URB, from enqueue until it's given back */
+struct gb_usb_urb {
+	struct list_head links;		/* pending or dequeues */
+	struct list_head inflight_links;
+	struct urb *urb;
+	struct gb_operation *operation;	/* set once sent */
+	bool dequeued;
+};
+
+#define to_gb_usb_device(d) ((struct gb_usb_device *)(d)->hcd_priv[0])
 
 /* Define get_version() routine */
 define_get_version(gb_usb_device, USB);
@@ -121,49 +161,338 @@ static int hcd_start(struct usb_hcd *hcd)
 	return 0;
 }
 
-static int urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
+/* Complete an URB; called without dev->lock held */
+static void gb_usb_urb_giveback(struct gb_usb_device *dev,
+				struct gb_usb_urb *gb_urb, int status)
+{
+	struct urb *urb = gb_urb->urb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	list_del(&gb_urb->links);
+	list_del(&gb_urb->inflight_links);
+	usb_hcd_unlink_urb_from_ep(dev->hcd, urb);
+	if (urb->unlinked)
+		status = urb->unlinked;
+	urb->hcpriv = NULL;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	kfree(gb_urb);
+	usb_hcd_giveback_urb(dev->hcd, urb, status);
+}
+
+static int gb_usb_urb_dequeue_send(struct gb_usb_device *dev, u16 id);
+
+static void gb_usb_urb_callback(struct gb_operation *operation)
+{
+	struct gb_usb_urb *gb_urb = operation->private;
+	struct gb_usb_device *dev = operation->connection->private;
+	struct gb_usb_urb_enqueue_response *response;
+	struct urb *urb = gb_urb->urb;
+	u32 actual_length = 0;
+	int status;
+
+	status = gb_operation_result(operation);
+	if (!status && dev->version_minor >= GB_USB_VERSION_MINOR_STATUS) {
+		response = operation->response->payload;
+		status = (s32)le32_to_cpu(response->status);
+		actual_length = min_t(u32, le32_to_cpu(response->actual_length),
+				      urb->transfer_buffer_length);
+		if (usb_pipein(urb->pipe))
+			memcpy(urb->transfer_buffer, response->payload,
+			       actual_length);
+	} else if (!status && usb_pipeout(urb->pipe)) {
+		actual_length = urb->transfer_buffer_length;
+	}
+	urb->actual_length = actual_length;
+
+	/* Make sure a module that still has the URB lets go of it */
+	if (status == -ETIMEDOUT &&
+	    dev->version_minor >= GB_USB_VERSION_MINOR_STATUS)
+		gb_usb_urb_dequeue_send(dev, operation->id);
+
+	/* The work might look up the operation id until it's given back */
+	gb_usb_urb_giveback(dev, gb_urb, status);
+	gb_operation_put(operation);
+}
+
+static void gb_usb_urb_send(struct gb_usb_device *dev, struct gb_usb_urb *gb_urb)
 {
-	struct gb_usb_device *dev = to_gb_usb_device(hcd);
 	struct gb_usb_urb_enqueue_request *request;
 	struct gb_operation *operation;
+	struct urb *urb = gb_urb->urb;
+	size_t request_size = sizeof(*request);
+	size_t response_size = 0;
+	unsigned int timeout;
+	unsigned long flags;
 	int ret;
 
+	if (usb_pipeout(urb->pipe))
+		request_size += urb->transfer_buffer_length;
+	if (dev->version_minor >= GB_USB_VERSION_MINOR_STATUS) {
+		response_size = sizeof(struct gb_usb_urb_enqueue_response);
+		if (usb_pipein(urb->pipe))
+			response_size += urb->transfer_buffer_length;
+	}
+
 	operation = gb_operation_create(dev->connection,
 					GB_USB_TYPE_URB_ENQUEUE,
-					sizeof(*request) +
-					urb->transfer_buffer_length, 0);
-	if (!operation)
-		return -ENODEV;
+					request_size, response_size);
+	if (!operation) {
+		ret = -ENOMEM;
+		goto err_giveback;
+	}
+	operation->private = gb_urb;
 
 	request = operation->request->payload;
 	request->pipe = cpu_to_le32(urb->pipe);
 	request->transfer_flags = cpu_to_le32(urb->transfer_flags);
 	request->transfer_buffer_length = cpu_to_le32(urb->transfer_buffer_length);
+	request->maxpacket = cpu_to_le32(usb_endpoint_maxp(&urb->ep->desc));
 	request->interval = cpu_to_le32(urb->interval);
 	request->hcpriv_ep = cpu_to_le64((unsigned long)urb->ep->hcpriv);
 	request->number_of_packets = cpu_to_le32(urb->number_of_packets);
 
-	memcpy(request->setup_packet, urb->setup_packet, 8);
-	memcpy(&request->payload, urb->transfer_buffer,
-	       urb->transfer_buffer_length);
+	if (usb_pipecontrol(urb->pipe))
+		memcpy(request->setup_packet, urb->setup_packet, 8);
+	if (usb_pipeout(urb->pipe))
+		memcpy(&request->payload, urb->transfer_buffer,
+		       urb->transfer_buffer_length);
+
+	/*
+	 * From here on a dequeue goes to the module; one that came in
+	 * while this was being built is passed on now.
+	 */
+	spin_lock_irqsave(&dev->lock, flags);
+	gb_urb->operation = operation;
+	list_add_tail(&gb_urb->inflight_links, &dev->inflight);
+	if (gb_urb->dequeued)
+		list_add_tail(&gb_urb->links, &dev->dequeues);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	/*
+	 * A module that answers with the URB's status only does so once
+	 * the URB completes, which for an interrupt or bulk IN endpoint
+	 * can take as long as the device likes.  Such an URB stays in
+	 * flight until then, or until it is dequeued.
+	 */
+	if (dev->version_minor >= GB_USB_VERSION_MINOR_STATUS)
+		timeout = 0;
+	else
+		timeout = gb_connection_timeout(dev->connection);
+
+	ret = gb_operation_request_send_timeout(operation, gb_usb_urb_callback,
+						timeout);
+	if (ret) {
+		gb_operation_put(operation);
+		goto err_giveback;
+	}
+
+	return;
+
+err_giveback:
+	dev_err(&dev->connection->dev, "URB enqueue failed '%d'\n", ret);
+	gb_usb_urb_giveback(dev, gb_urb, ret);
+}
+
+static void gb_usb_dequeue_callback(struct gb_operation *operation)
+{
+	int ret;
+
+	ret = gb_operation_result(operation);
+	if (ret)
+		dev_dbg(&operation->connection->dev,
+			"URB dequeue failed '%d'\n", ret);
+	gb_operation_put(operation);
+}
 
-	ret = gb_operation_request_send_sync(operation);
-	gb_operation_destroy(operation);
+/* Ask the module to give back an URB early; its callback still does */
+static int gb_usb_urb_dequeue_send(struct gb_usb_device *dev, u16 id)
+{
+	struct gb_usb_urb_dequeue_request *request;
+	struct gb_operation *operation;
+	int ret;
+
+	operation = gb_operation_create(dev->connection,
+					GB_USB_TYPE_URB_DEQUEUE,
+					sizeof(*request), 0);
+	if (!operation)
+		return -ENOMEM;
+
+	request = operation->request->payload;
+	request->operation_id = cpu_to_le16(id);
+
+	ret = gb_operation_request_send(operation, gb_usb_dequeue_callback);
+	if (ret)
+		gb_operation_put(operation);
 
 	return ret;
 }
 
+/*
+ * Cancel the operation of an URB in flight, when the module can't be
+ * asked to give the URB back because the connection is going away.
+ * The caller holds a reference to the operation, which is dropped.
+ * If the cancel comes before the response, the operation's callback
+ * won't be called, so the URB is given back here instead.
+ */
+static void gb_usb_urb_cancel(struct gb_usb_device *dev,
+			      struct gb_usb_urb *gb_urb,
+			      struct gb_operation *operation)
+{
+	if (!gb_operation_cancel(operation, -ESHUTDOWN))
+		return;
+
+	gb_usb_urb_giveback(dev, gb_urb, -ESHUTDOWN);
+	gb_operation_put(operation);	/* gb_usb_urb_callback()'s */
+	gb_operation_put(operation);	/* The caller's */
+}
+
+/* Cancel every URB in flight, once nothing more can be sent */
+static void gb_usb_urbs_cancel(struct gb_usb_device *dev)
+{
+	struct gb_operation *operation;
+	struct gb_usb_urb *gb_urb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	while (!list_empty(&dev->inflight)) {
+		gb_urb = list_first_entry(&dev->inflight, struct gb_usb_urb,
+					  inflight_links);
+		list_del_init(&gb_urb->inflight_links);
+		operation = gb_urb->operation;
+		gb_operation_get(operation);
+		spin_unlock_irqrestore(&dev->lock, flags);
+
+		gb_usb_urb_cancel(dev, gb_urb, operation);
+
+		spin_lock_irqsave(&dev->lock, flags);
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+static void gb_usb_work(struct work_struct *work)
+{
+	struct gb_usb_device *dev = container_of(work, struct gb_usb_device,
+						 work);
+	struct gb_operation *operation;
+	struct gb_usb_urb *gb_urb;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	while (!list_empty(&dev->dequeues) || !list_empty(&dev->pending)) {
+		if (!list_empty(&dev->dequeues)) {
+			gb_urb = list_first_entry(&dev->dequeues,
+						  struct gb_usb_urb, links);
+			list_del_init(&gb_urb->links);
+			operation = gb_urb->operation;
+			gb_operation_get(operation);
+			spin_unlock_irqrestore(&dev->lock, flags);
+
+			/*
+			 * Older modules give URBs back when they time out.
+			 * If the connection is going away the module can't
+			 * be asked to, so the URB is canceled instead.
+			 */
+			if (dev->version_minor < GB_USB_VERSION_MINOR_STATUS)
+				ret = 0;
+			else
+				ret = gb_usb_urb_dequeue_send(dev,
+							      operation->id);
+			if (ret)
+				gb_usb_urb_cancel(dev, gb_urb, operation);
+			else
+				gb_operation_put(operation);
+		} else {
+			gb_urb = list_first_entry(&dev->pending,
+						  struct gb_usb_urb, links);
+			list_del_init(&gb_urb->links);
+			spin_unlock_irqrestore(&dev->lock, flags);
+
+			gb_usb_urb_send(dev, gb_urb);
+		}
+		spin_lock_irqsave(&dev->lock, flags);
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/*
+ * URBs are sent without waiting for each other, as many at a time
+ * (on any endpoint) as the usb core hands over.  Each is given back
+ * from its operation's callback.
+ */
+static int urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
+{
+	struct gb_usb_device *dev = to_gb_usb_device(hcd);
+	struct gb_usb_urb *gb_urb;
+	unsigned long flags;
+	size_t payload_max;
+	int ret;
+
+	payload_max = dev->connection->hd->buffer_size_max -
+			sizeof(struct gb_operation_msg_hdr) -
+			sizeof(struct gb_usb_urb_enqueue_request);
+	if (urb->transfer_buffer_length > payload_max)
+		return -EMSGSIZE;
+
+	gb_urb = kzalloc(sizeof(*gb_urb), mem_flags);
+	if (!gb_urb)
+		return -ENOMEM;
+	gb_urb->urb = urb;
+	INIT_LIST_HEAD(&gb_urb->inflight_links);
+
+	spin_lock_irqsave(&dev->lock, flags);
+	ret = usb_hcd_link_urb_to_ep(hcd, urb);
+	if (ret) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		kfree(gb_urb);
+		return ret;
+	}
+	urb->hcpriv = gb_urb;
+	list_add_tail(&gb_urb->links, &dev->pending);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	schedule_work(&dev->work);
+
+	return 0;
+}
+
+/*
+ * An URB not sent yet is given back right away.  For one in flight
+ * the module is asked to give it back; its callback still completes
+ * it (with the unlink status), once the module is done with it.
+ */
 static int urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 {
 	struct gb_usb_device *dev = to_gb_usb_device(hcd);
-	struct gb_usb_urb_dequeue_request request;
+	struct gb_usb_urb *gb_urb;
+	unsigned long flags;
+	bool pending = false;
 	int ret;
 
-	urb->ep->hcpriv = NULL;
-	request.hcpriv_ep = cpu_to_le64((unsigned long)urb->hcpriv);
-	ret = gb_operation_sync(dev->connection, GB_USB_TYPE_URB_DEQUEUE,
-				&request, sizeof(request), NULL, 0);
-	urb->hcpriv = NULL;
+	spin_lock_irqsave(&dev->lock, flags);
+	ret = usb_hcd_check_unlink_urb(hcd, urb, status);
+	if (ret)
+		goto out;
+
+	gb_urb = urb->hcpriv;
+	if (gb_urb->operation) {
+		if (!gb_urb->dequeued) {
+			list_add_tail(&gb_urb->links, &dev->dequeues);
+			schedule_work(&dev->work);
+		}
+	} else if (!list_empty(&gb_urb->links)) {
+		list_del_init(&gb_urb->links);
+		pending = true;
+	}
+	gb_urb->dequeued = true;	/* being sent: see gb_usb_urb_send() */
+out:
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (pending)
+		gb_usb_urb_giveback(dev, gb_urb, status);
+
 	return ret;
 }
 
@@ -185,18 +514,27 @@ static void endpoint_reset(struct usb_hcd *hcd, struct usb_host_endpoint *ep)
 
 static int get_frame_number(struct usb_hcd *hcd)
 {
-	return atomic_read(&frame_number);
+	struct gb_usb_device *dev = to_gb_usb_device(hcd);
+
+	return atomic_read(&dev->frame_number);
 }
 
 static int hub_status_data(struct usb_hcd *hcd, char *buf)
 {
-	int retval;
+	struct gb_usb_device *dev = to_gb_usb_device(hcd);
+	struct gb_usb_hub_status *hub_status;
 	unsigned long flags;
-
-	spin_lock_irqsave(&hub_status_lock, flags);
-	memcpy(buf, hub_status->buf, le16_to_cpu(hub_status->buf_size));
-	retval = le32_to_cpu(hub_status->status);
-	spin_unlock_irqrestore(&hub_status_lock, flags);
+	int retval = 0;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	hub_status = dev->hub_status;
+	if (hub_status) {
+		memcpy(buf, hub_status->buf,
+		       min_t(u16, le16_to_cpu(hub_status->buf_size),
+			     GB_USB_HUB_STATUS_BUF_MAX));
+		retval = le32_to_cpu(hub_status->status);
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
 
 	return retval;
 }
@@ -227,7 +565,7 @@ static struct hc_driver usb_gb_hc_driver = {
 	.description = "greybus_usb",
 	.product_desc = "GB-Bridge USB Controller", /* TODO: Get this from GPB ?*/
 	.flags = HCD_MEMORY | HCD_USB2, /* FIXME: Get this from GPB */
-	.hcd_priv_size = sizeof(struct gb_usb_device),
+	.hcd_priv_size = sizeof(struct gb_usb_device *),
 
 	.start = hcd_start,
 	.stop = hcd_stop,
@@ -240,72 +578,82 @@ static struct hc_driver usb_gb_hc_driver = {
 	.hub_control = hub_control,
 };
 
-#if 0
-static inline void gb_usb_handle_get_frame_number(struct gbuf *gbuf)
+static int gb_usb_frame_number(struct gb_usb_device *dev,
+				struct gb_operation *operation)
 {
-	__le32 frame_num;
-	const size_t packet_size = sizeof(struct gb_usb_header) +
-				   sizeof(frame_num);
-	struct gb_usb_header* hdr = gbuf->transfer_buffer;
+	struct gb_message *request = operation->request;
+	struct gb_usb_frame_number *payload = request->payload;
 
-	if (le16_to_cpu(hdr->size) != packet_size) {
-		pr_err("%s(): dropping packet too small\n", __func__);
-		return;
+	if (request->payload_size != sizeof(*payload)) {
+		dev_err(&dev->connection->dev,
+			"bad frame number size (%zu)\n", request->payload_size);
+		return -EINVAL;
 	}
 
-	frame_num = (__le32) ((char*) gbuf->transfer_buffer +
-			      sizeof(struct gb_usb_header));
-	atomic_set(&frame_number, le32_to_cpu(frame_num));
+	atomic_set(&dev->frame_number, le32_to_cpu(payload->frame_number));
+
+	return 0;
 }
 
-static inline void gb_usb_handle_hubs_status_data(struct gbuf *gbuf)
+static int gb_usb_hub_status(struct gb_usb_device *dev,
+			     struct gb_operation *operation)
 {
-	struct gb_usb_hub_status *new_hubstatus, *hubstatus;
-	struct gb_usb_header* hdr = gbuf->transfer_buffer;
-	const size_t min_packet_size = sizeof(struct gb_usb_header) +
-				       sizeof(struct gb_usb_hub_status);
+	struct gb_message *request = operation->request;
+	struct gb_usb_hub_status *hub_status = request->payload;
+	struct gb_usb_hub_status *new_hub_status;
 	unsigned long flags;
 
-	if (le16_to_cpu(hdr->size) < min_packet_size) {
-		pr_err("%s(): dropping packet too small\n", __func__);
-		return;
+	if (request->payload_size < sizeof(*hub_status) ||
+	    request->payload_size != sizeof(*hub_status) +
+				     le16_to_cpu(hub_status->buf_size)) {
+		dev_err(&dev->connection->dev,
+			"bad hub status size (%zu)\n", request->payload_size);
+		return -EINVAL;
 	}
 
-	hubstatus = (struct gb_usb_hub_status*) ((char*) gbuf->transfer_buffer
-						+ sizeof(struct gb_usb_header));
+	new_hub_status = kmemdup(hub_status, request->payload_size,
+				 GFP_KERNEL);
+	if (!new_hub_status)
+		return -ENOMEM;
 
-	if (le16_to_cpu(hdr->size) != min_packet_size + hubstatus->buf_size) {
-		pr_err("%s(): invalid packet size, dropping packet\n",
-		       __func__);
-		return;
-	}
+	spin_lock_irqsave(&dev->lock, flags);
+	hub_status = dev->hub_status;
+	dev->hub_status = new_hub_status;
+	spin_unlock_irqrestore(&dev->lock, flags);
 
-	new_hubstatus = kmalloc(hubstatus->buf_size, GFP_KERNEL);
-	memcpy(&new_hubstatus, hubstatus, hubstatus->buf_size);
+	kfree(hub_status);
 
-	spin_lock_irqsave(&hub_status_lock, flags);
-	hubstatus = hub_status;
-	hub_status = new_hubstatus;
-	spin_unlock_irqrestore(&hub_status_lock, flags);
+	if (dev->hcd)
+		usb_hcd_poll_rh_status(dev->hcd);
 
-	kfree(hubstatus);
+	return 0;
 }
 
-static void gb_usb_in_handler(struct gbuf *gbuf)
+static void gb_usb_request_recv(u8 type, struct gb_operation *operation)
 {
-	struct gb_usb_header* hdr = gbuf->transfer_buffer;
-
-	switch (hdr->type) {
-		case GB_USB_TYPE_GET_FRAME_NUMBER:
-			gb_usb_handle_get_frame_number(gbuf);
-			break;
+	struct gb_connection *connection = operation->connection;
+	struct gb_usb_device *dev = connection->private;
+	int ret;
 
-		case GB_USB_TYPE_HUB_STATUS_DATA:
-			gb_usb_handle_hubs_status_data(gbuf);
-			break;
+	switch (type) {
+	case GB_USB_TYPE_GET_FRAME_NUMBER:
+		ret = gb_usb_frame_number(dev, operation);
+		break;
+	case GB_USB_TYPE_HUB_STATUS_DATA:
+		ret = gb_usb_hub_status(dev, operation);
+		break;
+	default:
+		dev_err(&connection->dev,
+			"unsupported unsolicited request: %hhu\n", type);
+		ret = -EINVAL;
+		break;
 	}
+
+	ret = gb_operation_response_send(operation, ret);
+	if (ret)
+		dev_err(&connection->dev,
+			"failed to send response: %d\n", ret);
 }
-#endif
 
 static int gb_usb_connection_init(struct gb_connection *connection)
 {
@@ -319,6 +667,12 @@ static int gb_usb_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 
 	gb_usb_dev->connection = connection;
+	spin_lock_init(&gb_usb_dev->lock);
+	INIT_LIST_HEAD(&gb_usb_dev->pending);
+	INIT_LIST_HEAD(&gb_usb_dev->dequeues);
+	INIT_LIST_HEAD(&gb_usb_dev->inflight);
+	INIT_WORK(&gb_usb_dev->work, gb_usb_work);
+	atomic_set(&gb_usb_dev->frame_number, 0);
 	connection->private = gb_usb_dev;
 
 	/* Check for compatible protocol version */
@@ -349,7 +703,24 @@ error_create_hcd:
 
 static void gb_usb_connection_exit(struct gb_connection *connection)
 {
-	// FIXME - tear everything down!
+	struct gb_usb_device *gb_usb_dev = connection->private;
+
+	/*
+	 * The connection is no longer enabled, so nothing more is sent,
+	 * and the module can't be asked for URBs back: cancel those in
+	 * flight.  Any the usb core dequeues while the hcd goes away are
+	 * canceled by the work, as their dequeue can't be sent either.
+	 */
+	flush_work(&gb_usb_dev->work);
+	gb_usb_urbs_cancel(gb_usb_dev);
+
+	/* Gives back every URB */
+	usb_remove_hcd(gb_usb_dev->hcd);
+	cancel_work_sync(&gb_usb_dev->work);
+	usb_put_hcd(gb_usb_dev->hcd);
+
+	kfree(gb_usb_dev->hub_status);
+	kfree(gb_usb_dev);
 }
 
 static struct gb_protocol usb_protocol = {
@@ -359,7 +730,8 @@ static struct gb_protocol usb_protocol = {
 	.minor			= 1,
 	.connection_init	= gb_usb_connection_init,
 	.connection_exit	= gb_usb_connection_exit,
-	.request_recv		= NULL,	/* FIXME we have requests!!! */
+	.request_recv		= gb_usb_request_recv,
+	.flags			= GB_PROTOCOL_BULK,
 };
 
 int gb_usb_protocol_init(void)
@@ -13,15 +13,25 @@
 #include <linux/device.h>
 #include <linux/kdev_t.h>
 #include <linux/idr.h>
+#include <linux/mutex.h>
 #include "greybus.h"
 
+/*
+ * Writes to timeout don't wait for the module; only the latest one
+ * is sure to be sent (see struct gb_operation_latest).
+ */
 struct gb_vibrator_device {
 	struct gb_connection	*connection;
 	struct device		*dev;
 	int			minor;		/* vibrator minor number */
 	u8			version_major;
 	u8			version_minor;
+
+	struct gb_operation_latest	latest;
+	u16			timeout_ms;	/* 0 is off (latest.lock) */
 };
+#define latest_to_vib(l) \
+	container_of(l, struct gb_vibrator_device, latest)
 
 /* Version of the Greybus vibrator protocol we support */
 #define	GB_VIBRATOR_VERSION_MAJOR		0x00
@@ -41,19 +51,58 @@ struct gb_vibrator_on_request {
 /* Define get_version() routine */
 define_get_version(gb_vibrator_device, VIBRATOR);
 
-static int turn_on(struct gb_vibrator_device *vib, u16 timeout_ms)
+/* An ON for the timeout set now, or an OFF if it is 0 */
+static struct gb_operation *turn_create(struct gb_operation_latest *latest)
 {
-	struct gb_vibrator_on_request request;
+	struct gb_vibrator_device *vib = latest_to_vib(latest);
+	unsigned long flags;
+	u16 timeout_ms;
+
+	spin_lock_irqsave(&latest->lock, flags);
+	timeout_ms = vib->timeout_ms;
+	spin_unlock_irqrestore(&latest->lock, flags);
+
+	if (timeout_ms)
+		return gb_operation_create(vib->connection, GB_VIBRATOR_TYPE_ON,
+				sizeof(struct gb_vibrator_on_request), 0);
 
-	request.timeout_ms = cpu_to_le16(timeout_ms);
-	return gb_operation_sync(vib->connection, GB_VIBRATOR_TYPE_ON,
-				 &request, sizeof(request), NULL, 0);
+	return gb_operation_create(vib->connection, GB_VIBRATOR_TYPE_OFF, 0, 0);
 }
 
-static int turn_off(struct gb_vibrator_device *vib)
+static bool turn_fill(struct gb_operation_latest *latest,
+		      struct gb_operation *operation)
 {
-	return gb_operation_sync(vib->connection, GB_VIBRATOR_TYPE_OFF,
-				 NULL, 0, NULL, 0);
+	struct gb_vibrator_device *vib = latest_to_vib(latest);
+	struct gb_vibrator_on_request *request;
+
+	if (!vib->timeout_ms)
+		return operation->type == GB_VIBRATOR_TYPE_OFF;
+	if (operation->type != GB_VIBRATOR_TYPE_ON)
+		return false;
+
+	request = operation->request->payload;
+	request->timeout_ms = cpu_to_le16(vib->timeout_ms);
+
+	return true;
+}
+
+static const struct gb_operation_latest_ops turn_ops = {
+	.create		= turn_create,
+	.fill		= turn_fill,
+};
+
+static void turn_queue(struct gb_vibrator_device *vib, u16 timeout_ms)
+{
+	unsigned long flags;
+	bool send;
+
+	spin_lock_irqsave(&vib->latest.lock, flags);
+	vib->timeout_ms = timeout_ms;
+	send = gb_operation_latest_set(&vib->latest);
+	spin_unlock_irqrestore(&vib->latest.lock, flags);
+
+	if (send)
+		gb_operation_latest_send(&vib->latest);
 }
 
 static ssize_t timeout_store(struct device *dev, struct device_attribute *attr,
@@ -69,12 +118,8 @@ static ssize_t timeout_store(struct device *dev, struct device_attribute *attr,
 		return retval;
 	}
 
-	if (val)
-		retval = turn_on(vib, (u16)val);
-	else
-		retval = turn_off(vib);
-	if (retval)
-		return retval;
+	/* Errors sending it are only logged */
+	turn_queue(vib, (u16)val);
 
 	return count;
 }
@@ -95,6 +140,7 @@ static struct class vibrator_class = {
 };
 
 static DEFINE_IDR(minors);
+static DEFINE_MUTEX(minors_lock);
 
 static int gb_vibrator_connection_init(struct gb_connection *connection)
 {
@@ -107,6 +153,7 @@ static int gb_vibrator_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 
 	vib->connection = connection;
+	gb_operation_latest_init(&vib->latest, connection, &turn_ops);
 	connection->private = vib;
 
 	retval = get_version(vib);
@@ -118,7 +165,9 @@ static int gb_vibrator_connection_init(struct gb_connection *connection)
 	 * there is a "real" device somewhere in the kernel for this, but I
 	 * can't find it at the moment...
 	 */
+	mutex_lock(&minors_lock);
 	vib->minor = idr_alloc(&minors, vib, 0, 0, GFP_KERNEL);
+	mutex_unlock(&minors_lock);
 	if (vib->minor < 0) {
 		retval = vib->minor;
 		goto error;
@@ -147,7 +196,9 @@ static int gb_vibrator_connection_init(struct gb_connection *connection)
 	return 0;
 
 err_idr_remove:
+	mutex_lock(&minors_lock);
 	idr_remove(&minors, vib->minor);
+	mutex_unlock(&minors_lock);
 error:
 	kfree(vib);
 	return retval;
@@ -160,8 +211,11 @@ static void gb_vibrator_connection_exit(struct gb_connection *connection)
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(3,11,0)
 	sysfs_remove_group(&vib->dev->kobj, vibrator_groups[0]);
 #endif
+	mutex_lock(&minors_lock);
 	idr_remove(&minors, vib->minor);
+	mutex_unlock(&minors_lock);
 	device_unregister(vib->dev);
+	gb_operation_latest_flush(&vib->latest);
 	kfree(vib);
 }
 